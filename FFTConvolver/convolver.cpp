@@ -1,6 +1,7 @@
 
 
 #include <pthread.h>
+#include <sys/types.h>
 #include <sndfile.h>
 #include "convolver.h"
 #include "FFTConvolver.h"
@@ -9,8 +10,16 @@
 extern "C" void _warn(const char *filename, const int linenumber, const char *format, ...);
 extern "C" void _debug(const char *filename, const int linenumber, int level, const char *format, ...);
 
+extern "C" int _debug_mutex_lock(pthread_mutex_t *mutex, useconds_t dally_time, const char *mutexName,
+                                 const char *filename, const int line, int debuglevel);
+extern "C" int _debug_mutex_unlock(pthread_mutex_t *mutex, const char *mutexName, const char *filename,
+                                   const int line, int debuglevel);
+
 #define warn(...) _warn(__FILE__, __LINE__, __VA_ARGS__)
 #define debug(...) _debug(__FILE__, __LINE__, __VA_ARGS__)
+// as in common.h, so that the convolver lock is seen by the mutex profiler
+#define debug_mutex_lock(mu, t, d) _debug_mutex_lock(mu, t, #mu, __FILE__, __LINE__, d)
+#define debug_mutex_unlock(mu, d) _debug_mutex_unlock(mu, #mu, __FILE__, __LINE__, d)
 
 fftconvolver::FFTConvolver convolver_l;
 fftconvolver::FFTConvolver convolver_r;
@@ -33,7 +42,7 @@ int convolver_init(const char* filename, int max_length) {
   
           size_t l = sf_readf_float(file, buffer, size);
           if (l != 0) {
-            pthread_mutex_lock(&convolver_lock);
+            debug_mutex_lock(&convolver_lock, 1000000, 3);
             convolver_l.reset(); // it is possible that init could be called more than once
             convolver_r.reset(); // so it could be necessary to remove all previous settings
   
@@ -56,7 +65,7 @@ int convolver_init(const char* filename, int max_length) {
               convolver_r.init(352, buffer_r, size);
               
             }
-            pthread_mutex_unlock(&convolver_lock);
+            debug_mutex_unlock(&convolver_lock, 3);
             success = 1;
           }
           debug(1, "IR initialized from \"%s\" with %d channels and %d samples", filename, info.channels, size);
@@ -73,13 +82,13 @@ int convolver_init(const char* filename, int max_length) {
 }
 
 void convolver_process_l(float* data, int length) {
-  pthread_mutex_lock(&convolver_lock);
+  debug_mutex_lock(&convolver_lock, 0, 0);
   convolver_l.process(data, data, length);
-  pthread_mutex_unlock(&convolver_lock);
+  debug_mutex_unlock(&convolver_lock, 0);
 }
 
 void convolver_process_r(float* data, int length) {
-  pthread_mutex_lock(&convolver_lock);
+  debug_mutex_lock(&convolver_lock, 0, 0);
   convolver_r.process(data, data, length);
-  pthread_mutex_unlock(&convolver_lock);
+  debug_mutex_unlock(&convolver_lock, 0);
 }
@@ -27,6 +27,7 @@
  */
 
 #include "common.h"
+#include "trace.h"
 
 #ifdef CONFIG_USE_GIT_VERSION_STRING
 #include "gitversion.h"
@@ -244,6 +245,208 @@ void log_to_syslog() {
 #endif
 }
 
+// Asynchronous logging.
+// Log messages are formatted by the calling thread into a slot in a ring of log records and
+// written out by the log writer thread, so that a slow log destination doesn't hold up
+// the caller. Slots are claimed without locking: each slot's sequence number says whether it's
+// free for the writer with that position or ready for the reader, as in Dmitry Vyukov's
+// bounded MPMC queue. If the ring is full, the message is dropped and counted.
+// There is one ring for all threads rather than one per thread: its memory is fixed however many
+// threads there are, messages come out in the order they were logged, and one reader can empty
+// it without visiting every thread's ring. The cost is a compare-and-swap on the shared tail.
+
+#define LOG_RING_SIZE 256 // must be a power of two
+#define LOG_RECORD_TEXT_SIZE 2048
+
+typedef struct {
+  volatile uint32_t sequence;
+  int priority;
+  int with_preliminary_string; // if set, add the times and file and line as configured
+  uint64_t time;               // when the message was logged
+  const char *filename;        // always __FILE__, so it needn't be copied
+  int linenumber;
+  const char *prefix;
+  char text[LOG_RECORD_TEXT_SIZE];
+} log_record;
+
+static log_record *log_ring = NULL;
+static volatile uint32_t log_ring_tail;                  // the next position to be claimed
+static uint32_t log_ring_head;                           // the next position to be written out
+static pthread_mutex_t log_reader_lock = PTHREAD_MUTEX_INITIALIZER; // only one reader at a time
+static volatile uint32_t log_records_dropped;
+static uint32_t log_records_dropped_reported;
+static volatile int log_writer_running = 0;
+static volatile int log_writer_stop_requested;
+static pthread_t log_writer_thread;
+static volatile int log_drained_for_exit = 0;
+
+char *generate_preliminary_string(char *buffer, size_t buffer_length, double tss, double tsl,
+                                  const char *filename, const int linenumber, const char *prefix);
+int sps_pthread_mutex_timedlock(pthread_mutex_t *mutex, useconds_t dally_time);
+
+// returns 0 if the message has been queued or dropped, -1 if it should be logged directly
+static int log_enqueue(int priority, int with_preliminary_string, const char *filename,
+                       const int linenumber, const char *prefix, const char *format,
+                       va_list args) {
+  if (log_writer_running == 0)
+    return -1;
+  uint64_t time_now = get_absolute_time_in_ns();
+  uint32_t position = log_ring_tail;
+  log_record *record;
+  for (;;) {
+    record = &log_ring[position & (LOG_RING_SIZE - 1)];
+    int32_t difference = record->sequence - position;
+    if (difference == 0) {
+      if (__sync_bool_compare_and_swap(&log_ring_tail, position, position + 1))
+        break;
+      position = log_ring_tail;
+    } else if (difference < 0) {
+      __sync_fetch_and_add(&log_records_dropped, 1); // the ring is full
+      return 0;
+    } else {
+      position = log_ring_tail;
+    }
+  }
+  record->priority = priority;
+  record->with_preliminary_string = with_preliminary_string;
+  record->time = time_now;
+  record->filename = filename;
+  record->linenumber = linenumber;
+  record->prefix = prefix;
+  vsnprintf(record->text, sizeof(record->text), format, args);
+  __sync_synchronize();
+  record->sequence = position + 1; // ready to be written out
+  return 0;
+}
+
+static void log_write_record(log_record *record) {
+  char b[LOG_RECORD_TEXT_SIZE + 256];
+  b[0] = 0;
+  char *s = b;
+  if (record->with_preliminary_string) {
+    pthread_mutex_lock(&debug_timing_lock);
+    uint64_t time_since_start = record->time - ns_time_at_startup;
+    uint64_t time_since_last_debug_message = 0;
+    // records from different threads can be very slightly out of order
+    if (record->time > ns_time_at_last_debug_message) {
+      time_since_last_debug_message = record->time - ns_time_at_last_debug_message;
+      ns_time_at_last_debug_message = record->time;
+    }
+    pthread_mutex_unlock(&debug_timing_lock);
+    const char *filename = strrchr(record->filename, '/');
+    if (filename != NULL)
+      filename++;
+    else
+      filename = record->filename;
+    s = generate_preliminary_string(b, sizeof(b), 1.0 * time_since_start / 1000000000,
+                                    1.0 * time_since_last_debug_message / 1000000000, filename,
+                                    record->linenumber, record->prefix);
+  } else if (record->prefix != NULL) {
+    snprintf(b, sizeof(b), "%s", record->prefix);
+    s = b + strlen(b);
+  }
+  snprintf(s, sizeof(b) - (s - b), "%s", record->text);
+  sps_log(record->priority, "%s", b);
+}
+
+// write out everything that's ready in the ring -- call with the log_reader_lock held
+// if claimed_wait is non-zero, wait up to that many milliseconds in all for messages that have
+// been claimed but are still being formatted
+static void log_drain_locked(int claimed_wait) {
+  if (log_ring != NULL) {
+    uint32_t tail = log_ring_tail;
+    log_record *record = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+    while (1) {
+      if (record->sequence != log_ring_head + 1) {
+        if ((claimed_wait == 0) || (log_ring_head == tail))
+          break;
+        usleep(1000);
+        claimed_wait--;
+        continue;
+      }
+      __sync_synchronize();
+      log_write_record(record);
+      __sync_synchronize();
+      record->sequence = log_ring_head + LOG_RING_SIZE; // free for the next time round
+      log_ring_head++;
+      record = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+    }
+    uint32_t dropped = log_records_dropped;
+    if (dropped != log_records_dropped_reported) {
+      sps_log(LOG_WARNING, "warning: %u log messages were lost because the log writer fell behind.",
+              dropped - log_records_dropped_reported);
+      log_records_dropped_reported = dropped;
+    }
+  }
+}
+
+static void log_drain() {
+  pthread_mutex_lock(&log_reader_lock);
+  log_drain_locked(0);
+  pthread_mutex_unlock(&log_reader_lock);
+}
+
+// Called by die() -- possibly on several threads at once, or on the writer thread itself -- so it
+// mustn't join the writer. The first caller stops messages being queued and writes out what's
+// already in the ring, including messages still being formatted, itself. The writer thread is
+// left to end with the process.
+static void log_drain_for_exit() {
+  if (__sync_bool_compare_and_swap(&log_drained_for_exit, 0, 1)) {
+    log_writer_running = 0; // new messages are logged directly from now on
+    __sync_synchronize();
+    if (sps_pthread_mutex_timedlock(&log_reader_lock, 100000) == 0) {
+      log_drain_locked(100);
+      pthread_mutex_unlock(&log_reader_lock);
+    }
+  }
+}
+
+static void *log_writer_thread_func(__attribute__((unused)) void *arg) {
+  // not cancellable -- it's stopped by log_writer_stop()
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  while (log_writer_stop_requested == 0) {
+    log_drain();
+    usleep(10000);
+  }
+  pthread_exit(NULL);
+}
+
+void log_writer_start() {
+  if (log_writer_running == 0) {
+    log_ring = calloc(LOG_RING_SIZE, sizeof(log_record));
+    if (log_ring == NULL) {
+      warn("Could not allocate memory for asynchronous logging. Logging directly.");
+    } else {
+      uint32_t i;
+      for (i = 0; i < LOG_RING_SIZE; i++)
+        log_ring[i].sequence = i;
+      log_ring_tail = 0;
+      log_ring_head = 0;
+      log_records_dropped = 0;
+      log_records_dropped_reported = 0;
+      log_writer_stop_requested = 0;
+      if (pthread_create(&log_writer_thread, NULL, log_writer_thread_func, NULL) == 0) {
+        __sync_synchronize();
+        log_writer_running = 1;
+      } else {
+        free(log_ring);
+        log_ring = NULL;
+        warn("Could not start the log writer thread. Logging directly.");
+      }
+    }
+  }
+}
+
+void log_writer_stop() {
+  // new messages are logged directly from now on
+  if (__sync_bool_compare_and_swap(&log_writer_running, 1, 0)) {
+    log_writer_stop_requested = 1;
+    if (pthread_equal(pthread_self(), log_writer_thread) == 0)
+      pthread_join(log_writer_thread, NULL);
+    log_drain(); // anything that got in before the writer stopped
+  }
+}
+
 shairport_cfg config;
 
 volatile int debuglev = 0;
@@ -448,6 +651,7 @@ char *generate_preliminary_string(char *buffer, size_t buffer_length, double tss
 void _die(const char *thefilename, const int linenumber, const char *format, ...) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  log_drain_for_exit(); // write out anything queued before this and log directly from now on
 
   char b[16384];
   b[0] = 0;
@@ -482,6 +686,17 @@ void _die(const char *thefilename, const int linenumber, const char *format, ...
 void _warn(const char *thefilename, const int linenumber, const char *format, ...) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  if (log_writer_running) {
+    va_list args;
+    va_start(args, format);
+    int queued = log_enqueue(LOG_WARNING, debuglev != 0, thefilename, linenumber,
+                             debuglev != 0 ? " *warning: " : "warning: ", format, args);
+    va_end(args);
+    if (queued == 0) {
+      pthread_setcancelstate(oldState, NULL);
+      return;
+    }
+  }
   char b[16384];
   b[0] = 0;
   char *s;
@@ -515,6 +730,16 @@ void _debug(const char *thefilename, const int linenumber, int level, const char
     return;
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  if (log_writer_running) {
+    va_list args;
+    va_start(args, format);
+    int queued = log_enqueue(LOG_INFO, 1, thefilename, linenumber, " ", format, args);
+    va_end(args);
+    if (queued == 0) {
+      pthread_setcancelstate(oldState, NULL);
+      return;
+    }
+  }
 
   char b[16384];
   b[0] = 0;
@@ -541,6 +766,17 @@ void _debug(const char *thefilename, const int linenumber, int level, const char
 void _inform(const char *thefilename, const int linenumber, const char *format, ...) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  if (log_writer_running) {
+    va_list args;
+    va_start(args, format);
+    int queued = log_enqueue(LOG_INFO, debuglev != 0, thefilename, linenumber,
+                             debuglev != 0 ? " " : NULL, format, args);
+    va_end(args);
+    if (queued == 0) {
+      pthread_setcancelstate(oldState, NULL);
+      return;
+    }
+  }
   char b[16384];
   b[0] = 0;
   char *s;
@@ -1649,15 +1885,293 @@ int sps_pthread_mutex_timedlock(pthread_mutex_t *mutex, useconds_t dally_time) {
 }
 // #endif
 
+// Mutex contention profiling.
+// When config.mutex_profiling is set, every acquisition made through _debug_mutex_lock (and the
+// metadata hub's write lock) is recorded against the site -- file and line -- that made it.
+// For each site we keep the number of acquisitions, how many of them found the lock taken,
+// and log2 histograms of the time spent waiting for the lock and of the time it was then held.
+// Hold time runs from acquisition until the lock is released through _debug_mutex_unlock or
+// pthread_cleanup_debug_mutex_unlock, so it includes any time spent in pthread_cond_wait.
+// Sites are never removed; they live in a fixed open-addressed table that is searched without a
+// lock and added to under one. All counts are updated with atomic operations.
+
+#define MUTEX_PROFILE_SITES 256
+#define MUTEX_PROFILE_HELD_LOCKS 16
+
+typedef struct {
+  const char *lockname;
+  const char *filename; // site identity is the filename pointer and the line
+  int line;
+  uint64_t acquisitions;
+  uint64_t contended;
+  uint64_t wait_total, wait_max; // nanoseconds
+  uint64_t hold_total, hold_max; // nanoseconds
+  uint64_t wait_histogram[MUTEX_PROFILE_BUCKETS];
+  uint64_t hold_histogram[MUTEX_PROFILE_BUCKETS];
+} mutex_profile_site;
+
+typedef struct {
+  const void *lock;
+  mutex_profile_site *site;
+  uint64_t acquired_at;
+} mutex_profile_held_lock;
+
+typedef struct {
+  int count;
+  mutex_profile_held_lock held[MUTEX_PROFILE_HELD_LOCKS];
+} mutex_profile_thread_state;
+
+static mutex_profile_site mutex_profile_sites[MUTEX_PROFILE_SITES];
+static pthread_mutex_t mutex_profile_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mutex_profile_key;
+static pthread_once_t mutex_profile_key_once = PTHREAD_ONCE_INIT;
+static uint64_t mutex_profile_sites_full; // acquisitions not recorded because the table is full
+
+static void mutex_profile_key_create() { pthread_key_create(&mutex_profile_key, free); }
+
+static mutex_profile_thread_state *mutex_profile_thread_state_get(int create) {
+  pthread_once(&mutex_profile_key_once, mutex_profile_key_create);
+  mutex_profile_thread_state *state = pthread_getspecific(mutex_profile_key);
+  if ((state == NULL) && (create != 0)) {
+    state = calloc(1, sizeof(mutex_profile_thread_state));
+    if (state)
+      pthread_setspecific(mutex_profile_key, state);
+  }
+  return state;
+}
+
+// bucket 0 is for anything under a microsecond; bucket n is for [2^(n-1), 2^n) microseconds
+static int mutex_profile_bucket(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while ((us != 0) && (bucket < MUTEX_PROFILE_BUCKETS - 1)) {
+    us = us >> 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+static void mutex_profile_update_max(uint64_t *max, uint64_t value) {
+  uint64_t current = *max;
+  while (value > current) {
+    uint64_t previous = __sync_val_compare_and_swap(max, current, value);
+    if (previous == current)
+      break;
+    current = previous;
+  }
+}
+
+static mutex_profile_site *mutex_profile_site_get(const char *lockname, const char *filename,
+                                                  int line) {
+  uintptr_t hash = (((uintptr_t)filename) >> 3) * 31 + (uintptr_t)line;
+  unsigned int start = (hash ^ (hash >> 11)) % MUTEX_PROFILE_SITES;
+  unsigned int i = start;
+  // look for it without the lock -- a site's filename is written last, so a non-NULL filename
+  // means its other identifying fields are in place
+  do {
+    const char *site_filename = __sync_fetch_and_add(&mutex_profile_sites[i].filename, 0);
+    if (site_filename == NULL)
+      break;
+    if ((site_filename == filename) && (mutex_profile_sites[i].line == line))
+      return &mutex_profile_sites[i];
+    i = (i + 1) % MUTEX_PROFILE_SITES;
+  } while (i != start);
+  // not there -- add it, unless someone else got in first
+  mutex_profile_site *response = NULL;
+  pthread_mutex_lock(&mutex_profile_sites_lock);
+  i = start;
+  do {
+    if (mutex_profile_sites[i].filename == NULL) {
+      mutex_profile_sites[i].lockname = lockname;
+      mutex_profile_sites[i].line = line;
+      __sync_synchronize();
+      mutex_profile_sites[i].filename = filename;
+      response = &mutex_profile_sites[i];
+    } else if ((mutex_profile_sites[i].filename == filename) &&
+               (mutex_profile_sites[i].line == line)) {
+      response = &mutex_profile_sites[i];
+    }
+    i = (i + 1) % MUTEX_PROFILE_SITES;
+  } while ((response == NULL) && (i != start));
+  pthread_mutex_unlock(&mutex_profile_sites_lock);
+  return response;
+}
+
+void mutex_profile_acquired(const void *lock, const char *lockname, const char *filename,
+                            const int line, uint64_t wait_start) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  mutex_profile_site *site = mutex_profile_site_get(lockname, filename, line);
+  if (site == NULL) {
+    __sync_fetch_and_add(&mutex_profile_sites_full, 1);
+    return;
+  }
+  __sync_fetch_and_add(&site->acquisitions, 1);
+  uint64_t wait_time = 0;
+  if (wait_start != 0) {
+    __sync_fetch_and_add(&site->contended, 1);
+    wait_time = time_now - wait_start;
+    __sync_fetch_and_add(&site->wait_total, wait_time);
+    mutex_profile_update_max(&site->wait_max, wait_time);
+  }
+  __sync_fetch_and_add(&site->wait_histogram[mutex_profile_bucket(wait_time)], 1);
+
+  mutex_profile_thread_state *state = mutex_profile_thread_state_get(1);
+  if (state) {
+    // a lock released by some other means than _debug_mutex_unlock leaves its entry behind, so
+    // reuse the entry if this lock is already on the list, and drop the oldest if it's full
+    int i;
+    for (i = 0; (i < state->count) && (state->held[i].lock != lock); i++)
+      ;
+    if (i == MUTEX_PROFILE_HELD_LOCKS) {
+      memmove(&state->held[0], &state->held[1],
+              sizeof(mutex_profile_held_lock) * (MUTEX_PROFILE_HELD_LOCKS - 1));
+      i = MUTEX_PROFILE_HELD_LOCKS - 1;
+    } else if (i == state->count) {
+      state->count++;
+    }
+    state->held[i].lock = lock;
+    state->held[i].site = site;
+    state->held[i].acquired_at = time_now;
+  }
+}
+
+void mutex_profile_released(const void *lock) {
+  mutex_profile_thread_state *state = mutex_profile_thread_state_get(0);
+  if (state == NULL)
+    return;
+  int i;
+  for (i = state->count - 1; (i >= 0) && (state->held[i].lock != lock); i--)
+    ;
+  if (i < 0)
+    return; // acquired before profiling was turned on, or on another thread
+  mutex_profile_site *site = state->held[i].site;
+  uint64_t hold_time = get_absolute_time_in_ns() - state->held[i].acquired_at;
+  state->count--;
+  if (i != state->count)
+    memmove(&state->held[i], &state->held[i + 1],
+            sizeof(mutex_profile_held_lock) * (state->count - i));
+  __sync_fetch_and_add(&site->hold_total, hold_time);
+  mutex_profile_update_max(&site->hold_max, hold_time);
+  __sync_fetch_and_add(&site->hold_histogram[mutex_profile_bucket(hold_time)], 1);
+}
+
+static int mutex_profile_compare(const void *a, const void *b) {
+  const mutex_profile_site *site_a = *(const mutex_profile_site *const *)a;
+  const mutex_profile_site *site_b = *(const mutex_profile_site *const *)b;
+  if (site_a->wait_total > site_b->wait_total)
+    return -1;
+  if (site_a->wait_total < site_b->wait_total)
+    return 1;
+  return 0;
+}
+
+static size_t mutex_profile_append(char *buf, size_t size, size_t used, const char *format, ...) {
+  if (used < size) {
+    va_list args;
+    va_start(args, format);
+    int r = vsnprintf(buf + used, size - used, format, args);
+    va_end(args);
+    if (r > 0)
+      used += r;
+  }
+  return used;
+}
+
+size_t mutex_profile_report(char *buf, size_t size, int max_sites) {
+  mutex_profile_site *sites[MUTEX_PROFILE_SITES];
+  int site_count = 0;
+  int i, j;
+  for (i = 0; i < MUTEX_PROFILE_SITES; i++)
+    if ((mutex_profile_sites[i].filename != NULL) && (mutex_profile_sites[i].acquisitions != 0))
+      sites[site_count++] = &mutex_profile_sites[i];
+  qsort(sites, site_count, sizeof(mutex_profile_site *), mutex_profile_compare);
+  if ((max_sites > 0) && (site_count > max_sites))
+    site_count = max_sites;
+  size_t used = 0;
+  if (size != 0)
+    buf[0] = '\0';
+  for (i = 0; i < site_count; i++) {
+    mutex_profile_site *site = sites[i];
+    const char *basename = strrchr(site->filename, '/');
+    basename = basename ? basename + 1 : site->filename;
+    used = mutex_profile_append(
+        buf, size, used,
+        "%s at %s:%d: %" PRIu64 " acquisitions, %" PRIu64 " contended, wait total %.3f ms max "
+        "%.3f ms, hold total %.3f ms max %.3f ms.",
+        site->lockname, basename, site->line, site->acquisitions, site->contended,
+        site->wait_total * 1E-6, site->wait_max * 1E-6, site->hold_total * 1E-6,
+        site->hold_max * 1E-6);
+    used = mutex_profile_append(buf, size, used, " Wait histogram (log2 us):");
+    for (j = 0; j < MUTEX_PROFILE_BUCKETS; j++)
+      used = mutex_profile_append(buf, size, used, " %" PRIu64 "", site->wait_histogram[j]);
+    used = mutex_profile_append(buf, size, used, ". Hold histogram (log2 us):");
+    for (j = 0; j < MUTEX_PROFILE_BUCKETS; j++)
+      used = mutex_profile_append(buf, size, used, " %" PRIu64 "", site->hold_histogram[j]);
+    used = mutex_profile_append(buf, size, used, ".\n");
+  }
+  if (mutex_profile_sites_full != 0)
+    used = mutex_profile_append(buf, size, used,
+                                "%" PRIu64 " acquisitions not recorded -- too many lock sites.\n",
+                                mutex_profile_sites_full);
+  if (used >= size)
+    used = size == 0 ? 0 : size - 1; // truncated
+  return used;
+}
+
+void mutex_profile_reset() {
+  int i;
+  // the sites themselves stay, so that pointers to them held by other threads remain valid
+  // other threads may be updating the counters, so they are cleared atomically too
+  for (i = 0; i < MUTEX_PROFILE_SITES; i++) {
+    mutex_profile_site *site = &mutex_profile_sites[i];
+    __atomic_store_n(&site->acquisitions, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->contended, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->wait_total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->wait_max, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->hold_total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->hold_max, 0, __ATOMIC_RELAXED);
+    int j;
+    for (j = 0; j < MUTEX_PROFILE_BUCKETS; j++) {
+      __atomic_store_n(&site->wait_histogram[j], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&site->hold_histogram[j], 0, __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_store_n(&mutex_profile_sites_full, 0, __ATOMIC_RELAXED);
+}
+
 int _debug_mutex_lock(pthread_mutex_t *mutex, useconds_t dally_time, const char *mutexname,
                       const char *filename, const int line, int debuglevel) {
-  if ((debuglevel > debuglev) || (debuglevel == 0))
-    return pthread_mutex_lock(mutex);
+  uint64_t wait_start = TRACE_TIME();
+  uint64_t profile_wait_start = 0;
+  if ((debuglevel > debuglev) || (debuglevel == 0)) {
+    int result;
+    if (__builtin_expect(config.mutex_profiling, 0)) {
+      // try it first so that an uncontended acquisition can be told from a contended one
+      result = pthread_mutex_trylock(mutex);
+      if (result == EBUSY) {
+        profile_wait_start = get_absolute_time_in_ns();
+        result = pthread_mutex_lock(mutex);
+      }
+      if (result == 0)
+        mutex_profile_acquired(mutex, mutexname, filename, line, profile_wait_start);
+    } else {
+      result = pthread_mutex_lock(mutex);
+    }
+    TRACE_COMPLETE(mutexname, wait_start, 0);
+    return result;
+  }
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
   if (debuglevel != 0)
     _debug(filename, line, 3, "mutex_lock \"%s\".", mutexname); // only if you really ask for it!
-  int result = sps_pthread_mutex_timedlock(mutex, dally_time);
+  int result = EBUSY;
+  if (config.mutex_profiling) {
+    result = pthread_mutex_trylock(mutex);
+    if (result == EBUSY)
+      profile_wait_start = get_absolute_time_in_ns();
+  }
+  if (result == EBUSY)
+    result = sps_pthread_mutex_timedlock(mutex, dally_time);
   if (result == ETIMEDOUT) {
     _debug(
         filename, line, debuglevel,
@@ -1670,12 +2184,17 @@ int _debug_mutex_lock(pthread_mutex_t *mutex, useconds_t dally_time, const char
       _debug(filename, line, debuglevel, " ...mutex_lock \"%s\" exited with error code: %u",
              mutexname, result);
   }
+  if ((result == 0) && (config.mutex_profiling))
+    mutex_profile_acquired(mutex, mutexname, filename, line, profile_wait_start);
+  TRACE_COMPLETE(mutexname, wait_start, 0);
   pthread_setcancelstate(oldState, NULL);
   return result;
 }
 
 int _debug_mutex_unlock(pthread_mutex_t *mutex, const char *mutexname, const char *filename,
                         const int line, int debuglevel) {
+  if (__builtin_expect(config.mutex_profiling, 0))
+    mutex_profile_released(mutex);
   if ((debuglevel > debuglev) || (debuglevel == 0))
     return pthread_mutex_unlock(mutex);
   int oldState;
@@ -1738,7 +2257,11 @@ void thread_cleanup(void *arg) {
   debug(3, "thread_cleanup done.");
 }
 
-void pthread_cleanup_debug_mutex_unlock(void *arg) { pthread_mutex_unlock((pthread_mutex_t *)arg); }
+void pthread_cleanup_debug_mutex_unlock(void *arg) {
+  if (config.mutex_profiling)
+    mutex_profile_released(arg);
+  pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
 
 char *get_version_string() {
   char *version_string = malloc(1024);
@@ -1818,6 +2341,9 @@ char *get_version_string() {
 #ifdef CONFIG_CONVOLUTION
     strcat(version_string, "-convolution");
 #endif
+#ifdef CONFIG_TRACING
+    strcat(version_string, "-tracing");
+#endif
 #ifdef CONFIG_METADATA
     strcat(version_string, "-metadata");
 #endif
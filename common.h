@@ -62,6 +62,11 @@ typedef enum {
   ST_auto,      // use soxr if compiled for it and if the soxr_index is low enough
 } stuffing_type;
 
+typedef enum {
+  CE_regression = 0, // least squares fit through the time pings with the lowest dispersions
+  CE_kalman,         // a Kalman filter tracking the remote clock's offset and skew
+} clock_estimator_type;
+
 typedef enum {
   ST_stereo = 0,
   ST_mono,
@@ -114,6 +119,8 @@ const char *sps_format_description_string(sps_format_t format);
 typedef struct {
   double missing_port_dacp_scan_interval_seconds; // if no DACP port number can be found, check at
                                                   // these intervals
+  int dacp_long_polling; // hold a play status request open until the DACP server has news, rather
+                         // than asking at the scan intervals
   double resend_control_first_check_time; // wait this long before asking for a missing packet to be
                                           // resent
   double resend_control_check_interval_time; // wait this long between making requests
@@ -154,9 +161,12 @@ typedef struct {
 #ifdef CONFIG_METADATA
   int metadata_enabled;
   char *metadata_pipename;
+  int metadata_pipe_binary; // write length-prefixed binary items rather than XML to the pipe
   char *metadata_sockaddr;
   int metadata_sockport;
   size_t metadata_sockmsglength;
+  int metadata_sock_compact_chunks; // use the compact "ssncchk2" framing for chunked items
+  int metadata_sock_rate_limit;     // kilobytes per second for chunked items; 0 means no limit
   int get_coverart;
   double metadata_progress_interval; // 0 means no progress reports
 #endif
@@ -219,6 +229,12 @@ typedef struct {
   int debugger_show_elapsed_time;  // in the debug message, display the time since startup
   int debugger_show_relative_time; // in the debug message, display the time since the last one
   int debugger_show_file_and_line; // in the debug message, display the filename and line number
+  int log_asynchronously;          // queue log messages for a separate thread to write out
+  int mutex_profiling;             // record wait and hold times at each debug_mutex_lock site
+#ifdef CONFIG_TRACING
+  int trace_requested;
+  char *trace_file_path; // where SIGUSR2 dumps the trace
+#endif
   int statistics_requested, use_negotiated_latencies;
   playback_mode_type playback_mode;
   char *cmd_start, *cmd_stop, *cmd_set_volume, *cmd_unfixable;
@@ -226,6 +242,7 @@ typedef struct {
   int cmd_blocking, cmd_start_returns_output;
   double tolerance; // allow this much drift before attempting to correct it
   stuffing_type packet_stuffing;
+  clock_estimator_type clock_estimator; // for AirPlay 1 NTP-style timing
   int soxr_delay_index;
   int soxr_delay_threshold; // the soxr delay must be less or equal to this for soxr interpolation
                             // to be enabled under the auto setting
@@ -298,6 +315,7 @@ typedef struct {
 #ifdef CONFIG_METADATA_HUB
   char *cover_art_cache_dir;
   int retain_coverart;
+  int cover_art_cache_size_limit; // bytes of artwork to keep, apart from the current picture
 
   int scan_interval_when_active;   // number of seconds between DACP server scans when playing
                                    // something (1)
@@ -330,6 +348,12 @@ typedef struct {
   char *airplay_pin;       // non-NULL, 4 char PIN, if required for pairing
   char *airplay_pi;        // UUID in the Bonjour advertisement and the GETINFO Plist
   char *nqptp_shared_memory_interface_name; // client name for nqptp service
+  size_t ap2_audio_buffer_size; // the audioBufferSize offered to the sender for buffered audio.
+                                // It's held compressed and encrypted until needed.
+  double ap2_decoding_lookahead; // decode buffered audio only this many seconds ahead of the player
+  int buffered_audio_resampler_drift_correction; // correct drift in the decoder's resampler rather
+                                                 // than by stuffing in the player
+  char *airplay_pairings_file; // where HomeKit pairings are kept, or NULL to keep them in memory
 #endif
   int unfixable_error_reported; // only report once.
 } shairport_cfg;
@@ -345,6 +369,9 @@ void log_to_stdout(); // call this to direct logging to stdout;
 void log_to_syslog(); // call this to direct logging to the system log;
 void log_to_file();   // call this to direct logging to a file or (pre-existing) pipe;
 
+void log_writer_start(); // from now on, log messages are queued and written out by a thread
+void log_writer_stop();  // write out any queued messages and go back to logging directly
+
 // true if Shairport Sync is supposed to be sending output to the output device, false otherwise
 
 int get_requested_connection_state_to_output();
@@ -467,6 +494,17 @@ int _debug_mutex_unlock(pthread_mutex_t *mutex, const char *mutexName, const cha
 
 void pthread_cleanup_debug_mutex_unlock(void *arg);
 
+// mutex contention profiling -- active when config.mutex_profiling is set
+#define MUTEX_PROFILE_BUCKETS 16
+// wait_start is when the wait for a contended lock began, or zero if the lock was free
+void mutex_profile_acquired(const void *lock, const char *lockname, const char *filename,
+                            const int line, uint64_t wait_start);
+void mutex_profile_released(const void *lock);
+// write a report of up to max_sites sites (all if zero), worst total wait first, into buf;
+// returns the length of the report
+size_t mutex_profile_report(char *buf, size_t size, int max_sites);
+void mutex_profile_reset();
+
 #define pthread_cleanup_debug_mutex_lock(mu, t, d)                                                 \
   if (_debug_mutex_lock(mu, t, #mu, __FILE__, __LINE__, d) == 0)                                   \
   pthread_cleanup_push(pthread_cleanup_debug_mutex_unlock, (void *)mu)
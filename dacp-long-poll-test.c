@@ -0,0 +1,538 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A test of the DACP client's long polling against a stand-in DACP server.
+// The stand-in is a small HTTP/1.1 server on the loopback interface. It answers
+// playstatusupdate requests with revision number 1 and other commands straight away, and can be
+// told to hold a long poll for a while before answering, to never answer one, to close the
+// connection after answering, or to drop its open connections.
+// dacp.c is compiled into the test, with a one-second long poll timeout instead of 30 seconds,
+// so that its connection state can be checked directly.
+// Prints a line for each check that fails and exits with a failure status if any did.
+// Usage: dacp-long-poll-test [debug level]
+
+#define DACP_LONG_POLL_TIMEOUT_SECONDS 1
+#include "dacp.c"
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+// dacp.c is normally linked with common.c and the metadata hub, which aren't linked in here
+
+volatile int debuglev = 0;
+shairport_cfg config;
+struct metadata_bundle metadata_store;
+
+void _die(const char *filename, const int linenumber, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "fatal error: \"%s:%d\": ", filename, linenumber);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  exit(EXIT_FAILURE);
+}
+
+void _warn(const char *filename, const int linenumber, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "warning: \"%s:%d\": ", filename, linenumber);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+void _debug(const char *filename, const int linenumber, int level, const char *format, ...) {
+  if (level > debuglev)
+    return;
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "\"%s:%d\": ", filename, linenumber);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+int _debug_mutex_lock(pthread_mutex_t *mutex, __attribute__((unused)) useconds_t dally_time,
+                      __attribute__((unused)) const char *mutexName,
+                      __attribute__((unused)) const char *filename,
+                      __attribute__((unused)) const int line,
+                      __attribute__((unused)) int debuglevel) {
+  return pthread_mutex_lock(mutex);
+}
+
+int _debug_mutex_unlock(pthread_mutex_t *mutex, __attribute__((unused)) const char *mutexName,
+                        __attribute__((unused)) const char *filename,
+                        __attribute__((unused)) const int line,
+                        __attribute__((unused)) int debuglevel) {
+  return pthread_mutex_unlock(mutex);
+}
+
+void pthread_cleanup_debug_mutex_unlock(void *arg) { pthread_mutex_unlock((pthread_mutex_t *)arg); }
+
+uint64_t get_absolute_time_in_ns() {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return (uint64_t)tn.tv_sec * 1000000000 + tn.tv_nsec;
+}
+
+uint64_t get_realtime_in_ns() {
+  struct timespec tn;
+  clock_gettime(CLOCK_REALTIME, &tn);
+  return (uint64_t)tn.tv_sec * 1000000000 + tn.tv_nsec;
+}
+
+void _metadata_hub_modify_prolog(__attribute__((unused)) const char *filename,
+                                 __attribute__((unused)) const int linenumber) {}
+
+void _metadata_hub_modify_epilog(__attribute__((unused)) int modified,
+                                 __attribute__((unused)) const char *filename,
+                                 __attribute__((unused)) const int linenumber) {}
+
+void mdns_dacp_monitor_set_id(__attribute__((unused)) const char *dacp_id) {}
+
+int string_update_with_size(__attribute__((unused)) char **str, __attribute__((unused)) int *flag,
+                            __attribute__((unused)) char *s, __attribute__((unused)) size_t len) {
+  return 0;
+}
+
+// the stand-in DACP server
+
+typedef enum {
+  long_poll_answer,           // answer after long_poll_hold_ms
+  long_poll_answer_and_close, // answer after long_poll_hold_ms with "Connection: close", then close
+  long_poll_silent,           // never answer
+} long_poll_behaviour;
+
+#define MAX_STAND_IN_CONNECTIONS 32
+
+static struct {
+  int listen_fd;
+  uint16_t port;
+  pthread_mutex_t lock;
+  int connections; // accepted so far
+  int requests;    // received so far
+  int long_polls;  // playstatusupdate requests received with a revision number other than 1
+  long_poll_behaviour behaviour;
+  int long_poll_hold_ms;
+  int32_t revision_number; // the revision number the next playstatusupdate reply carries
+  int open_fds[MAX_STAND_IN_CONNECTIONS];
+} stand_in;
+
+static void stand_in_forget_fd(int fd) {
+  int i;
+  pthread_mutex_lock(&stand_in.lock);
+  for (i = 0; i < MAX_STAND_IN_CONNECTIONS; i++)
+    if (stand_in.open_fds[i] == fd)
+      stand_in.open_fds[i] = -1;
+  pthread_mutex_unlock(&stand_in.lock);
+}
+
+static int stand_in_reply(int fd, int close_connection, int32_t revision_number) {
+  // a playstatusupdate with just the status and revision number in it
+  uint8_t body[8 + 12 + 9];
+  uint32_t v;
+  memcpy(body, "cmst", 4);
+  v = htonl(sizeof(body) - 8);
+  memcpy(body + 4, &v, 4);
+  memcpy(body + 8, "cmsr", 4);
+  v = htonl(4);
+  memcpy(body + 12, &v, 4);
+  v = htonl(revision_number);
+  memcpy(body + 16, &v, 4);
+  memcpy(body + 20, "caps", 4);
+  v = htonl(1);
+  memcpy(body + 24, &v, 4);
+  body[28] = 4; // playing
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+                               "HTTP/1.1 200 OK\r\nContent-Type: application/x-dmap-tagged\r\n"
+                               "Content-Length: %zu\r\n%s\r\n",
+                               sizeof(body), close_connection ? "Connection: close\r\n" : "");
+  if ((send(fd, header, header_length, 0) != header_length) ||
+      (send(fd, body, sizeof(body), 0) != (ssize_t)sizeof(body)))
+    return -1;
+  return 0;
+}
+
+static void *stand_in_connection_thread(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char request[4096];
+  size_t occupancy = 0;
+  int finished = 0;
+  request[0] = '\0';
+  while (finished == 0) {
+    char *end = NULL;
+    while ((end = strstr(request, "\r\n\r\n")) == NULL) {
+      ssize_t ndata = recv(fd, request + occupancy, sizeof(request) - 1 - occupancy, 0);
+      if (ndata <= 0) {
+        finished = 1;
+        break;
+      }
+      occupancy += ndata;
+      request[occupancy] = '\0';
+    }
+    if (finished)
+      break;
+    size_t request_length = end + 4 - request;
+    int long_poll = 0;
+    const char *revision = strstr(request, "playstatusupdate?revision-number=");
+    if ((revision != NULL) && (atoi(revision + strlen("playstatusupdate?revision-number=")) != 1))
+      long_poll = 1;
+    occupancy -= request_length;
+    memmove(request, request + request_length, occupancy + 1);
+
+    pthread_mutex_lock(&stand_in.lock);
+    stand_in.requests++;
+    if (long_poll)
+      stand_in.long_polls++;
+    long_poll_behaviour behaviour = stand_in.behaviour;
+    int hold_ms = stand_in.long_poll_hold_ms;
+    int32_t revision_number = stand_in.revision_number++;
+    pthread_mutex_unlock(&stand_in.lock);
+
+    int close_connection = 0;
+    if (long_poll) {
+      if (behaviour == long_poll_silent) {
+        // wait for the client to give up
+        while (recv(fd, request, sizeof(request), 0) > 0)
+          ;
+        break;
+      }
+      usleep(hold_ms * 1000);
+      close_connection = (behaviour == long_poll_answer_and_close);
+    }
+    if ((stand_in_reply(fd, close_connection, revision_number) != 0) || (close_connection))
+      finished = 1;
+  }
+  stand_in_forget_fd(fd);
+  close(fd);
+  return NULL;
+}
+
+static void *stand_in_listener_thread(__attribute__((unused)) void *arg) {
+  while (1) {
+    int fd = accept(stand_in.listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    int i;
+    pthread_mutex_lock(&stand_in.lock);
+    stand_in.connections++;
+    for (i = 0; (i < MAX_STAND_IN_CONNECTIONS) && (stand_in.open_fds[i] != -1); i++)
+      ;
+    if (i < MAX_STAND_IN_CONNECTIONS)
+      stand_in.open_fds[i] = fd;
+    pthread_mutex_unlock(&stand_in.lock);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stand_in_connection_thread, (void *)(intptr_t)fd) == 0)
+      pthread_detach(thread);
+    else
+      close(fd);
+  }
+  return NULL;
+}
+
+static void stand_in_start() {
+  int i;
+  pthread_mutex_init(&stand_in.lock, NULL);
+  for (i = 0; i < MAX_STAND_IN_CONNECTIONS; i++)
+    stand_in.open_fds[i] = -1;
+  stand_in.revision_number = 2;
+  stand_in.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t address_length = sizeof(address);
+  if ((stand_in.listen_fd < 0) ||
+      (bind(stand_in.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+      (listen(stand_in.listen_fd, 8) != 0) ||
+      (getsockname(stand_in.listen_fd, (struct sockaddr *)&address, &address_length) != 0))
+    die("can not set up the stand-in DACP server -- error %d.", errno);
+  stand_in.port = ntohs(address.sin_port);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stand_in_listener_thread, NULL) != 0)
+    die("can not start the stand-in DACP server.");
+  pthread_detach(thread);
+}
+
+static void stand_in_set(long_poll_behaviour behaviour, int hold_ms) {
+  pthread_mutex_lock(&stand_in.lock);
+  stand_in.behaviour = behaviour;
+  stand_in.long_poll_hold_ms = hold_ms;
+  pthread_mutex_unlock(&stand_in.lock);
+}
+
+static void stand_in_counts(int *connections, int *requests, int *long_polls) {
+  pthread_mutex_lock(&stand_in.lock);
+  *connections = stand_in.connections;
+  *requests = stand_in.requests;
+  *long_polls = stand_in.long_polls;
+  pthread_mutex_unlock(&stand_in.lock);
+}
+
+// close the server's end of every open connection, as a server timing out idle ones would
+static void stand_in_drop_connections() {
+  int i;
+  pthread_mutex_lock(&stand_in.lock);
+  for (i = 0; i < MAX_STAND_IN_CONNECTIONS; i++)
+    if (stand_in.open_fds[i] != -1)
+      shutdown(stand_in.open_fds[i], SHUT_RDWR);
+  pthread_mutex_unlock(&stand_in.lock);
+  usleep(100000); // let the client's side see it
+}
+
+// the checks
+
+static int checks = 0;
+static int failures = 0;
+
+#define check(condition)                                                                           \
+  do {                                                                                             \
+    checks++;                                                                                      \
+    if (!(condition)) {                                                                            \
+      failures++;                                                                                  \
+      fprintf(stderr, "%s:%d: in %s: check failed: %s\n", __FILE__, __LINE__, __func__,           \
+              #condition);                                                                         \
+    }                                                                                              \
+  } while (0)
+
+static double seconds_since(uint64_t start) {
+  return (get_absolute_time_in_ns() - start) * 1E-9;
+}
+
+// the revision number in a playstatusupdate reply, or -1
+static int32_t reply_revision_number(char *body, ssize_t body_size) {
+  int32_t item_size;
+  char *p = body;
+  if ((body == NULL) || (body_size < 8) || (dacp_tlv_crawl(&p, &item_size) != 'cmst'))
+    return -1;
+  p -= item_size;
+  ssize_t remaining = item_size;
+  while (remaining >= 8) {
+    uint32_t type = dacp_tlv_crawl(&p, &item_size);
+    remaining -= item_size + 8;
+    if ((type == 'cmsr') && (item_size == 4)) {
+      uint32_t v;
+      memcpy(&v, p - item_size, 4);
+      return ntohl(v);
+    }
+  }
+  return -1;
+}
+
+typedef struct {
+  int code;
+  char *body;
+  ssize_t body_size;
+  double seconds;
+} long_poll_result;
+
+static void long_poll(long_poll_result *result) {
+  uint64_t start = get_absolute_time_in_ns();
+  result->code = dacp_send_long_poll_command("playstatusupdate?revision-number=5", &result->body,
+                                             &result->body_size);
+  result->seconds = seconds_since(start);
+}
+
+static void *long_poll_thread(void *arg) {
+  long_poll((long_poll_result *)arg);
+  return NULL;
+}
+
+static void long_poll_result_free(long_poll_result *result) {
+  free(result->body);
+  result->body = NULL;
+}
+
+// the server holds the request until it has something new, and the answer comes back then
+static void test_hold_open() {
+  long_poll_result result;
+  int connections, requests, long_polls;
+  stand_in_set(long_poll_answer, 500);
+  long_poll(&result);
+  stand_in_counts(&connections, &requests, &long_polls);
+  check(result.code == 200);
+  check(result.seconds >= 0.45);
+  check(result.seconds < DACP_LONG_POLL_TIMEOUT_SECONDS);
+  check(reply_revision_number(result.body, result.body_size) > 1);
+  check(long_polls == 1);
+  check(dacp_long_poll_connection.fd != -1); // kept alive
+  long_poll_result_free(&result);
+}
+
+// a long poll is sent again on the connection the last one was answered on, and ordinary
+// commands keep using a connection of their own
+static void test_keep_alive_reuse() {
+  long_poll_result result;
+  int connections, requests, long_polls;
+  int connections_after, requests_after, long_polls_after;
+  stand_in_set(long_poll_answer, 100);
+  stand_in_counts(&connections, &requests, &long_polls);
+  int fd = dacp_long_poll_connection.fd;
+  long_poll(&result);
+  stand_in_counts(&connections_after, &requests_after, &long_polls_after);
+  check(result.code == 200);
+  check(connections_after == connections);
+  check(long_polls_after == long_polls + 1);
+  check(dacp_long_poll_connection.fd == fd);
+  long_poll_result_free(&result);
+
+  check(send_simple_dacp_command("getproperty?properties=dmcp.volume") == 200);
+  check(send_simple_dacp_command("getproperty?properties=dmcp.volume") == 200);
+  stand_in_counts(&connections, &requests, &long_polls);
+  check(connections == connections_after + 1);
+  check(requests == requests_after + 2);
+  check(dacp_connection.fd != -1);
+  check(dacp_long_poll_connection.fd == fd);
+
+  long_poll(&result);
+  stand_in_counts(&connections_after, &requests_after, &long_polls_after);
+  check(result.code == 200);
+  check(connections_after == connections);
+  check(dacp_long_poll_connection.fd == fd);
+  long_poll_result_free(&result);
+}
+
+// a long poll being held by the server doesn't hold up remote control commands
+static void test_commands_during_long_poll() {
+  long_poll_result result;
+  pthread_t thread;
+  stand_in_set(long_poll_answer, 800);
+  pthread_create(&thread, NULL, long_poll_thread, &result);
+  usleep(100000);
+  uint64_t start = get_absolute_time_in_ns();
+  check(send_simple_dacp_command("playpause") == 200);
+  check(seconds_since(start) < 0.4);
+  pthread_join(thread, NULL);
+  check(result.code == 200);
+  check(result.seconds >= 0.75);
+  long_poll_result_free(&result);
+}
+
+// when the server has closed the kept-alive connection, the long poll is sent on a new one
+static void test_reconnect_after_server_close() {
+  long_poll_result result;
+  int connections, requests, long_polls;
+  int connections_after, requests_after, long_polls_after;
+  stand_in_set(long_poll_answer, 0);
+  check(dacp_long_poll_connection.fd != -1);
+  stand_in_drop_connections();
+  stand_in_counts(&connections, &requests, &long_polls);
+  long_poll(&result);
+  stand_in_counts(&connections_after, &requests_after, &long_polls_after);
+  check(result.code == 200);
+  check(connections_after == connections + 1);
+  check(long_polls_after == long_polls + 1);
+  check(dacp_long_poll_connection.fd != -1);
+  long_poll_result_free(&result);
+
+  // and when it answers with "Connection: close", the next long poll goes on a new connection
+  stand_in_set(long_poll_answer_and_close, 0);
+  long_poll(&result);
+  check(result.code == 200);
+  check(dacp_long_poll_connection.fd == -1);
+  long_poll_result_free(&result);
+  stand_in_set(long_poll_answer, 0);
+  stand_in_counts(&connections, &requests, &long_polls);
+  long_poll(&result);
+  stand_in_counts(&connections_after, &requests_after, &long_polls_after);
+  check(result.code == 200);
+  check(connections_after == connections + 1);
+  long_poll_result_free(&result);
+}
+
+// a long poll that nothing comes back to gives up after the timeout, without resending, and
+// doesn't leave the connection for reuse, as the server could still answer on it
+static void test_timeout() {
+  long_poll_result result;
+  int connections, requests, long_polls;
+  int connections_after, requests_after, long_polls_after;
+  stand_in_set(long_poll_silent, 0);
+  stand_in_counts(&connections, &requests, &long_polls);
+  long_poll(&result);
+  stand_in_counts(&connections_after, &requests_after, &long_polls_after);
+  check(result.code == 489);
+  check(result.seconds >= DACP_LONG_POLL_TIMEOUT_SECONDS * 0.9);
+  check(result.seconds < DACP_LONG_POLL_TIMEOUT_SECONDS + 1.0);
+  check(result.body == NULL);
+  check(long_polls_after == long_polls + 1);
+  check(dacp_long_poll_connection.fd == -1);
+  long_poll_result_free(&result);
+}
+
+// a long poll cut short because the DACP server has changed returns at once, without resending,
+// even on a kept-alive connection, where a failure would otherwise be retried
+static void test_interrupt() {
+  long_poll_result result;
+  int connections, requests, long_polls;
+  int connections_after, requests_after, long_polls_after;
+  pthread_t thread;
+  stand_in_set(long_poll_answer, 0);
+  long_poll(&result);
+  check(result.code == 200);
+  check(dacp_long_poll_connection.fd != -1);
+  long_poll_result_free(&result);
+  stand_in_set(long_poll_silent, 0);
+  stand_in_counts(&connections, &requests, &long_polls);
+  pthread_create(&thread, NULL, long_poll_thread, &result);
+  usleep(200000);
+  dacp_long_poll_interrupt();
+  pthread_join(thread, NULL);
+  stand_in_counts(&connections_after, &requests_after, &long_polls_after);
+  check(result.code == 495);
+  check(result.seconds < DACP_LONG_POLL_TIMEOUT_SECONDS * 0.9);
+  check(long_polls_after == long_polls + 1);
+  check(dacp_long_poll_connection.fd == -1);
+  long_poll_result_free(&result);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    debuglev = atoi(argv[1]);
+  signal(SIGPIPE, SIG_IGN);
+  stand_in_start();
+
+  pthread_mutex_init(&dacp_conversation_lock, NULL);
+  pthread_mutex_init(&dacp_long_poll_lock, NULL);
+  memset(&dacp_server, 0, sizeof(dacp_server));
+  dacp_server.port = stand_in.port;
+  dacp_server.connection_family = AF_INET;
+  snprintf(dacp_server.ip_string, sizeof(dacp_server.ip_string), "127.0.0.1");
+  dacp_server.active_remote_id = "1234567890";
+
+  test_hold_open();
+  test_keep_alive_reuse();
+  test_commands_during_long_poll();
+  test_reconnect_after_server_close();
+  test_timeout();
+  test_interrupt();
+
+  dacp_connection_close(&dacp_connection, 0);
+  dacp_connection_close(&dacp_long_poll_connection, 0);
+  printf("%d checks, %d failed.\n", checks, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
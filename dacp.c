@@ -39,6 +39,7 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -71,6 +72,8 @@ struct HttpResponse {
   ssize_t malloced_size; // this will be its allocated size
   ssize_t size;          // the current size of the content
   int code;
+  int length_known;     // set if a Content-Length or chunked Transfer-Encoding was given
+  int connection_close; // set if the server says it will close the connection
 };
 
 void *response_realloc(__attribute__((unused)) void *opaque, void *ptr, int size) {
@@ -101,10 +104,16 @@ void response_body(void *opaque, const char *data, int size) {
   response->size += size;
 }
 
-static void
-response_header(__attribute__((unused)) void *opaque, __attribute__((unused)) const char *ckey,
-                __attribute__((unused)) int nkey, __attribute__((unused)) const char *cvalue,
-                __attribute__((unused)) int nvalue) { /* example doesn't care about headers */
+// the keys come in lower case, the values as sent
+static void response_header(void *opaque, const char *ckey, int nkey, const char *cvalue,
+                            int nvalue) {
+  struct HttpResponse *response = (struct HttpResponse *)opaque;
+  if (((nkey == 14) && (strncmp(ckey, "content-length", nkey) == 0)) ||
+      ((nkey == 17) && (strncmp(ckey, "transfer-encoding", nkey) == 0)))
+    response->length_known = 1;
+  else if ((nkey == 10) && (strncmp(ckey, "connection", nkey) == 0) && (nvalue == 5) &&
+           (strncasecmp(cvalue, "close", nvalue) == 0))
+    response->connection_close = 1;
 }
 
 static void response_code(void *opaque, int code) {
@@ -125,6 +134,22 @@ static pthread_mutex_t dacp_conversation_lock;
 static pthread_mutex_t dacp_server_information_lock;
 static pthread_cond_t dacp_server_information_cv;
 
+// The HTTP/1.1 connection to the DACP server is kept open from one command to the next.
+// It is reopened if the server closes it, if an exchange on it fails or if the DACP server
+// changes. It is only touched with the dacp_conversation_lock held.
+typedef struct {
+  int fd;                    // -1 if not connected
+  char server[1024];         // the server and port it is connected to
+  char portstring[10];
+  char buffer[8192];         // data received but not yet parsed, e.g. the start of the next
+  ssize_t buffer_occupancy;  // pipelined response
+  int must_close;            // the last response can't be followed by another on this connection
+  int timed_out;             // the last receive timed out before anything arrived
+  int closed_unanswered;     // the server closed or reset the connection before anything arrived
+} dacp_connection_record;
+
+static dacp_connection_record dacp_connection = {.fd = -1};
+
 void addrinfo_cleanup(void *arg) {
   // debug(1, "addrinfo cleanup called.");
   struct addrinfo **info = (struct addrinfo **)arg;
@@ -137,233 +162,440 @@ void mutex_lock_cleanup(void *arg) {
     debug(1, "Error releasing mutex.");
 }
 
-void connect_cleanup(void *arg) {
-  int *fd = (int *)arg;
-  // debug(2, "dacp_send_command: close socket %d.",*fd);
-  close(*fd);
-}
-
 void http_cleanup(void *arg) {
   // debug(1, "http cleanup called.");
   struct http_roundtripper *rt = (struct http_roundtripper *)arg;
   http_free(rt);
 }
 
-int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
-  int result;
-  // debug(1,"dacp_send_command: command is: \"%s\".",command);
-
-  if (dacp_server.port == 0) {
-    // debug(3, "No DACP port specified yet");
-    result = 490; // no port specified
-  } else {
+static void response_body_cleanup(void *arg) {
+  struct HttpResponse *response = (struct HttpResponse *)arg;
+  free(response->body);
+  response->body = NULL;
+}
 
-    // will malloc space for the body or set it to NULL -- the caller should free it.
-
-    // Using some custom HTTP-like return codes
-    //  498 Bad Address information for the DACP server
-    //  497 Can't establish a socket to the DACP server
-    //  496 Can't connect to the DACP server
-    //  495 Error receiving response
-    //  494 This client is already busy
-    //  493 Client failed to send a message
-    //  492 Argument out of range
-    //  491 Client refused connection
-    //  490 No port specified
-
-    struct addrinfo hints, *res;
-    int sockfd;
-
-    struct HttpResponse response;
-    response.body = NULL;
-    response.malloced_size = 0;
-    response.size = 0;
-    response.code = 0;
-
-    char portstring[10], server[1024], message[1024];
-    memset(&portstring, 0, sizeof(portstring));
-    if (dacp_server.connection_family == AF_INET6) {
-      snprintf(server, sizeof(server), "%s%%%u", dacp_server.ip_string, dacp_server.scope_id);
-    } else {
-      strcpy(server, dacp_server.ip_string);
+static void dacp_connection_close(dacp_connection_record *conn, int abort) {
+  if (conn->fd != -1) {
+    if (abort) {
+      // reset the connection rather than leave it lingering
+      struct linger so_linger;
+      so_linger.l_onoff = 1; // "true"
+      so_linger.l_linger = 0;
+      if (setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger))
+        debug(1, "Could not set the dacp socket to abort on closing.");
     }
-    snprintf(portstring, sizeof(portstring), "%u", dacp_server.port);
-
-    // first, load up address structs with getaddrinfo():
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    // debug(2, "dacp_connection_close: close socket %d.", conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->buffer_occupancy = 0;
+}
 
-    // debug(1, "DACP port string is \"%s:%s\".", server, portstring);
+// if cancelled part way through an exchange, the state of the connection is unknown
+static void dacp_connection_cleanup(void *arg) {
+  dacp_connection_close((dacp_connection_record *)arg, 1);
+}
 
-    int ires = getaddrinfo(server, portstring, &hints, &res);
-    if (ires) {
-      // debug(1,"Error %d \"%s\" at getaddrinfo.",ires,gai_strerror(ires));
-      response.code = 498; // Bad Address information for the DACP server
+// returns 0 or one of the custom response codes
+static int dacp_connection_open(dacp_connection_record *conn, const char *server,
+                                const char *portstring) {
+  int response_code = 0;
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  // debug(1, "DACP port string is \"%s:%s\".", server, portstring);
+
+  int ires = getaddrinfo(server, portstring, &hints, &res);
+  if (ires) {
+    // debug(1,"Error %d \"%s\" at getaddrinfo.",ires,gai_strerror(ires));
+    response_code = 498; // Bad Address information for the DACP server
+  } else {
+    pthread_cleanup_push(addrinfo_cleanup, (void *)&res);
+    int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd == -1) {
+      // debug(1, "DACP socket could not be created -- error %d:
+      // \"%s\".",errno,strerror(errno));
+      response_code = 497; // Can't establish a socket to the DACP server
     } else {
-      uint64_t start_time = get_absolute_time_in_ns();
-      pthread_cleanup_push(addrinfo_cleanup, (void *)&res);
-      // only do this one at a time -- not sure it is necessary, but better safe than sorry
-
-      // int mutex_reply = sps_pthread_mutex_timedlock(&dacp_conversation_lock, 2000000, command,
-      // 1);
-      int mutex_reply = debug_mutex_lock(&dacp_conversation_lock, 2000000, 1);
-      // int mutex_reply = pthread_mutex_lock(&dacp_conversation_lock);
-      if (mutex_reply == 0) {
-        pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_conversation_lock);
-
-        // make a socket:
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-        if (sockfd == -1) {
-          // debug(1, "DACP socket could not be created -- error %d:
-          // \"%s\".",errno,strerror(errno));
-          response.code = 497; // Can't establish a socket to the DACP server
-        } else {
-          pthread_cleanup_push(connect_cleanup, (void *)&sockfd);
-          // debug(2, "dacp_send_command: open socket %d.",sockfd);
-
-          // This is for limiting the time to be spent waiting for a response.
-
-          struct timeval tv;
-          tv.tv_sec = 0;
-          tv.tv_usec = 500000;
-          if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
-            debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
-          if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof tv) == -1)
-            debug(1, "dacp_send_command: error %d setting send timeout.", errno);
-
-          // connect!
-          // debug(1, "DACP socket created.");
-          if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-            // debug(1, "dacp_send_command: connect failed with errno %d.", errno);
-            if (errno == ECONNREFUSED)
-              response.code = 491; // DACP server doesn't want to talk anymore...
-            else
-              response.code = 496; // Can't connect to the DACP server
-          } else {
-            // debug(1,"DACP connect succeeded.");
+      // This is for limiting the time to be spent waiting for a response.
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = 500000;
+      if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
+        debug(1, "dacp_connection_open: error %d setting receive timeout.", errno);
+      if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof tv) == -1)
+        debug(1, "dacp_connection_open: error %d setting send timeout.", errno);
+      // the socket is recorded before connecting so that a cancellation will close it
+      conn->fd = sockfd;
+      conn->buffer_occupancy = 0;
+      if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
+        // debug(1, "dacp_connection_open: connect failed with errno %d.", errno);
+        if (errno == ECONNREFUSED)
+          response_code = 491; // DACP server doesn't want to talk anymore...
+        else
+          response_code = 496; // Can't connect to the DACP server
+        dacp_connection_close(conn, 0);
+      } else {
+        debug(3, "dacp_connection_open: connected to \"%s:%s\".", server, portstring);
+        strncpy(conn->server, server, sizeof(conn->server) - 1);
+        conn->server[sizeof(conn->server) - 1] = '\0';
+        strncpy(conn->portstring, portstring, sizeof(conn->portstring) - 1);
+        conn->portstring[sizeof(conn->portstring) - 1] = '\0';
+      }
+    }
+    pthread_cleanup_pop(1); // this should free the addrinfo
+  }
+  return response_code;
+}
 
-            snprintf(message, sizeof(message),
+// send all the requests together so that the server can work through them back-to-back
+// returns 0 or 493 -- Client failed to send a message
+static int dacp_connection_send(dacp_connection_record *conn, dacp_command_exchange *exchanges,
+                                int count) {
+  char message[4096];
+  size_t message_length = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    int l = snprintf(message + message_length, sizeof(message) - message_length,
                      "GET /ctrl-int/1/%s HTTP/1.1\r\nHost: %s:%u\r\nActive-Remote: %s\r\n\r\n",
-                     command, dacp_server.ip_string, dacp_server.port,
+                     exchanges[i].command, dacp_server.ip_string, dacp_server.port,
                      dacp_server.active_remote_id);
+    if ((l < 0) || ((size_t)l >= sizeof(message) - message_length)) {
+      debug(1, "dacp_connection_send: commands too long to send.");
+      return 493;
+    }
+    message_length += l;
+    debug(3, "dacp_send_command: \"%s\".", exchanges[i].command);
+  }
+  size_t sent = 0;
+  while (sent < message_length) {
+    ssize_t wresp = send(conn->fd, message + sent, message_length - sent, 0);
+    if (wresp == -1) {
+      if (errno == EINTR)
+        continue;
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(2, "dacp_connection_send: write error %d: \"%s\".", errno, (char *)errorstring);
+      return 493;
+    }
+    sent += wresp;
+  }
+  return 0;
+}
 
-            // Send command
-            debug(3, "dacp_send_command: \"%s\".", command);
-            ssize_t wresp = send(sockfd, message, strlen(message), 0);
-            if (wresp == -1) {
-              char errorstring[1024];
-              strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-              debug(2, "dacp_send_command: write error %d: \"%s\".", errno, (char *)errorstring);
-              struct linger so_linger;
-              so_linger.l_onoff = 1; // "true"
-              so_linger.l_linger = 0;
-              int err = setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-              if (err)
-                debug(1, "Could not set the dacp socket to abort due to a write error on closing.");
-            }
-            if (wresp != (ssize_t)strlen(message)) {
-              // debug(1, "dacp_send_command: send failed.");
-              response.code = 493; // Client failed to send a message
+// receive the response to one request
+// returns 0 or 495 -- Error receiving response -- in which case the connection must be closed
+// sets must_close if the connection can't be used for another request
+// sets timed_out if nothing at all arrived before the receive timeout
+// sets closed_unanswered if the server closed or reset the connection before anything arrived
+static int dacp_connection_receive(dacp_connection_record *conn,
+                                   dacp_command_exchange *exchange) {
+  int reply = 0;
+  int server_closed = 0;
+  int received = (conn->buffer_occupancy != 0); // part of a pipelined response may be here already
+  conn->must_close = 0;
+  conn->timed_out = 0;
+  conn->closed_unanswered = 0;
+  struct HttpResponse response;
+  memset(&response, 0, sizeof(response));
+  response.body = malloc(2048); // it can resize this if necessary
+  response.malloced_size = 2048;
+  pthread_cleanup_push(response_body_cleanup, (void *)&response);
+
+  struct http_roundtripper rt;
+  http_init(&rt, responseFuncs, &response);
+  pthread_cleanup_push(http_cleanup, &rt);
+
+  int needmore = 1;
+  while ((needmore) && (reply == 0)) {
+    if (conn->buffer_occupancy == 0) {
+      ssize_t ndata = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+      // debug(3, "Received %d bytes: \"%s\".", ndata, conn->buffer);
+      if (ndata == -1) {
+        if (errno != EINTR) {
+          char errorstring[1024];
+          strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+          debug(2, "dacp_connection_receive: receiving error %d: \"%s\".", errno,
+                (char *)errorstring);
+          if ((received == 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            conn->timed_out = 1;
+          if ((received == 0) && (errno == ECONNRESET))
+            conn->closed_unanswered = 1;
+          reply = 495;
+        }
+      } else if (ndata == 0) {
+        server_closed = 1;
+        // without a length, the body runs until the server closes the connection
+        if ((response.code != 0) && (response.length_known == 0)) {
+          needmore = 0;
+        } else {
+          if (received == 0)
+            conn->closed_unanswered = 1;
+          reply = 495;
+        }
+      } else {
+        conn->buffer_occupancy = ndata;
+        received = 1;
+      }
+    }
+    if ((needmore) && (conn->buffer_occupancy != 0)) {
+      int read;
+      if (response.code == 0) {
+        // feed the header a character at a time so that, if the header turns out to be the whole
+        // response, nothing belonging to the next response is taken as a body
+        needmore = http_data(&rt, conn->buffer, 1, &read);
+        if ((needmore) && (response.code != 0) && (response.length_known == 0) &&
+            ((response.code == 204) || (response.code == 304)))
+          needmore = 0; // these have no body
+      } else {
+        needmore = http_data(&rt, conn->buffer, conn->buffer_occupancy, &read);
+      }
+      conn->buffer_occupancy -= read;
+      if (conn->buffer_occupancy)
+        memmove(conn->buffer, conn->buffer + read,
+                conn->buffer_occupancy);
+    }
+  }
 
-            } else {
+  if ((reply == 0) && (http_iserror(&rt))) {
+    debug(3, "dacp_connection_receive: error parsing data.");
+    reply = 495;
+  }
 
-              response.body = malloc(2048); // it can resize this if necessary
-              response.malloced_size = 2048;
-              pthread_cleanup_push(malloc_cleanup, response.body);
-
-              struct http_roundtripper rt;
-              http_init(&rt, responseFuncs, &response);
-              pthread_cleanup_push(http_cleanup, &rt);
-
-              int needmore = 1;
-              int looperror = 0;
-              char buffer[8192];
-              memset(buffer, 0, sizeof(buffer));
-              while (needmore && !looperror) {
-                const char *data = buffer;
-                if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
-                  debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
-                ssize_t ndata = recv(sockfd, buffer, sizeof(buffer), 0);
-                // debug(3, "Received %d bytes: \"%s\".", ndata, buffer);
-                if (ndata <= 0) {
-                  if (ndata == -1) {
-                    char errorstring[1024];
-                    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-                    debug(2, "dacp_send_command: receiving error %d: \"%s\".", errno,
-                          (char *)errorstring);
-                    struct linger so_linger;
-                    so_linger.l_onoff = 1; // "true"
-                    so_linger.l_linger = 0;
-                    int err =
-                        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-                    if (err)
-                      debug(
-                          1,
-                          "Could not set the dacp socket to abort due to a read error on closing.");
-                  }
+  if (reply == 0) {
+    exchange->body = response.body;
+    exchange->body_size = response.size;
+    exchange->code = response.code;
+    response.body = NULL; // it's now the caller's
+    if ((server_closed) || (response.connection_close))
+      conn->must_close = 1;
+  }
+  pthread_cleanup_pop(1); // this should call http_cleanup
+  pthread_cleanup_pop(1); // this frees the body unless it has been handed over
+  return reply;
+}
 
-                  free(response.body);
-                  response.body = NULL;
-                  response.malloced_size = 0;
-                  response.size = 0;
-                  response.code = 495; // Error receiving response
-                  looperror = 1;
-                }
+static void dacp_server_address(char *server, size_t server_size, char *portstring,
+                                size_t portstring_size) {
+  if (dacp_server.connection_family == AF_INET6)
+    snprintf(server, server_size, "%s%%%u", dacp_server.ip_string, dacp_server.scope_id);
+  else
+    snprintf(server, server_size, "%s", dacp_server.ip_string);
+  snprintf(portstring, portstring_size, "%u", dacp_server.port);
+}
 
-                while (needmore && ndata && !looperror) {
-                  int read;
-                  needmore = http_data(&rt, data, ndata, &read);
-                  ndata -= read;
-                  data += read;
-                }
-              }
+int dacp_send_commands(dacp_command_exchange *exchanges, int count) {
+  // Using some custom HTTP-like return codes
+  //  498 Bad Address information for the DACP server
+  //  497 Can't establish a socket to the DACP server
+  //  496 Can't connect to the DACP server
+  //  495 Error receiving response
+  //  494 This client is already busy
+  //  493 Client failed to send a message
+  //  492 Argument out of range
+  //  491 Client refused connection
+  //  490 No port specified
+
+  // will malloc space for each body or set it to NULL -- the caller should free them.
+
+  int i;
+  for (i = 0; i < count; i++) {
+    exchanges[i].body = NULL;
+    exchanges[i].body_size = 0;
+    exchanges[i].code = 0;
+  }
 
-              if (http_iserror(&rt)) {
-                debug(3, "dacp_send_command: error parsing data.");
-                free(response.body);
-                response.body = NULL;
-                response.malloced_size = 0;
-                response.size = 0;
-              }
-              // debug(1,"Size of response body is %d",response.size);
-              pthread_cleanup_pop(1); // this should call http_cleanup
-              // http_free(&rt);
-              pthread_cleanup_pop(
-                  0); // this should *not* free the malloced buffer -- just pop the malloc cleanup
-            }
+  if (dacp_server.port == 0) {
+    // debug(3, "No DACP port specified yet");
+    for (i = 0; i < count; i++)
+      exchanges[i].code = 490; // no port specified
+  } else {
+    char portstring[10], server[1024];
+    dacp_server_address(server, sizeof(server), portstring, sizeof(portstring));
+
+    uint64_t start_time = get_absolute_time_in_ns();
+    // only do this one at a time -- the connection is shared
+    int mutex_reply = debug_mutex_lock(&dacp_conversation_lock, 2000000, 1);
+    if (mutex_reply == 0) {
+      pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_conversation_lock);
+      pthread_cleanup_push(dacp_connection_cleanup, (void *)&dacp_connection);
+
+      if ((dacp_connection.fd != -1) &&
+          ((strcmp(server, dacp_connection.server) != 0) ||
+           (strcmp(portstring, dacp_connection.portstring) != 0))) {
+        debug(2, "dacp_send_commands: the DACP server has changed -- reconnecting.");
+        dacp_connection_close(&dacp_connection, 0);
+      }
+
+      int first = 0;          // the first exchange not yet answered
+      int retry_permitted = 1; // a kept-alive connection may have been closed by the server
+      while (first < count) {
+        int reused = (dacp_connection.fd != -1);
+        int first_sent = first;
+        int send_failed = 0;
+        if (reused == 0) {
+          int open_reply = dacp_connection_open(&dacp_connection, server, portstring);
+          if (open_reply != 0) {
+            for (i = first; i < count; i++)
+              exchanges[i].code = open_reply;
+            break;
+          }
+        }
+        int reply = dacp_connection_send(&dacp_connection, exchanges + first, count - first);
+        if (reply != 0)
+          send_failed = 1;
+        while ((reply == 0) && (first < count) && (dacp_connection.fd != -1)) {
+          reply = dacp_connection_receive(&dacp_connection, &exchanges[first]);
+          if (reply == 0) {
+            first++;
+            if (dacp_connection.must_close)
+              dacp_connection_close(&dacp_connection, 0);
+          }
+        }
+        if (reply != 0) {
+          // Only resend if the kept-alive connection was found to be closed before the server
+          // could have acted on anything sent -- never after a timeout or a partial response, as
+          // commands like playpause mustn't be carried out twice.
+          int stale = (send_failed) ||
+                      ((first == first_sent) && (dacp_connection.closed_unanswered));
+          dacp_connection_close(&dacp_connection, 1);
+          if ((reused) && (retry_permitted) && (stale)) {
+            debug(3, "dacp_send_commands: the kept-alive connection failed -- reconnecting.");
+            retry_permitted = 0;
+          } else {
+            for (i = first; i < count; i++)
+              exchanges[i].code = reply;
+            break;
           }
-          pthread_cleanup_pop(1); // this should close the socket
-                                  // close(sockfd);
-                                  // debug(1,"DACP socket closed.");
         }
-        pthread_cleanup_pop(1); // this should unlock the dacp_conversation_lock);
-        // pthread_mutex_unlock(&dacp_conversation_lock);
-        // debug(1,"Sent command\"%s\" with a response body of size %d.",command,response.size);
-        // debug(1,"dacp_conversation_lock released.");
-      } else {
-        debug(3,
-              "dacp_send_command: could not acquire a lock on the dacp transmit/receive section "
-              "when attempting to "
-              "send the command \"%s\". Possible timeout?",
-              command);
-        response.code = 494; // This client is already busy
       }
-      pthread_cleanup_pop(1); // this should free the addrinfo
-      // freeaddrinfo(res);
-      uint64_t et = get_absolute_time_in_ns() - start_time; // this will be in nanoseconds
-      debug(3, "dacp_send_command: %f seconds, response code %d, command \"%s\".",
-            (1.0 * et) / 1000000000, response.code, command);
+      pthread_cleanup_pop(0); // the connection is left open if it can be used again
+      pthread_cleanup_pop(1); // this should unlock the dacp_conversation_lock);
+    } else {
+      debug(3,
+            "dacp_send_commands: could not acquire a lock on the dacp transmit/receive section "
+            "when attempting to "
+            "send the command \"%s\". Possible timeout?",
+            exchanges[0].command);
+      for (i = 0; i < count; i++)
+        exchanges[i].code = 494; // This client is already busy
     }
-    *body = response.body;
-    *bodysize = response.size;
-    result = response.code;
+    uint64_t et = get_absolute_time_in_ns() - start_time; // this will be in nanoseconds
+    for (i = 0; i < count; i++)
+      debug(3, "dacp_send_command: %f seconds, response code %d, command \"%s\".",
+            (1.0 * et) / 1000000000, exchanges[i].code, exchanges[i].command);
   }
+  int result = exchanges[count - 1].code;
+  for (i = count - 1; i >= 0; i--)
+    if ((exchanges[i].code < 200) || (exchanges[i].code > 299))
+      result = exchanges[i].code;
   return result;
 }
 
+int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
+  // debug(1,"dacp_send_command: command is: \"%s\".",command);
+  dacp_command_exchange exchange;
+  exchange.command = command;
+  dacp_send_commands(&exchange, 1);
+  *body = exchange.body;
+  *bodysize = exchange.body_size;
+  return exchange.code;
+}
+
+// The long poll for play status updates has a connection of its own, so that a request held open
+// by the DACP server doesn't hold up remote control commands. Only the monitor thread sends on it;
+// the lock is so that set_dacp_server_information() can safely cut a poll short.
+#ifndef DACP_LONG_POLL_TIMEOUT_SECONDS // dacp-long-poll-test sets a shorter one
+#define DACP_LONG_POLL_TIMEOUT_SECONDS 30
+#endif
+static dacp_connection_record dacp_long_poll_connection = {.fd = -1};
+static pthread_mutex_t dacp_long_poll_lock;
+static int dacp_long_poll_interrupted; // set to stop the current long poll being retried
+
+static void dacp_long_poll_connection_close(int abort) {
+  debug_mutex_lock(&dacp_long_poll_lock, 500000, 2);
+  dacp_connection_close(&dacp_long_poll_connection, abort);
+  debug_mutex_unlock(&dacp_long_poll_lock, 3);
+}
+
+// wake up a long poll waiting on a DACP server that's no longer wanted
+static void dacp_long_poll_interrupt() {
+  debug_mutex_lock(&dacp_long_poll_lock, 500000, 2);
+  dacp_long_poll_interrupted = 1;
+  if (dacp_long_poll_connection.fd != -1)
+    shutdown(dacp_long_poll_connection.fd, SHUT_RDWR);
+  debug_mutex_unlock(&dacp_long_poll_lock, 3);
+}
+
+// send a command that the DACP server can hold until it has something new to report
+// returns the response code or one of the custom codes as dacp_send_command() does,
+// or 489 if nothing came back within DACP_LONG_POLL_TIMEOUT_SECONDS
+static int dacp_send_long_poll_command(const char *command, char **body, ssize_t *bodysize) {
+  dacp_command_exchange exchange;
+  exchange.command = command;
+  exchange.body = NULL;
+  exchange.body_size = 0;
+  exchange.code = 0;
+  if (dacp_server.port == 0) {
+    exchange.code = 490; // no port specified
+  } else {
+    char portstring[10], server[1024];
+    dacp_server_address(server, sizeof(server), portstring, sizeof(portstring));
+    dacp_long_poll_interrupted = 0;
+    int attempts = 2; // a kept-alive connection may have been closed by the server
+    do {
+      attempts--;
+      int reused = (dacp_long_poll_connection.fd != -1);
+      if ((reused) && ((strcmp(server, dacp_long_poll_connection.server) != 0) ||
+                       (strcmp(portstring, dacp_long_poll_connection.portstring) != 0))) {
+        dacp_long_poll_connection_close(0);
+        reused = 0;
+      }
+      if (reused == 0) {
+        debug_mutex_lock(&dacp_long_poll_lock, 500000, 2);
+        pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_long_poll_lock);
+        exchange.code = dacp_connection_open(&dacp_long_poll_connection, server, portstring);
+        pthread_cleanup_pop(1);
+        if (exchange.code != 0)
+          break;
+        attempts = 0; // a new connection that fails won't do better on a second try
+      }
+      struct timeval tv;
+      tv.tv_sec = DACP_LONG_POLL_TIMEOUT_SECONDS;
+      tv.tv_usec = 0;
+      if (setsockopt(dacp_long_poll_connection.fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv,
+                     sizeof tv) == -1)
+        debug(1, "dacp_send_long_poll_command: error %d setting receive timeout.", errno);
+      int reply = dacp_connection_send(&dacp_long_poll_connection, &exchange, 1);
+      if (reply == 0)
+        reply = dacp_connection_receive(&dacp_long_poll_connection, &exchange);
+      if (reply == 0) {
+        attempts = 0;
+        if (dacp_long_poll_connection.must_close)
+          dacp_long_poll_connection_close(0);
+      } else {
+        // the server will still answer an unanswered request, so the connection can't be reused
+        dacp_long_poll_connection_close(1);
+        if (dacp_long_poll_connection.timed_out) {
+          exchange.code = 489; // nothing to report
+          attempts = 0;
+        } else {
+          exchange.code = reply;
+          if (dacp_long_poll_interrupted)
+            attempts = 0;
+        }
+      }
+    } while (attempts > 0);
+    debug(3, "dacp_send_long_poll_command: response code %d, command \"%s\".", exchange.code,
+          command);
+  }
+  *body = exchange.body;
+  *bodysize = exchange.body_size;
+  return exchange.code;
+}
+
 int send_simple_dacp_command(const char *command) {
   int reply = 0;
   char *server_reply = NULL;
@@ -413,15 +645,17 @@ void set_dacp_server_information(rtsp_conn_info *conn) {
 
     /*
 
-    "long polling" is not implemented by Shairport Sync, whereby by sending the client the
-    last-received revision number, the link will hang until a change occurs.
+    With "long polling", by sending the client the last-received revision number, the link will
+    hang until a change occurs.
 
-    Instead, at present, Shairport Sync always uses a revision number of 1.
+    Unless the dacp_long_polling setting is "yes", Shairport Sync always uses a revision number
+    of 1 and asks for the status at intervals instead.
 
     */
 
-    // always use revision number 1
-    dacp_server.always_use_revision_number_1 = 1;
+    dacp_server.always_use_revision_number_1 = (config.dacp_long_polling == 0);
+    if (config.dacp_long_polling)
+      dacp_long_poll_interrupt(); // don't keep waiting on the previous server
 
     metadata_hub_modify_prolog();
     int ch = metadata_store.dacp_server_active != dacp_server.scan_enable;
@@ -500,6 +734,7 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
   while (1) {
     int result = 0;
     int32_t the_volume;
+    int32_t revision_number_sent = 1;
     pthread_cleanup_debug_mutex_lock(&dacp_server_information_lock, 500000, 2);
     if (dacp_server.scan_enable == 0) {
       metadata_hub_modify_prolog();
@@ -551,6 +786,7 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
       if (dacp_server.scan_enable == 1) {
         bad_result_count = 0;
         idle_scan_count = 0;
+        revision_number = 1;
       }
     }
 
@@ -653,10 +889,18 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
         char command[1024] = "";
         if (always_use_revision_number_1 != 0) // see the "long polling" note above
           revision_number = 1;
+        revision_number_sent = revision_number;
         snprintf(command, sizeof(command) - 1, "playstatusupdate?revision-number=%d",
                  revision_number);
         // debug(1,"dacp_monitor_thread_code: command: \"%s\"",command);
-        result = dacp_send_command(command, &response, &le);
+        if (revision_number != 1) {
+          // this will hang until there's a change or it times out
+          result = dacp_send_long_poll_command(command, &response, &le);
+          if ((result != 200) && (result != 489))
+            revision_number = 1; // start again with an ordinary request
+        } else {
+          result = dacp_send_command(command, &response, &le);
+        }
         // debug(1,"Response to \"%s\" is %d.",command,result);
         // remember: unless the revision_number you pass in is 1,
         // response will be 200 only if there's something new to report.
@@ -919,10 +1163,14 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
         response = NULL;
       }
       */
-      if (metadata_store.player_thread_active)
+      if ((always_use_revision_number_1 == 0) && (revision_number != 1) &&
+          (((result == 200) && (revision_number != revision_number_sent)) || (result == 489))) {
+        // long polling -- go straight back to wait for the next change
+      } else if (metadata_store.player_thread_active) {
         sleep(config.scan_interval_when_active);
-      else
+      } else {
         sleep(config.scan_interval_when_inactive);
+      }
     }
   }
   debug(1, "DACP monitor thread exiting -- should never happen.");
@@ -972,6 +1220,10 @@ void dacp_monitor_start() {
   // if (rc)
   //  debug(1,"Error creating the DACP Server Information Lock Mutex Set Name");
 
+  rc = pthread_mutex_init(&dacp_long_poll_lock, NULL);
+  if (rc)
+    debug(1, "Error creating the DACP Long Poll Lock Mutex Init");
+
   rc = pthread_mutex_init(&dacp_server_information_lock, &mta);
   if (rc)
     debug(1, "Error creating the DACP Server Information Lock Mutex Init");
@@ -991,6 +1243,9 @@ void dacp_monitor_stop() {
     debug(2, "dacp_monitor_stop");
     pthread_cancel(dacp_monitor_thread);
     pthread_join(dacp_monitor_thread, NULL);
+    dacp_connection_close(&dacp_connection, 0);
+    dacp_connection_close(&dacp_long_poll_connection, 0);
+    pthread_mutex_destroy(&dacp_long_poll_lock);
     pthread_mutex_destroy(&dacp_server_information_lock);
     debug(3, "DACP Conversation Lock Mutex Destroyed");
     pthread_mutex_destroy(&dacp_conversation_lock);
@@ -1015,6 +1270,32 @@ uint32_t dacp_tlv_crawl(char **p, int32_t *length) {
   return type;
 }
 
+static int32_t dacp_parse_client_volume(char *server_reply, ssize_t reply_size) {
+  int32_t overall_volume = -1;
+  char *sp = server_reply;
+  int32_t item_size;
+  if (reply_size >= 8) {
+    if (dacp_tlv_crawl(&sp, &item_size) == 'cmgt') {
+      sp -= item_size; // drop down into the array -- don't skip over it
+      reply_size -= 8;
+      while (reply_size >= 8) {
+        uint32_t type = dacp_tlv_crawl(&sp, &item_size);
+        reply_size -= item_size + 8;
+        if (type == 'cmvo') { // drop down into the dictionary -- don't skip over it
+          char *t = sp - item_size;
+          overall_volume = ntohl(*(uint32_t *)(t));
+        }
+      }
+    } else {
+      debug(1, "Unexpected payload response from getproperty?properties=dmcp.volume");
+    }
+  } else {
+    debug(1, "Too short a response from getproperty?properties=dmcp.volume");
+  }
+  // debug(1, "Overall Volume is %d.", overall_volume);
+  return overall_volume;
+}
+
 int dacp_get_client_volume(int32_t *result) {
   // debug(1,"dacp_get_client_volume");
   char *server_reply = NULL;
@@ -1023,29 +1304,8 @@ int dacp_get_client_volume(int32_t *result) {
   // debug(1,"dacp_get_client_volume: dacp_send_command");
   int response =
       dacp_send_command("getproperty?properties=dmcp.volume", &server_reply, &reply_size);
-  if (response == 200) { // if we get an okay
-    char *sp = server_reply;
-    int32_t item_size;
-    if (reply_size >= 8) {
-      if (dacp_tlv_crawl(&sp, &item_size) == 'cmgt') {
-        sp -= item_size; // drop down into the array -- don't skip over it
-        reply_size -= 8;
-        while (reply_size >= 8) {
-          uint32_t type = dacp_tlv_crawl(&sp, &item_size);
-          reply_size -= item_size + 8;
-          if (type == 'cmvo') { // drop down into the dictionary -- don't skip over it
-            char *t = sp - item_size;
-            overall_volume = ntohl(*(uint32_t *)(t));
-          }
-        }
-      } else {
-        debug(1, "Unexpected payload response from getproperty?properties=dmcp.volume");
-      }
-    } else {
-      debug(1, "Too short a response from getproperty?properties=dmcp.volume");
-    }
-    // debug(1, "Overall Volume is %d.", overall_volume);
-  }
+  if (response == 200) // if we get an okay
+    overall_volume = dacp_parse_client_volume(server_reply, reply_size);
 
   if (server_reply) {
     // debug(1, "Freeing response memory.");
@@ -1082,124 +1342,157 @@ int dacp_set_speaker_volume(int64_t machine_number, int32_t vo) {
   // should return 204
 }
 
-int dacp_get_speaker_list(dacp_spkr_stuff *speaker_info, int max_size_of_array,
-                          int *actual_speaker_count) {
+// returns 200 or 413 if there are more speakers than will fit
+static int dacp_parse_speaker_list(char *server_reply, ssize_t le, dacp_spkr_stuff *speaker_info,
+                                   int max_size_of_array, int *actual_speaker_count) {
   // char typestring[5];
-  char *server_reply = NULL;
   int speaker_index = -1; // will be incremented before use
   int speaker_count = -1; // will be fixed if there is no problem
-  ssize_t le;
+  char *sp = server_reply;
+  int32_t item_size;
+  if (le >= 8) {
+    if (dacp_tlv_crawl(&sp, &item_size) == 'casp') {
+      //          debug(1,"Speakers:",item_size);
+      sp -= item_size; // drop down into the array -- don't skip over it
+      le -= 8;
+      while (le >= 8) {
+        uint32_t type = dacp_tlv_crawl(&sp, &item_size);
+        if (type == 'mdcl') { // drop down into the dictionary -- don't skip over it
+          // debug(1,">>>> Dictionary:");
+          sp -= item_size;
+          le -= 8;
+          speaker_index++;
+          if (speaker_index == max_size_of_array) {
+            return 413; // Payload Too Large -- too many speakers
+          }
+          speaker_info[speaker_index].active = 0;
+          speaker_info[speaker_index].speaker_number = 0;
+          speaker_info[speaker_index].volume = 0;
+          speaker_info[speaker_index].name[0] = '\0';
+        } else {
+          le -= item_size + 8;
+          char *t;
+          // char u;
+          int32_t r;
+          int64_t s, v;
+          switch (type) {
+          case 'minm':
+            t = sp - item_size;
+            strncpy((char *)&speaker_info[speaker_index].name, t,
+                    sizeof(speaker_info[speaker_index].name));
+            speaker_info[speaker_index].name[sizeof(speaker_info[speaker_index].name) - 1] =
+                '\0'; // just in case
+            break;
+          case 'cmvo':
+            t = sp - item_size;
+            r = ntohl(*(uint32_t *)(t));
+            speaker_info[speaker_index].volume = r;
+            // debug(1,"The individual volume of speaker \"%s\" is
+            // \"%d\".",speaker_info[speaker_index].name,r);
+            break;
+          case 'msma':
+            t = sp - item_size;
+            s = ntohl(*(uint32_t *)(t));
+            s = s << 32;
+            t += 4;
+            v = (ntohl(*(uint32_t *)(t))) & 0xffffffff;
+            s += v;
+            speaker_info[speaker_index].speaker_number = s;
+            // debug(1,"Speaker machine number: %ld",s);
+            break;
+
+          case 'caia':
+            speaker_info[speaker_index].active = 1;
+            break;
+          /*
+                          case 'caip':
+                          case 'cavd':
+                          case 'caiv':
+                          case 'cads':
 
-  // debug(1,"dacp_speaker_list: dacp_send_command");
-  int response = dacp_send_command("getspeakers", &server_reply, &le);
-  if (response == 200) {
-    char *sp = server_reply;
-    int32_t item_size;
-    if (le >= 8) {
-      if (dacp_tlv_crawl(&sp, &item_size) == 'casp') {
-        //          debug(1,"Speakers:",item_size);
-        sp -= item_size; // drop down into the array -- don't skip over it
-        le -= 8;
-        while (le >= 8) {
-          uint32_t type = dacp_tlv_crawl(&sp, &item_size);
-          if (type == 'mdcl') { // drop down into the dictionary -- don't skip over it
-            // debug(1,">>>> Dictionary:");
-            sp -= item_size;
-            le -= 8;
-            speaker_index++;
-            if (speaker_index == max_size_of_array) {
-              return 413; // Payload Too Large -- too many speakers
-            }
-            speaker_info[speaker_index].active = 0;
-            speaker_info[speaker_index].speaker_number = 0;
-            speaker_info[speaker_index].volume = 0;
-            speaker_info[speaker_index].name[0] = '\0';
-          } else {
-            le -= item_size + 8;
-            char *t;
-            // char u;
-            int32_t r;
-            int64_t s, v;
-            switch (type) {
-            case 'minm':
-              t = sp - item_size;
-              strncpy((char *)&speaker_info[speaker_index].name, t,
-                      sizeof(speaker_info[speaker_index].name));
-              speaker_info[speaker_index].name[sizeof(speaker_info[speaker_index].name) - 1] =
-                  '\0'; // just in case
-              break;
-            case 'cmvo':
-              t = sp - item_size;
-              r = ntohl(*(uint32_t *)(t));
-              speaker_info[speaker_index].volume = r;
-              // debug(1,"The individual volume of speaker \"%s\" is
-              // \"%d\".",speaker_info[speaker_index].name,r);
-              break;
-            case 'msma':
-              t = sp - item_size;
-              s = ntohl(*(uint32_t *)(t));
-              s = s << 32;
-              t += 4;
-              v = (ntohl(*(uint32_t *)(t))) & 0xffffffff;
-              s += v;
-              speaker_info[speaker_index].speaker_number = s;
-              // debug(1,"Speaker machine number: %ld",s);
-              break;
-
-            case 'caia':
-              speaker_info[speaker_index].active = 1;
-              break;
-            /*
-                            case 'caip':
-                            case 'cavd':
-                            case 'caiv':
-                            case 'cads':
-
-                              *(uint32_t *)typestring = htonl(type);
-                              typestring[4] = 0;
-
-
-
-                              t = sp-item_size;
-                              u = *t;
-                              debug(1,"Type: '%s' Value: \"%d\".",typestring,u);
-                              break;
-            */
-            default:
-              break;
-            }
+                            *(uint32_t *)typestring = htonl(type);
+                            typestring[4] = 0;
+
+
+
+                            t = sp-item_size;
+                            u = *t;
+                            debug(1,"Type: '%s' Value: \"%d\".",typestring,u);
+                            break;
+          */
+          default:
+            break;
           }
         }
-        // debug(1,"Total of %d speakers found. Here are the active ones:",speaker_index+1);
-        speaker_count = speaker_index + 1; // number of speaker entries in the array
-      } else {
-        debug(1, "Speaker array not found.");
       }
-      /*
-              int i;
-              for (i=0;i<le;i++) {
-                if (*sp < ' ')
-                  debug(1,"%d  %02x", i, *sp);
-                else
-                  debug(1,"%d  %02x  '%c'", i, *sp,*sp);
-                sp++;
-              }
-      */
+      // debug(1,"Total of %d speakers found. Here are the active ones:",speaker_index+1);
+      speaker_count = speaker_index + 1; // number of speaker entries in the array
     } else {
-      debug(1, "Can't find any content in dacp speakers request");
+      debug(1, "Speaker array not found.");
     }
-    free(server_reply);
-    server_reply = NULL;
+    /*
+            int i;
+            for (i=0;i<le;i++) {
+              if (*sp < ' ')
+                debug(1,"%d  %02x", i, *sp);
+              else
+                debug(1,"%d  %02x  '%c'", i, *sp,*sp);
+              sp++;
+            }
+    */
   } else {
-    // debug(1, "Unexpected response %d to dacp speakers request", response);
-    if (server_reply) {
-      debug(1, "Freeing response memory.");
-      free(server_reply);
-      server_reply = NULL;
-    }
+    debug(1, "Can't find any content in dacp speakers request");
   }
   if (actual_speaker_count)
     *actual_speaker_count = speaker_count;
+  return 200;
+}
+
+int dacp_get_speaker_list(dacp_spkr_stuff *speaker_info, int max_size_of_array,
+                          int *actual_speaker_count) {
+  char *server_reply = NULL;
+  ssize_t le;
+
+  // debug(1,"dacp_speaker_list: dacp_send_command");
+  int response = dacp_send_command("getspeakers", &server_reply, &le);
+  if (response == 200) {
+    response = dacp_parse_speaker_list(server_reply, le, speaker_info, max_size_of_array,
+                                       actual_speaker_count);
+  } else {
+    // debug(1, "Unexpected response %d to dacp speakers request", response);
+    if (actual_speaker_count)
+      *actual_speaker_count = -1;
+  }
+  if (server_reply) {
+    free(server_reply);
+    server_reply = NULL;
+  }
+  return response;
+}
+
+// the overall volume and the speaker list are independent, so ask for both at once
+static int dacp_get_client_volume_and_speaker_list(int32_t *overall_volume,
+                                                   dacp_spkr_stuff *speaker_info,
+                                                   int max_size_of_array,
+                                                   int *actual_speaker_count) {
+  dacp_command_exchange exchanges[2];
+  exchanges[0].command = "getproperty?properties=dmcp.volume";
+  exchanges[1].command = "getspeakers";
+  dacp_send_commands(exchanges, 2);
+  int response = exchanges[0].code;
+  *overall_volume = -1;
+  *actual_speaker_count = -1;
+  if (response == 200) {
+    *overall_volume = dacp_parse_client_volume(exchanges[0].body, exchanges[0].body_size);
+    response = exchanges[1].code;
+    if (response == 200)
+      response = dacp_parse_speaker_list(exchanges[1].body, exchanges[1].body_size, speaker_info,
+                                         max_size_of_array, actual_speaker_count);
+    else
+      debug(2, "Unexpected return code %d from the dacp speakers request.", response);
+  }
+  free(exchanges[0].body);
+  free(exchanges[1].body);
   return response;
 }
 
@@ -1213,47 +1506,44 @@ int dacp_get_volume(int32_t *the_actual_volume) {
 
   int32_t overall_volume = 0;
   int32_t actual_volume = 0;
-  int http_response = dacp_get_client_volume(&overall_volume);
+  int speaker_count = 0;
+  int http_response = dacp_get_client_volume_and_speaker_list(
+      &overall_volume, (dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
   if (http_response == 200) {
     // debug(1,"Overall volume is: %u.",overall_volume);
-    int speaker_count = 0;
-    http_response = dacp_get_speaker_list((dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
-    if (http_response == 200) {
-      // get our machine number
-      uint16_t *hn = (uint16_t *)config.ap1_prefix;
-      uint32_t *ln = (uint32_t *)(config.ap1_prefix + 2);
-      uint64_t t1 = ntohs(*hn);
-      uint64_t t2 = ntohl(*ln);
-      int64_t machine_number = (t1 << 32) + t2; // this form is useful
-
-      // Let's find our own speaker in the array and pick up its relative volume
-      int i;
-      int32_t relative_volume = 0;
-      for (i = 0; i < speaker_count; i++) {
-        if (speaker_info[i].speaker_number == machine_number) {
-          relative_volume = speaker_info[i].volume;
-          /*
-          debug(1,"Our speaker was found with a relative volume of: %u.",relative_volume);
-
-          if (speaker_info[i].active)
-            debug(1,"Our speaker is active.");
-          else
-            debug(1,"Our speaker is inactive.");
-          */
-        }
+    // get our machine number
+    uint16_t *hn = (uint16_t *)config.ap1_prefix;
+    uint32_t *ln = (uint32_t *)(config.ap1_prefix + 2);
+    uint64_t t1 = ntohs(*hn);
+    uint64_t t2 = ntohl(*ln);
+    int64_t machine_number = (t1 << 32) + t2; // this form is useful
+
+    // Let's find our own speaker in the array and pick up its relative volume
+    int i;
+    int32_t relative_volume = 0;
+    for (i = 0; i < speaker_count; i++) {
+      if (speaker_info[i].speaker_number == machine_number) {
+        relative_volume = speaker_info[i].volume;
+        /*
+        debug(1,"Our speaker was found with a relative volume of: %u.",relative_volume);
+
+        if (speaker_info[i].active)
+          debug(1,"Our speaker is active.");
+        else
+          debug(1,"Our speaker is inactive.");
+        */
       }
-      actual_volume = (overall_volume * relative_volume + 50) / 100;
-      // debug(1,"Overall volume: %d, relative volume: %d%, actual volume:
-      // %d.",overall_volume,relative_volume,actual_volume);
-      // debug(1,"Our actual speaker volume is %d.",actual_volume);
-      // metadata_hub_modify_prolog();
-      // metadata_store.speaker_volume = actual_volume;
-      // metadata_hub_modify_epilog(1);
-    } else {
-      debug(2, "Unexpected return code %d from dacp_get_speaker_list.", http_response);
     }
+    actual_volume = (overall_volume * relative_volume + 50) / 100;
+    // debug(1,"Overall volume: %d, relative volume: %d%, actual volume:
+    // %d.",overall_volume,relative_volume,actual_volume);
+    // debug(1,"Our actual speaker volume is %d.",actual_volume);
+    // metadata_hub_modify_prolog();
+    // metadata_store.speaker_volume = actual_volume;
+    // metadata_hub_modify_epilog(1);
   } else if ((http_response != 400) && (http_response != 490)) {
-    debug(3, "Unexpected return code %d from dacp_get_client_volume.", http_response);
+    debug(3, "Unexpected return code %d getting the client volume and speaker list.",
+          http_response);
   }
   if (the_actual_volume) {
     // debug(1,"dacp_get_volume returns %d.",actual_volume);
@@ -1268,99 +1558,95 @@ int dacp_set_volume(int32_t vo) {
     // get the information we need -- the absolute volume, the speaker list, our ID
     struct dacp_speaker_stuff speaker_info[50];
     int32_t overall_volume;
-    http_response = dacp_get_client_volume(&overall_volume);
+    int speaker_count;
+    http_response = dacp_get_client_volume_and_speaker_list(
+        &overall_volume, (dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
     if (http_response == 200) {
-      int speaker_count;
-      http_response = dacp_get_speaker_list((dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
-      if (http_response == 200) {
-        // get our machine number
-        uint16_t *hn = (uint16_t *)config.ap1_prefix;
-        uint32_t *ln = (uint32_t *)(config.ap1_prefix + 2);
-        uint64_t t1 = ntohs(*hn);
-        uint64_t t2 = ntohl(*ln);
-        int64_t machine_number = (t1 << 32) + t2; // this form is useful
-
-        // Let's find our own speaker in the array and pick up its relative volume
-        int i;
-        int32_t active_speakers = 0;
-        for (i = 0; i < speaker_count; i++) {
-          if (speaker_info[i].speaker_number == machine_number) {
-            debug(2, "Our speaker number found: %ld with relative volume.", machine_number,
-                  speaker_info[i].volume);
-          }
-          if (speaker_info[i].active == 1) {
-            active_speakers++;
-          }
+      // get our machine number
+      uint16_t *hn = (uint16_t *)config.ap1_prefix;
+      uint32_t *ln = (uint32_t *)(config.ap1_prefix + 2);
+      uint64_t t1 = ntohs(*hn);
+      uint64_t t2 = ntohl(*ln);
+      int64_t machine_number = (t1 << 32) + t2; // this form is useful
+
+      // Let's find our own speaker in the array and pick up its relative volume
+      int i;
+      int32_t active_speakers = 0;
+      for (i = 0; i < speaker_count; i++) {
+        if (speaker_info[i].speaker_number == machine_number) {
+          debug(2, "Our speaker number found: %ld with relative volume.", machine_number,
+                speaker_info[i].volume);
+        }
+        if (speaker_info[i].active == 1) {
+          active_speakers++;
         }
+      }
 
-        if (active_speakers == 1) {
-          // must be just this speaker
-          debug(2, "Remote-setting volume to %d on just one speaker.", vo);
+      if (active_speakers == 1) {
+        // must be just this speaker
+        debug(2, "Remote-setting volume to %d on just one speaker.", vo);
+        http_response = dacp_set_include_speaker_volume(machine_number, vo);
+      } else if (active_speakers == 0) {
+        debug(2, "No speakers!");
+      } else {
+        debug(2, "Speakers: %d, active: %d", speaker_count, active_speakers);
+        if (vo >= overall_volume) {
+          debug(2, "Multiple speakers active, but desired new volume is highest");
           http_response = dacp_set_include_speaker_volume(machine_number, vo);
-        } else if (active_speakers == 0) {
-          debug(2, "No speakers!");
         } else {
-          debug(2, "Speakers: %d, active: %d", speaker_count, active_speakers);
-          if (vo >= overall_volume) {
-            debug(2, "Multiple speakers active, but desired new volume is highest");
+          // the desired volume is less than the current overall volume and there is more than
+          // one
+          // speaker
+          // we must find out the highest other speaker volume.
+          // If the desired volume is less than it, we must set the current_overall volume to
+          // that
+          // highest volume
+          // and set our volume relative to it.
+          // If the desired volume is greater than the highest current volume, then we can just
+          // go
+          // ahead
+          // with dacp_set_include_speaker_volume, setting the new current overall volume to the
+          // desired new level
+          // with the speaker at 100%
+
+          int32_t highest_other_volume = 0;
+          for (i = 0; i < speaker_count; i++) {
+            if ((speaker_info[i].speaker_number != machine_number) &&
+                (speaker_info[i].active == 1) &&
+                (speaker_info[i].volume > highest_other_volume)) {
+              highest_other_volume = speaker_info[i].volume;
+            }
+          }
+          highest_other_volume = (highest_other_volume * overall_volume + 50) / 100;
+          if (highest_other_volume <= vo) {
+            debug(2,
+                  "Highest other volume %d is less than or equal to the desired new volume %d.",
+                  highest_other_volume, vo);
             http_response = dacp_set_include_speaker_volume(machine_number, vo);
           } else {
-            // the desired volume is less than the current overall volume and there is more than
-            // one
-            // speaker
-            // we must find out the highest other speaker volume.
-            // If the desired volume is less than it, we must set the current_overall volume to
-            // that
-            // highest volume
-            // and set our volume relative to it.
-            // If the desired volume is greater than the highest current volume, then we can just
-            // go
-            // ahead
-            // with dacp_set_include_speaker_volume, setting the new current overall volume to the
-            // desired new level
-            // with the speaker at 100%
-
-            int32_t highest_other_volume = 0;
-            for (i = 0; i < speaker_count; i++) {
-              if ((speaker_info[i].speaker_number != machine_number) &&
-                  (speaker_info[i].active == 1) &&
-                  (speaker_info[i].volume > highest_other_volume)) {
-                highest_other_volume = speaker_info[i].volume;
-              }
+            debug(2, "Highest other volume %d is greater than the desired new volume %d.",
+                  highest_other_volume, vo);
+            // if the present overall volume is higher than the highest other volume at present,
+            // then bring it down to it.
+            if (overall_volume > highest_other_volume) {
+              debug(2, "Lower overall volume to new highest volume.");
+              http_response = dacp_set_include_speaker_volume(
+                  machine_number,
+                  highest_other_volume); // set the overall volume to the highest one
             }
-            highest_other_volume = (highest_other_volume * overall_volume + 50) / 100;
-            if (highest_other_volume <= vo) {
-              debug(2,
-                    "Highest other volume %d is less than or equal to the desired new volume %d.",
-                    highest_other_volume, vo);
-              http_response = dacp_set_include_speaker_volume(machine_number, vo);
-            } else {
-              debug(2, "Highest other volume %d is greater than the desired new volume %d.",
-                    highest_other_volume, vo);
-              // if the present overall volume is higher than the highest other volume at present,
-              // then bring it down to it.
-              if (overall_volume > highest_other_volume) {
-                debug(2, "Lower overall volume to new highest volume.");
-                http_response = dacp_set_include_speaker_volume(
-                    machine_number,
-                    highest_other_volume); // set the overall volume to the highest one
-              }
-              if (highest_other_volume != 0) {
-                int32_t desired_relative_volume =
-                    (vo * 100 + (highest_other_volume / 2)) / highest_other_volume;
-                debug(2, "Set our speaker volume relative to the highest volume.");
-                http_response = dacp_set_speaker_volume(
-                    machine_number,
-                    desired_relative_volume); // set the overall volume to the highest one
-              }
+            if (highest_other_volume != 0) {
+              int32_t desired_relative_volume =
+                  (vo * 100 + (highest_other_volume / 2)) / highest_other_volume;
+              debug(2, "Set our speaker volume relative to the highest volume.");
+              http_response = dacp_set_speaker_volume(
+                  machine_number,
+                  desired_relative_volume); // set the overall volume to the highest one
             }
           }
         }
-      } else {
-        debug(2, "Can't get speakers list");
       }
     } else {
-      debug(2, "Can't get client volume");
+      debug(2, "Can't get the client volume and speakers list");
     }
 
   } else {
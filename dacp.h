@@ -33,6 +33,16 @@ void relinquish_dacp_server_information(rtsp_conn_info *conn); // tell the DACP
 void dacp_monitor_port_update_callback(
     char *dacp_id, uint16_t port); // a callback to say the port is no longer in use
 
+typedef struct dacp_command_exchange {
+  const char *command;
+  char *body; // malloc'ed or NULL -- the caller should free it
+  ssize_t body_size;
+  int code;
+} dacp_command_exchange;
+
+// send a number of independent commands together on the DACP connection, returning the code of
+// the first one that didn't succeed, or of the last one if they all did
+int dacp_send_commands(dacp_command_exchange *exchanges, int count);
 int dacp_send_command(const char *command, char **body, ssize_t *bodysize);
 int send_simple_dacp_command(const char *command);
 
@@ -36,6 +36,7 @@
 #include "rtsp.h"
 
 #include "rtp.h"
+#include "trace.h"
 
 #include "dacp.h"
 #include "metadata_hub.h"
@@ -222,6 +223,10 @@ void dbus_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused))
                                                        new_status);
   }
 
+  // only rebuild the metadata if some of it may have changed
+  if ((argc->changed_fields & (MH_CHANGED_TRACK_METADATA | MH_CHANGED_OTHER)) == 0)
+    return;
+
   // Build the metadata array
   debug(2, "Build metadata");
   GVariantBuilder *dict_builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
@@ -891,6 +896,44 @@ static gboolean on_handle_set_frame_position_update_interval(ShairportSync *skel
   return TRUE;
 }
 
+// write the trace to the trace_file
+static gboolean on_handle_dump_trace(ShairportSyncDiagnostics *skeleton,
+                                     GDBusMethodInvocation *invocation,
+                                     __attribute__((unused)) gpointer user_data) {
+  int reply = -1;
+#ifdef CONFIG_TRACING
+  if (trace_enabled)
+    reply = trace_dump();
+  else
+    debug(1, "DumpTrace requested, but tracing is not turned on.");
+#else
+  debug(1, "DumpTrace requested, but this build does not include tracing.");
+#endif
+  shairport_sync_diagnostics_complete_dump_trace(skeleton, invocation, reply);
+  return TRUE;
+}
+
+// return the lock site profile, all sites, worst first, and optionally start it again
+static gboolean on_handle_get_mutex_profile(ShairportSyncDiagnostics *skeleton,
+                                            GDBusMethodInvocation *invocation, gboolean reset,
+                                            __attribute__((unused)) gpointer user_data) {
+  size_t report_size = 65536;
+  char *report = malloc(report_size);
+  if (report) {
+    if (config.mutex_profiling == 0)
+      snprintf(report, report_size, "Mutex profiling is not turned on.");
+    else
+      mutex_profile_report(report, report_size, 0);
+    if (reset)
+      mutex_profile_reset();
+    shairport_sync_diagnostics_complete_get_mutex_profile(skeleton, invocation, report);
+    free(report);
+  } else {
+    shairport_sync_diagnostics_complete_get_mutex_profile(skeleton, invocation, "");
+  }
+  return TRUE;
+}
+
 static void on_dbus_name_acquired(GDBusConnection *connection, const gchar *name,
                                   __attribute__((unused)) gpointer user_data) {
 
@@ -967,6 +1010,12 @@ static void on_dbus_name_acquired(GDBusConnection *connection, const gchar *name
   g_signal_connect(shairportSyncDiagnosticsSkeleton, "notify::file-and-line",
                    G_CALLBACK(notify_file_and_line_callback), NULL);
 
+  g_signal_connect(shairportSyncDiagnosticsSkeleton, "handle-dump-trace",
+                   G_CALLBACK(on_handle_dump_trace), NULL);
+
+  g_signal_connect(shairportSyncDiagnosticsSkeleton, "handle-get-mutex-profile",
+                   G_CALLBACK(on_handle_get_mutex_profile), NULL);
+
   g_signal_connect(shairportSyncRemoteControlSkeleton, "handle-fast-forward",
                    G_CALLBACK(on_handle_fast_forward), NULL);
   g_signal_connect(shairportSyncRemoteControlSkeleton, "handle-rewind",
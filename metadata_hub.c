@@ -36,6 +36,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -45,6 +47,7 @@
 #include "common.h"
 #include "dacp.h"
 #include "metadata_hub.h"
+#include "trace.h"
 
 #ifdef CONFIG_MBEDTLS
 #include <mbedtls/md5.h>
@@ -65,6 +68,10 @@ int metadata_hub_initialised = 0;
 
 pthread_rwlock_t metadata_hub_re_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+static pthread_t cover_art_thread;
+static int cover_art_thread_running = 0;
+static void *cover_art_thread_function(void *arg);
+
 int string_update(char **str, int *flag, char *s) {
   if (s)
     return string_update_with_size(str, flag, s, strlen(s));
@@ -72,13 +79,166 @@ int string_update(char **str, int *flag, char *s) {
     return string_update_with_size(str, flag, NULL, 0);
 }
 
+// Watchers aren't called by whoever changed the hub, while they hold the hub's write lock.
+// Instead, the _changed flags are gathered into a bitmask of changed fields when the write lock
+// is released, and a notifier thread calls the watchers with the read lock held, telling them
+// which fields have changed in changed_fields. Changes arriving within a short interval of one
+// another are delivered together; the end of a metadata bundle ('mden') is delivered at once.
+
+#define METADATA_HUB_COALESCING_INTERVAL_NS 50000000
+
+static const struct {
+  size_t offset; // of the _changed flag in the metadata bundle
+  uint32_t bit;
+} metadata_hub_changed_flags[] = {
+    {offsetof(metadata_bundle, client_ip_changed), MH_CHANGED_CLIENT_IP},
+    {offsetof(metadata_bundle, client_name_changed), MH_CHANGED_CLIENT_NAME},
+    {offsetof(metadata_bundle, server_ip_changed), MH_CHANGED_SERVER_IP},
+    {offsetof(metadata_bundle, stream_type_changed), MH_CHANGED_STREAM_TYPE},
+    {offsetof(metadata_bundle, progress_string_changed), MH_CHANGED_PROGRESS_STRING},
+    {offsetof(metadata_bundle, frame_position_string_changed), MH_CHANGED_FRAME_POSITION_STRING},
+    {offsetof(metadata_bundle, first_frame_position_string_changed),
+     MH_CHANGED_FIRST_FRAME_POSITION_STRING},
+    {offsetof(metadata_bundle, cover_art_pathname_changed), MH_CHANGED_COVER_ART_PATHNAME},
+    {offsetof(metadata_bundle, item_id_changed), MH_CHANGED_ITEM_ID},
+    {offsetof(metadata_bundle, item_composite_id_changed), MH_CHANGED_ITEM_COMPOSITE_ID},
+    {offsetof(metadata_bundle, song_data_kind_changed), MH_CHANGED_SONG_DATA_KIND},
+    {offsetof(metadata_bundle, track_name_changed), MH_CHANGED_TRACK_NAME},
+    {offsetof(metadata_bundle, artist_name_changed), MH_CHANGED_ARTIST_NAME},
+    {offsetof(metadata_bundle, album_artist_name_changed), MH_CHANGED_ALBUM_ARTIST_NAME},
+    {offsetof(metadata_bundle, album_name_changed), MH_CHANGED_ALBUM_NAME},
+    {offsetof(metadata_bundle, genre_changed), MH_CHANGED_GENRE},
+    {offsetof(metadata_bundle, comment_changed), MH_CHANGED_COMMENT},
+    {offsetof(metadata_bundle, composer_changed), MH_CHANGED_COMPOSER},
+    {offsetof(metadata_bundle, file_kind_changed), MH_CHANGED_FILE_KIND},
+    {offsetof(metadata_bundle, song_description_changed), MH_CHANGED_SONG_DESCRIPTION},
+    {offsetof(metadata_bundle, song_album_artist_changed), MH_CHANGED_SONG_ALBUM_ARTIST},
+    {offsetof(metadata_bundle, sort_name_changed), MH_CHANGED_SORT_NAME},
+    {offsetof(metadata_bundle, sort_artist_changed), MH_CHANGED_SORT_ARTIST},
+    {offsetof(metadata_bundle, sort_album_changed), MH_CHANGED_SORT_ALBUM},
+    {offsetof(metadata_bundle, sort_composer_changed), MH_CHANGED_SORT_COMPOSER},
+    {offsetof(metadata_bundle, songtime_in_milliseconds_changed),
+     MH_CHANGED_SONGTIME_IN_MILLISECONDS},
+};
+
+static pthread_t metadata_hub_notifier_thread;
+static int metadata_hub_notifier_running = 0;
+static pthread_mutex_t metadata_hub_notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metadata_hub_notify_signal = PTHREAD_COND_INITIALIZER;
+static uint32_t metadata_hub_undelivered_changes = 0; // under the notify lock
+static int metadata_hub_notification_requested = 0;   // under the notify lock
+static int metadata_hub_flush_requested = 0;          // under the notify lock
+static uint32_t metadata_hub_changes = 0;            // under the hub write lock
+static int metadata_hub_bundle_ended = 0;            // under the hub write lock
+
+// call with the hub locked
+static void collect_changed_flags(void) {
+  unsigned int i;
+  for (i = 0; i < sizeof(metadata_hub_changed_flags) / sizeof(metadata_hub_changed_flags[0]);
+       i++) {
+    int *flag = (int *)((char *)&metadata_store + metadata_hub_changed_flags[i].offset);
+    if (*flag) {
+      metadata_hub_changes |= metadata_hub_changed_flags[i].bit;
+      *flag = 0;
+    }
+  }
+}
+
+static void run_metadata_watchers(uint32_t changes) {
+  int i;
+  metadata_store.changed_fields = changes;
+  for (i = 0; i < number_of_watchers; i++) {
+    if (metadata_store.watchers[i]) {
+      metadata_store.watchers[i](&metadata_store, metadata_store.watchers_data[i]);
+    }
+  }
+  metadata_store.changed_fields = 0;
+}
+
+static void metadata_hub_notifier_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&metadata_hub_notify_lock);
+}
+
+static void *metadata_hub_notifier_thread_function(__attribute__((unused)) void *arg) {
+  TRACE_THREAD_NAME("metadata hub notifier");
+  pthread_mutex_lock(&metadata_hub_notify_lock);
+  pthread_cleanup_push(metadata_hub_notifier_cleanup_handler, NULL);
+  while (1) {
+    while (metadata_hub_notification_requested == 0)
+      pthread_cond_wait(&metadata_hub_notify_signal, &metadata_hub_notify_lock);
+    // wait a little for further changes, unless the end of a bundle has been reached
+    int rc = 0;
+    uint64_t time_to_wait_for_wakeup_ns = METADATA_HUB_COALESCING_INTERVAL_NS;
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+    uint64_t time_of_wakeup_ns = get_realtime_in_ns() + time_to_wait_for_wakeup_ns;
+    uint64_t sec = time_of_wakeup_ns / 1000000000;
+    uint64_t nsec = time_of_wakeup_ns % 1000000000;
+#endif
+#ifdef COMPILE_FOR_OSX
+    uint64_t sec = time_to_wait_for_wakeup_ns / 1000000000;
+    uint64_t nsec = time_to_wait_for_wakeup_ns % 1000000000;
+#endif
+    struct timespec time_to_wait;
+    time_to_wait.tv_sec = sec;
+    time_to_wait.tv_nsec = nsec;
+    while ((metadata_hub_flush_requested == 0) && (rc != ETIMEDOUT)) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+      rc = pthread_cond_timedwait(&metadata_hub_notify_signal, &metadata_hub_notify_lock,
+                                  &time_to_wait); // this is a pthread cancellation point
+#endif
+#ifdef COMPILE_FOR_OSX
+      rc = pthread_cond_timedwait_relative_np(&metadata_hub_notify_signal,
+                                              &metadata_hub_notify_lock, &time_to_wait);
+#endif
+    }
+    uint32_t changes = metadata_hub_undelivered_changes;
+    metadata_hub_undelivered_changes = 0;
+    metadata_hub_notification_requested = 0;
+    metadata_hub_flush_requested = 0;
+    pthread_mutex_unlock(&metadata_hub_notify_lock);
+
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    pthread_rwlock_rdlock(&metadata_hub_re_lock);
+    run_metadata_watchers(changes);
+    pthread_rwlock_unlock(&metadata_hub_re_lock);
+    pthread_setcancelstate(oldState, NULL);
+
+    pthread_mutex_lock(&metadata_hub_notify_lock);
+  }
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
+
 void metadata_hub_init(void) {
   // debug(1, "Metadata bundle initialisation.");
   memset(&metadata_store, 0, sizeof(metadata_store));
+  if (pthread_create(&metadata_hub_notifier_thread, NULL, metadata_hub_notifier_thread_function,
+                     NULL) == 0)
+    metadata_hub_notifier_running = 1;
+  else
+    debug(1, "Failed to create the metadata hub notifier thread!");
+  if (strcmp(config.cover_art_cache_dir, "") != 0) {
+    if (pthread_create(&cover_art_thread, NULL, cover_art_thread_function, NULL) == 0)
+      cover_art_thread_running = 1;
+    else
+      debug(1, "Failed to create the cover art thread!");
+  }
   metadata_hub_initialised = 1;
 }
 
-void metadata_hub_stop(void) {}
+void metadata_hub_stop(void) {
+  if (cover_art_thread_running) {
+    pthread_cancel(cover_art_thread);
+    pthread_join(cover_art_thread, NULL);
+    cover_art_thread_running = 0;
+  }
+  if (metadata_hub_notifier_running) {
+    pthread_cancel(metadata_hub_notifier_thread);
+    pthread_join(metadata_hub_notifier_thread, NULL);
+    metadata_hub_notifier_running = 0;
+  }
+}
 
 void add_metadata_watcher(metadata_watcher fn, void *userdata) {
   int i;
@@ -92,38 +252,6 @@ void add_metadata_watcher(metadata_watcher fn, void *userdata) {
   }
 }
 
-void run_metadata_watchers(void) {
-  int i;
-  for (i = 0; i < number_of_watchers; i++) {
-    if (metadata_store.watchers[i]) {
-      metadata_store.watchers[i](&metadata_store, metadata_store.watchers_data[i]);
-    }
-  }
-  // turn off changed flags
-  metadata_store.cover_art_pathname_changed = 0;
-  metadata_store.client_ip_changed = 0;
-  metadata_store.client_name_changed = 0;
-  metadata_store.server_ip_changed = 0;
-  metadata_store.progress_string_changed = 0;
-  metadata_store.item_id_changed = 0;
-  metadata_store.item_composite_id_changed = 0;
-  metadata_store.artist_name_changed = 0;
-  metadata_store.album_artist_name_changed = 0;
-  metadata_store.album_name_changed = 0;
-  metadata_store.song_data_kind_changed = 0;
-  metadata_store.track_name_changed = 0;
-  metadata_store.genre_changed = 0;
-  metadata_store.comment_changed = 0;
-  metadata_store.composer_changed = 0;
-  metadata_store.file_kind_changed = 0;
-  metadata_store.song_description_changed = 0;
-  metadata_store.song_album_artist_changed = 0;
-  metadata_store.sort_artist_changed = 0;
-  metadata_store.sort_album_changed = 0;
-  metadata_store.sort_composer_changed = 0;
-  metadata_store.songtime_in_milliseconds_changed = 0;
-}
-
 void metadata_hub_unlock_hub_mutex_cleanup(__attribute__((unused)) void *arg) {
   debug(1, "metadata_hub_unlock_hub_mutex_cleanup called.");
   metadata_hub_modify_epilog(0);
@@ -136,7 +264,10 @@ int metadata_hub_re_lock_access_is_delayed;
 void _metadata_hub_modify_prolog(const char *filename, const int linenumber) {
   // always run this before changing an entry or a sequence of entries in the metadata_hub
   // debug(1, "locking metadata hub for writing");
+  uint64_t profile_wait_start = 0;
   if (pthread_rwlock_trywrlock(&metadata_hub_re_lock) != 0) {
+    if (config.mutex_profiling)
+      profile_wait_start = get_absolute_time_in_ns();
     if (last_metadata_hub_modify_prolog_file)
       debug(2, "Metadata_hub write lock at \"%s:%d\" is already taken at \"%s:%d\" -- must wait.",
             filename, linenumber, last_metadata_hub_modify_prolog_file,
@@ -155,14 +286,33 @@ void _metadata_hub_modify_prolog(const char *filename, const int linenumber) {
     // debug(3, "Metadata_hub write lock acquired.");
   }
   metadata_hub_re_lock_access_is_delayed = 0;
+  if (config.mutex_profiling)
+    mutex_profile_acquired(&metadata_hub_re_lock, "metadata_hub_re_lock", filename, linenumber,
+                           profile_wait_start);
 }
 
 void _metadata_hub_modify_epilog(int modified, const char *filename, const int linenumber) {
   metadata_store.dacp_server_has_been_active =
       metadata_store.dacp_server_active; // set the scanner_has_been_active now.
+  collect_changed_flags(); // flags set without "modified" are delivered with the next change
   if (modified) {
-    run_metadata_watchers();
+    uint32_t changes = metadata_hub_changes;
+    if (changes == 0)
+      changes = MH_CHANGED_OTHER;
+    metadata_hub_changes = 0;
+    if (metadata_hub_notifier_running) {
+      pthread_mutex_lock(&metadata_hub_notify_lock);
+      metadata_hub_undelivered_changes |= changes;
+      metadata_hub_notification_requested = 1;
+      if (metadata_hub_bundle_ended)
+        metadata_hub_flush_requested = 1;
+      pthread_cond_signal(&metadata_hub_notify_signal);
+      pthread_mutex_unlock(&metadata_hub_notify_lock);
+    } else {
+      run_metadata_watchers(changes);
+    }
   }
+  metadata_hub_bundle_ended = 0;
   if (metadata_hub_re_lock_access_is_delayed) {
     if (last_metadata_hub_modify_prolog_file) {
       debug(1, "Metadata_hub write lock taken at \"%s:%d\" is freed at \"%s:%d\".",
@@ -175,6 +325,8 @@ void _metadata_hub_modify_epilog(int modified, const char *filename, const int l
             linenumber);
     }
   }
+  if (config.mutex_profiling)
+    mutex_profile_released(&metadata_hub_re_lock);
   pthread_rwlock_unlock(&metadata_hub_re_lock);
   // debug(3, "Metadata_hub write lock unlocked.");
 }
@@ -196,58 +348,164 @@ void _metadata_hub_read_epilog(const char *filename, const int linenumber) {
   pthread_rwlock_unlock(&metadata_hub_re_lock);
 }
 */
-char *metadata_write_image_file(const char *buf, int len) {
-
-  // warning -- this removes all files from the directory apart from this one, if it exists
-  // it will return a path to the image file allocated with malloc.
-  // free it if you don't need it.
-
-  char *path = NULL;                                 // this will be what is returned
-  if (strcmp(config.cover_art_cache_dir, "") != 0) { // an empty string means do not write the file
-
-    uint8_t img_md5[16];
-    // uint8_t ap_md5[16];
+// Cover art is written to the cover art cache directory by a worker thread, so that the metadata
+// hub thread -- which holds the hub lock while it works -- never waits for the hashing or the
+// file I/O.
+// Files are named after the MD5 of their contents, so if a picture is already in the cache it
+// isn't written again. The cache keeps its files in most-recently-used order and, unless
+// retain_cover_art is set, deletes the least recently used ones until their total size is within
+// cover_art_cache_size_limit; the picture just received is always kept.
+
+typedef struct cover_art_cache_entry {
+  struct cover_art_cache_entry *next; // towards the least recently used
+  char name[64];                      // e.g. "cover-<md5>.jpg"
+  off_t size;
+  time_t mtime; // only used to order the files found in the directory at startup
+} cover_art_cache_entry;
+
+static cover_art_cache_entry *cover_art_cache = NULL; // most recently used first
+static off_t cover_art_cache_total_size = 0;
+static int cover_art_cache_scanned = 0;
+
+static pthread_mutex_t cover_art_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cover_art_pending_signal = PTHREAD_COND_INITIALIZER;
+static char *cover_art_pending = NULL; // the most recent picture not yet taken by the worker
+static int cover_art_pending_length;
+static uint32_t cover_art_generation = 0; // changed when a picture arrives or is withdrawn
+
+static const char *cover_art_prefix = "cover-";
+
+static void cover_art_md5_string(const char *buf, int len, char *img_md5_str) {
+  uint8_t img_md5[16];
 
 #ifdef CONFIG_OPENSSL
-    EVP_MD_CTX *ctx;
-    unsigned int img_md5_len = EVP_MD_size(EVP_md5());
-
-    ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
-    EVP_DigestUpdate(ctx, buf, len);
-    EVP_DigestFinal_ex(ctx, img_md5, &img_md5_len);
-    EVP_MD_CTX_free(ctx);
+  EVP_MD_CTX *ctx;
+  unsigned int img_md5_len = EVP_MD_size(EVP_md5());
+
+  ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+  EVP_DigestUpdate(ctx, buf, len);
+  EVP_DigestFinal_ex(ctx, img_md5, &img_md5_len);
+  EVP_MD_CTX_free(ctx);
 #endif
 
 #ifdef CONFIG_MBEDTLS
 #if MBEDTLS_VERSION_MINOR >= 7
-    mbedtls_md5_context tctx;
-    mbedtls_md5_starts_ret(&tctx);
-    mbedtls_md5_update_ret(&tctx, (const unsigned char *)buf, len);
-    mbedtls_md5_finish_ret(&tctx, img_md5);
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts_ret(&tctx);
+  mbedtls_md5_update_ret(&tctx, (const unsigned char *)buf, len);
+  mbedtls_md5_finish_ret(&tctx, img_md5);
 #else
-    mbedtls_md5_context tctx;
-    mbedtls_md5_starts(&tctx);
-    mbedtls_md5_update(&tctx, (const unsigned char *)buf, len);
-    mbedtls_md5_finish(&tctx, img_md5);
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts(&tctx);
+  mbedtls_md5_update(&tctx, (const unsigned char *)buf, len);
+  mbedtls_md5_finish(&tctx, img_md5);
 #endif
 #endif
 
 #ifdef CONFIG_POLARSSL
-    md5_context tctx;
-    md5_starts(&tctx);
-    md5_update(&tctx, (const unsigned char *)buf, len);
-    md5_finish(&tctx, img_md5);
+  md5_context tctx;
+  md5_starts(&tctx);
+  md5_update(&tctx, (const unsigned char *)buf, len);
+  md5_finish(&tctx, img_md5);
 #endif
 
+  int i;
+  for (i = 0; i < 16; i++)
+    snprintf(&img_md5_str[i * 2], 3, "%02x", (uint8_t)img_md5[i]);
+}
+
+static cover_art_cache_entry *cover_art_cache_add(const char *name, off_t size) {
+  cover_art_cache_entry *entry = calloc(1, sizeof(cover_art_cache_entry));
+  if (entry) {
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->size = size;
+    entry->next = cover_art_cache;
+    cover_art_cache = entry;
+    cover_art_cache_total_size += size;
+  }
+  return entry;
+}
+
+// if it's in the cache, make it the most recently used entry and return it
+static cover_art_cache_entry *cover_art_cache_use(const char *name) {
+  cover_art_cache_entry **p = &cover_art_cache;
+  while ((*p != NULL) && (strcmp((*p)->name, name) != 0))
+    p = &(*p)->next;
+  cover_art_cache_entry *entry = *p;
+  if ((entry != NULL) && (entry != cover_art_cache)) {
+    *p = entry->next;
+    entry->next = cover_art_cache;
+    cover_art_cache = entry;
+  }
+  return entry;
+}
+
+// pick up whatever is already in the directory, newest first, so that it can be reused or evicted
+static void cover_art_cache_scan() {
+  DIR *d = opendir(config.cover_art_cache_dir);
+  if (d == NULL)
+    return;
+  int dir_fd = dirfd(d);
+  struct dirent *dir;
+  while ((dir = readdir(d)) != NULL) {
+    struct stat st;
+    if ((strncmp(dir->d_name, cover_art_prefix, strlen(cover_art_prefix)) == 0) &&
+        (strlen(dir->d_name) < sizeof(((cover_art_cache_entry *)0)->name)) &&
+        (fstatat(dir_fd, dir->d_name, &st, 0) == 0) && (S_ISREG(st.st_mode))) {
+      // insert it in order of modification time, newest first
+      cover_art_cache_entry *entry = cover_art_cache_add(dir->d_name, st.st_size);
+      if (entry) {
+        entry->mtime = st.st_mtime;
+        cover_art_cache = entry->next;
+        cover_art_cache_entry **p = &cover_art_cache;
+        while ((*p != NULL) && ((*p)->mtime >= entry->mtime))
+          p = &(*p)->next;
+        entry->next = *p;
+        *p = entry;
+      }
+    }
+  }
+  closedir(d);
+  debug(2, "Cover art cache \"%s\" holds %" PRId64 " bytes of existing artwork.",
+        config.cover_art_cache_dir, (int64_t)cover_art_cache_total_size);
+}
+
+// delete least recently used files until those apart from the newest are within the limit
+static void cover_art_cache_evict() {
+  if (config.retain_coverart != 0)
+    return;
+  while ((cover_art_cache != NULL) && (cover_art_cache->next != NULL) &&
+         (cover_art_cache_total_size - cover_art_cache->size >
+          config.cover_art_cache_size_limit)) {
+    cover_art_cache_entry **p = &cover_art_cache;
+    while ((*p)->next != NULL)
+      p = &(*p)->next;
+    cover_art_cache_entry *entry = *p;
+    *p = NULL;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", config.cover_art_cache_dir, entry->name);
+    if ((unlink(path) != 0) && (errno != ENOENT))
+      debug(1, "Error %d deleting cover art file \"%s\".", errno, path);
+    cover_art_cache_total_size -= entry->size;
+    free(entry);
+  }
+}
+
+char *metadata_write_image_file(const char *buf, int len) {
+
+  // it will return a path to the image file allocated with malloc.
+  // free it if you don't need it.
+
+  char *path = NULL;                                 // this will be what is returned
+  if (strcmp(config.cover_art_cache_dir, "") != 0) { // an empty string means do not write the file
+
     char img_md5_str[33];
     memset(img_md5_str, 0, sizeof(img_md5_str));
+    cover_art_md5_string(buf, len, img_md5_str);
     char *ext;
     char png[] = "png";
     char jpg[] = "jpg";
-    int i;
-    for (i = 0; i < 16; i++)
-      snprintf(&img_md5_str[i * 2], 3, "%02x", (uint8_t)img_md5[i]);
     // see if the file is a jpeg or a png
     if (strncmp(buf, "\xFF\xD8\xFF", 3) == 0)
       ext = jpg;
@@ -261,69 +519,54 @@ char *metadata_write_image_file(const char *buf, int len) {
     int result = mkpath(config.cover_art_cache_dir, 0777);
     umask(oldumask);
     if ((result == 0) || (result == -EEXIST)) {
-      // see if the file exists by opening it.
-      // if it exists, we're done
-      char *prefix = "cover-";
-
-      size_t pl = strlen(config.cover_art_cache_dir) + 1 + strlen(prefix) + strlen(img_md5_str) +
-                  1 + strlen(ext);
-
+      if (cover_art_cache_scanned == 0) {
+        cover_art_cache_scan();
+        cover_art_cache_scanned = 1;
+      }
+      char name[64];
+      snprintf(name, sizeof(name), "%s%s.%s", cover_art_prefix, img_md5_str, ext);
+      size_t pl = strlen(config.cover_art_cache_dir) + 1 + strlen(name);
       path = malloc(pl + 1);
-      snprintf(path, pl + 1, "%s/%s%s.%s", config.cover_art_cache_dir, prefix, img_md5_str, ext);
-      int cover_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH);
-      if (cover_fd > 0) {
-        // write the contents
-        if (write(cover_fd, buf, len) < len) {
-          warn("Writing cover art file \"%s\" failed!", path);
-          free(path);
-          path = NULL;
-        }
-        close(cover_fd);
-
-        // now delete all other files, if requested
-        if (config.retain_coverart == 0) {
-          DIR *d;
-          struct dirent *dir;
-          d = opendir(config.cover_art_cache_dir);
-          if (d) {
-            int fnl = strlen(prefix) + strlen(img_md5_str) + 1 + strlen(ext) + 1;
-
-            char *full_filename = malloc(fnl);
-            if (full_filename == NULL)
-              die("Can't allocate memory at metadata_write_image_file.");
-            memset(full_filename, 0, fnl);
-            snprintf(full_filename, fnl, "%s%s.%s", prefix, img_md5_str, ext);
-            int dir_fd = open(config.cover_art_cache_dir, O_DIRECTORY);
-            if (dir_fd > 0) {
-              while ((dir = readdir(d)) != NULL) {
-                if (dir->d_type == DT_REG) {
-                  if (strcmp(full_filename, dir->d_name) != 0) {
-                    if (unlinkat(dir_fd, dir->d_name, 0) != 0) {
-                      debug(1, "Error %d deleting cover art file \"%s\".", errno, dir->d_name);
-                    }
-                  }
-                }
-              }
-              if (close(dir_fd) < 0)
-                debug(1, "Error %d closing directory \"%s\"", errno, config.cover_art_cache_dir);
-            } else {
-              debug(1, "Can't open the directory \"%s\" for deletion -- error %d.",
-                    config.cover_art_cache_dir, errno);
-            }
-            free(full_filename);
-            closedir(d);
+      if (path == NULL)
+        die("Can't allocate memory at metadata_write_image_file.");
+      snprintf(path, pl + 1, "%s/%s", config.cover_art_cache_dir, name);
+
+      cover_art_cache_entry *entry = cover_art_cache_use(name);
+      if ((entry != NULL) && (access(path, F_OK) != 0)) {
+        // someone has deleted it behind our backs -- forget it and write it again
+        cover_art_cache = entry->next;
+        cover_art_cache_total_size -= entry->size;
+        free(entry);
+        entry = NULL;
+      }
+      if (entry == NULL) {
+        // write it to a temporary file and rename it, so that nobody sees a partial file
+        char *temp_path = malloc(pl + 8);
+        if (temp_path == NULL)
+          die("Can't allocate memory at metadata_write_image_file.");
+        snprintf(temp_path, pl + 8, "%s.part", path);
+        int cover_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRGRP | S_IROTH);
+        if (cover_fd >= 0) {
+          int written = write(cover_fd, buf, len);
+          close(cover_fd);
+          if ((written == len) && (rename(temp_path, path) == 0)) {
+            cover_art_cache_add(name, len);
+          } else {
+            warn("Writing cover art file \"%s\" failed!", path);
+            unlink(temp_path);
+            free(path);
+            path = NULL;
           }
-        }
-      } else {
-        //      if (errno == EEXIST)
-        //        debug(1, "Cover art file \"%s\" already exists!", path);
-        //      else {
-        if (errno != EEXIST) {
-          warn("Could not open file \"%s\" for writing cover art", path);
+        } else {
+          warn("Could not open file \"%s\" for writing cover art", temp_path);
           free(path);
           path = NULL;
         }
+        free(temp_path);
+      } else {
+        debug(3, "Cover art \"%s\" is already in the cache.", name);
       }
+      cover_art_cache_evict();
     } else {
       debug(1, "Couldn't access or create the cover art cache directory \"%s\".",
             config.cover_art_cache_dir);
@@ -332,6 +575,60 @@ char *metadata_write_image_file(const char *buf, int len) {
   return path;
 }
 
+static void cover_art_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&cover_art_lock);
+}
+
+static void *cover_art_thread_function(__attribute__((unused)) void *arg) {
+  TRACE_THREAD_NAME("cover art");
+  while (1) {
+    pthread_mutex_lock(&cover_art_lock);
+    pthread_cleanup_push(cover_art_thread_cleanup_handler, NULL);
+    while (cover_art_pending == NULL)
+      pthread_cond_wait(&cover_art_pending_signal, &cover_art_lock);
+    pthread_cleanup_pop(0);
+    char *picture = cover_art_pending;
+    int length = cover_art_pending_length;
+    uint32_t generation = cover_art_generation;
+    cover_art_pending = NULL;
+    pthread_mutex_unlock(&cover_art_lock);
+
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
+    char uri[2048];
+    uri[0] = '\0';
+    char *pathname = metadata_write_image_file(picture, length);
+    if (pathname) {
+      snprintf(uri, sizeof(uri), "file://%s", pathname);
+      free(pathname);
+    }
+    free(picture);
+    // publish it, unless a newer picture has arrived or the picture has been withdrawn meanwhile
+    metadata_hub_modify_prolog();
+    int changed = 0;
+    if (generation == __sync_fetch_and_add(&cover_art_generation, 0))
+      changed = string_update(&metadata_store.cover_art_pathname,
+                              &metadata_store.cover_art_pathname_changed, uri);
+    metadata_hub_modify_epilog(changed);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_exit(NULL);
+}
+
+// hand a picture to the worker, replacing any it hasn't got to yet; takes ownership of picture
+// call with the metadata hub locked
+static void cover_art_submit(char *picture, int length) {
+  pthread_mutex_lock(&cover_art_lock);
+  __sync_fetch_and_add(&cover_art_generation, 1);
+  if (cover_art_pending)
+    free(cover_art_pending);
+  cover_art_pending = picture;
+  cover_art_pending_length = length;
+  if (picture)
+    pthread_cond_signal(&cover_art_pending_signal);
+  pthread_mutex_unlock(&cover_art_lock);
+}
+
 int metadata_packet_item_changed = 0; // set if any parsed part of a metadata stream changes
 
 void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length) {
@@ -537,30 +834,30 @@ void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uin
       else
         debug(2, "MH Metadata stream processing end without changes.");
       changed = metadata_packet_item_changed;
+      metadata_hub_bundle_ended = 1;
       break;
     case 'PICT':
       debug(2, "MH Picture received, length %u bytes.", length);
 
-      char uri[2048];
-      if ((length > 16) &&
-          (strcmp(config.cover_art_cache_dir, "") != 0)) { // if it's okay to write the file
-                                                           // make this uncancellable
-        int oldState;
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
-        char *pathname = metadata_write_image_file(data, length);
-        snprintf(uri, sizeof(uri), "file://%s", pathname);
-        free(pathname);
-        pthread_setcancelstate(oldState, NULL);
-
+      if ((length > 16) && (cover_art_thread_running != 0)) { // if it's okay to write the file
+        // the worker will set the cover art pathname when it has the file
+        char *picture = malloc(length);
+        if (picture) {
+          memcpy(picture, data, length);
+          cover_art_submit(picture, length);
+        } else {
+          debug(1, "Can't allocate %u bytes for cover art.", length);
+        }
+        changed = 0;
       } else {
-        uri[0] = '\0';
+        cover_art_submit(NULL, 0); // withdraw any picture not yet written
+        if (string_update(&metadata_store.cover_art_pathname,
+                          &metadata_store.cover_art_pathname_changed,
+                          "")) // if the picture's file path is different from the stored one...
+          changed = 1;
+        else
+          changed = 0;
       }
-      if (string_update(&metadata_store.cover_art_pathname,
-                        &metadata_store.cover_art_pathname_changed,
-                        uri)) // if the picture's file path is different from the stored one...
-        changed = 1;
-      else
-        changed = 0;
       //      pthread_cleanup_pop(0); // don't remove the lock -- it'll have been done
       break;
     case 'clip':
@@ -37,6 +37,45 @@ struct metadata_bundle;
 
 typedef void (*metadata_watcher)(struct metadata_bundle *argc, void *userdata);
 
+// bits in changed_fields, which tells watchers what has changed since they were last called
+#define MH_CHANGED_CLIENT_IP (1U << 0)
+#define MH_CHANGED_CLIENT_NAME (1U << 1)
+#define MH_CHANGED_SERVER_IP (1U << 2)
+#define MH_CHANGED_STREAM_TYPE (1U << 3)
+#define MH_CHANGED_PROGRESS_STRING (1U << 4)
+#define MH_CHANGED_FRAME_POSITION_STRING (1U << 5)
+#define MH_CHANGED_FIRST_FRAME_POSITION_STRING (1U << 6)
+#define MH_CHANGED_COVER_ART_PATHNAME (1U << 7)
+#define MH_CHANGED_ITEM_ID (1U << 8)
+#define MH_CHANGED_ITEM_COMPOSITE_ID (1U << 9)
+#define MH_CHANGED_SONG_DATA_KIND (1U << 10)
+#define MH_CHANGED_TRACK_NAME (1U << 11)
+#define MH_CHANGED_ARTIST_NAME (1U << 12)
+#define MH_CHANGED_ALBUM_ARTIST_NAME (1U << 13)
+#define MH_CHANGED_ALBUM_NAME (1U << 14)
+#define MH_CHANGED_GENRE (1U << 15)
+#define MH_CHANGED_COMMENT (1U << 16)
+#define MH_CHANGED_COMPOSER (1U << 17)
+#define MH_CHANGED_FILE_KIND (1U << 18)
+#define MH_CHANGED_SONG_DESCRIPTION (1U << 19)
+#define MH_CHANGED_SONG_ALBUM_ARTIST (1U << 20)
+#define MH_CHANGED_SORT_NAME (1U << 21)
+#define MH_CHANGED_SORT_ARTIST (1U << 22)
+#define MH_CHANGED_SORT_ALBUM (1U << 23)
+#define MH_CHANGED_SORT_COMPOSER (1U << 24)
+#define MH_CHANGED_SONGTIME_IN_MILLISECONDS (1U << 25)
+// something without a _changed flag, such as the player state or the volume
+#define MH_CHANGED_OTHER (1U << 31)
+
+// the fields that make up the track metadata
+#define MH_CHANGED_TRACK_METADATA                                                                  \
+  (MH_CHANGED_COVER_ART_PATHNAME | MH_CHANGED_ITEM_ID | MH_CHANGED_ITEM_COMPOSITE_ID |             \
+   MH_CHANGED_SONG_DATA_KIND | MH_CHANGED_TRACK_NAME | MH_CHANGED_ARTIST_NAME |                    \
+   MH_CHANGED_ALBUM_ARTIST_NAME | MH_CHANGED_ALBUM_NAME | MH_CHANGED_GENRE | MH_CHANGED_COMMENT |  \
+   MH_CHANGED_COMPOSER | MH_CHANGED_FILE_KIND | MH_CHANGED_SONG_DESCRIPTION |                      \
+   MH_CHANGED_SONG_ALBUM_ARTIST | MH_CHANGED_SORT_NAME | MH_CHANGED_SORT_ARTIST |                  \
+   MH_CHANGED_SORT_ALBUM | MH_CHANGED_SORT_COMPOSER | MH_CHANGED_SONGTIME_IN_MILLISECONDS)
+
 typedef struct metadata_bundle {
 
   char *client_ip; // IP number used by the audio source (i.e. the "client"), which is also the DACP
@@ -149,6 +188,8 @@ typedef struct metadata_bundle {
                       // speaker volume control
   double airplay_volume;
 
+  uint32_t changed_fields; // MH_CHANGED_ bits -- only valid while the watchers are being called
+
   metadata_watcher watchers[number_of_watchers]; // functions to call if the metadata is changed.
   void *watchers_data[number_of_watchers];       // their individual data
 
@@ -163,6 +163,10 @@ void mpris_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused)
 
   */
 
+  // only rebuild the metadata if some of it may have changed
+  if ((argc->changed_fields & (MH_CHANGED_TRACK_METADATA | MH_CHANGED_OTHER)) == 0)
+    return;
+
   // Build the metadata array
   debug(2, "Build metadata");
   GVariantBuilder *dict_builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
@@ -22,7 +22,7 @@
 
 #define NQPTP_INTERFACE_NAME "/nqptp"
 
-#define NQPTP_SHM_STRUCTURES_VERSION 10
+#define NQPTP_SHM_STRUCTURES_VERSION 11
 #define NQPTP_CONTROL_PORT 9000
 
 // The control port expects a UDP packet with the first character being a command letter
@@ -63,16 +63,28 @@ typedef struct {
 } shm_structure_set;
 
 // The actual interface comprises a shared memory region of type struct shm_structure.
-// This comprises two records of type shm_structure_set.
-// The secondary record is written strictly after all writes to the main record are
-// complete. This is ensured using the __sync_synchronize() construct.
-// The reader should ensure that both copies match for a read to be valid.
+// This comprises two records of type shm_structure_set and a sequence number.
+
+// From version 11, the sequence number makes the interface a seqlock:
+// the writer increments the sequence number (making it odd) before it starts
+// updating the main record and increments it again (making it even) when all
+// writes to the main record are complete.
+// The reader reads the sequence number, then the main record, then the sequence number again.
+// The read is valid if both readings of the sequence number are the same and even.
+// Furthermore, if the sequence number hasn't changed since a previous valid read,
+// the record hasn't changed either, so the previous copy can be reused.
+// Strict write and read ordering is ensured using the __sync_synchronize() construct.
+
+// Up to version 10, the secondary record is written strictly after all writes to the main record
+// are complete. The reader should ensure that both copies match for a read to be valid.
 // For safety, the secondary record should be read strictly after the first.
+// The secondary record continues to be written from version 11 onwards.
 
 struct shm_structure {
   uint16_t version; // check this is equal to NQPTP_SHM_STRUCTURES_VERSION
   shm_structure_set main;
   shm_structure_set secondary;
+  uint32_t sequence_number; // version 11 onwards -- odd while the main record is being updated
 };
 
 #endif
@@ -737,6 +737,30 @@ pair_decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *cipherte
   return cctx->type->pair_decrypt(plaintext, plaintext_len, ciphertext, ciphertext_len, cctx);
 }
 
+ssize_t
+pair_encrypt_buf(uint8_t *ciphertext, size_t ciphertext_size, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
+{
+  if (!cctx->type->pair_encrypt_buf)
+    {
+      cctx->errmsg = "Encryption unsupported";
+      return -1;
+    }
+
+  return cctx->type->pair_encrypt_buf(ciphertext, ciphertext_size, ciphertext_len, plaintext, plaintext_len, cctx);
+}
+
+ssize_t
+pair_decrypt_buf(uint8_t *plaintext, size_t plaintext_size, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
+{
+  if (!cctx->type->pair_decrypt_buf)
+    {
+      cctx->errmsg = "Decryption unsupported";
+      return -1;
+    }
+
+  return cctx->type->pair_decrypt_buf(plaintext, plaintext_size, plaintext_len, ciphertext, ciphertext_len, cctx);
+}
+
 void
 pair_encrypt_rollback(struct pair_cipher_context *cctx)
 {
@@ -157,7 +157,8 @@ pair_setup_response3(struct pair_setup_context *sctx, const uint8_t *in, size_t
  * If set, the callback is made as part of pair_verify_response2. The job of the
  * callback is to fill out the public_key with the public key from the setup
  * stage (see 'struct pair_result'). If the client device id is not known (i.e.
- * it has not completed pair-setup), return -1.
+ * it has not completed pair-setup), return -1 to refuse it, or return 1 to let
+ * it through without verifying its signature, as if the callback were NULL.
  */
 struct pair_verify_context *
 pair_verify_new(enum pair_type type, const char *client_setup_keys, pair_cb get_cb, void *cb_arg, const char *device_id);
@@ -227,6 +228,22 @@ pair_encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaint
 ssize_t
 pair_decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
 
+/* As pair_encrypt, but the ciphertext is written to a buffer of
+ * ciphertext_size bytes supplied by the caller, so nothing is allocated. Only
+ * the blocks that fit in the buffer are encrypted, so the return value may be
+ * less than plaintext_len even when there is no error. The buffer should have
+ * room for at least one full block (1042 bytes with the homekit ciphers).
+ */
+ssize_t
+pair_encrypt_buf(uint8_t *ciphertext, size_t ciphertext_size, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx);
+
+/* As pair_decrypt, but the plaintext is written to a buffer of plaintext_size
+ * bytes supplied by the caller. Only the complete blocks whose plaintext fits
+ * in the buffer are decrypted.
+ */
+ssize_t
+pair_decrypt_buf(uint8_t *plaintext, size_t plaintext_size, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
+
 /* Rolls back the nonce
  */
 void
@@ -2580,6 +2580,8 @@ server_verify_request2(struct pair_verify_context *handle, const uint8_t *data,
           handle->status = PAIR_STATUS_AUTH_FAILED;
           goto out;
         }
+      else if (ret > 0)
+        goto out; // Unknown device that the callback lets through unverified
 
       ret = verify_info(signature->value, client_public_key, vctx->client_eph_public_key, sizeof(vctx->client_eph_public_key),
                         device_id->value, device_id->size, vctx->server_eph_public_key, sizeof(vctx->server_eph_public_key));
@@ -2942,34 +2944,30 @@ cipher_new(struct pair_definition *type, int channel, const uint8_t *shared_secr
 }
 
 static ssize_t
-encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
+encrypt_buf(uint8_t *ciphertext, size_t ciphertext_size, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
 {
   uint8_t nonce[NONCE_LENGTH] = { 0 };
   uint8_t tag[AUTHTAG_LENGTH];
   const uint8_t *plain_block;
   uint8_t *cipher_block;
   uint16_t block_len;
-  int nblocks;
   int ret;
-  int i;
 
-  if (plaintext_len == 0 || !plaintext)
+  if (plaintext_len == 0 || !plaintext || !ciphertext)
     return -1;
 
   // Encryption is done in blocks, where each block consists of a short, the
   // encrypted data and an auth tag. The short is the size of the encrypted
   // data. The encrypted data in the block cannot exceed ENCRYPTED_LEN_MAX.
-  nblocks = 1 + ((plaintext_len - 1) / ENCRYPTED_LEN_MAX); // Ceiling of division
-
-  *ciphertext_len = nblocks * (sizeof(block_len) + AUTHTAG_LENGTH) + plaintext_len;
-  *ciphertext = malloc(*ciphertext_len);
-
+  // Only the blocks that fit in the caller's buffer are encrypted.
   cctx->encryption_counter_prev = cctx->encryption_counter;
 
-  for (i = 0, plain_block = plaintext, cipher_block = *ciphertext; i < nblocks; i++)
+  for (plain_block = plaintext, cipher_block = ciphertext; plain_block < plaintext + plaintext_len; )
     {
       // If it is the last block we will encrypt only the remaining data
-      block_len = (i + 1 == nblocks) ? (plaintext + plaintext_len - plain_block) : ENCRYPTED_LEN_MAX;
+      block_len = (plaintext + plaintext_len - plain_block > ENCRYPTED_LEN_MAX) ? ENCRYPTED_LEN_MAX : (plaintext + plaintext_len - plain_block);
+      if (cipher_block + block_len + sizeof(block_len) + AUTHTAG_LENGTH > ciphertext + ciphertext_size)
+	break;
 
       memcpy(nonce + 4, &(cctx->encryption_counter), sizeof(cctx->encryption_counter));// TODO BE or LE?
 
@@ -2980,7 +2978,6 @@ encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext,
 	{
 	  cctx->errmsg = "Encryption with chacha poly1305 failed";
 	  cctx->encryption_counter = cctx->encryption_counter_prev;
-	  free(*ciphertext);
 	  return -1;
 	}
       memcpy(cipher_block + sizeof(block_len) + block_len, tag, AUTHTAG_LENGTH);
@@ -2990,15 +2987,44 @@ encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext,
       cctx->encryption_counter++;
     }
 
+  *ciphertext_len = cipher_block - ciphertext;
+
 #ifdef DEBUG_PAIR
-  hexdump("Encrypted:\n", *ciphertext, *ciphertext_len);
+  hexdump("Encrypted:\n", ciphertext, *ciphertext_len);
 #endif
 
   return plain_block - plaintext;
 }
 
 static ssize_t
-decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
+encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
+{
+  size_t ciphertext_size;
+  int nblocks;
+  ssize_t ret;
+
+  if (plaintext_len == 0 || !plaintext)
+    return -1;
+
+  nblocks = 1 + ((plaintext_len - 1) / ENCRYPTED_LEN_MAX); // Ceiling of division
+
+  ciphertext_size = nblocks * (sizeof(uint16_t) + AUTHTAG_LENGTH) + plaintext_len;
+  *ciphertext = malloc(ciphertext_size);
+  if (!*ciphertext)
+    {
+      cctx->errmsg = "Out of memory for ciphertext";
+      return -1;
+    }
+
+  ret = encrypt_buf(*ciphertext, ciphertext_size, ciphertext_len, plaintext, plaintext_len, cctx);
+  if (ret < 0)
+    free(*ciphertext);
+
+  return ret;
+}
+
+static ssize_t
+decrypt_buf(uint8_t *plaintext, size_t plaintext_size, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
 {
   uint8_t nonce[NONCE_LENGTH] = { 0 };
   uint8_t tag[AUTHTAG_LENGTH];
@@ -3007,16 +3033,12 @@ decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, s
   uint16_t block_len;
   int ret;
 
-  if (ciphertext_len < sizeof(block_len) || !ciphertext)
+  if (ciphertext_len < sizeof(block_len) || !ciphertext || !plaintext)
     return -1;
 
-  // This will allocate more than we need. Since we don't know the number of
-  // blocks in the ciphertext yet we can't calculate the exact required length.
-  *plaintext = malloc(ciphertext_len);
-
   cctx->decryption_counter_prev = cctx->decryption_counter;
 
-  for (plain_block = *plaintext, cipher_block = ciphertext; cipher_block < ciphertext + ciphertext_len; )
+  for (plain_block = plaintext, cipher_block = ciphertext; cipher_block + sizeof(block_len) <= ciphertext + ciphertext_len; )
     {
       memcpy(&block_len, cipher_block, sizeof(block_len)); // TODO BE or LE?
       if (cipher_block + block_len + sizeof(block_len) + AUTHTAG_LENGTH > ciphertext + ciphertext_len)
@@ -3024,6 +3046,11 @@ decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, s
 	  // The remaining ciphertext doesn't contain an entire block, so stop
 	  break;
 	}
+      if (plain_block + block_len > plaintext + plaintext_size)
+	{
+	  // No room for this block in the caller's buffer, so stop
+	  break;
+	}
 
       memcpy(tag, cipher_block + sizeof(block_len) + block_len, sizeof(tag));
       memcpy(nonce + 4, &(cctx->decryption_counter), sizeof(cctx->decryption_counter));// TODO BE or LE?
@@ -3033,7 +3060,6 @@ decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, s
 	{
 	  cctx->errmsg = "Decryption with chacha poly1305 failed";
 	  cctx->decryption_counter = cctx->decryption_counter_prev;
-	  free(*plaintext);
 	  return -1;
 	}
 
@@ -3042,15 +3068,39 @@ decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, s
       cctx->decryption_counter++;
     }
 
-  *plaintext_len = plain_block - *plaintext;
+  *plaintext_len = plain_block - plaintext;
 
 #ifdef DEBUG_PAIR
-  hexdump("Decrypted:\n", *plaintext, *plaintext_len);
+  hexdump("Decrypted:\n", plaintext, *plaintext_len);
 #endif
 
   return cipher_block - ciphertext;
 }
 
+static ssize_t
+decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
+{
+  ssize_t ret;
+
+  if (ciphertext_len < sizeof(uint16_t) || !ciphertext)
+    return -1;
+
+  // This will allocate more than we need. Since we don't know the number of
+  // blocks in the ciphertext yet we can't calculate the exact required length.
+  *plaintext = malloc(ciphertext_len);
+  if (!*plaintext)
+    {
+      cctx->errmsg = "Out of memory for plaintext";
+      return -1;
+    }
+
+  ret = decrypt_buf(*plaintext, ciphertext_len, plaintext_len, ciphertext, ciphertext_len, cctx);
+  if (ret < 0)
+    free(*plaintext);
+
+  return ret;
+}
+
 static int
 state_get(const char **errmsg, const uint8_t *data, size_t data_len)
 {
@@ -3120,6 +3170,8 @@ const struct pair_definition pair_client_homekit_normal =
 
   .pair_encrypt = encrypt,
   .pair_decrypt = decrypt,
+  .pair_encrypt_buf = encrypt_buf,
+  .pair_decrypt_buf = decrypt_buf,
 
   .pair_state_get = state_get,
 };
@@ -3150,6 +3202,8 @@ const struct pair_definition pair_client_homekit_transient =
 
   .pair_encrypt = encrypt,
   .pair_decrypt = decrypt,
+  .pair_encrypt_buf = encrypt_buf,
+  .pair_decrypt_buf = decrypt_buf,
 
   .pair_state_get = state_get,
 };
@@ -3184,6 +3238,8 @@ const struct pair_definition pair_server_homekit =
 
   .pair_encrypt = encrypt,
   .pair_decrypt = decrypt,
+  .pair_encrypt_buf = encrypt_buf,
+  .pair_decrypt_buf = decrypt_buf,
 
   .pair_state_get = state_get,
   .pair_public_key_get = public_key_get,
@@ -86,6 +86,7 @@
 #include "player.h"
 #include "rtp.h"
 #include "rtsp.h"
+#include "trace.h"
 
 #include "alac.h"
 
@@ -461,22 +462,10 @@ void get_audio_buffer_size_and_occupancy(unsigned int *size, unsigned int *occup
   debug_mutex_unlock(&conn->ab_mutex, 0);
 }
 
-void player_put_packet(int original_format, seq_t seqno, uint32_t actual_timestamp, uint8_t *data,
-                       int len, rtsp_conn_info *conn) {
-
-  // if it's original format, it has a valid seqno and must be decoded
-  // otherwise, it can take the next seqno and doesn't need decoding.
-
-  // ignore a request to flush that has been made before the first packet...
-  if (conn->packet_count == 0) {
-    debug_mutex_lock(&conn->flush_mutex, 1000, 1);
-    conn->flush_requested = 0;
-    conn->flush_rtp_timestamp = 0;
-    debug_mutex_unlock(&conn->flush_mutex, 3);
-  }
-
-  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
-  uint64_t time_now = get_absolute_time_in_ns();
+// store a packet in the audio buffer -- the ab_mutex must be held
+static void put_packet_in_buffer(int original_format, seq_t seqno, uint32_t actual_timestamp,
+                                 uint8_t *data, int len, uint64_t time_now,
+                                 rtsp_conn_info *conn) {
   conn->packet_count++;
   conn->packet_count_since_flush++;
   conn->time_of_last_audio_packet = time_now;
@@ -560,7 +549,32 @@ void player_put_packet(int original_format, seq_t seqno, uint32_t actual_timesta
         abuf->sequence_number = 0;
       }
     }
+  }
+}
+
+void player_put_packets(int original_format, player_packet_t *packets, int count,
+                        rtsp_conn_info *conn) {
+
+  // if it's original format, it has a valid seqno and must be decoded
+  // otherwise, it can take the next seqno and doesn't need decoding.
+
+  // ignore a request to flush that has been made before the first packet...
+  if (conn->packet_count == 0) {
+    debug_mutex_lock(&conn->flush_mutex, 1000, 1);
+    conn->flush_requested = 0;
+    conn->flush_rtp_timestamp = 0;
+    debug_mutex_unlock(&conn->flush_mutex, 3);
+  }
 
+  uint64_t trace_start = TRACE_TIME();
+  // take the ab_mutex once for the whole batch
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  uint64_t time_now = get_absolute_time_in_ns();
+  int i;
+  for (i = 0; i < count; i++)
+    put_packet_in_buffer(original_format, packets[i].seqno, packets[i].timestamp,
+                         packets[i].data, packets[i].len, time_now, conn);
+  if (conn->connection_state_to_output) {
     int rc = pthread_cond_signal(&conn->flowcontrol);
     if (rc)
       debug(1, "Error signalling flowcontrol.");
@@ -666,6 +680,17 @@ void player_put_packet(int original_format, seq_t seqno, uint32_t actual_timesta
     }
   }
   debug_mutex_unlock(&conn->ab_mutex, 0);
+  TRACE_COMPLETE("player_put_packets", trace_start, count);
+}
+
+void player_put_packet(int original_format, seq_t seqno, uint32_t actual_timestamp, uint8_t *data,
+                       int len, rtsp_conn_info *conn) {
+  player_packet_t packet;
+  packet.seqno = seqno;
+  packet.timestamp = actual_timestamp;
+  packet.data = data;
+  packet.len = len;
+  player_put_packets(original_format, &packet, 1, conn);
 }
 
 int32_t rand_in_range(int32_t exclusive_range_limit) {
@@ -1896,6 +1921,7 @@ void player_thread_cleanup_handler(void *arg) {
 
 void *player_thread_func(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  TRACE_THREAD_NAME("player");
 #ifdef CONFIG_METADATA
   uint64_t time_of_last_metadata_progress_update =
       0; // the assignment is to stop a compiler warning...
@@ -2174,6 +2200,15 @@ void *player_thread_func(void *arg) {
   int sync_error_out_of_bounds =
       0; // number of times in a row that there's been a serious sync error
 
+#ifdef CONFIG_AIRPLAY_2
+  // when drift is corrected in the buffered audio processor's resampler, a correction only
+  // shows up here, as a step in the packet rtptimes, once the audio has come through the buffer,
+  // so keep track of the corrections requested that haven't yet arrived
+  int64_t resampler_frames_in_flight = 0;
+  uint32_t resampler_expected_rtptime = 0;
+  int resampler_expected_rtptime_is_valid = 0;
+#endif
+
   conn->statistics = malloc(sizeof(stats_t) * trend_interval);
   if (conn->statistics == NULL)
     die("Failed to allocate a statistics buffer");
@@ -2271,8 +2306,10 @@ void *player_thread_func(void *arg) {
       debug(1, "conn->input_bytes_per_frame is zero!");
 
     pthread_testcancel();                     // allow a pthread_cancel request to take effect.
+    uint64_t trace_start = TRACE_TIME();
     abuf_t *inframe = buffer_get_frame(conn); // this has cancellation point(s), but it's not
                                               // guaranteed that they'll always be executed
+    TRACE_COMPLETE("buffer_get_frame", trace_start, inframe ? inframe->given_timestamp : 0);
     uint64_t local_time_now = get_absolute_time_in_ns(); // types okay
     config.last_access_to_volume_info_time =
         local_time_now; // ensure volume info remains seen as valid
@@ -2475,6 +2512,24 @@ void *player_thread_func(void *arg) {
 
           int amount_to_stuff = 0;
 
+#ifdef CONFIG_AIRPLAY_2
+          int resampler_frames_to_stuff = 0;
+          if (conn->resampler_drift_correction) {
+            if (inframe->given_timestamp != 0) {
+              if (resampler_expected_rtptime_is_valid) {
+                int32_t frames_inserted = resampler_expected_rtptime - inframe->given_timestamp;
+                // anything bigger is a flush or a missing packet, not a correction
+                if ((frames_inserted >= -64) && (frames_inserted <= 64))
+                  resampler_frames_in_flight -= frames_inserted;
+              }
+              resampler_expected_rtptime = inframe->given_timestamp + inframe->length;
+              resampler_expected_rtptime_is_valid = 1;
+            } else {
+              resampler_expected_rtptime_is_valid = 0;
+            }
+          }
+#endif
+
           // check sequencing
           if (conn->last_seqno_read == -1)
             conn->last_seqno_read =
@@ -2656,6 +2711,17 @@ void *player_thread_func(void *arg) {
               } else {
                 inform("No frames received in the last sampling interval.");
               }
+              if (config.mutex_profiling) {
+                char mutex_profile[4096];
+                if (mutex_profile_report(mutex_profile, sizeof(mutex_profile), 5) != 0) {
+                  char *saveptr = NULL;
+                  char *profile_line = strtok_r(mutex_profile, "\n", &saveptr);
+                  while (profile_line != NULL) {
+                    inform("Lock profile: %s", profile_line);
+                    profile_line = strtok_r(NULL, "\n", &saveptr);
+                  }
+                }
+              }
             }
 #ifdef CONFIG_AIRPLAY_2
             conn->ap2_audio_buffer_minimum_size = -1;
@@ -2945,6 +3011,13 @@ void *player_thread_func(void *arg) {
               }
               */
 
+              // allow for corrections that are on their way through the resampler
+              int64_t sync_error_to_correct = sync_error;
+#ifdef CONFIG_AIRPLAY_2
+              if (conn->resampler_drift_correction)
+                sync_error_to_correct += resampler_frames_in_flight;
+#endif
+
               if (amount_to_stuff == 0) {
                 // use a "V" shaped function to decide if stuffing should occur
                 int64_t s = r64i();
@@ -2953,11 +3026,11 @@ void *player_thread_func(void *arg) {
                 s = (s >> 32) + config.tolerance * config.output_rate; // should be a number from 0
                                                                        // to config.tolerance *
                                                                        // config.output_rate;
-                if ((sync_error > 0) && (sync_error > s)) {
+                if ((sync_error_to_correct > 0) && (sync_error_to_correct > s)) {
                   // debug(1,"Extra stuff -1");
                   amount_to_stuff = -1;
                 }
-                if ((sync_error < 0) && (sync_error < (-s))) {
+                if ((sync_error_to_correct < 0) && (sync_error_to_correct < (-s))) {
                   // debug(1,"Extra stuff +1");
                   amount_to_stuff = 1;
                 }
@@ -2990,6 +3063,18 @@ void *player_thread_func(void *arg) {
               if (config.no_sync != 0)
                 amount_to_stuff = 0; // no stuffing if it's been disabled
 
+#ifdef CONFIG_AIRPLAY_2
+              // pass the correction back to the buffered audio processor rather than stuffing here
+              if (conn->resampler_drift_correction) {
+                if (amount_to_stuff) {
+                  __sync_fetch_and_add(&conn->resampler_frames_to_stuff, amount_to_stuff);
+                  resampler_frames_in_flight += amount_to_stuff;
+                  resampler_frames_to_stuff = amount_to_stuff;
+                }
+                amount_to_stuff = 0;
+              }
+#endif
+
               // Apply DSP here
 
               // check the state of loudness and convolution flags here and don't change them for
@@ -3082,6 +3167,10 @@ void *player_thread_func(void *arg) {
                                                     amount_to_stuff, conn->enable_dither, conn);
               }
 #endif
+#ifdef CONFIG_AIRPLAY_2
+              if (conn->resampler_drift_correction)
+                conn->amountStuffed = resampler_frames_to_stuff; // for the statistics
+#endif
 
               /*
               {
@@ -3111,8 +3200,10 @@ void *player_thread_func(void *arg) {
                   uint64_t should_be_time;
                   frame_to_local_time(inframe->given_timestamp, &should_be_time, conn);
 
+                  uint64_t play_start = TRACE_TIME();
                   config.output->play(conn->outbuf, play_samples, play_samples_are_timed,
                                       inframe->given_timestamp, should_be_time);
+                  TRACE_COMPLETE("output play", play_start, play_samples);
 #ifdef CONFIG_METADATA
                   // debug(1,"config.metadata_progress_interval is %f.",
                   // config.metadata_progress_interval);
@@ -3189,8 +3280,10 @@ void *player_thread_func(void *arg) {
               }
               uint64_t should_be_time;
               frame_to_local_time(inframe->given_timestamp, &should_be_time, conn);
+              uint64_t play_start = TRACE_TIME();
               config.output->play(conn->outbuf, play_samples, play_samples_are_timed,
                                   inframe->given_timestamp, should_be_time);
+              TRACE_COMPLETE("output play", play_start, play_samples);
 #ifdef CONFIG_METADATA
               // debug(1,"config.metadata_progress_interval is %f.",
               // config.metadata_progress_interval);
@@ -3545,6 +3638,7 @@ void player_volume(double airplay_volume, rtsp_conn_info *conn) {
 void do_flush(uint32_t timestamp, rtsp_conn_info *conn) {
 
   debug(3, "do_flush: flush to %u.", timestamp);
+  TRACE_INSTANT("flush", timestamp);
   debug_mutex_lock(&conn->flush_mutex, 1000, 1);
   conn->flush_requested = 1;
   conn->flush_rtp_timestamp = timestamp; // flush all packets up to, but not including, this one.
@@ -23,6 +23,7 @@
 
 #ifdef CONFIG_AIRPLAY_2
 #include "pair_ap/pair.h"
+#include "ptp-utilities.h"
 #include <plist/plist.h>
 #endif
 
@@ -40,6 +41,8 @@ typedef struct time_ping_record {
   uint64_t remote_time;
   int sequence_number;
   int chosen;
+  int in_fit;                  // chosen and included in the drift calculation
+  double aged_dispersion_key; // orders records by their aged dispersion -- see rtp.c
 } time_ping_record;
 
 // these are for reporting the status of the clock
@@ -71,6 +74,13 @@ typedef struct audio_buffer_entry { // decoded audio packets
   int length;                   // the length of the decoded data
 } abuf_t;
 
+typedef struct { // an incoming packet, as passed to player_put_packets()
+  seq_t seqno;
+  uint32_t timestamp;
+  uint8_t *data;
+  int len;
+} player_packet_t;
+
 typedef struct stats { // statistics for running averages
   int64_t sync_error, correction, drift;
 } stats_t;
@@ -111,21 +121,41 @@ typedef enum {
   classic_airplay_stream
 } airplay_stream_c; // "c" for category
 
+// An affine mapping between frames and local times, rebuilt when the timing information it was
+// derived from changes. Rates are fixed point: ns_per_frame has 32 fraction bits and
+// frames_per_ns, which is always less than one, has 64.
+typedef struct {
+  int valid;
+  int is_ptp;
+  uint32_t epoch;               // the connection's timing_epoch when it was built
+  uint32_t ptp_sequence_number; // the NQPTP record it was built from; zero means don't reuse
+  uint32_t input_rate;
+  uint32_t origin_frame;
+  uint64_t origin_time; // the local time of origin_frame
+  uint64_t ns_per_frame;
+  uint64_t frames_per_ns;
+} frame_time_mapping_t;
+
 #ifdef CONFIG_AIRPLAY_2
 typedef enum { ts_ntp, ts_ptp } timing_t;
 typedef enum { ap_1, ap_2 } airplay_t;
 typedef enum { realtime_stream, buffered_stream } airplay_stream_t;
 
+// Big enough for several encrypted blocks of up to 1042 bytes each, so that a whole block
+// can always be buffered and decrypted without reallocating.
+#define PAIR_CIPHER_BUFFER_SIZE 8192
+
 typedef struct {
-  uint8_t *data;
-  size_t length;
-  size_t size;
+  uint8_t data[PAIR_CIPHER_BUFFER_SIZE];
+  size_t offset; // where the unread data starts
+  size_t length; // how much unread data there is
 } sized_buffer;
 
 typedef struct {
   struct pair_cipher_context *cipher_ctx;
   sized_buffer encrypted_read_buffer;
   sized_buffer plaintext_read_buffer;
+  uint8_t encrypted_write_buffer[PAIR_CIPHER_BUFFER_SIZE];
   int is_encrypted;
 } pair_cipher_bundle; // cipher context and buffers
 
@@ -148,10 +178,14 @@ typedef struct flush_request_t {
 
 #endif
 
-typedef struct {
+typedef struct rtsp_conn_info {
   int connection_number; // for debug ID purposes, nothing else...
   int resend_interval;   // this is really just for debugging
   int rtsp_link_is_idle; // if true, this indicates if the client asleep
+  char *rtsp_input_buffer; // holds RTSP headers as they are parsed, and anything received after
+                           // the end of a request, kept for the next one
+  size_t rtsp_input_buffer_occupancy;
+  int rtsp_input_skip_lf; // the last line ended with a \r, so skip a \n if it comes next
   char *UserAgent;       // free this on teardown
   int AirPlayVersion;    // zero if not an AirPlay session. Used to help calculate latency
   int latency_warning_issued;
@@ -170,12 +204,12 @@ typedef struct {
   volatile int running;
   volatile uint64_t watchdog_bark_time;
   volatile int watchdog_barks; // number of times the watchdog has timed out and done something
+  struct rtsp_conn_info *watchdog_next; // in the shared watchdog's list of watched connections
 
   uint64_t playstart;
   uint64_t connection_start_time; // the time the device is selected, which could be a long time
                                   // before a play
-  pthread_t thread, timer_requester, rtp_audio_thread, rtp_control_thread, rtp_timing_thread,
-      player_watchdog_thread;
+  pthread_t thread, timer_requester, rtp_audio_thread, rtp_control_thread, rtp_timing_thread;
 
   // buffers to delete on exit
   int32_t *tbuf;
@@ -323,9 +357,12 @@ typedef struct {
   uint64_t last_anchor_local_time;
   uint64_t last_anchor_time_of_update;
   uint64_t last_anchor_validity_start_time;
+  int last_anchor_clock_is_master; // the last anchor info was derived from the master clock
 
   ssize_t ap2_audio_buffer_size;
   ssize_t ap2_audio_buffer_minimum_size;
+  int resampler_drift_correction; // buffered audio: drift is corrected in the decoder's resampler
+  int resampler_frames_to_stuff;  // set by the player, collected by the buffered audio processor
   flush_request_t *flush_requests; // if non-null, there are flush requests, mutex protected
   int ap2_flush_requested;
   int ap2_flush_from_valid;
@@ -375,7 +412,28 @@ typedef struct {
   int request_sent;
 
   int time_ping_count;
+  // a ring buffer -- the record for sequence number n is at [n % time_ping_history]
   struct time_ping_record time_pings[time_ping_history];
+  // sequence numbers of the records, in order, that have the lowest aged dispersion of those after
+  // them -- the first is the lowest of all
+  int time_ping_minima[time_ping_history];
+  int time_ping_minima_start;
+  int time_ping_minima_count;
+  // running sums over the records in the drift calculation, relative to the base times
+  int time_ping_fit_count;
+  int time_ping_fit_updates; // since the sums were last worked out from scratch
+  uint64_t time_ping_fit_local_base;
+  uint64_t time_ping_fit_remote_base;
+  double time_ping_fit_sx, time_ping_fit_sy, time_ping_fit_sxx, time_ping_fit_sxy;
+
+  // the Kalman filter alternative -- it tracks the offset of the remote clock from the local
+  // clock (relative to the offset at the first ping) and the skew, i.e. the gradient less one
+  uint64_t clock_kalman_base;
+  uint64_t clock_kalman_time; // local time of the last update
+  double clock_kalman_offset;
+  double clock_kalman_skew;
+  double clock_kalman_p[2][2]; // the covariance of the estimate
+  int clock_kalman_updates;
 
   uint64_t departure_time; // dangerous -- this assumes that there will never be two timing
                            // request in flight at the same time
@@ -383,6 +441,9 @@ typedef struct {
   pthread_mutex_t reference_time_mutex;
   pthread_mutex_t watchdog_mutex;
 
+  uint32_t timing_epoch; // incremented whenever the anchor or the clock relationship changes
+  frame_time_mapping_t frame_time_mapping; // protected by the reference_time_mutex
+
   double local_to_remote_time_gradient; // if no drift, this would be exactly 1.0; likely it's
                                         // slightly above or  below.
   int local_to_remote_time_gradient_sample_count; // the number of samples used to calculate the
@@ -436,6 +497,9 @@ void player_flush(uint32_t timestamp, rtsp_conn_info *conn);
 // void player_full_flush(rtsp_conn_info *conn);
 void player_put_packet(int original_format, seq_t seqno, uint32_t actual_timestamp, uint8_t *data,
                        int len, rtsp_conn_info *conn);
+// put a batch of packets, e.g. from one receive call, in the buffer in one go
+void player_put_packets(int original_format, player_packet_t *packets, int count,
+                        rtsp_conn_info *conn);
 int64_t monotonic_timestamp(uint32_t timestamp,
                             rtsp_conn_info *conn); // add an epoch to the timestamp. The monotonic
 // timestamp guaranteed to start between 2^32 2^33
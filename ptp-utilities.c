@@ -116,45 +116,146 @@ int ptp_get_clock_version() {
   return response;
 }
 
-int ptp_get_clock_info(uint64_t *actual_clock_id, uint64_t *time_of_sample, uint64_t *raw_offset,
-                       uint64_t *mastership_start_time) {
-  int response = clock_ok;
-  if (actual_clock_id != NULL)
-    *actual_clock_id = 0;
-  if (raw_offset != NULL)
-    *raw_offset = 0;
-  if (time_of_sample != NULL)
-    *time_of_sample = 0;
-  if (mastership_start_time != NULL)
-    *mastership_start_time = 0;
-  //  if (ptp_shm_interface_open() == 0) {
-  struct shm_structure nqptp_data;
-  if (get_nqptp_data(&nqptp_data) == 0) {
-    if (nqptp_data.version == NQPTP_SHM_STRUCTURES_VERSION) {
-      // assuming a clock id can not be zero
-      if (nqptp_data.main.master_clock_id != 0) {
-        if (actual_clock_id != NULL)
-          *actual_clock_id = nqptp_data.main.master_clock_id;
-        if (time_of_sample != NULL)
-          *time_of_sample = nqptp_data.main.local_time;
-        if (raw_offset != NULL)
-          *raw_offset = nqptp_data.main.local_to_master_time_offset;
-        if (mastership_start_time != NULL)
-          *mastership_start_time = nqptp_data.main.master_clock_start_time;
-      } else {
-        response = clock_no_master;
+// Read the main record using the sequence number as a seqlock (version 11 onwards).
+// On success, the (even) sequence number of the record is returned in sequence_number.
+static int get_nqptp_record(shm_structure_set *record, uint32_t *sequence_number) {
+  volatile struct shm_structure *shm = (volatile struct shm_structure *)mapped_addr;
+  int response = -1;
+  int loop_count = 0;
+  uint32_t sequence_number_before, sequence_number_after;
+  do {
+    if (loop_count != 0)
+      usleep(2); // microseconds -- an update is in progress
+    sequence_number_before = shm->sequence_number;
+    __sync_synchronize();
+    record->master_clock_id = shm->main.master_clock_id;
+    record->local_time = shm->main.local_time;
+    record->local_to_master_time_offset = shm->main.local_to_master_time_offset;
+    record->master_clock_start_time = shm->main.master_clock_start_time;
+    __sync_synchronize();
+    sequence_number_after = shm->sequence_number;
+    loop_count++;
+  } while ((((sequence_number_before & 1) != 0) ||
+            (sequence_number_before != sequence_number_after)) &&
+           (loop_count < 10));
+  if (((sequence_number_before & 1) == 0) && (sequence_number_before == sequence_number_after)) {
+    *sequence_number = sequence_number_before;
+    response = 0;
+  } else {
+    debug(1, "get_nqptp_record -- no consistent record after %d attempts!", loop_count);
+  }
+  return response;
+}
+
+static void clock_snapshot_from_record(ptp_clock_snapshot *snapshot,
+                                       const shm_structure_set *record) {
+  // assuming a clock id can not be zero
+  if (record->master_clock_id != 0) {
+    snapshot->status = clock_ok;
+    snapshot->actual_clock_id = record->master_clock_id;
+    snapshot->time_of_sample = record->local_time;
+    snapshot->raw_offset = record->local_to_master_time_offset;
+    snapshot->mastership_start_time = record->master_clock_start_time;
+  } else {
+    snapshot->status = clock_no_master;
+  }
+}
+
+int ptp_get_clock_snapshot(ptp_clock_snapshot *snapshot) {
+  if ((mapped_addr != MAP_FAILED) && (mapped_addr != NULL)) {
+    volatile struct shm_structure *shm = (volatile struct shm_structure *)mapped_addr;
+    uint16_t version = shm->version;
+    if (version == NQPTP_SHM_STRUCTURES_VERSION) {
+      // if the record hasn't been updated since the snapshot was taken, the snapshot is current
+      uint32_t sequence_number = shm->sequence_number;
+      __sync_synchronize();
+      if ((snapshot->sequence_number == 0) || (sequence_number != snapshot->sequence_number)) {
+        shm_structure_set record;
+        memset(snapshot, 0, sizeof(ptp_clock_snapshot));
+        if (get_nqptp_record(&record, &sequence_number) == 0) {
+          clock_snapshot_from_record(snapshot, &record);
+          snapshot->sequence_number = sequence_number;
+        } else {
+          snapshot->status = clock_data_unavailable;
+        }
       }
+    } else if (version == NQPTP_SHM_STRUCTURES_VERSION_DUAL_RECORD) {
+      // no sequence number, so the snapshot can't be reused
+      struct shm_structure nqptp_data;
+      memset(snapshot, 0, sizeof(ptp_clock_snapshot));
+      if (get_nqptp_data(&nqptp_data) == 0)
+        clock_snapshot_from_record(snapshot, &nqptp_data.main);
+      else
+        snapshot->status = clock_data_unavailable;
     } else {
+      memset(snapshot, 0, sizeof(ptp_clock_snapshot));
       // the version can not be zero. If zero is returned here, it means that the shared memory is
       // not yet initialised, so not availalbe
-      if (nqptp_data.version == 0)
-        response = clock_service_unavailable;
+      if (version == 0)
+        snapshot->status = clock_service_unavailable;
       else
-        response = clock_version_mismatch;
+        snapshot->status = clock_version_mismatch;
     }
   } else {
-    response = clock_data_unavailable;
+    debug(1, "ptp_get_clock_snapshot failed because the NQPTP interface is not open");
+    memset(snapshot, 0, sizeof(ptp_clock_snapshot));
+    snapshot->status = clock_data_unavailable;
   }
+  return snapshot->status;
+}
+
+// Each thread keeps its own snapshot, as the NQPTP clock record is the same for every connection.
+// Checking it costs a load of the sequence number, with no lock.
+static pthread_key_t clock_snapshot_key;
+static pthread_once_t clock_snapshot_key_once = PTHREAD_ONCE_INIT;
+
+static void clock_snapshot_key_create() { pthread_key_create(&clock_snapshot_key, free); }
+
+int ptp_get_cached_clock_snapshot(ptp_clock_snapshot *snapshot) {
+  pthread_once(&clock_snapshot_key_once, clock_snapshot_key_create);
+  ptp_clock_snapshot *cached_snapshot = pthread_getspecific(clock_snapshot_key);
+  if (cached_snapshot == NULL) {
+    cached_snapshot = calloc(1, sizeof(ptp_clock_snapshot)); // a zero sequence number to start
+    if ((cached_snapshot == NULL) || (pthread_setspecific(clock_snapshot_key, cached_snapshot))) {
+      free(cached_snapshot);
+      snapshot->sequence_number = 0; // force a fresh read
+      return ptp_get_clock_snapshot(snapshot);
+    }
+  }
+  int response = ptp_get_clock_snapshot(cached_snapshot);
+  *snapshot = *cached_snapshot;
+  return response;
+}
+
+// Returns the sequence number of the current NQPTP clock record, or zero if it can't be
+// determined, e.g. with an interface older than version 11 or while the record is being updated.
+uint32_t ptp_get_clock_sequence_number() {
+  uint32_t response = 0;
+  if ((mapped_addr != MAP_FAILED) && (mapped_addr != NULL)) {
+    volatile struct shm_structure *shm = (volatile struct shm_structure *)mapped_addr;
+    if (shm->version == NQPTP_SHM_STRUCTURES_VERSION) {
+      response = shm->sequence_number;
+      __sync_synchronize();
+      if ((response & 1) != 0)
+        response = 0;
+    }
+  }
+  return response;
+}
+
+int ptp_get_clock_info(uint64_t *actual_clock_id, uint64_t *time_of_sample, uint64_t *raw_offset,
+                       uint64_t *mastership_start_time) {
+  ptp_clock_snapshot snapshot;
+  snapshot.sequence_number = 0; // force a fresh read
+  int response = ptp_get_clock_snapshot(&snapshot);
+  if (actual_clock_id != NULL)
+    *actual_clock_id = snapshot.actual_clock_id;
+  if (raw_offset != NULL)
+    *raw_offset = snapshot.raw_offset;
+  if (time_of_sample != NULL)
+    *time_of_sample = snapshot.time_of_sample;
+  if (mastership_start_time != NULL)
+    *mastership_start_time = snapshot.mastership_start_time;
   return response;
 }
 
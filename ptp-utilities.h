@@ -30,6 +30,25 @@
 #include "nqptp-shm-structures.h"
 #include <stdint.h>
 
+// the oldest NQPTP shared memory interface still understood -- it has no sequence number
+#define NQPTP_SHM_STRUCTURES_VERSION_DUAL_RECORD 10
+
+// A copy of the clock information, reused for as long as the NQPTP sequence number
+// stays the same. A sequence_number of zero means the snapshot must be refreshed.
+typedef struct {
+  uint32_t sequence_number;
+  int status; // a clock_status_t
+  uint64_t actual_clock_id;
+  uint64_t time_of_sample;
+  uint64_t raw_offset;
+  uint64_t mastership_start_time;
+} ptp_clock_snapshot;
+
+int ptp_get_clock_snapshot(ptp_clock_snapshot *snapshot);
+// as above, from a snapshot kept by the calling thread, so no lock is needed
+int ptp_get_cached_clock_snapshot(ptp_clock_snapshot *snapshot);
+uint32_t ptp_get_clock_sequence_number();
+
 int ptp_get_clock_info(uint64_t *actual_clock_id, uint64_t *time_of_sample, uint64_t *raw_offset,
                        uint64_t *mastership_start_time);
 
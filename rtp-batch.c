@@ -0,0 +1,229 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE // for recvmmsg(), sendmmsg() and struct mmsghdr
+
+#include "rtp-batch.h"
+#include "common.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// This file is kept apart from rtp.c because _GNU_SOURCE changes the definition of
+// strerror_r(), which rtp.c relies on.
+
+// Receive timestamps are taken by the kernel when a datagram arrives, so they aren't
+// affected by how long it takes for the receiving thread to be scheduled.
+// They are in CLOCK_REALTIME, so each is converted to the get_absolute_time_in_ns() timebase
+// by working out how long ago it was and subtracting that from the local time now.
+
+#if defined(SO_TIMESTAMPNS)
+#define RECEIVE_TIMESTAMP_OPTION SO_TIMESTAMPNS
+#define RECEIVE_TIMESTAMP_MESSAGE SCM_TIMESTAMPNS
+#elif defined(SO_TIMESTAMP)
+#define RECEIVE_TIMESTAMP_OPTION SO_TIMESTAMP
+#define RECEIVE_TIMESTAMP_MESSAGE SCM_TIMESTAMP
+#endif
+
+#define RTP_BATCH_CONTROL_SIZE 64 // room for a receive timestamp control message
+
+int rtp_enable_receive_timestamps(int fd) {
+#ifdef RECEIVE_TIMESTAMP_OPTION
+  int on = 1;
+  return setsockopt(fd, SOL_SOCKET, RECEIVE_TIMESTAMP_OPTION, &on, sizeof(on));
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+static uint64_t get_real_time_in_ns() {
+  struct timespec tn;
+  clock_gettime(CLOCK_REALTIME, &tn);
+  uint64_t tnnsec = tn.tv_sec;
+  tnnsec = tnnsec * 1000000000;
+  return tnnsec + tn.tv_nsec;
+}
+
+// when the datagram arrived, from its receive timestamp if it has one, or else now
+static uint64_t arrival_time(struct msghdr *msg, uint64_t local_time_now,
+                             uint64_t real_time_now) {
+  uint64_t result = local_time_now;
+#ifdef RECEIVE_TIMESTAMP_MESSAGE
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == RECEIVE_TIMESTAMP_MESSAGE)) {
+      uint64_t received_at;
+#if defined(SO_TIMESTAMPNS)
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      received_at = ts.tv_sec;
+      received_at = received_at * 1000000000 + ts.tv_nsec;
+#else
+      struct timeval tv;
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      received_at = tv.tv_sec;
+      received_at = received_at * 1000000000 + tv.tv_usec * 1000;
+#endif
+      int64_t age = real_time_now - received_at;
+      // ignore it if the real time clock has been stepped in the meantime
+      if ((age >= 0) && (age < 1000000000))
+        result = local_time_now - age;
+      break;
+    }
+  }
+#endif
+  return result;
+}
+
+ssize_t rtp_receive_timestamped(int fd, void *buf, size_t len, uint64_t *arrival) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  uint64_t control[RTP_BATCH_CONTROL_SIZE / sizeof(uint64_t)]; // aligned
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t nread = recvmsg(fd, &msg, 0);
+  uint64_t local_time_now = get_absolute_time_in_ns();
+  if (nread >= 0)
+    *arrival = arrival_time(&msg, local_time_now, get_real_time_in_ns());
+  else
+    *arrival = local_time_now;
+  return nread;
+}
+
+int rtp_batch_init(rtp_batch *batch, const char *name, size_t packet_size) {
+  memset(batch, 0, sizeof(rtp_batch));
+  batch->name = name;
+  batch->packet_size = packet_size;
+  batch->arena = malloc(RTP_BATCH_SIZE * packet_size);
+  batch->controls = malloc(RTP_BATCH_SIZE * RTP_BATCH_CONTROL_SIZE);
+  if ((batch->arena == NULL) || (batch->controls == NULL)) {
+    rtp_batch_free(batch);
+    return -1;
+  }
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr *messages = calloc(RTP_BATCH_SIZE, sizeof(struct mmsghdr));
+  struct iovec *iovecs = calloc(RTP_BATCH_SIZE, sizeof(struct iovec));
+  batch->messages = messages;
+  batch->iovecs = iovecs;
+  if ((messages == NULL) || (iovecs == NULL)) {
+    rtp_batch_free(batch);
+    return -1;
+  }
+  int i;
+  for (i = 0; i < RTP_BATCH_SIZE; i++) {
+    iovecs[i].iov_base = RTP_BATCH_PACKET(batch, i);
+    iovecs[i].iov_len = packet_size;
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+    messages[i].msg_hdr.msg_control = (uint8_t *)batch->controls + i * RTP_BATCH_CONTROL_SIZE;
+  }
+#endif
+  return 0;
+}
+
+void rtp_batch_free(void *arg) {
+  rtp_batch *batch = (rtp_batch *)arg;
+  free(batch->messages);
+  batch->messages = NULL;
+  free(batch->iovecs);
+  batch->iovecs = NULL;
+  free(batch->controls);
+  batch->controls = NULL;
+  free(batch->arena);
+  batch->arena = NULL;
+}
+
+int rtp_batch_receive(int fd, rtp_batch *batch) {
+  int received;
+#ifdef HAVE_RECVMMSG
+  int i;
+  struct mmsghdr *messages = batch->messages;
+  for (i = 0; i < RTP_BATCH_SIZE; i++)
+    messages[i].msg_hdr.msg_controllen = RTP_BATCH_CONTROL_SIZE; // the kernel changes it
+  // block until one datagram arrives, then take whatever else is already waiting
+  received = recvmmsg(fd, messages, RTP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+  uint64_t local_time_now = get_absolute_time_in_ns();
+  uint64_t real_time_now = get_real_time_in_ns();
+  for (i = 0; i < received; i++) {
+    batch->lengths[i] = messages[i].msg_len;
+    batch->arrival_times[i] = arrival_time(&messages[i].msg_hdr, local_time_now, real_time_now);
+  }
+#else
+  ssize_t nread = rtp_receive_timestamped(fd, batch->arena, batch->packet_size,
+                                          &batch->arrival_times[0]);
+  batch->lengths[0] = nread;
+  received = nread < 0 ? -1 : 1;
+#endif
+  if (received > 0) {
+    batch->receive_calls++;
+    batch->packets_received += received;
+    if (batch->packets_received >= 2500) {
+      debug(2, "%s: %.2f packets per receive call over the last %" PRIu64 " packets.", batch->name,
+            (1.0 * batch->packets_received) / batch->receive_calls, batch->packets_received);
+      batch->receive_calls = 0;
+      batch->packets_received = 0;
+    }
+  }
+  return received;
+}
+
+int udp_send_batch(int fd, const void *address, socklen_t address_length, struct iovec *iovecs,
+                   int iovecs_per_datagram, int count) {
+  if (count > RTP_BATCH_SIZE)
+    count = RTP_BATCH_SIZE;
+  int i;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr messages[RTP_BATCH_SIZE];
+  memset(messages, 0, sizeof(struct mmsghdr) * count);
+  for (i = 0; i < count; i++) {
+    messages[i].msg_hdr.msg_name = (void *)address;
+    messages[i].msg_hdr.msg_namelen = address_length;
+    messages[i].msg_hdr.msg_iov = &iovecs[i * iovecs_per_datagram];
+    messages[i].msg_hdr.msg_iovlen = iovecs_per_datagram;
+  }
+  return sendmmsg(fd, messages, count, 0);
+#else
+  for (i = 0; i < count; i++) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = (void *)address;
+    message.msg_namelen = address_length;
+    message.msg_iov = &iovecs[i * iovecs_per_datagram];
+    message.msg_iovlen = iovecs_per_datagram;
+    if (sendmsg(fd, &message, 0) < 0)
+      return i == 0 ? -1 : i;
+  }
+  return count;
+#endif
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __RTP_BATCH_H
+#define __RTP_BATCH_H
+
+#include "config.h"
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// the most datagrams taken from a socket in one receive call
+#define RTP_BATCH_SIZE 32
+
+typedef struct {
+  const char *name;   // used in the packets-per-call report
+  size_t packet_size; // the space for each datagram
+  uint8_t *arena;     // RTP_BATCH_SIZE datagrams of packet_size bytes each
+  ssize_t lengths[RTP_BATCH_SIZE];
+  uint64_t arrival_times[RTP_BATCH_SIZE]; // in the get_absolute_time_in_ns() timebase
+  void *controls;                         // space for their receive timestamps
+  void *messages; // the struct mmsghdr array for recvmmsg(), if available
+  void *iovecs;
+  uint64_t receive_calls; // since the last report
+  uint64_t packets_received;
+} rtp_batch;
+
+#define RTP_BATCH_PACKET(batch, i) ((batch)->arena + (i) * (batch)->packet_size)
+
+// ask the kernel to timestamp datagrams as they arrive on the socket -- returns 0 if it will
+int rtp_enable_receive_timestamps(int fd);
+
+// like recv(), but also gives the arrival time, from the kernel receive timestamp if available
+ssize_t rtp_receive_timestamped(int fd, void *buf, size_t len, uint64_t *arrival);
+
+int rtp_batch_init(rtp_batch *batch, const char *name, size_t packet_size);
+void rtp_batch_free(void *arg); // can be used as a pthread cleanup handler
+
+// wait for at least one datagram and take as many as are waiting, up to RTP_BATCH_SIZE
+// returns the number received or -1, with errno set
+int rtp_batch_receive(int fd, rtp_batch *batch);
+
+// send count datagrams to the address, each made of iovecs_per_datagram consecutive iovecs,
+// in one sendmmsg() call if available; this can be used with any UDP socket
+// returns the number of datagrams sent, which may be fewer than count, or -1, with errno set
+int udp_send_batch(int fd, const void *address, socklen_t address_length, struct iovec *iovecs,
+                   int iovecs_per_datagram, int count);
+
+#endif /* __RTP_BATCH_H */
@@ -28,7 +28,9 @@
 #include "rtp.h"
 #include "common.h"
 #include "player.h"
+#include "rtp-batch.h"
 #include "rtsp.h"
+#include "trace.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -64,6 +66,25 @@ typedef struct Nvll nvll;
 uint64_t local_to_remote_time_jitter;
 uint64_t local_to_remote_time_jitter_count;
 
+// An index of the blocks in the buffered audio stream, built by the buffered_tcp_reader as the
+// bytes arrive. Blocks are numbered consecutively, so the index is direct-mapped by sequence
+// number. It lets a flush discard everything up to the flushUntilSeq block in one step, rather
+// than reading each discarded block out of the buffer.
+// This needs to be a power of 2. At 1,024 frames per block, 8,192 entries is about 190 seconds.
+#define BUFFERED_BLOCK_INDEX_SIZE 8192
+
+// room for frames the resampler may insert into a decoded frame when correcting drift
+#define RESAMPLER_COMPENSATION_HEADROOM 32
+
+typedef struct {
+  uint64_t stream_offset; // position of the block's length field in the incoming byte stream
+  uint64_t block_number;  // the number of blocks that came before it in the stream
+  uint32_t seq_no;
+  uint32_t rtptime;
+  uint16_t length; // including the two-byte length field itself
+  int valid;
+} buffered_block_index_entry;
+
 typedef struct {
   int closed;
   int error_code;
@@ -73,6 +94,13 @@ typedef struct {
   char *eoq;
   size_t buffer_max_size;
   size_t buffer_occupancy;
+  uint64_t stream_bytes_in;   // total bytes put into the buffer
+  uint64_t stream_bytes_out;  // total bytes taken out of the buffer, read or skipped
+  uint64_t next_block_offset; // stream position of the next block header to be indexed
+  uint64_t blocks_indexed;
+  uint32_t last_indexed_seq_no;
+  int block_index_lost; // set if the framing no longer makes sense
+  buffered_block_index_entry *block_index;
   pthread_mutex_t mutex;
   pthread_cond_t not_empty_cv;
   pthread_cond_t not_full_cv;
@@ -177,17 +205,70 @@ uint64_t local_to_remote_time_difference_now(rtsp_conn_info *conn) {
   return result;
 }
 
+// Call this after changing anything a frame_time_mapping_t is derived from.
+void bump_timing_epoch(rtsp_conn_info *conn) {
+  __sync_synchronize(); // the changes must be visible before the new epoch
+  __sync_fetch_and_add(&conn->timing_epoch, 1);
+}
+
+// (a * b) >> fraction_bits, with a 128-bit intermediate product built from 32-bit parts
+static uint64_t fixed_point_multiply(uint64_t a, uint64_t b, unsigned int fraction_bits) {
+  uint64_t al = a & 0xFFFFFFFF, ah = a >> 32;
+  uint64_t bl = b & 0xFFFFFFFF, bh = b >> 32;
+  uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+  uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+  uint64_t lo = (mid << 32) | (ll & 0xFFFFFFFF);
+  uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+  if (fraction_bits == 0)
+    return lo;
+  else if (fraction_bits >= 64)
+    return hi;
+  else
+    return (hi << (64 - fraction_bits)) | (lo >> fraction_bits);
+}
+
+// frames_per_second is in terms of the local clock
+static void frame_time_mapping_set(frame_time_mapping_t *mapping, uint32_t origin_frame,
+                                   uint64_t origin_time, double frames_per_second) {
+  mapping->origin_frame = origin_frame;
+  mapping->origin_time = origin_time;
+  mapping->ns_per_frame = (uint64_t)llround(ldexp(1.0E9 / frames_per_second, 32));
+  mapping->frames_per_ns = (uint64_t)llround(ldexp(frames_per_second / 1.0E9, 64));
+}
+
+// as before, intervals are truncated towards zero
+static uint64_t frame_time_mapping_time(const frame_time_mapping_t *mapping, uint32_t frame) {
+  int32_t frame_difference = frame - mapping->origin_frame;
+  if (frame_difference >= 0)
+    return mapping->origin_time +
+           fixed_point_multiply(frame_difference, mapping->ns_per_frame, 32);
+  else
+    return mapping->origin_time -
+           fixed_point_multiply(-(int64_t)frame_difference, mapping->ns_per_frame, 32);
+}
+
+static uint32_t frame_time_mapping_frame(const frame_time_mapping_t *mapping, uint64_t time) {
+  int64_t time_difference = time - mapping->origin_time;
+  int32_t frame_difference;
+  if (time_difference >= 0)
+    frame_difference = fixed_point_multiply(time_difference, mapping->frames_per_ns, 64);
+  else
+    frame_difference = -(int32_t)fixed_point_multiply(-time_difference, mapping->frames_per_ns, 64);
+  return mapping->origin_frame + frame_difference;
+}
+
 void rtp_audio_receiver_cleanup_handler(__attribute__((unused)) void *arg) {
   debug(3, "Audio Receiver Cleanup Done.");
 }
 
 void *rtp_audio_receiver(void *arg) {
   debug(3, "rtp_audio_receiver start");
+  TRACE_THREAD_NAME("audio receiver");
   pthread_cleanup_push(rtp_audio_receiver_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
 
   int32_t last_seqno = -1;
-  uint8_t packet[2048], *pktp;
+  uint8_t *packet, *pktp;
 
   uint64_t time_of_previous_packet_ns = 0;
   float longest_packet_time_interval_us = 0.0;
@@ -199,36 +280,57 @@ void *rtp_audio_receiver(void *arg) {
   float stat_mean = 0.0;
   float stat_M2 = 0.0;
 
+  // packets arriving together, e.g. in answer to a resend request, are taken in one call
+  // and passed to the player in one go
+  rtp_batch batch;
+  if (rtp_batch_init(&batch, "Audio receiver", 2048) != 0)
+    die("Could not allocate packet buffers for the audio receiver.");
+  pthread_cleanup_push(rtp_batch_free, &batch);
+  if (rtp_enable_receive_timestamps(conn->audio_socket) != 0)
+    debug(2, "Audio receiver -- kernel receive timestamps are not available.");
+  player_packet_t packets_for_player[RTP_BATCH_SIZE];
+
   ssize_t nread;
   while (1) {
-    nread = recv(conn->audio_socket, packet, sizeof(packet), 0);
-
-    uint64_t local_time_now_ns = get_absolute_time_in_ns();
-    if (time_of_previous_packet_ns) {
-      float time_interval_us = (local_time_now_ns - time_of_previous_packet_ns) * 0.001;
-      time_of_previous_packet_ns = local_time_now_ns;
-      if (time_interval_us > longest_packet_time_interval_us)
-        longest_packet_time_interval_us = time_interval_us;
-      stat_n += 1;
-      float stat_delta = time_interval_us - stat_mean;
-      stat_mean += stat_delta / stat_n;
-      stat_M2 += stat_delta * (time_interval_us - stat_mean);
-      if ((stat_n != 1) && (stat_n % 2500 == 0)) {
-        debug(2,
-              "Packet reception interval stats: mean, standard deviation and max for the last "
-              "2,500 packets in microseconds: %10.1f, %10.1f, %10.1f.",
-              stat_mean, sqrtf(stat_M2 / (stat_n - 1)), longest_packet_time_interval_us);
-        stat_n = 0;
-        stat_mean = 0.0;
-        stat_M2 = 0.0;
-        time_of_previous_packet_ns = 0;
-        longest_packet_time_interval_us = 0.0;
-      }
-    } else {
-      time_of_previous_packet_ns = local_time_now_ns;
+    int packets_received = rtp_batch_receive(conn->audio_socket, &batch);
+    if (packets_received < 0) {
+      char em[1024];
+      strerror_r(errno, em, sizeof(em));
+      debug(1, "Error %d receiving an audio packet: \"%s\".", errno, em);
+      continue;
     }
 
-    if (nread >= 0) {
+    int packets_for_player_count = 0;
+    int batch_index;
+    for (batch_index = 0; batch_index < packets_received; batch_index++) {
+      packet = RTP_BATCH_PACKET(&batch, batch_index);
+      nread = batch.lengths[batch_index];
+      uint64_t arrival_time_ns = batch.arrival_times[batch_index];
+
+      if (time_of_previous_packet_ns) {
+        float time_interval_us = (arrival_time_ns - time_of_previous_packet_ns) * 0.001;
+        time_of_previous_packet_ns = arrival_time_ns;
+        if (time_interval_us > longest_packet_time_interval_us)
+          longest_packet_time_interval_us = time_interval_us;
+        stat_n += 1;
+        float stat_delta = time_interval_us - stat_mean;
+        stat_mean += stat_delta / stat_n;
+        stat_M2 += stat_delta * (time_interval_us - stat_mean);
+        if ((stat_n != 1) && (stat_n % 2500 == 0)) {
+          debug(2,
+                "Packet reception interval stats: mean, standard deviation and max for the last "
+                "2,500 packets in microseconds: %10.1f, %10.1f, %10.1f.",
+                stat_mean, sqrtf(stat_M2 / (stat_n - 1)), longest_packet_time_interval_us);
+          stat_n = 0;
+          stat_mean = 0.0;
+          stat_M2 = 0.0;
+          time_of_previous_packet_ns = 0;
+          longest_packet_time_interval_us = 0.0;
+        }
+      } else {
+        time_of_previous_packet_ns = arrival_time_ns;
+      }
+
       ssize_t plen = nread;
       uint8_t type = packet[1] & ~0x80;
       if (type == 0x60 || type == 0x56) { // audio data / resend
@@ -280,10 +382,13 @@ void *rtp_audio_receiver(void *arg) {
         // check if packet contains enough content to be reasonable
         if (plen >= 16) {
           if ((config.diagnostic_drop_packet_fraction == 0.0) ||
-              (drand48() > config.diagnostic_drop_packet_fraction))
-            player_put_packet(1, seqno, actual_timestamp, pktp, plen,
-                              conn); // the '1' means is original format
-          else
+              (drand48() > config.diagnostic_drop_packet_fraction)) {
+            player_packet_t *packet_for_player = &packets_for_player[packets_for_player_count++];
+            packet_for_player->seqno = seqno;
+            packet_for_player->timestamp = actual_timestamp;
+            packet_for_player->data = pktp;
+            packet_for_player->len = plen;
+          } else
             debug(3, "Dropping audio packet %u to simulate a bad connection.", seqno);
           continue;
         }
@@ -295,11 +400,10 @@ void *rtp_audio_receiver(void *arg) {
               nread, seqno);
       }
       warn("Audio receiver -- Unknown RTP packet of type 0x%02X length %d.", type, nread);
-    } else {
-      char em[1024];
-      strerror_r(errno, em, sizeof(em));
-      debug(1, "Error %d receiving an audio packet: \"%s\".", errno, em);
     }
+    if (packets_for_player_count)
+      player_put_packets(1, packets_for_player, packets_for_player_count,
+                         conn); // the '1' means is original format
   }
 
   /*
@@ -308,6 +412,7 @@ void *rtp_audio_receiver(void *arg) {
   */
 
   debug(1, "Audio receiver thread \"normal\" exit -- this can't happen. Hah!");
+  pthread_cleanup_pop(1); // free the packet buffers
   pthread_cleanup_pop(0); // don't execute anything here.
   debug(2, "Audio receiver thread exit.");
   pthread_exit(NULL);
@@ -319,247 +424,269 @@ void rtp_control_handler_cleanup_handler(__attribute__((unused)) void *arg) {
 
 void *rtp_control_receiver(void *arg) {
   debug(2, "rtp_control_receiver start");
+  TRACE_THREAD_NAME("control receiver");
   pthread_cleanup_push(rtp_control_handler_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
 
   conn->anchor_rtptime = 0; // nothing valid received yet
-  uint8_t packet[2048], *pktp;
+  uint8_t *packet, *pktp;
   // struct timespec tn;
   uint64_t remote_time_of_sync;
   uint32_t sync_rtp_timestamp;
+
+  // resent audio packets often arrive in bursts -- take them together
+  rtp_batch batch;
+  if (rtp_batch_init(&batch, "Control receiver", 2048) != 0)
+    die("Could not allocate packet buffers for the control receiver.");
+  pthread_cleanup_push(rtp_batch_free, &batch);
+  player_packet_t packets_for_player[RTP_BATCH_SIZE];
+
   ssize_t nread;
   while (1) {
-    nread = recv(conn->control_socket, packet, sizeof(packet), 0);
+    int packets_received = rtp_batch_receive(conn->control_socket, &batch);
     if (conn->rtsp_link_is_idle == 0) {
-      if (nread >= 0) {
-        if ((config.diagnostic_drop_packet_fraction == 0.0) ||
-            (drand48() > config.diagnostic_drop_packet_fraction)) {
+      if (packets_received >= 0) {
+        int packets_for_player_count = 0;
+        int batch_index;
+        for (batch_index = 0; batch_index < packets_received; batch_index++) {
+          packet = RTP_BATCH_PACKET(&batch, batch_index);
+          nread = batch.lengths[batch_index];
+          if ((config.diagnostic_drop_packet_fraction == 0.0) ||
+              (drand48() > config.diagnostic_drop_packet_fraction)) {
 
-          ssize_t plen = nread;
-          if (packet[1] == 0xd4) { // sync data
-            // clang-format off
-            /*
-                // the following stanza is for debugging only -- normally commented out.
-                {
-                  char obf[4096];
-                  char *obfp = obf;
-                  int obfc;
-                  for (obfc = 0; obfc < plen; obfc++) {
-                    snprintf(obfp, 3, "%02X", packet[obfc]);
-                    obfp += 2;
-                  };
-                  *obfp = 0;
-
-
-                  // get raw timestamp information
-                  // I think that a good way to understand these timestamps is that
-                  // (1) the rtlt below is the timestamp of the frame that should be playing at the
-                  // client-time specified in the packet if there was no delay
-                  // and (2) that the rt below is the timestamp of the frame that should be playing
-                  // at the client-time specified in the packet on this device taking account of
-                  // the delay
-                  // Thus, (3) the latency can be calculated by subtracting the second from the
-                  // first.
-                  // There must be more to it -- there something missing.
-
-                  // In addition, it seems that if the value of the short represented by the second
-                  // pair of bytes in the packet is 7
-                  // then an extra time lag is expected to be added, presumably by
-                  // the AirPort Express.
-
-                  // Best guess is that this delay is 11,025 frames.
-
-                  uint32_t rtlt = nctohl(&packet[4]); // raw timestamp less latency
-                  uint32_t rt = nctohl(&packet[16]);  // raw timestamp
-
-                  uint32_t fl = nctohs(&packet[2]); //
-
-                  debug(1,"Sync Packet of %d bytes received: \"%s\", flags: %d, timestamps %u and %u,
-              giving a latency of %d frames.",plen,obf,fl,rt,rtlt,rt-rtlt);
-                  //debug(1,"Monotonic timestamps are: %" PRId64 " and %" PRId64 "
-              respectively.",monotonic_timestamp(rt, conn),monotonic_timestamp(rtlt, conn));
-                }
-            */
-            // clang-format off
-            if (conn->local_to_remote_time_difference) { // need a time packet to be interchanged
-                                                         // first...
-              uint64_t ps, pn;
+            ssize_t plen = nread;
+            if (packet[1] == 0xd4) { // sync data
+              // clang-format off
+              /*
+                  // the following stanza is for debugging only -- normally commented out.
+                  {
+                    char obf[4096];
+                    char *obfp = obf;
+                    int obfc;
+                    for (obfc = 0; obfc < plen; obfc++) {
+                      snprintf(obfp, 3, "%02X", packet[obfc]);
+                      obfp += 2;
+                    };
+                    *obfp = 0;
+
+
+                    // get raw timestamp information
+                    // I think that a good way to understand these timestamps is that
+                    // (1) the rtlt below is the timestamp of the frame that should be playing at the
+                    // client-time specified in the packet if there was no delay
+                    // and (2) that the rt below is the timestamp of the frame that should be playing
+                    // at the client-time specified in the packet on this device taking account of
+                    // the delay
+                    // Thus, (3) the latency can be calculated by subtracting the second from the
+                    // first.
+                    // There must be more to it -- there something missing.
+
+                    // In addition, it seems that if the value of the short represented by the second
+                    // pair of bytes in the packet is 7
+                    // then an extra time lag is expected to be added, presumably by
+                    // the AirPort Express.
+
+                    // Best guess is that this delay is 11,025 frames.
+
+                    uint32_t rtlt = nctohl(&packet[4]); // raw timestamp less latency
+                    uint32_t rt = nctohl(&packet[16]);  // raw timestamp
+
+                    uint32_t fl = nctohs(&packet[2]); //
+
+                    debug(1,"Sync Packet of %d bytes received: \"%s\", flags: %d, timestamps %u and %u,
+                giving a latency of %d frames.",plen,obf,fl,rt,rtlt,rt-rtlt);
+                    //debug(1,"Monotonic timestamps are: %" PRId64 " and %" PRId64 "
+                respectively.",monotonic_timestamp(rt, conn),monotonic_timestamp(rtlt, conn));
+                  }
+              */
+              // clang-format off
+              if (conn->local_to_remote_time_difference) { // need a time packet to be interchanged
+                                                           // first...
+                uint64_t ps, pn;
 
-              ps = nctohl(&packet[8]);
-              ps = ps * 1000000000; // this many nanoseconds from the whole seconds
-              pn = nctohl(&packet[12]);
-              pn = pn * 1000000000;
-              pn = pn >> 32; // this many nanoseconds from the fractional part
-              remote_time_of_sync = ps + pn;
+                ps = nctohl(&packet[8]);
+                ps = ps * 1000000000; // this many nanoseconds from the whole seconds
+                pn = nctohl(&packet[12]);
+                pn = pn * 1000000000;
+                pn = pn >> 32; // this many nanoseconds from the fractional part
+                remote_time_of_sync = ps + pn;
 
-              // debug(1,"Remote Sync Time: " PRIu64 "",remote_time_of_sync);
+                // debug(1,"Remote Sync Time: " PRIu64 "",remote_time_of_sync);
 
-              sync_rtp_timestamp = nctohl(&packet[16]);
-              uint32_t rtp_timestamp_less_latency = nctohl(&packet[4]);
+                sync_rtp_timestamp = nctohl(&packet[16]);
+                uint32_t rtp_timestamp_less_latency = nctohl(&packet[4]);
 
-              // debug(1,"Sync timestamp is %u.",ntohl(*((uint32_t *)&packet[16])));
+                // debug(1,"Sync timestamp is %u.",ntohl(*((uint32_t *)&packet[16])));
 
-              if (config.userSuppliedLatency) {
-                if (config.userSuppliedLatency != conn->latency) {
-                  debug(1, "Using the user-supplied latency: %" PRIu32 ".",
-                        config.userSuppliedLatency);
-                }
-                conn->latency = config.userSuppliedLatency;
-              } else {
+                if (config.userSuppliedLatency) {
+                  if (config.userSuppliedLatency != conn->latency) {
+                    debug(1, "Using the user-supplied latency: %" PRIu32 ".",
+                          config.userSuppliedLatency);
+                  }
+                  conn->latency = config.userSuppliedLatency;
+                } else {
 
-                // It seems that the second pair of bytes in the packet indicate whether a fixed
-                // delay of 11,025 frames should be added -- iTunes set this field to 7 and
-                // AirPlay sets it to 4.
+                  // It seems that the second pair of bytes in the packet indicate whether a fixed
+                  // delay of 11,025 frames should be added -- iTunes set this field to 7 and
+                  // AirPlay sets it to 4.
 
-                // However, on older versions of AirPlay, the 11,025 frames seem to be necessary too
+                  // However, on older versions of AirPlay, the 11,025 frames seem to be necessary too
 
-                // The value of 11,025 (0.25 seconds) is a guess based on the "Audio-Latency"
-                // parameter
-                // returned by an AE.
+                  // The value of 11,025 (0.25 seconds) is a guess based on the "Audio-Latency"
+                  // parameter
+                  // returned by an AE.
 
-                // Sigh, it would be nice to have a published protocol...
+                  // Sigh, it would be nice to have a published protocol...
 
-                uint16_t flags = nctohs(&packet[2]);
-                uint32_t la = sync_rtp_timestamp - rtp_timestamp_less_latency; // note, this might
-                                                                               // loop around in
-                                                                               // modulo. Not sure if
-                                                                               // you'll get an error!
-                // debug(1, "Latency from the sync packet is %" PRIu32 " frames.", la);
+                  uint16_t flags = nctohs(&packet[2]);
+                  uint32_t la = sync_rtp_timestamp - rtp_timestamp_less_latency; // note, this might
+                                                                                 // loop around in
+                                                                                 // modulo. Not sure if
+                                                                                 // you'll get an error!
+                  // debug(1, "Latency from the sync packet is %" PRIu32 " frames.", la);
 
-                if ((flags == 7) || ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion <= 353)) ||
-                    ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion >= 371))) {
-                  la += config.fixedLatencyOffset;
-                  // debug(1, "Latency offset by %" PRIu32" frames due to the source flags and version
-                  // giving a latency of %" PRIu32 " frames.", config.fixedLatencyOffset, la);
-                }
-                if ((conn->maximum_latency) && (conn->maximum_latency < la))
-                  la = conn->maximum_latency;
-                if ((conn->minimum_latency) && (conn->minimum_latency > la))
-                  la = conn->minimum_latency;
-
-                const uint32_t max_frames = ((3 * BUFFER_FRAMES * 352) / 4) - 11025;
-
-                if (la > max_frames) {
-                  warn("An out-of-range latency request of %" PRIu32
-                       " frames was ignored. Must be %" PRIu32
-                       " frames or less (44,100 frames per second). "
-                       "Latency remains at %" PRIu32 " frames.",
-                       la, max_frames, conn->latency);
-                } else {
+                  if ((flags == 7) || ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion <= 353)) ||
+                      ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion >= 371))) {
+                    la += config.fixedLatencyOffset;
+                    // debug(1, "Latency offset by %" PRIu32" frames due to the source flags and version
+                    // giving a latency of %" PRIu32 " frames.", config.fixedLatencyOffset, la);
+                  }
+                  if ((conn->maximum_latency) && (conn->maximum_latency < la))
+                    la = conn->maximum_latency;
+                  if ((conn->minimum_latency) && (conn->minimum_latency > la))
+                    la = conn->minimum_latency;
+
+                  const uint32_t max_frames = ((3 * BUFFER_FRAMES * 352) / 4) - 11025;
+
+                  if (la > max_frames) {
+                    warn("An out-of-range latency request of %" PRIu32
+                         " frames was ignored. Must be %" PRIu32
+                         " frames or less (44,100 frames per second). "
+                         "Latency remains at %" PRIu32 " frames.",
+                         la, max_frames, conn->latency);
+                  } else {
+
+                    // here we have the latency but it does not yet account for the
+                    // audio_backend_latency_offset
+                    int32_t latency_offset =
+                        (int32_t)(config.audio_backend_latency_offset * conn->input_rate);
+
+                    // debug(1,"latency offset is %" PRId32 ", input rate is %u", latency_offset,
+                    // conn->input_rate);
+                    int32_t adjusted_latency = latency_offset + (int32_t)la;
+                    if ((adjusted_latency < 0) ||
+                        (adjusted_latency >
+                         (int32_t)(conn->max_frames_per_packet *
+                                   (BUFFER_FRAMES - config.minimum_free_buffer_headroom))))
+                      warn("audio_backend_latency_offset out of range -- ignored.");
+                    else
+                      la = adjusted_latency;
 
-                  // here we have the latency but it does not yet account for the
-                  // audio_backend_latency_offset
-                  int32_t latency_offset =
-                      (int32_t)(config.audio_backend_latency_offset * conn->input_rate);
-
-                  // debug(1,"latency offset is %" PRId32 ", input rate is %u", latency_offset,
-                  // conn->input_rate);
-                  int32_t adjusted_latency = latency_offset + (int32_t)la;
-                  if ((adjusted_latency < 0) ||
-                      (adjusted_latency >
-                       (int32_t)(conn->max_frames_per_packet *
-                                 (BUFFER_FRAMES - config.minimum_free_buffer_headroom))))
-                    warn("audio_backend_latency_offset out of range -- ignored.");
-                  else
-                    la = adjusted_latency;
-
-                  if (la != conn->latency) {
-                    conn->latency = la;
-                    debug(2,
-                          "New latency: %" PRIu32 ", sync latency: %" PRIu32
-                          ", minimum latency: %" PRIu32 ", maximum "
-                          "latency: %" PRIu32 ", fixed offset: %" PRIu32
-                          ", audio_backend_latency_offset: %f.",
-                          conn->latency, sync_rtp_timestamp - rtp_timestamp_less_latency,
-                          conn->minimum_latency, conn->maximum_latency, config.fixedLatencyOffset,
-                          config.audio_backend_latency_offset);
+                    if (la != conn->latency) {
+                      conn->latency = la;
+                      debug(2,
+                            "New latency: %" PRIu32 ", sync latency: %" PRIu32
+                            ", minimum latency: %" PRIu32 ", maximum "
+                            "latency: %" PRIu32 ", fixed offset: %" PRIu32
+                            ", audio_backend_latency_offset: %f.",
+                            conn->latency, sync_rtp_timestamp - rtp_timestamp_less_latency,
+                            conn->minimum_latency, conn->maximum_latency, config.fixedLatencyOffset,
+                            config.audio_backend_latency_offset);
+                    }
                   }
                 }
-              }
 
-              // here, we apply the latency to the sync_rtp_timestamp
+                // here, we apply the latency to the sync_rtp_timestamp
 
-              sync_rtp_timestamp = sync_rtp_timestamp - conn->latency;
+                sync_rtp_timestamp = sync_rtp_timestamp - conn->latency;
 
-              debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
+                debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
 
-              if (conn->initial_reference_time == 0) {
-                if (conn->packet_count_since_flush > 0) {
-                  conn->initial_reference_time = remote_time_of_sync;
-                  conn->initial_reference_timestamp = sync_rtp_timestamp;
+                if (conn->initial_reference_time == 0) {
+                  if (conn->packet_count_since_flush > 0) {
+                    conn->initial_reference_time = remote_time_of_sync;
+                    conn->initial_reference_timestamp = sync_rtp_timestamp;
+                  }
+                } else {
+                  uint64_t remote_frame_time_interval =
+                      conn->anchor_time -
+                      conn->initial_reference_time; // here, this should never be zero
+                  if (remote_frame_time_interval) {
+                    conn->remote_frame_rate =
+                        (1.0E9 * (conn->anchor_rtptime - conn->initial_reference_timestamp)) /
+                        remote_frame_time_interval;
+                  } else {
+                    conn->remote_frame_rate = 0.0; // use as a flag.
+                  }
                 }
-              } else {
-                uint64_t remote_frame_time_interval =
-                    conn->anchor_time -
-                    conn->initial_reference_time; // here, this should never be zero
-                if (remote_frame_time_interval) {
-                  conn->remote_frame_rate =
-                      (1.0E9 * (conn->anchor_rtptime - conn->initial_reference_timestamp)) /
-                      remote_frame_time_interval;
+
+                // this is for debugging
+                uint64_t old_remote_reference_time = conn->anchor_time;
+                uint32_t old_reference_timestamp = conn->anchor_rtptime;
+                // int64_t old_latency_delayed_timestamp = conn->latency_delayed_timestamp;
+                if (conn->anchor_remote_info_is_valid != 0) {
+                  int64_t time_difference = remote_time_of_sync - conn->anchor_time;
+                  int32_t frame_difference = sync_rtp_timestamp - conn->anchor_rtptime;
+                  double time_difference_in_frames = (1.0 * time_difference * conn->input_rate) / 1000000000;
+                  double frame_change = frame_difference - time_difference_in_frames;
+                  debug(2,"AP1 control thread: set_ntp_anchor_info: rtptime: %" PRIu32 ", networktime: %" PRIx64 ", frame adjustment: %7.3f.", sync_rtp_timestamp, remote_time_of_sync, frame_change);
                 } else {
-                  conn->remote_frame_rate = 0.0; // use as a flag.
+                  debug(2,"AP1 control thread: set_ntp_anchor_info: rtptime: %" PRIu32 ", networktime: %" PRIx64 ".", sync_rtp_timestamp, remote_time_of_sync);            
                 }
-              }
 
-              // this is for debugging
-              uint64_t old_remote_reference_time = conn->anchor_time;
-              uint32_t old_reference_timestamp = conn->anchor_rtptime;
-              // int64_t old_latency_delayed_timestamp = conn->latency_delayed_timestamp;
-              if (conn->anchor_remote_info_is_valid != 0) {
-                int64_t time_difference = remote_time_of_sync - conn->anchor_time;
-                int32_t frame_difference = sync_rtp_timestamp - conn->anchor_rtptime;
-                double time_difference_in_frames = (1.0 * time_difference * conn->input_rate) / 1000000000;
-                double frame_change = frame_difference - time_difference_in_frames;
-                debug(2,"AP1 control thread: set_ntp_anchor_info: rtptime: %" PRIu32 ", networktime: %" PRIx64 ", frame adjustment: %7.3f.", sync_rtp_timestamp, remote_time_of_sync, frame_change);
+                conn->anchor_time = remote_time_of_sync;
+                // conn->reference_timestamp_time =
+                //    remote_time_of_sync - local_to_remote_time_difference_now(conn);
+                conn->anchor_rtptime = sync_rtp_timestamp;
+                conn->anchor_remote_info_is_valid = 1;
+                bump_timing_epoch(conn);
+
+                conn->latency_delayed_timestamp = rtp_timestamp_less_latency;
+                debug_mutex_unlock(&conn->reference_time_mutex, 0);
+
+                conn->reference_to_previous_time_difference =
+                    remote_time_of_sync - old_remote_reference_time;
+                if (old_reference_timestamp == 0)
+                  conn->reference_to_previous_frame_difference = 0;
+                else
+                  conn->reference_to_previous_frame_difference =
+                      sync_rtp_timestamp - old_reference_timestamp;
               } else {
-                debug(2,"AP1 control thread: set_ntp_anchor_info: rtptime: %" PRIu32 ", networktime: %" PRIx64 ".", sync_rtp_timestamp, remote_time_of_sync);            
+                debug(2, "Sync packet received before we got a timing packet back.");
               }
-
-              conn->anchor_time = remote_time_of_sync;
-              // conn->reference_timestamp_time =
-              //    remote_time_of_sync - local_to_remote_time_difference_now(conn);
-              conn->anchor_rtptime = sync_rtp_timestamp;
-              conn->anchor_remote_info_is_valid = 1;
-            
-            
-              conn->latency_delayed_timestamp = rtp_timestamp_less_latency;
-              debug_mutex_unlock(&conn->reference_time_mutex, 0);
-
-              conn->reference_to_previous_time_difference =
-                  remote_time_of_sync - old_remote_reference_time;
-              if (old_reference_timestamp == 0)
-                conn->reference_to_previous_frame_difference = 0;
-              else
-                conn->reference_to_previous_frame_difference =
-                    sync_rtp_timestamp - old_reference_timestamp;
-            } else {
-              debug(2, "Sync packet received before we got a timing packet back.");
-            }
-          } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
-            pktp = packet + 4;
-            plen -= 4;
-            seq_t seqno = ntohs(*(uint16_t *)(pktp + 2));
-            debug(3, "Control Receiver -- Retransmitted Audio Data Packet %u received.", seqno);
-
-            uint32_t actual_timestamp = ntohl(*(uint32_t *)(pktp + 4));
-
-            pktp += 12;
-            plen -= 12;
-
-            // check if packet contains enough content to be reasonable
-            if (plen >= 16) {
-              player_put_packet(1, seqno, actual_timestamp, pktp, plen,
-                                conn); // the '1' means is original format
-              continue;
-            } else {
-              debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
-            }
-          } else
-            debug(1, "Control Receiver -- Unknown RTP packet of type 0x%02X length %d, ignored.",
-                  packet[1], nread);
-        } else {
-          debug(3, "Control Receiver -- dropping a packet to simulate a bad network.");
+            } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
+              pktp = packet + 4;
+              plen -= 4;
+              seq_t seqno = ntohs(*(uint16_t *)(pktp + 2));
+              debug(3, "Control Receiver -- Retransmitted Audio Data Packet %u received.", seqno);
+
+              uint32_t actual_timestamp = ntohl(*(uint32_t *)(pktp + 4));
+
+              pktp += 12;
+              plen -= 12;
+
+              // check if packet contains enough content to be reasonable
+              if (plen >= 16) {
+                player_packet_t *packet_for_player =
+                    &packets_for_player[packets_for_player_count++];
+                packet_for_player->seqno = seqno;
+                packet_for_player->timestamp = actual_timestamp;
+                packet_for_player->data = pktp;
+                packet_for_player->len = plen;
+                continue;
+              } else {
+                debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
+              }
+            } else
+              debug(1, "Control Receiver -- Unknown RTP packet of type 0x%02X length %d, ignored.",
+                    packet[1], nread);
+          } else {
+            debug(3, "Control Receiver -- dropping a packet to simulate a bad network.");
+          }
         }
+        if (packets_for_player_count)
+          player_put_packets(1, packets_for_player, packets_for_player_count,
+                             conn); // the '1' means is original format
       } else {
 
         char em[1024];
@@ -569,6 +696,7 @@ void *rtp_control_receiver(void *arg) {
     }
   }
   debug(1, "Control RTP thread \"normal\" exit -- this can't happen. Hah!");
+  pthread_cleanup_pop(1); // free the packet buffers
   pthread_cleanup_pop(0); // don't execute anything here.
   debug(2, "Control RTP thread exit.");
   pthread_exit(NULL);
@@ -600,7 +728,6 @@ void *rtp_timing_sender(void *arg) {
   req.filler = 0;
   req.seqno = htons(7);
 
-  conn->time_ping_count = 0;
   while (1) {
     if (conn->rtsp_link_is_idle == 0) {
       if (conn->udp_clock_sender_is_initialised == 0) {
@@ -690,8 +817,176 @@ void rtp_timing_receiver_cleanup_handler(void *arg) {
   pthread_setcancelstate(oldState, NULL);
 }
 
+// The time ping history is a ring buffer, so adding a ping is O(1).
+// Rather than ageing every dispersion on every ping, each record keeps the log of its dispersion
+// less the ageing it would have had since sequence number zero. Comparing these is the same as
+// comparing the aged dispersions, so the record with the lowest aged dispersion can be kept at
+// the front of a monotonic deque. The sums for the least squares fit are kept up to date as
+// records are chosen and as they drop out of the history.
+
+static void time_ping_history_reset(rtsp_conn_info *conn) {
+  conn->time_ping_count = 0;
+  conn->time_ping_minima_start = 0;
+  conn->time_ping_minima_count = 0;
+  conn->time_ping_fit_count = 0;
+  conn->time_ping_fit_updates = 0;
+  conn->clock_kalman_updates = 0;
+}
+
+static void time_ping_fit_include(rtsp_conn_info *conn, time_ping_record *record, int sign) {
+  if ((conn->time_ping_fit_count == 0) && (sign > 0)) {
+    conn->time_ping_fit_local_base = record->local_time;
+    conn->time_ping_fit_remote_base = record->remote_time;
+    conn->time_ping_fit_sx = 0.0;
+    conn->time_ping_fit_sy = 0.0;
+    conn->time_ping_fit_sxx = 0.0;
+    conn->time_ping_fit_sxy = 0.0;
+  }
+  double x = (int64_t)(record->local_time - conn->time_ping_fit_local_base);
+  double y = (int64_t)(record->remote_time - conn->time_ping_fit_remote_base);
+  conn->time_ping_fit_sx += sign * x;
+  conn->time_ping_fit_sy += sign * y;
+  conn->time_ping_fit_sxx += sign * x * x;
+  conn->time_ping_fit_sxy += sign * x * y;
+  conn->time_ping_fit_count += sign;
+}
+
+// work the sums out from scratch every so often so rounding errors can't build up
+static void time_ping_fit_recalculate(rtsp_conn_info *conn) {
+  conn->time_ping_fit_count = 0;
+  int i;
+  for (i = 0; i < conn->time_ping_count; i++)
+    if (conn->time_pings[i].in_fit)
+      time_ping_fit_include(conn, &conn->time_pings[i], 1);
+  conn->time_ping_fit_updates = 0;
+}
+
+// add a ping to the history and return the record with the lowest aged dispersion
+static time_ping_record *time_ping_history_add(rtsp_conn_info *conn, uint64_t local_time,
+                                               uint64_t remote_time, uint64_t dispersion,
+                                               int sequence_number,
+                                               double log_of_ageing_factor,
+                                               int first_sequence_number_for_fit) {
+  time_ping_record *record = &conn->time_pings[sequence_number & (time_ping_history - 1)];
+  if (conn->time_ping_count == time_ping_history) {
+    // the oldest record is about to be overwritten
+    if (record->in_fit)
+      time_ping_fit_include(conn, record, -1);
+  } else {
+    conn->time_ping_count++;
+  }
+  record->local_time = local_time;
+  record->remote_time = remote_time;
+  record->dispersion = dispersion;
+  record->sequence_number = sequence_number;
+  record->chosen = 0;
+  record->in_fit = 0;
+  record->aged_dispersion_key = log(dispersion + 1.0) - sequence_number * log_of_ageing_factor;
+
+  // drop records that have left the history from the front of the deque
+  while ((conn->time_ping_minima_count) &&
+         (conn->time_ping_minima[conn->time_ping_minima_start] <=
+          sequence_number - time_ping_history)) {
+    conn->time_ping_minima_start = (conn->time_ping_minima_start + 1) & (time_ping_history - 1);
+    conn->time_ping_minima_count--;
+  }
+  // drop records that can never again be the lowest from the back
+  while (conn->time_ping_minima_count) {
+    int last = (conn->time_ping_minima_start + conn->time_ping_minima_count - 1) &
+               (time_ping_history - 1);
+    time_ping_record *last_record =
+        &conn->time_pings[conn->time_ping_minima[last] & (time_ping_history - 1)];
+    if (last_record->aged_dispersion_key < record->aged_dispersion_key)
+      break;
+    conn->time_ping_minima_count--;
+  }
+  conn->time_ping_minima[(conn->time_ping_minima_start + conn->time_ping_minima_count) &
+                         (time_ping_history - 1)] = sequence_number;
+  conn->time_ping_minima_count++;
+
+  time_ping_record *chosen =
+      &conn->time_pings[conn->time_ping_minima[conn->time_ping_minima_start] &
+                        (time_ping_history - 1)];
+  if (chosen->chosen == 0) {
+    chosen->chosen = 1; // record the fact that it has been used for timing
+    if (chosen->sequence_number >= first_sequence_number_for_fit) {
+      chosen->in_fit = 1;
+      time_ping_fit_include(conn, chosen, 1);
+    }
+  }
+  conn->time_ping_fit_updates++;
+  if (conn->time_ping_fit_updates >= time_ping_history)
+    time_ping_fit_recalculate(conn);
+  return chosen;
+}
+
+// A Kalman filter with the offset of the remote clock from the local clock and its skew as
+// state. Each ping is weighted by its return time, so there's no need to wait for a history
+// of pings to pick the best from.
+static void clock_kalman_update(rtsp_conn_info *conn, uint64_t local_time, uint64_t remote_time,
+                                uint64_t dispersion) {
+  // half the return time is the uncertainty in when the remote time was taken
+  const double measurement_floor = 50000.0; // ns
+  double measurement_variance =
+      (dispersion * 0.5) * (dispersion * 0.5) + measurement_floor * measurement_floor;
+  const double offset_noise = 1.0E6; // ns^2 per second -- a random walk of 1 us per root second
+  const double skew_noise = 1.0E-18; // per second -- a random walk of 1 ppb per root second
+
+  if (conn->clock_kalman_updates == 0) {
+    conn->clock_kalman_base = remote_time - local_time;
+    conn->clock_kalman_offset = 0.0;
+    // start with the last known drift, if any, for this source
+    conn->clock_kalman_skew = conn->local_to_remote_time_gradient - 1.0;
+    conn->clock_kalman_p[0][0] = measurement_variance;
+    conn->clock_kalman_p[0][1] = 0.0;
+    conn->clock_kalman_p[1][0] = 0.0;
+    conn->clock_kalman_p[1][1] = 100.0E-6 * 100.0E-6;
+  } else {
+    double dt = (int64_t)(local_time - conn->clock_kalman_time);
+    double dt_in_seconds = dt * 1.0E-9;
+    double(*p)[2] = conn->clock_kalman_p;
+
+    // predict
+    conn->clock_kalman_offset += conn->clock_kalman_skew * dt;
+    p[0][0] += dt * (p[0][1] + p[1][0]) + dt * dt * p[1][1] + offset_noise * dt_in_seconds;
+    p[0][1] += dt * p[1][1];
+    p[1][0] += dt * p[1][1];
+    p[1][1] += skew_noise * dt_in_seconds;
+
+    // update
+    double measured_offset = (int64_t)((remote_time - local_time) - conn->clock_kalman_base);
+    double innovation = measured_offset - conn->clock_kalman_offset;
+    double innovation_variance = p[0][0] + measurement_variance;
+    // ignore outliers once the filter has settled a little
+    if ((conn->clock_kalman_updates > 8) &&
+        (innovation * innovation > 25.0 * innovation_variance)) {
+      debug(2, "AP1 clock receiver thread: Kalman filter ignoring a ping %.3f ms off the estimate.",
+            innovation * 0.000001);
+    } else {
+      double k0 = p[0][0] / innovation_variance;
+      double k1 = p[1][0] / innovation_variance;
+      conn->clock_kalman_offset += k0 * innovation;
+      conn->clock_kalman_skew += k1 * innovation;
+      double p00 = p[0][0], p01 = p[0][1];
+      p[0][0] -= k0 * p00;
+      p[0][1] -= k0 * p01;
+      p[1][0] -= k1 * p00;
+      p[1][1] -= k1 * p01;
+    }
+  }
+  conn->clock_kalman_time = local_time;
+  conn->clock_kalman_updates++;
+
+  conn->local_to_remote_time_difference =
+      conn->clock_kalman_base + (int64_t)llround(conn->clock_kalman_offset);
+  conn->local_to_remote_time_difference_measurement_time = local_time;
+  conn->local_to_remote_time_gradient = 1.0 + conn->clock_kalman_skew;
+  conn->local_to_remote_time_gradient_sample_count = conn->clock_kalman_updates;
+}
+
 void *rtp_timing_receiver(void *arg) {
   debug(3, "rtp_timing_receiver start");
+  TRACE_THREAD_NAME("timing receiver");
   pthread_cleanup_push(rtp_timing_receiver_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
 
@@ -732,6 +1027,8 @@ void *rtp_timing_receiver(void *arg) {
   uint64_t dispersion_factor = (uint64_t)(multiplier * 100);
   if (dispersion_factor == 0)
     die("dispersion factor is zero!");
+  double log_of_ageing_factor = log(dispersion_factor / 100.0);
+  time_ping_history_reset(conn);
   // debug(1,"dispersion factor is %" PRIu64 ".", dispersion_factor);
 
   // uint64_t first_local_to_remote_time_difference_time;
@@ -743,8 +1040,15 @@ void *rtp_timing_receiver(void *arg) {
   double stat_mean = 0.0;
   // double stat_M2 = 0.0;
 
+  // use the kernel's receive timestamps, so that the time it takes for this thread to be
+  // scheduled doesn't count as part of the round trip time
+  if (rtp_enable_receive_timestamps(conn->timing_socket) != 0)
+    debug(2, "AP1 clock receiver thread: kernel receive timestamps are not available.");
+  uint64_t packet_arrival_time;
+
   while (1) {
-    nread = recv(conn->timing_socket, packet, sizeof(packet), 0);
+    nread = rtp_receive_timestamped(conn->timing_socket, packet, sizeof(packet),
+                                    &packet_arrival_time);
     if (conn->rtsp_link_is_idle == 0) {
       if (conn->udp_clock_is_initialised == 0) {
         debug(2,"AP1 clock receiver thread: initialised.");
@@ -756,12 +1060,13 @@ void *rtp_timing_receiver(void *arg) {
         sequence_number = 0;
         stat_n = 0;
         stat_mean = 0.0;
+        time_ping_history_reset(conn);
         conn->udp_clock_is_initialised = 1;
       }
       if (nread >= 0) {
         if ((config.diagnostic_drop_packet_fraction == 0.0) ||
             (drand48() > config.diagnostic_drop_packet_fraction)) {
-          arrival_time = get_absolute_time_in_ns();
+          arrival_time = packet_arrival_time;
 
           // ssize_t plen = nread;
           // debug(1,"Packet Received on Timing Port.");
@@ -810,29 +1115,17 @@ void *rtp_timing_receiver(void *arg) {
               else
                 debug(1, "Remote processing time greater than return time -- ignored.");
 
-              int cc;
-              // debug(1, "time ping history is %d entries.", time_ping_history);
-              for (cc = time_ping_history - 1; cc > 0; cc--) {
-                conn->time_pings[cc] = conn->time_pings[cc - 1];
-                // if ((conn->time_ping_count) && (conn->time_ping_count < 10))
-                //                conn->time_pings[cc].dispersion =
-                //                  conn->time_pings[cc].dispersion * pow(2.14,
-                //                  1.0/conn->time_ping_count);
-                if (conn->time_pings[cc].dispersion > UINT64_MAX / dispersion_factor)
-                  debug(1, "dispersion factor is too large at %" PRIu64 ".");
-                else
-                  conn->time_pings[cc].dispersion =
-                      (conn->time_pings[cc].dispersion * dispersion_factor) /
-                      100; // make the dispersions 'age' by this rational factor
-              }
+              // approximate time in seconds to let the system settle down
+              const int settling_time = 60;
+              // number of points to have for calculating a valid drift
+              const int sample_point_minimum = 8;
+
               // these are used for doing a least squares calculation to get the drift
-              conn->time_pings[0].local_time = arrival_time;
-              conn->time_pings[0].remote_time = distant_transmit_time + return_time / 2;
-              conn->time_pings[0].sequence_number = sequence_number++;
-              conn->time_pings[0].chosen = 0;
-              conn->time_pings[0].dispersion = return_time;
-              if (conn->time_ping_count < time_ping_history)
-                conn->time_ping_count++;
+              // pick the record with the least aged dispersion, and record that it's been chosen
+              time_ping_record *chosen = time_ping_history_add(
+                  conn, arrival_time, distant_transmit_time + return_time / 2, return_time,
+                  sequence_number++, log_of_ageing_factor,
+                  (settling_time / 3) + 1); // wait for a approximate settling time
 
               // here, calculate the mean and standard deviation of the return times
 
@@ -847,113 +1140,63 @@ void *rtp_timing_receiver(void *arg) {
               // %d packets: %.1f, %.1f, %.1f (nanoseconds).",
               //        stat_n,return_time,stat_mean, sqrtf(stat_M2 / (stat_n - 1)));
 
-              // here, pick the record with the least dispersion, and record that it's been chosen
-
-              // uint64_t local_time_chosen = arrival_time;
-              // uint64_t remote_time_chosen = distant_transmit_time;
-              // now pick the timestamp with the lowest dispersion
-              uint64_t rt = conn->time_pings[0].remote_time;
-              uint64_t lt = conn->time_pings[0].local_time;
-              uint64_t tld = conn->time_pings[0].dispersion;
-              int chosen = 0;
-              for (cc = 1; cc < conn->time_ping_count; cc++)
-                if (conn->time_pings[cc].dispersion < tld) {
-                  chosen = cc;
-                  rt = conn->time_pings[cc].remote_time;
-                  lt = conn->time_pings[cc].local_time;
-                  tld = conn->time_pings[cc].dispersion;
-                  // local_time_chosen = conn->time_pings[cc].local_time;
-                  // remote_time_chosen = conn->time_pings[cc].remote_time;
-                }
-              // debug(1,"Record %d has the lowest dispersion with %0.2f us
-              // dispersion.",chosen,1.0*((tld * 1000000) >> 32));
-              conn->time_pings[chosen].chosen = 1; // record the fact that it has been used for timing
-
-              conn->local_to_remote_time_difference =
-                  rt - lt; // make this the new local-to-remote-time-difference
-              conn->local_to_remote_time_difference_measurement_time = lt; // done at this time.
-
-              if (first_local_to_remote_time_difference == 0) {
-                first_local_to_remote_time_difference = conn->local_to_remote_time_difference;
-                // first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
-              }
-
-              // here, let's try to use the timing pings that were selected because of their short
-              // return times to
-              // estimate a figure for drift between the local clock (x) and the remote clock (y)
-
-              // if we plug in a local interval, we will get back what that is in remote time
-
-              // calculate the line of best fit for relating the local time and the remote time
-              // we will calculate the slope, which is the drift
-              // see https://www.varsitytutors.com/hotmath/hotmath_help/topics/line-of-best-fit
-
-              uint64_t y_bar = 0; // remote timestamp average
-              uint64_t x_bar = 0; // local timestamp average
-              int sample_count = 0;
+              if (config.clock_estimator == CE_kalman) {
+                clock_kalman_update(conn, arrival_time, distant_transmit_time + return_time / 2,
+                                    return_time);
+              } else {
+                conn->local_to_remote_time_difference =
+                    chosen->remote_time -
+                    chosen->local_time; // make this the new local-to-remote-time-difference
+                conn->local_to_remote_time_difference_measurement_time =
+                    chosen->local_time; // done at this time.
+
+                // here, let's try to use the timing pings that were selected because of their
+                // short return times to estimate a figure for drift between the local clock (x)
+                // and the remote clock (y)
+
+                // if we plug in a local interval, we will get back what that is in remote time
+
+                // calculate the line of best fit for relating the local time and the remote time
+                // we will calculate the slope, which is the drift
+                // see https://www.varsitytutors.com/hotmath/hotmath_help/topics/line-of-best-fit
+
+                int sample_count = conn->time_ping_fit_count;
+                conn->local_to_remote_time_gradient_sample_count = sample_count;
+                if (sample_count > sample_point_minimum) {
+                  double x_sum = conn->time_ping_fit_sx;
+                  double y_sum = conn->time_ping_fit_sy;
+                  double mtl = conn->time_ping_fit_sxy - x_sum * y_sum / sample_count;
+                  double mbl = conn->time_ping_fit_sxx - x_sum * x_sum / sample_count;
+                  if (mbl > 0.0)
+                    conn->local_to_remote_time_gradient = mtl / mbl;
+                  else {
+                    // conn->local_to_remote_time_gradient = 1.0;
+                    debug(1, "mbl is zero. Drift remains at %.2f ppm.",
+                          (conn->local_to_remote_time_gradient - 1.0) * 1000000);
+                  }
 
-              // approximate time in seconds to let the system settle down
-              const int settling_time = 60;
-              // number of points to have for calculating a valid drift
-              const int sample_point_minimum = 8;
-              for (cc = 0; cc < conn->time_ping_count; cc++)
-                if ((conn->time_pings[cc].chosen) &&
-                    (conn->time_pings[cc].sequence_number >
-                     (settling_time / 3))) { // wait for a approximate settling time
-                                             // have to scale them down so that the sum, possibly over
-                                             // every term in the array, doesn't overflow
-                  y_bar += (conn->time_pings[cc].remote_time >> time_ping_history_power_of_two);
-                  x_bar += (conn->time_pings[cc].local_time >> time_ping_history_power_of_two);
-                  sample_count++;
-                }
-              conn->local_to_remote_time_gradient_sample_count = sample_count;
-              if (sample_count > sample_point_minimum) {
-                y_bar = y_bar / sample_count;
-                x_bar = x_bar / sample_count;
-
-                int64_t xid, yid;
-                double mtl, mbl;
-                mtl = 0;
-                mbl = 0;
-                for (cc = 0; cc < conn->time_ping_count; cc++)
-                  if ((conn->time_pings[cc].chosen) &&
-                      (conn->time_pings[cc].sequence_number > (settling_time / 3))) {
-
-                    uint64_t slt = conn->time_pings[cc].local_time >> time_ping_history_power_of_two;
-                    if (slt > x_bar)
-                      xid = slt - x_bar;
-                    else
-                      xid = -(x_bar - slt);
+                  // the means, relative to the base times
+                  uint64_t xbf = conn->time_ping_fit_local_base +
+                                 (int64_t)llround(x_sum / sample_count);
+                  uint64_t ybf = conn->time_ping_fit_remote_base +
+                                 (int64_t)llround(y_sum / sample_count);
 
-                    uint64_t srt = conn->time_pings[cc].remote_time >> time_ping_history_power_of_two;
-                    if (srt > y_bar)
-                      yid = srt - y_bar;
-                    else
-                      yid = -(y_bar - srt);
+                  conn->local_to_remote_time_difference =
+                      ybf - xbf; // make this the new local-to-remote-time-difference
+                  conn->local_to_remote_time_difference_measurement_time = xbf;
 
-                    mtl = mtl + (1.0 * xid) * yid;
-                    mbl = mbl + (1.0 * xid) * xid;
-                  }
-                if (mbl)
-                  conn->local_to_remote_time_gradient = mtl / mbl;
-                else {
-                  // conn->local_to_remote_time_gradient = 1.0;
-                  debug(1, "mbl is zero. Drift remains at %.2f ppm.",
+                } else {
+                  debug(3, "not enough samples to estimate drift -- remaining at %.2f ppm.",
                         (conn->local_to_remote_time_gradient - 1.0) * 1000000);
+                  // conn->local_to_remote_time_gradient = 1.0;
                 }
+              }
 
-                // scale the numbers back up
-                uint64_t ybf = y_bar << time_ping_history_power_of_two;
-                uint64_t xbf = x_bar << time_ping_history_power_of_two;
+              bump_timing_epoch(conn);
 
-                conn->local_to_remote_time_difference =
-                    ybf - xbf; // make this the new local-to-remote-time-difference
-                conn->local_to_remote_time_difference_measurement_time = xbf;
-
-              } else {
-                debug(3, "not enough samples to estimate drift -- remaining at %.2f ppm.",
-                      (conn->local_to_remote_time_gradient - 1.0) * 1000000);
-                // conn->local_to_remote_time_gradient = 1.0;
+              if (first_local_to_remote_time_difference == 0) {
+                first_local_to_remote_time_difference = conn->local_to_remote_time_difference;
+                // first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
               }
               // debug(1,"local to remote time gradient is %12.2f ppm, based on %d
               // samples.",conn->local_to_remote_time_gradient*1000000,sample_count);
@@ -1103,6 +1346,7 @@ void reset_ntp_anchor_info(rtsp_conn_info *conn) {
   conn->anchor_remote_info_is_valid = 0;
   conn->anchor_rtptime = 0;
   conn->anchor_time = 0;
+  bump_timing_epoch(conn);
   debug_mutex_unlock(&conn->reference_time_mutex, 3);
 }
 
@@ -1116,29 +1360,45 @@ int have_ntp_timing_information(rtsp_conn_info *conn) {
 // the timestamp is a timestamp calculated at the input rate
 // the reference timestamps are denominated in terms of the input rate
 
+// Bring the NTP frame-time mapping up to date. Call with the reference_time_mutex held.
+// The remote time of a frame is anchor_time plus the nominal interval from anchor_rtptime and
+// the remote clock runs local_to_remote_time_gradient times as fast as the local clock,
+// so the mapping is affine in the local time.
+static int ntp_frame_time_mapping(rtsp_conn_info *conn) {
+  frame_time_mapping_t *mapping = &conn->frame_time_mapping;
+  uint32_t epoch = conn->timing_epoch;
+  __sync_synchronize(); // read the epoch before the information it covers
+  if (conn->anchor_remote_info_is_valid == 0) {
+    mapping->valid = 0;
+    return -1;
+  }
+  if ((mapping->valid == 0) || (mapping->is_ptp != 0) || (mapping->epoch != epoch)) {
+    double gradient = conn->local_to_remote_time_gradient;
+    if (gradient <= 0.0)
+      gradient = 1.0;
+    uint64_t measurement_time = conn->local_to_remote_time_difference_measurement_time;
+    int64_t remote_interval =
+        conn->anchor_time - measurement_time - conn->local_to_remote_time_difference;
+    uint64_t anchor_local_time = measurement_time + llround(remote_interval / gradient);
+    frame_time_mapping_set(mapping, conn->anchor_rtptime, anchor_local_time, 44100 * gradient);
+    mapping->is_ptp = 0;
+    mapping->epoch = epoch;
+    mapping->valid = 1;
+  }
+  return 0;
+}
+
+// the timestamp is a timestamp calculated at the input rate
+// the reference timestamps are denominated in terms of the input rate
+
 int frame_to_ntp_local_time(uint32_t timestamp, uint64_t *time, rtsp_conn_info *conn) {
   // a zero result is good
   if (conn->anchor_remote_info_is_valid == 0)
     debug(1,"no anchor information");
   debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
-  int result = -1;
-   if (conn->anchor_remote_info_is_valid != 0) {
-    uint64_t remote_time_of_timestamp;
-    int32_t timestamp_interval = timestamp - conn->anchor_rtptime;
-    int64_t timestamp_interval_time = timestamp_interval;
-    timestamp_interval_time = timestamp_interval_time * 1000000000;
-    timestamp_interval_time =
-        timestamp_interval_time / 44100;            // this is the nominal time, based on the
-                                                    // fps specified between current and
-                                                    // previous sync frame.
-    remote_time_of_timestamp =
-        conn->anchor_time + timestamp_interval_time; // based on the reference timestamp time
-                                                     // plus the time interval calculated based
-                                                     // on the specified fps.
-    if (time != NULL)
-      *time = remote_time_of_timestamp - local_to_remote_time_difference_now(conn);
-    result = 0;
-  }
+  int result = ntp_frame_time_mapping(conn);
+  if ((result == 0) && (time != NULL))
+    *time = frame_time_mapping_time(&conn->frame_time_mapping, timestamp);
   debug_mutex_unlock(&conn->reference_time_mutex, 0);
   return result;
 }
@@ -1146,29 +1406,15 @@ int frame_to_ntp_local_time(uint32_t timestamp, uint64_t *time, rtsp_conn_info *
 int local_ntp_time_to_frame(uint64_t time, uint32_t *frame, rtsp_conn_info *conn) {
   // a zero result is good
   debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
-  int result = -1;
-   if (conn->anchor_remote_info_is_valid != 0) {
-    // first, get from [local] time to remote time.
-    uint64_t remote_time = time + local_to_remote_time_difference_now(conn);
-    // next, get the remote time interval from the remote_time to the reference time
-    // here, we calculate the time interval, in terms of remote time
-    int64_t offset = remote_time - conn->anchor_time;
-    // now, convert the remote time interval into frames using the frame rate we have observed or
-    // which has been nominated
-    int64_t frame_interval = 0;
-    frame_interval = (offset * 44100) / 1000000000;
-    int32_t frame_interval_32 = frame_interval;
-    uint32_t new_frame = conn->anchor_rtptime + frame_interval_32;
-    // debug(1,"frame is %u.", new_frame);
-    if (frame != NULL)
-      *frame = new_frame;
-    result = 0;
-  }  
+  int result = ntp_frame_time_mapping(conn);
+  if ((result == 0) && (frame != NULL))
+    *frame = frame_time_mapping_frame(&conn->frame_time_mapping, time);
   debug_mutex_unlock(&conn->reference_time_mutex, 0);
   return result;
 }
 
 void rtp_request_resend(seq_t first, uint32_t count, rtsp_conn_info *conn) {
+  TRACE_INSTANT("resend request", count);
   // debug(1, "rtp_request_resend of %u packets from sequence number %u.", count, first);
   if (conn->rtp_running) {
     // if (!request_sent) {
@@ -1316,12 +1562,14 @@ void set_ptp_anchor_info(rtsp_conn_info *conn, uint64_t clock_id, uint32_t rtpti
   conn->anchor_rtptime = rtptime;
   conn->anchor_time = networktime;
   conn->anchor_clock = clock_id;
+  bump_timing_epoch(conn);
 }
 
 void reset_ptp_anchor_info(rtsp_conn_info *conn) {
   debug(2, "Connection %d: Clear anchor information.", conn->connection_number);
   conn->last_anchor_info_is_valid = 0;
   conn->anchor_remote_info_is_valid = 0;
+  bump_timing_epoch(conn);
 }
 
 int long_time_notifcation_done = 0;
@@ -1332,8 +1580,13 @@ int get_ptp_anchor_local_time_info(rtsp_conn_info *conn, uint32_t *anchorRTP,
   uint64_t actual_clock_id;
   if (conn->rtsp_link_is_idle == 0) {
     uint64_t actual_time_of_sample, actual_offset, start_of_mastership;
-    response = ptp_get_clock_info(&actual_clock_id, &actual_time_of_sample, &actual_offset,
-                                      &start_of_mastership);
+    // the calling thread's snapshot is only refreshed when NQPTP has updated its clock record
+    ptp_clock_snapshot snapshot;
+    response = ptp_get_cached_clock_snapshot(&snapshot);
+    actual_clock_id = snapshot.actual_clock_id;
+    actual_time_of_sample = snapshot.time_of_sample;
+    actual_offset = snapshot.raw_offset;
+    start_of_mastership = snapshot.mastership_start_time;
     if (response == clock_ok) {
       uint64_t time_now = get_absolute_time_in_ns();
       int64_t time_since_sample = time_now - actual_time_of_sample;
@@ -1359,7 +1612,9 @@ int get_ptp_anchor_local_time_info(rtsp_conn_info *conn, uint32_t *anchorRTP,
           if (conn->last_anchor_info_is_valid == 0)
             conn->last_anchor_validity_start_time = start_of_mastership;
           conn->last_anchor_info_is_valid = 1;
+          conn->last_anchor_clock_is_master = 1;
         } else {
+          conn->last_anchor_clock_is_master = 0;
           debug(3, "Current master clock %" PRIx64 " and anchor_clock %" PRIx64 " are different",
                 actual_clock_id, conn->anchor_clock);
           // the anchor clock and the actual clock are different
@@ -1385,6 +1640,7 @@ int get_ptp_anchor_local_time_info(rtsp_conn_info *conn, uint32_t *anchorRTP,
 
               conn->anchor_time = conn->last_anchor_local_time + actual_offset;
               conn->anchor_clock = actual_clock_id;
+              bump_timing_epoch(conn);
           
             }
           
@@ -1444,6 +1700,7 @@ int get_ptp_anchor_local_time_info(rtsp_conn_info *conn, uint32_t *anchorRTP,
       break;
     }
     conn->clock_status = response;
+    bump_timing_epoch(conn); // a mapping made under the old status mustn't be reused
   }
 
   if (conn->last_anchor_info_is_valid != 0) {
@@ -1463,42 +1720,61 @@ int have_ptp_timing_information(rtsp_conn_info *conn) {
     return 0;
 }
 
-int frame_to_ptp_local_time(uint32_t timestamp, uint64_t *time, rtsp_conn_info *conn) {
-  int result = -1;
+// Bring the PTP frame-time mapping up to date. Call with the reference_time_mutex held.
+// It can be reused without consulting NQPTP until the anchor, the clock status or NQPTP's clock
+// record changes.
+static int ptp_frame_time_mapping(rtsp_conn_info *conn) {
+  frame_time_mapping_t *mapping = &conn->frame_time_mapping;
+  uint32_t epoch = conn->timing_epoch;
+  uint32_t sequence_number = ptp_get_clock_sequence_number();
+  __sync_synchronize(); // read the epoch before the information it covers
+  if ((mapping->valid != 0) && (mapping->is_ptp != 0) && (mapping->epoch == epoch) &&
+      (sequence_number != 0) && (mapping->ptp_sequence_number == sequence_number) &&
+      (mapping->input_rate == conn->input_rate) && (conn->rtsp_link_is_idle == 0) &&
+      (conn->clock_status == clock_ok) && (conn->last_anchor_info_is_valid != 0)) {
+    // the anchor is still current, just as get_ptp_anchor_local_time_info would have found
+    conn->last_anchor_time_of_update = get_absolute_time_in_ns();
+    return 0;
+  }
+  mapping->valid = 0;
   uint32_t anchor_rtptime = 0;
   uint64_t anchor_local_time = 0;
-  if (get_ptp_anchor_local_time_info(conn, &anchor_rtptime, &anchor_local_time) == clock_ok) {
-    int32_t frame_difference = timestamp - anchor_rtptime;
-    int64_t time_difference = frame_difference;
-    time_difference = time_difference * 1000000000;
-    if (conn->input_rate == 0)
-      die("conn->input_rate is zero!");
-    time_difference = time_difference / conn->input_rate;
-    uint64_t ltime = anchor_local_time + time_difference;
-    *time = ltime;
-    result = 0;
-  } else {
+  if (get_ptp_anchor_local_time_info(conn, &anchor_rtptime, &anchor_local_time) != clock_ok)
+    return -1;
+  if (conn->input_rate == 0)
+    die("conn->input_rate is zero!");
+  frame_time_mapping_set(mapping, anchor_rtptime, anchor_local_time, conn->input_rate);
+  mapping->is_ptp = 1;
+  mapping->epoch = epoch;
+  mapping->input_rate = conn->input_rate;
+  // while the master clock is changing over, the anchor information must be checked every time
+  if (conn->last_anchor_clock_is_master != 0)
+    mapping->ptp_sequence_number = sequence_number;
+  else
+    mapping->ptp_sequence_number = 0;
+  mapping->valid = 1;
+  return 0;
+}
+
+int frame_to_ptp_local_time(uint32_t timestamp, uint64_t *time, rtsp_conn_info *conn) {
+  debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
+  int result = ptp_frame_time_mapping(conn);
+  if (result == 0)
+    *time = frame_time_mapping_time(&conn->frame_time_mapping, timestamp);
+  else
     debug(3, "frame_to_ptp_local_time can't get anchor local time information");
-  }
+  debug_mutex_unlock(&conn->reference_time_mutex, 0);
   return result;
 }
 
 int local_ptp_time_to_frame(uint64_t time, uint32_t *frame, rtsp_conn_info *conn) {
-  int result = -1;
-  uint32_t anchor_rtptime = 0;
-  uint64_t anchor_local_time = 0;
-  if (get_ptp_anchor_local_time_info(conn, &anchor_rtptime, &anchor_local_time) == clock_ok) {
-    int64_t time_difference = time - anchor_local_time;
-    int64_t frame_difference = time_difference;
-    frame_difference = frame_difference * conn->input_rate; // but this is by 10^9
-    frame_difference = frame_difference / 1000000000;
-    int32_t fd32 = frame_difference;
-    uint32_t lframe = anchor_rtptime + fd32;
-    *frame = lframe;
-    result = 0;
-  } else {
+  debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
+  int result = ptp_frame_time_mapping(conn);
+  if (result == 0)
+    *frame = frame_time_mapping_frame(&conn->frame_time_mapping, time);
+  else
     debug(3, "local_ptp_time_to_frame can't get anchor local time information");
-  }
+  debug_mutex_unlock(&conn->reference_time_mutex, 0);
   return result;
 }
 
@@ -1640,11 +1916,14 @@ void rtp_ap2_control_handler_cleanup_handler(void *arg) {
          // recreated (needed for resend requests in the realtime mode)
 }
 
-int32_t decipher_player_put_packet(uint8_t *ciphered_audio_alt, ssize_t nread,
-                                   rtsp_conn_info *conn) {
+// decipher a packet into m, which must be at least 4096 bytes, and describe it in deciphered.
+// deciphered->data is left NULL if it can't be deciphered
+static int32_t decipher_packet(uint8_t *ciphered_audio_alt, ssize_t nread, unsigned char *m,
+                               player_packet_t *deciphered, rtsp_conn_info *conn) {
 
   // this deciphers the packet -- it doesn't decode it from ALAC
   uint16_t sequence_number = 0;
+  deciphered->data = NULL;
 
   // if the packet is too small, don't go ahead.
   // it must contain an uint16_t sequence number and eight bytes of AAD followed by the
@@ -1678,7 +1957,6 @@ int32_t decipher_player_put_packet(uint8_t *ciphered_audio_alt, ssize_t nread,
       // https://libsodium.gitbook.io/doc/secret-key_cryptography/aead/chacha20-poly1305/ietf_chacha20-poly1305_construction
       // Note: the eight-byte nonce must be front-padded out to 12 bytes.
 
-      unsigned char m[4096];
       unsigned long long new_payload_length = 0;
       int response = crypto_aead_chacha20poly1305_ietf_decrypt(
           m,                   // m
@@ -1701,8 +1979,10 @@ int32_t decipher_player_put_packet(uint8_t *ciphered_audio_alt, ssize_t nread,
         debug(1, "Madly long payload length!");
       int plen = new_payload_length; //
       // debug(1,"                                                        Write packet to buffer %d, timestamp %u.", sequence_number, timestamp);
-      player_put_packet(1, sequence_number, timestamp, m, plen,
-                        conn); // the '1' means is original format
+      deciphered->seqno = sequence_number;
+      deciphered->timestamp = timestamp;
+      deciphered->data = m;
+      deciphered->len = plen;
     } else {
       debug(2, "No session key, so the audio packet can not be deciphered -- skipped.");
     }
@@ -1713,7 +1993,18 @@ int32_t decipher_player_put_packet(uint8_t *ciphered_audio_alt, ssize_t nread,
   }
 }
 
+int32_t decipher_player_put_packet(uint8_t *ciphered_audio_alt, ssize_t nread,
+                                   rtsp_conn_info *conn) {
+  unsigned char m[4096];
+  player_packet_t deciphered;
+  int32_t seqno = decipher_packet(ciphered_audio_alt, nread, m, &deciphered, conn);
+  if (deciphered.data != NULL)
+    player_put_packets(1, &deciphered, 1, conn); // the '1' means is original format
+  return seqno;
+}
+
 void *rtp_ap2_control_receiver(void *arg) {
+  TRACE_THREAD_NAME("ap2 control receiver");
   pthread_cleanup_push(rtp_ap2_control_handler_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
   uint8_t packet[4096];
@@ -1896,60 +2187,91 @@ void rtp_realtime_audio_cleanup_handler(__attribute__((unused)) void *arg) {
 }
 
 void *rtp_realtime_audio_receiver(void *arg) {
+  TRACE_THREAD_NAME("realtime audio receiver");
   pthread_cleanup_push(rtp_realtime_audio_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-  uint8_t packet[4096];
+  uint8_t *packet;
   int32_t last_seqno = -1;
+
+  // take all the packets waiting in one call, decipher them and pass them to the player in one go
+  rtp_batch batch;
+  if (rtp_batch_init(&batch, "Realtime audio receiver", 4096) != 0)
+    die("Could not allocate packet buffers for the realtime audio receiver.");
+  pthread_cleanup_push(rtp_batch_free, &batch);
+  unsigned char *deciphered_packets = malloc(RTP_BATCH_SIZE * 4096);
+  if (deciphered_packets == NULL)
+    die("Could not allocate deciphered packet buffers for the realtime audio receiver.");
+  pthread_cleanup_push(malloc_cleanup, deciphered_packets);
+  player_packet_t packets_for_player[RTP_BATCH_SIZE];
+
   ssize_t nread;
   while (1) {
-    nread = recv(conn->realtime_audio_socket, packet, sizeof(packet), 0);
+    int packets_received = rtp_batch_receive(conn->realtime_audio_socket, &batch);
+    if (packets_received < 0) {
+      debug(1, "Realtime Audio Receiver -- error receiving a packet.");
+      continue;
+    }
+    int packets_for_player_count = 0;
+    int batch_index;
+    for (batch_index = 0; batch_index < packets_received; batch_index++) {
+      packet = RTP_BATCH_PACKET(&batch, batch_index);
+      nread = batch.lengths[batch_index];
 
-    if (nread > 36) { // 36 is the 12-byte header and and 24-byte footer
-      if ((config.diagnostic_drop_packet_fraction == 0.0) ||
-          (drand48() > config.diagnostic_drop_packet_fraction)) {
+      if (nread > 36) { // 36 is the 12-byte header and and 24-byte footer
+        if ((config.diagnostic_drop_packet_fraction == 0.0) ||
+            (drand48() > config.diagnostic_drop_packet_fraction)) {
 
-        /*
-                char *packet_in_hex_cstring =
-                    debug_malloc_hex_cstring(packet, nread); // remember to free this afterwards
-                debug(1, "Audio Receiver Packet of type 0x%02X length %d received: \"%s\".",
-                packet[1], nread, packet_in_hex_cstring);
-                free(packet_in_hex_cstring);
-        */
+          /*
+                  char *packet_in_hex_cstring =
+                      debug_malloc_hex_cstring(packet, nread); // remember to free this afterwards
+                  debug(1, "Audio Receiver Packet of type 0x%02X length %d received: \"%s\".",
+                  packet[1], nread, packet_in_hex_cstring);
+                  free(packet_in_hex_cstring);
+          */
 
-        /*
-        // debug(1, "Realtime Audio Receiver Packet of type 0x%02X length %d received.", packet[1],
-        nread);
-        // now get hold of its various bits and pieces
-        uint8_t version = (packet[0] & 0b11000000) >> 6;
-        uint8_t padding = (packet[0] & 0b00100000) >> 5;
-        uint8_t extension = (packet[0] & 0b00010000) >> 4;
-        uint8_t csrc_count = packet[0] & 0b00001111;
-        uint8_t marker = (packet[1] & 0b1000000) >> 7;
-        uint8_t payload_type = packet[1] & 0b01111111;
-        */
-        // if (have_ptp_timing_information(conn)) {
-        if (1) {
-        int32_t seqno = decipher_player_put_packet(packet + 2, nread - 2, conn);
-        if (seqno >= 0) {
-          if (last_seqno == -1) {
-            last_seqno = seqno;
+          /*
+          // debug(1, "Realtime Audio Receiver Packet of type 0x%02X length %d received.",
+          packet[1], nread);
+          // now get hold of its various bits and pieces
+          uint8_t version = (packet[0] & 0b11000000) >> 6;
+          uint8_t padding = (packet[0] & 0b00100000) >> 5;
+          uint8_t extension = (packet[0] & 0b00010000) >> 4;
+          uint8_t csrc_count = packet[0] & 0b00001111;
+          uint8_t marker = (packet[1] & 0b1000000) >> 7;
+          uint8_t payload_type = packet[1] & 0b01111111;
+          */
+          player_packet_t *packet_for_player = &packets_for_player[packets_for_player_count];
+          int32_t seqno =
+              decipher_packet(packet + 2, nread - 2, deciphered_packets + batch_index * 4096,
+                              packet_for_player, conn);
+          if (packet_for_player->data != NULL)
+            packets_for_player_count++;
+          if (seqno >= 0) {
+            if (last_seqno == -1) {
+              last_seqno = seqno;
+            } else {
+              last_seqno = (last_seqno + 1) & 0xffff;
+              // if (seqno != last_seqno)
+              //  debug(3, "RTP: Packets out of sequence: expected: %d, got %d.", last_seqno,
+              //  seqno);
+              last_seqno = seqno; // reset warning...
+            }
           } else {
-            last_seqno = (last_seqno + 1) & 0xffff;
-            // if (seqno != last_seqno)
-            //  debug(3, "RTP: Packets out of sequence: expected: %d, got %d.", last_seqno, seqno);
-            last_seqno = seqno; // reset warning...
+            debug(1, "Realtime Audio Receiver -- bad packet dropped.");
           }
         } else {
-          debug(1, "Realtime Audio Receiver -- bad packet dropped.");
-        }
+          debug(3, "Realtime Audio Receiver -- dropping a packet.");
         }
       } else {
-        debug(3, "Realtime Audio Receiver -- dropping a packet.");
+        debug(1, "Realtime Audio Receiver -- error receiving a packet.");
       }
-    } else {
-      debug(1, "Realtime Audio Receiver -- error receiving a packet.");
     }
+    if (packets_for_player_count)
+      player_put_packets(1, packets_for_player, packets_for_player_count,
+                         conn); // the '1' means is original format
   }
+  pthread_cleanup_pop(1); // free the deciphered packet buffers
+  pthread_cleanup_pop(1); // free the packet buffers
   pthread_cleanup_pop(0); // don't execute anything here.
   pthread_exit(NULL);
 }
@@ -1988,6 +2310,7 @@ ssize_t buffered_read(buffered_tcp_desc *descriptor, void *buf, size_t count,
     if (descriptor->toq == descriptor->buffer + descriptor->buffer_max_size)
       descriptor->toq = descriptor->buffer;
     descriptor->buffer_occupancy -= bytes_to_move;
+    descriptor->stream_bytes_out += bytes_to_move;
     if (bytes_remaining != NULL)
       *bytes_remaining = descriptor->buffer_occupancy;
     response = bytes_to_move;
@@ -2004,6 +2327,88 @@ ssize_t buffered_read(buffered_tcp_desc *descriptor, void *buf, size_t count,
   return response;
 }
 
+// the difference a - b between two 24-bit sequence numbers, taking wraparound into account
+// -- positive if a is after b, as in mod32Difference
+static inline int32_t seq24Difference(uint32_t a, uint32_t b) {
+  return ((int32_t)((a - b) << 8)) / (1 << 8);
+}
+
+// discard everything in the buffer before the block with sequence number seq_no, if the
+// block index knows where it is. If seq_no hasn't arrived yet, discard everything before the
+// most recent block indexed, so long as it precedes seq_no.
+// returns the block_number of the block now at the front of the buffer, or -1 if nothing was
+// skipped
+int64_t buffered_skip_to_block(buffered_tcp_desc *descriptor, uint32_t seq_no) {
+  int64_t response = -1;
+  if (pthread_mutex_lock(&descriptor->mutex) != 0)
+    debug(1, "problem with mutex");
+  pthread_cleanup_push(mutex_unlock, (void *)&descriptor->mutex);
+  if ((descriptor->block_index != NULL) && (descriptor->block_index_lost == 0) &&
+      (descriptor->blocks_indexed != 0)) {
+    buffered_block_index_entry *entry =
+        &descriptor->block_index[seq_no & (BUFFERED_BLOCK_INDEX_SIZE - 1)];
+    if ((entry->valid == 0) || (entry->seq_no != seq_no)) {
+      // not here (yet), so try the latest block we know about
+      entry = NULL;
+      if (seq24Difference(seq_no, descriptor->last_indexed_seq_no) > 0) {
+        entry = &descriptor->block_index[descriptor->last_indexed_seq_no &
+                                         (BUFFERED_BLOCK_INDEX_SIZE - 1)];
+        if ((entry->valid == 0) || (entry->seq_no != descriptor->last_indexed_seq_no))
+          entry = NULL;
+      }
+    }
+    if ((entry != NULL) && (entry->stream_offset > descriptor->stream_bytes_out) &&
+        (entry->stream_offset <= descriptor->stream_bytes_in)) {
+      size_t bytes_to_skip = entry->stream_offset - descriptor->stream_bytes_out;
+      size_t toq_offset = descriptor->toq - descriptor->buffer;
+      descriptor->toq =
+          descriptor->buffer + ((toq_offset + bytes_to_skip) % descriptor->buffer_max_size);
+      descriptor->buffer_occupancy -= bytes_to_skip;
+      descriptor->stream_bytes_out += bytes_to_skip;
+      debug(3, "buffered_skip_to_block: skipped %zu bytes to block %u, rtptime %u.",
+            bytes_to_skip, entry->seq_no, entry->rtptime);
+      response = entry->block_number;
+      if (pthread_cond_signal(&descriptor->not_full_cv))
+        debug(1, "Error signalling");
+    }
+  }
+  pthread_cleanup_pop(1); // release the mutex
+  return response;
+}
+
+// called with the descriptor mutex held after new bytes have been added
+// each block is a two-byte length (which includes itself) followed by the block,
+// which has a 24-bit sequence number at offset 1 and the rtptime at offset 4
+void buffered_tcp_index_blocks(buffered_tcp_desc *descriptor) {
+  while ((descriptor->block_index_lost == 0) &&
+         (descriptor->next_block_offset + 2 + 8 <= descriptor->stream_bytes_in)) {
+    uint8_t header[2 + 8];
+    unsigned int i;
+    for (i = 0; i < sizeof(header); i++)
+      header[i] = descriptor->buffer[(descriptor->next_block_offset + i) %
+                                     descriptor->buffer_max_size];
+    uint16_t length = nctohs(header);
+    if (length < sizeof(header)) {
+      debug(1, "buffered audio block of impossible length %u -- the block index is disabled.",
+            length);
+      descriptor->block_index_lost = 1;
+    } else {
+      uint32_t seq_no = header[3] * (1 << 16) + header[4] * (1 << 8) + header[5];
+      buffered_block_index_entry *entry =
+          &descriptor->block_index[seq_no & (BUFFERED_BLOCK_INDEX_SIZE - 1)];
+      entry->stream_offset = descriptor->next_block_offset;
+      entry->block_number = descriptor->blocks_indexed;
+      entry->seq_no = seq_no;
+      entry->rtptime = nctohl(header + 6);
+      entry->length = length;
+      entry->valid = 1;
+      descriptor->last_indexed_seq_no = seq_no;
+      descriptor->blocks_indexed++;
+      descriptor->next_block_offset += length;
+    }
+  }
+}
+
 #define STANDARD_PACKET_SIZE 4096
 
 void buffered_tcp_reader_cleanup_handler(__attribute__((unused)) void *arg) {
@@ -2011,6 +2416,7 @@ void buffered_tcp_reader_cleanup_handler(__attribute__((unused)) void *arg) {
 }
 
 void *buffered_tcp_reader(void *arg) {
+  TRACE_THREAD_NAME("buffered reader");
   pthread_cleanup_push(buffered_tcp_reader_cleanup_handler, NULL);
   buffered_tcp_desc *descriptor = (buffered_tcp_desc *)arg;
 
@@ -2072,6 +2478,9 @@ void *buffered_tcp_reader(void *arg) {
     } else if (nread > 0) {
       descriptor->eoq += nread;
       descriptor->buffer_occupancy += nread;
+      descriptor->stream_bytes_in += nread;
+      if (descriptor->block_index != NULL)
+        buffered_tcp_index_blocks(descriptor);
     } else {
       debug(1, "buffered audio port closed!");
     }
@@ -2222,6 +2631,7 @@ void display_flush_requests(int activeOnly, uint32_t currentSeq, uint32_t curren
 
 void *rtp_buffered_audio_processor(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  TRACE_THREAD_NAME("buffered audio processor");
   pthread_cleanup_push(rtp_buffered_audio_cleanup_handler, arg);
 
   pthread_t *buffered_reader_thread = malloc(sizeof(pthread_t));
@@ -2257,6 +2667,12 @@ void *rtp_buffered_audio_processor(void *arg) {
     debug(1, "cannot allocate an audio buffer of %u bytes!", buffered_audio->buffer_max_size);
   pthread_cleanup_push(malloc_cleanup, buffered_audio->buffer);
 
+  buffered_audio->block_index =
+      calloc(BUFFERED_BLOCK_INDEX_SIZE, sizeof(buffered_block_index_entry));
+  if (buffered_audio->block_index == NULL)
+    debug(1, "cannot allocate a buffered audio block index -- flushes will read through blocks.");
+  pthread_cleanup_push(malloc_cleanup, buffered_audio->block_index);
+
   // pthread_mutex_lock(&conn->buffered_audio_mutex);
   buffered_audio->toq = buffered_audio->buffer;
   buffered_audio->eoq = buffered_audio->buffer;
@@ -2357,6 +2773,9 @@ void *rtp_buffered_audio_processor(void *arg) {
   };
 
   av_opt_set_sample_fmt(swr, "out_sample_fmt", av_format, 0);
+  if (conn->resampler_drift_correction)
+    // keep the resampler in circuit from the start so that compensation can be changed on the fly
+    av_opt_set_int(swr, "flags", SWR_FLAG_RESAMPLE, 0);
   swr_init(swr);
 
   uint8_t packet[16 * 1024];
@@ -2370,7 +2789,8 @@ void *rtp_buffered_audio_processor(void *arg) {
   ssize_t nread;
 
   int finished = 0;
-  int pcm_buffer_size = (1024 + 352) * conn->input_bytes_per_frame;
+  int pcm_buffer_size =
+      (1024 + 352 + RESAMPLER_COMPENSATION_HEADROOM) * conn->input_bytes_per_frame;
   uint8_t pcm_buffer[pcm_buffer_size];
 
   int pcm_buffer_occupancy = 0;
@@ -2379,6 +2799,13 @@ void *rtp_buffered_audio_processor(void *arg) {
   uint32_t pcm_buffer_read_point_rtptime_offset = 0; // hack
   uint32_t expected_pcm_buffer_read_point_rtptime = 0;
 
+  // for drift correction in the resampler -- the frames into and out of it, the frames the player
+  // has asked to be inserted (+) or deleted (-) and the net insertions when the rtptime was anchored
+  int64_t resampler_frames_in = 0;
+  int64_t resampler_frames_out = 0;
+  int64_t resampler_frames_requested = 0;
+  int64_t resampler_anchor_insertions = 0;
+
   uint64_t blocks_read = 0;
   uint64_t blocks_read_in_sequence = 0; // since the start of this sequence -- reset by start or flush
   int flush_requested = 0;
@@ -2389,6 +2816,8 @@ void *rtp_buffered_audio_processor(void *arg) {
   int play_enabled = 0;
   uint32_t flush_from_timestamp = 0; // initialised to avoid a "possibly uninitialised" warning.
   double requested_lead_time = 0.0; // normal lead time minimum -- maybe  it should be about 0.1
+  uint64_t flush_request_time = 0;  // for measuring the time from a flush request to playing again
+  uint64_t blocks_skipped_in_flush = 0;
 
   // wait until our timing information is valid
 
@@ -2414,6 +2843,7 @@ void *rtp_buffered_audio_processor(void *arg) {
 
     int flush_request_active = 0;
     if (conn->ap2_flush_requested) {
+      TRACE_INSTANT("buffered flush", flushUntilTS);
       if (conn->ap2_flush_from_valid == 0) { // i.e. a flush from right now
         flush_request_active = 1;
         flush_is_delayed = 0;
@@ -2507,6 +2937,8 @@ void *rtp_buffered_audio_processor(void *arg) {
 
     if (flush_newly_requested) {
       reset_buffer(conn);
+      flush_request_time = get_absolute_time_in_ns();
+      blocks_skipped_in_flush = 0;
 
       if (flush_is_delayed == 0) {
         debug(2, "Immediate Buffered Audio Flush Started.");
@@ -2530,8 +2962,12 @@ void *rtp_buffered_audio_processor(void *arg) {
       get_audio_buffer_size_and_occupancy(&player_buffer_size, &player_buffer_occupancy, conn);
       // debug(1,"player buffer size and occupancy: %u and %u", player_buffer_size,
       // player_buffer_occupancy);
-      if (player_buffer_occupancy > ((requested_lead_time + 0.4) * conn->input_rate /
-                                     352)) { // must be greater than the lead time.
+      // blocks stay compressed and encrypted in the buffered_audio buffer and are only
+      // decoded when the player's buffer is down to the decoding lookahead, so
+      // a flush rarely costs any decoding at all
+      if (player_buffer_occupancy >
+          ((requested_lead_time + config.ap2_decoding_lookahead) * conn->input_rate /
+           352)) { // must be greater than the lead time.
         // if there is enough stuff in the player's buffer, sleep for a while and try again
         debug(3, "sleep while full");
         usleep(20000); // wait for a while
@@ -2561,12 +2997,22 @@ void *rtp_buffered_audio_processor(void *arg) {
                 //if ((blocks_read == 1) || (blocks_read_in_sequence > 3)) {
                   if ((lead_time >= (int64_t)(requested_lead_time * 1000000000L)) ||
                       (packets_played_in_this_sequence != 0)) {
-                    if (packets_played_in_this_sequence == 0)
+                    if (packets_played_in_this_sequence == 0) {
                       debug(2,
                             "Connection %d: buffered audio starting frame: %u, lead time: %f "
                             "seconds.",
                             conn->connection_number, pcm_buffer_read_point_rtptime,
                             0.000000001 * lead_time);
+                      if (flush_request_time != 0) {
+                        debug(2,
+                              "Connection %d: flush to play: %.3f milliseconds, %" PRIu64
+                              " blocks skipped using the block index.",
+                              conn->connection_number,
+                              0.000001 * (get_absolute_time_in_ns() - flush_request_time),
+                              blocks_skipped_in_flush);
+                        flush_request_time = 0;
+                      }
+                    }
                     // else {
                     // if (expected_rtptime != pcm_buffer_read_point_rtptime)
                     //  debug(1,"actual rtptime is %u, expected rtptime is %u.",
@@ -2637,9 +3083,16 @@ void *rtp_buffered_audio_processor(void *arg) {
                         conn->enable_dither, conn->previous_random_number);
                   }
 
-                  player_put_packet(
-                      0, 0, pcm_buffer_read_point_rtptime + pcm_buffer_read_point_rtptime_offset,
-                      pcm_buffer + pcm_buffer_read_point, 352, conn);
+                  uint32_t packet_rtptime =
+                      pcm_buffer_read_point_rtptime + pcm_buffer_read_point_rtptime_offset;
+                  if (conn->resampler_drift_correction)
+                    // stamp the packet with the rtptime of the audio in it rather than its position
+                    // in the output, so the player sees the effect of the frames inserted or deleted
+                    packet_rtptime -= resampler_frames_out - resampler_frames_in +
+                                      swr_get_delay(swr, conn->input_rate) -
+                                      resampler_anchor_insertions;
+                  player_put_packet(0, 0, packet_rtptime, pcm_buffer + pcm_buffer_read_point, 352,
+                                    conn);
                   packets_played_in_this_sequence++;
                   expected_pcm_buffer_read_point_rtptime = pcm_buffer_read_point_rtptime + 352;
                 }
@@ -2694,6 +3147,17 @@ void *rtp_buffered_audio_processor(void *arg) {
       // pcm_buffer_occupancy/conn->input_bytes_per_frame); ok, so here we know we need material
       // from the sender do we will get in a packet of audio
       uint16_t data_len;
+      // if flushing, jump straight to the flushUntilSeq block (or as near as possible to it)
+      // without reading out the blocks in between
+      if (flush_requested) {
+        int64_t block_number = buffered_skip_to_block(buffered_audio, flushUntilSeq);
+        if ((block_number >= 0) && ((uint64_t)block_number > blocks_read)) {
+          uint64_t blocks_skipped = block_number - blocks_read;
+          blocks_read += blocks_skipped;
+          blocks_read_in_sequence += blocks_skipped;
+          blocks_skipped_in_flush += blocks_skipped;
+        }
+      }
       // here we read from the buffer that our thread has been reading
       size_t bytes_remaining_in_buffer;
       nread = lread_sized_block(buffered_audio, &data_len, sizeof(data_len),
@@ -2823,6 +3287,7 @@ void *rtp_buffered_audio_processor(void *arg) {
           //        pcm_buffer_read_point_rtptime, timestamp);
           pcm_buffer_read_point_rtptime = timestamp;
           pcm_buffer_read_point = 0;
+          resampler_anchor_insertions = resampler_frames_out - resampler_frames_in;
           //}
         }
 
@@ -2913,18 +3378,44 @@ void *rtp_buffered_audio_processor(void *arg) {
                           else if (ret < 0) {
                             debug(1, "error %d during decoding", ret);
                           } else {
+                            // leave room for any frames the resampler inserts
+                            int pcm_audio_frames =
+                                decoded_frame->nb_samples + RESAMPLER_COMPENSATION_HEADROOM;
 #if LIBAVUTIL_VERSION_MAJOR >= 57
                             av_samples_alloc(&pcm_audio, &dst_linesize,
                                              codec_context->ch_layout.nb_channels,
-                                             decoded_frame->nb_samples, av_format, 1);
+                                             pcm_audio_frames, av_format, 1);
 #else
                             av_samples_alloc(&pcm_audio, &dst_linesize, codec_context->channels,
-                                             decoded_frame->nb_samples, av_format, 1);
+                                             pcm_audio_frames, av_format, 1);
 #endif
+                            if (conn->resampler_drift_correction) {
+                              resampler_frames_requested +=
+                                  __sync_lock_test_and_set(&conn->resampler_frames_to_stuff, 0);
+                              // work out what remains to be done from what has actually been
+                              // inserted so far, so nothing is lost if a compensation is cut short
+                              int64_t frames_to_stuff =
+                                  resampler_frames_requested -
+                                  (resampler_frames_out - resampler_frames_in +
+                                   swr_get_delay(swr, conn->input_rate));
+                              // no faster than one frame in 352, as the player would do it
+                              int64_t max_frames_to_stuff = decoded_frame->nb_samples / 352;
+                              if (frames_to_stuff > max_frames_to_stuff)
+                                frames_to_stuff = max_frames_to_stuff;
+                              else if (frames_to_stuff < -max_frames_to_stuff)
+                                frames_to_stuff = -max_frames_to_stuff;
+                              int cret = swr_set_compensation(swr, frames_to_stuff,
+                                                              decoded_frame->nb_samples);
+                              if (cret < 0)
+                                debug(1, "error %d setting the resampler compensation.", cret);
+                            }
                             // remember to free pcm_audio
-                            ret = swr_convert(swr, &pcm_audio, decoded_frame->nb_samples,
+                            ret = swr_convert(swr, &pcm_audio, pcm_audio_frames,
                                               (const uint8_t **)decoded_frame->extended_data,
                                               decoded_frame->nb_samples);
+                            resampler_frames_in += decoded_frame->nb_samples;
+                            if (ret > 0)
+                              resampler_frames_out += ret;
 #if LIBAVUTIL_VERSION_MAJOR >= 57
                             dst_bufsize = av_samples_get_buffer_size(
                                 &dst_linesize, codec_context->ch_layout.nb_channels, ret, av_format,
@@ -3010,6 +3501,7 @@ void *rtp_buffered_audio_processor(void *arg) {
   pthread_cleanup_pop(1); // avcodec_open2_cleanup_handler
   pthread_cleanup_pop(1); // avcodec_alloc_context3_cleanup_handler
   pthread_cleanup_pop(1); // thread creation
+  pthread_cleanup_pop(1); // block index malloc
   pthread_cleanup_pop(1); // buffer malloc
   pthread_cleanup_pop(1); // not_full_cv
   pthread_cleanup_pop(1); // not_empty_cv
@@ -18,6 +18,7 @@ void rtp_request_resend(seq_t first, uint32_t count, rtsp_conn_info *conn);
 void rtp_request_client_pause(rtsp_conn_info *conn); // ask the client to pause
 
 void reset_anchor_info(rtsp_conn_info *conn);
+void bump_timing_epoch(rtsp_conn_info *conn);
 
 int have_timestamp_timing_information(rtsp_conn_info *conn);
 
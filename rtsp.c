@@ -47,6 +47,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
@@ -69,7 +70,9 @@
 
 #include "common.h"
 #include "player.h"
+#include "rtp-batch.h"
 #include "rtp.h"
+#include "trace.h"
 #include "rtsp.h"
 
 #ifdef CONFIG_METADATA_HUB
@@ -162,18 +165,27 @@ static pthread_mutex_t reference_counter_lock = PTHREAD_MUTEX_INITIALIZER;
 int RTSP_connection_index = 1;
 
 #ifdef CONFIG_METADATA
+// A bounded multi-producer, multi-consumer queue that doesn't take a lock to add or remove an
+// item. Each slot has a sequence number that tells whether it's ready to be written or read at
+// a given position, so producers and consumers only contend on a compare-and-swap of the
+// position. The lock and condition variable are only used to let consumers sleep when the queue
+// is empty; a producer only takes the lock if a consumer is waiting.
+// Producers may still be using a queue after its consumer has stopped, so nothing a producer can
+// reach is ever freed: the items and slot sequences are static, the lock and condition variable
+// are initialised once and kept, and stopping a queue only sets its capacity to zero.
 typedef struct {
   pthread_mutex_t pc_queue_lock;
   pthread_cond_t pc_queue_item_added_signal;
-  pthread_cond_t pc_queue_item_removed_signal;
-  char *name;
-  size_t item_size;  // number of bytes in each item
-  uint32_t count;    // number of items in the queue
-  uint32_t capacity; // maximum number of items
-  uint32_t toq;      // first item to take
-  uint32_t eoq;      // free space at end of queue
-  void *items;       // a pointer to where the items are actually stored
-} pc_queue;          // producer-consumer queue
+  int lock_initialised;
+  int consumers_waiting;
+  const char *name;          // must be a string constant
+  size_t item_size;          // number of bytes in each item
+  uint32_t capacity;         // maximum number of items -- must be a power of two
+  uint32_t enqueue_position; // where the next item will be added
+  uint32_t dequeue_position; // where the next item will be taken from
+  uint32_t *slot_sequences;  // one per slot
+  void *items;               // a pointer to where the items are actually stored
+} pc_queue;                  // producer-consumer queue
 #endif
 
 static int msg_indexes = 1;
@@ -360,33 +372,68 @@ void build_bonjour_strings(__attribute((unused)) rtsp_conn_info *conn) {
 }
 
 #ifdef CONFIG_METADATA
+// Payload data that isn't in an rtsp_message is copied once into one of these, which is shared
+// by all the metadata queues and freed when the last of their consumers releases it.
+typedef struct {
+  int reference_count;
+  uint32_t length;
+  char data[];
+} metadata_payload;
+
 typedef struct {
   uint32_t type;
   uint32_t code;
   char *data;
   uint32_t length;
   rtsp_message *carrier;
+  metadata_payload *payload; // if non-NULL, data points into it
 } metadata_package;
 
-void pc_queue_init(pc_queue *the_queue, char *items, size_t item_size, uint32_t number_of_items,
-                   const char *name) {
+static metadata_payload *metadata_payload_new(const char *data, uint32_t length) {
+  metadata_payload *payload = malloc(sizeof(metadata_payload) + length);
+  if (payload) {
+    payload->reference_count = 1;
+    payload->length = length;
+    memcpy(payload->data, data, length);
+  }
+  return payload;
+}
+
+static void metadata_payload_retain(metadata_payload *payload) {
+  __sync_fetch_and_add(&payload->reference_count, 1);
+}
+
+static void metadata_payload_release(metadata_payload *payload) {
+  if (__sync_sub_and_fetch(&payload->reference_count, 1) == 0)
+    free(payload);
+}
+
+void pc_queue_init(pc_queue *the_queue, char *items, uint32_t *slot_sequences, size_t item_size,
+                   uint32_t number_of_items, const char *name) {
   if (name)
     debug(2, "Creating metadata queue \"%s\".", name);
   else
     debug(1, "Creating an unnamed metadata queue.");
-  pthread_mutex_init(&the_queue->pc_queue_lock, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_added_signal, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_removed_signal, NULL);
+  if ((number_of_items == 0) || ((number_of_items & (number_of_items - 1)) != 0))
+    die("metadata queue \"%s\": capacity %u is not a power of two.", name ? name : "",
+        number_of_items);
+  if (the_queue->lock_initialised == 0) {
+    pthread_mutex_init(&the_queue->pc_queue_lock, NULL);
+    pthread_cond_init(&the_queue->pc_queue_item_added_signal, NULL);
+    the_queue->lock_initialised = 1;
+  }
+  the_queue->consumers_waiting = 0;
   the_queue->item_size = item_size;
+  the_queue->enqueue_position = 0;
+  the_queue->dequeue_position = 0;
+  the_queue->slot_sequences = slot_sequences;
+  uint32_t i;
+  for (i = 0; i < number_of_items; i++)
+    the_queue->slot_sequences[i] = i;
   the_queue->items = items;
-  the_queue->count = 0;
-  the_queue->capacity = number_of_items;
-  the_queue->toq = 0;
-  the_queue->eoq = 0;
-  if (name == NULL)
-    the_queue->name = NULL;
-  else
-    the_queue->name = strdup(name);
+  the_queue->name = name;
+  __sync_synchronize();
+  the_queue->capacity = number_of_items; // a non-zero capacity means it's ready for use
 }
 
 void pc_queue_delete(pc_queue *the_queue) {
@@ -394,15 +441,8 @@ void pc_queue_delete(pc_queue *the_queue) {
     debug(2, "Deleting metadata queue \"%s\".", the_queue->name);
   else
     debug(1, "Deleting an unnamed metadata queue.");
-  if (the_queue->name != NULL)
-    free(the_queue->name);
-  // debug(2, "destroying pc_queue_item_removed_signal");
-  pthread_cond_destroy(&the_queue->pc_queue_item_removed_signal);
-  // debug(2, "destroying pc_queue_item_added_signal");
-  pthread_cond_destroy(&the_queue->pc_queue_item_added_signal);
-  // debug(2, "destroying pc_queue_lock");
-  pthread_mutex_destroy(&the_queue->pc_queue_lock);
-  // debug(2, "destroying signals and locks done");
+  the_queue->capacity = 0; // producers will add nothing more
+  __sync_synchronize();
 }
 
 int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
@@ -415,98 +455,109 @@ int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block) {
 void pc_queue_cleanup_handler(void *arg) {
   // debug(1, "pc_queue_cleanup_handler called.");
   pc_queue *the_queue = (pc_queue *)arg;
+  // done here, as the wait may have been cancelled
+  __sync_fetch_and_sub(&the_queue->consumers_waiting, 1);
   int rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
   if (rc)
-    debug(1, "Error unlocking for pc_queue_add_item or pc_queue_get_item.");
+    debug(1, "Error unlocking for pc_queue_get_item.");
 }
 
-int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff, int block) {
-  int response = 0;
-  int rc;
-  if (the_queue) {
-    if (block == 0) {
-      rc = debug_mutex_lock(&the_queue->pc_queue_lock, 10000, 2);
-      if (rc == EBUSY)
-        return EBUSY;
-    } else
-      rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_add_item");
-    pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
-    // leave this out if you want this to return if the queue is already full
-    // irrespective of the block flag.
-    /*
-                while (the_queue->count == the_queue->capacity) {
-                        rc = pthread_cond_wait(&the_queue->pc_queue_item_removed_signal,
-       &the_queue->pc_queue_lock); if (rc) debug(1, "Error waiting for item to be removed");
-                }
-                */
-    if (the_queue->count < the_queue->capacity) {
-      uint32_t i = the_queue->eoq;
-      void *p = the_queue->items + the_queue->item_size * i;
-      //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->eoq;
-      memcpy(p, the_stuff, the_queue->item_size);
-
-      // update the pointer
-      i++;
-      if (i == the_queue->capacity)
-        // fold pointer if necessary
-        i = 0;
-      the_queue->eoq = i;
-      the_queue->count++;
-      // debug(2,"metadata queue+ \"%s\" %d/%d.", the_queue->name, the_queue->count,
-      // the_queue->capacity);
-      if (the_queue->count == the_queue->capacity)
-        debug(3, "metadata queue \"%s\": is now full with %d items in it!", the_queue->name,
-              the_queue->count);
-      rc = pthread_cond_signal(&the_queue->pc_queue_item_added_signal);
-      if (rc)
-        debug(1, "metadata queue \"%s\": error signalling after pc_queue_add_item",
-              the_queue->name);
-    } else {
-      response = EWOULDBLOCK; // a bit arbitrary, this.
+// returns 0 on success or EWOULDBLOCK if the queue is full or isn't ready; never blocks
+int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff) {
+  if (the_queue == NULL) {
+    debug(1, "Adding an item to a NULL queue");
+    return EWOULDBLOCK;
+  }
+  uint32_t capacity = __sync_fetch_and_add(&the_queue->capacity, 0);
+  if (capacity == 0)
+    return EWOULDBLOCK; // its consumer hasn't started yet, or has stopped
+  uint32_t position = __sync_fetch_and_add(&the_queue->enqueue_position, 0);
+  uint32_t slot;
+  while (1) {
+    slot = position & (capacity - 1);
+    uint32_t sequence = __sync_fetch_and_add(&the_queue->slot_sequences[slot], 0);
+    int32_t difference = (int32_t)(sequence - position);
+    if (difference == 0) {
+      // the slot is free at this position -- try to claim it
+      uint32_t previous =
+          __sync_val_compare_and_swap(&the_queue->enqueue_position, position, position + 1);
+      if (previous == position)
+        break;
+      position = previous;
+    } else if (difference < 0) {
+      // the slot still holds the item from one lap ago, so the queue is full
       debug(3,
-            "metadata queue \"%s\": is already full with %d items in it. Not adding this item to "
+            "metadata queue \"%s\": is already full with %u items in it. Not adding this item to "
             "the queue.",
-            the_queue->name, the_queue->count);
+            the_queue->name, capacity);
+      return EWOULDBLOCK;
+    } else {
+      // another producer got here first
+      position = __sync_fetch_and_add(&the_queue->enqueue_position, 0);
     }
-    pthread_cleanup_pop(1); // unlock the queue lock.
-  } else {
-    debug(1, "Adding an item to a NULL queue");
   }
-  return response;
+  memcpy((char *)the_queue->items + the_queue->item_size * slot, the_stuff, the_queue->item_size);
+  __sync_synchronize();
+  the_queue->slot_sequences[slot] = position + 1; // publish it
+  __sync_synchronize();
+  if (the_queue->consumers_waiting != 0) {
+    pthread_mutex_lock(&the_queue->pc_queue_lock);
+    int rc = pthread_cond_signal(&the_queue->pc_queue_item_added_signal);
+    if (rc)
+      debug(1, "metadata queue \"%s\": error signalling after pc_queue_add_item", the_queue->name);
+    pthread_mutex_unlock(&the_queue->pc_queue_lock);
+  }
+  return 0;
+}
+
+// returns 1 if an item was taken, 0 if the queue is empty; never blocks
+static int pc_queue_try_get_item(pc_queue *the_queue, void *the_stuff) {
+  uint32_t capacity = the_queue->capacity;
+  uint32_t position = __sync_fetch_and_add(&the_queue->dequeue_position, 0);
+  uint32_t slot;
+  while (1) {
+    slot = position & (capacity - 1);
+    uint32_t sequence = __sync_fetch_and_add(&the_queue->slot_sequences[slot], 0);
+    int32_t difference = (int32_t)(sequence - (position + 1));
+    if (difference == 0) {
+      uint32_t previous =
+          __sync_val_compare_and_swap(&the_queue->dequeue_position, position, position + 1);
+      if (previous == position)
+        break;
+      position = previous;
+    } else if (difference < 0) {
+      return 0; // nothing has been published at this position yet
+    } else {
+      position = __sync_fetch_and_add(&the_queue->dequeue_position, 0);
+    }
+  }
+  memcpy(the_stuff, (char *)the_queue->items + the_queue->item_size * slot, the_queue->item_size);
+  __sync_synchronize();
+  the_queue->slot_sequences[slot] = position + capacity; // free for the next lap
+  return 1;
 }
 
 int pc_queue_get_item(pc_queue *the_queue, void *the_stuff) {
-  int rc;
   if (the_queue) {
-    rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "metadata queue \"%s\": error locking for pc_queue_get_item", the_queue->name);
-    pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
-    while (the_queue->count == 0) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_added_signal, &the_queue->pc_queue_lock);
+    int got_one = pc_queue_try_get_item(the_queue, the_stuff);
+    while (got_one == 0) {
+      // register as waiting before looking again, so that a producer that adds an item after
+      // the second look is sure to see that it must signal
+      int rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
       if (rc)
-        debug(1, "metadata queue \"%s\": error waiting for item to be added", the_queue->name);
-    }
-    uint32_t i = the_queue->toq;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->toq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    memcpy(the_stuff, p, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->toq = i;
-    the_queue->count--;
-    debug(3, "metadata queue- \"%s\" %d/%d.", the_queue->name, the_queue->count,
-          the_queue->capacity);
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_removed_signal);
-    if (rc)
-      debug(1, "metadata queue \"%s\": error signalling after pc_queue_get_item", the_queue->name);
-    pthread_cleanup_pop(1); // unlock the queue lock.
+        debug(1, "metadata queue \"%s\": error locking for pc_queue_get_item", the_queue->name);
+      pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
+      __sync_fetch_and_add(&the_queue->consumers_waiting, 1);
+      got_one = pc_queue_try_get_item(the_queue, the_stuff);
+      if (got_one == 0) {
+        rc = pthread_cond_wait(&the_queue->pc_queue_item_added_signal, &the_queue->pc_queue_lock);
+        if (rc)
+          debug(1, "metadata queue \"%s\": error waiting for item to be added", the_queue->name);
+      }
+      pthread_cleanup_pop(1); // stop waiting and unlock the queue lock.
+      if (got_one == 0)
+        got_one = pc_queue_try_get_item(the_queue, the_stuff);
+    }
   } else {
     debug(1, "Removing an item from a NULL queue");
   }
@@ -611,54 +662,89 @@ int get_play_lock(rtsp_conn_info *conn, int allow_session_interruption) {
   return response;
 }
 
-void player_watchdog_thread_cleanup_handler(void *arg) {
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-  debug(3, "Connection %d: Watchdog Exit.", conn->connection_number);
+// One watchdog thread looks after all the connections, so that an idle connection costs no more
+// than its conversation thread.
+// It keeps its own list of the connections it watches, guarded by the player_watchdog_lock, and
+// never takes the conns_lock -- conversation threads are joined while that is held, so a stuck
+// conversation thread, which is just what the watchdog is there to catch, would block it.
+// A connection is taken off the list before it can be freed.
+static pthread_t player_watchdog_thread;
+static int player_watchdog_thread_started = 0;
+static pthread_mutex_t player_watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static rtsp_conn_info *player_watchdog_conns = NULL;
+
+static void player_watchdog_add(rtsp_conn_info *conn) {
+  debug_mutex_lock(&player_watchdog_lock, 1000000, 3);
+  conn->watchdog_next = player_watchdog_conns;
+  player_watchdog_conns = conn;
+  debug_mutex_unlock(&player_watchdog_lock, 3);
 }
 
-void *player_watchdog_thread_code(void *arg) {
-  pthread_cleanup_push(player_watchdog_thread_cleanup_handler, arg);
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+static void player_watchdog_remove(rtsp_conn_info *conn) {
+  debug_mutex_lock(&player_watchdog_lock, 1000000, 3);
+  rtsp_conn_info **iter;
+  for (iter = &player_watchdog_conns; *iter && (*iter != conn); iter = &(*iter)->watchdog_next)
+    ; /* EMPTY */
+  if (*iter)
+    *iter = conn->watchdog_next;
+  conn->watchdog_next = NULL;
+  debug_mutex_unlock(&player_watchdog_lock, 3);
+}
+
+void *player_watchdog_thread_code(__attribute__((unused)) void *arg) {
   do {
     usleep(2000000); // check every two seconds
-    // debug(3, "Connection %d: Check the thread is doing something...", conn->connection_number);
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    int unfixable_connection = 0;
+    debug_mutex_lock(&player_watchdog_lock, 1000000, 3);
+    rtsp_conn_info *conn;
+    for (conn = player_watchdog_conns; conn != NULL; conn = conn->watchdog_next) {
+      // debug(3, "Connection %d: Check the thread is doing something...", conn->connection_number);
 #ifdef CONFIG_AIRPLAY_2
-    if ((config.dont_check_timeout == 0) && (config.timeout != 0) && (conn->airplay_type == ap_1)) {
+      if ((config.dont_check_timeout == 0) && (config.timeout != 0) &&
+          (conn->airplay_type == ap_1)) {
 #else
-    if ((config.dont_check_timeout == 0) && (config.timeout != 0)) {
+      if ((config.dont_check_timeout == 0) && (config.timeout != 0)) {
 #endif
-      debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
-      uint64_t last_watchdog_bark_time = conn->watchdog_bark_time;
-      debug_mutex_unlock(&conn->watchdog_mutex, 0);
-      if (last_watchdog_bark_time != 0) {
-        uint64_t time_since_last_bark =
-            (get_absolute_time_in_ns() - last_watchdog_bark_time) / 1000000000;
-        uint64_t ct = config.timeout; // go from int to 64-bit int
-
-        if (time_since_last_bark >= ct) {
-          conn->watchdog_barks++;
-          if (conn->watchdog_barks == 1) {
-            // debuglev = 3; // tell us everything.
-            debug(1,
-                  "Connection %d: As Yeats almost said, \"Too long a silence / can make a stone "
-                  "of the heart\".",
-                  conn->connection_number);
-            conn->stop = 1;
-            pthread_cancel(conn->thread);
-          } else if (conn->watchdog_barks == 3) {
-            if ((config.cmd_unfixable) && (config.unfixable_error_reported == 0)) {
-              config.unfixable_error_reported = 1;
-              command_execute(config.cmd_unfixable, "unable_to_cancel_play_session", 1);
-            } else {
-              die("an unrecoverable error, \"unable_to_cancel_play_session\", has been detected.",
-                  conn->connection_number);
+        debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+        uint64_t last_watchdog_bark_time = conn->watchdog_bark_time;
+        debug_mutex_unlock(&conn->watchdog_mutex, 0);
+        if (last_watchdog_bark_time != 0) {
+          uint64_t time_since_last_bark =
+              (get_absolute_time_in_ns() - last_watchdog_bark_time) / 1000000000;
+          uint64_t ct = config.timeout; // go from int to 64-bit int
+
+          if (time_since_last_bark >= ct) {
+            conn->watchdog_barks++;
+            if (conn->watchdog_barks == 1) {
+              // debuglev = 3; // tell us everything.
+              debug(1,
+                    "Connection %d: As Yeats almost said, \"Too long a silence / can make a stone "
+                    "of the heart\".",
+                    conn->connection_number);
+              conn->stop = 1;
+              pthread_cancel(conn->thread);
+            } else if (conn->watchdog_barks == 3) {
+              unfixable_connection = conn->connection_number;
             }
           }
         }
       }
     }
+    debug_mutex_unlock(&player_watchdog_lock, 3);
+    if (unfixable_connection) {
+      if ((config.cmd_unfixable) && (config.unfixable_error_reported == 0)) {
+        config.unfixable_error_reported = 1;
+        command_execute(config.cmd_unfixable, "unable_to_cancel_play_session", 1);
+      } else {
+        die("an unrecoverable error, \"unable_to_cancel_play_session\", has been detected on "
+            "connection %d.",
+            unfixable_connection);
+      }
+    }
+    pthread_setcancelstate(oldState, NULL);
   } while (1);
-  pthread_cleanup_pop(0); // should never happen
   pthread_exit(NULL);
 }
 
@@ -690,6 +776,8 @@ static void track_thread(rtsp_conn_info *conn) {
 
 int old_connection_count = -1;
 
+static int rtsp_listener_wakeup_pipe[2] = {-1, -1};
+
 void cleanup_threads(void) {
 
   void *retval;
@@ -1076,93 +1164,159 @@ void _debug_log_rtsp_message(const char *filename, const int linenumber, int lev
 #define debug_print_msg_headers(level, message)                                                    \
   _debug_print_msg_headers(__FILE__, __LINE__, level, message)
 
-#ifdef CONFIG_AIRPLAY_2
-static void buf_add(sized_buffer *buf, uint8_t *in, size_t in_len) {
-  if (buf->length + in_len > buf->size) {
-    buf->size = buf->length + in_len + 2048; // Extra legroom to avoid future memcpy's
-    uint8_t *new = malloc(buf->size);
-    memcpy(new, buf->data, buf->length);
-    free(buf->data);
-    buf->data = new;
+// Write all the pieces, picking up where a partial write left off and retrying after a signal.
+// Returns the number of bytes written, which is short only if writev() returned 0, or -1 on an
+// error, with errno set. The iovec array is used as working space.
+static ssize_t writev_fully(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  while (iovcnt > 0) {
+    ssize_t ret = writev(fd, iov, iovcnt);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (ret == 0)
+      break;
+    total += ret;
+    while ((iovcnt > 0) && ((size_t)ret >= iov->iov_len)) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
   }
-  memcpy(buf->data + buf->length, in, in_len);
-  buf->length += in_len;
+  return total;
 }
 
+#ifdef CONFIG_AIRPLAY_2
+// The buffers are fixed in size, so an encrypted session does no allocation per message.
+// A negative length empties the buffer.
 static void buf_drain(sized_buffer *buf, ssize_t len) {
   if (len < 0 || (size_t)len >= buf->length) {
-    free(buf->data);
-    memset(buf, 0, sizeof(sized_buffer));
+    buf->offset = 0;
+    buf->length = 0;
     return;
   }
-  memmove(buf->data, buf->data + len, buf->length - len);
+  buf->offset += len;
   buf->length -= len;
 }
 
 static size_t buf_remove(sized_buffer *buf, uint8_t *out, size_t out_len) {
   size_t bytes = (buf->length > out_len) ? out_len : buf->length;
-  memcpy(out, buf->data, bytes);
+  memcpy(out, buf->data + buf->offset, bytes);
   buf_drain(buf, bytes);
   return bytes;
 }
 
+// move any unread data to the start of the buffer and return the space left after it
+static size_t buf_make_room(sized_buffer *buf) {
+  if ((buf->offset != 0) && (buf->offset + buf->length == sizeof(buf->data))) {
+    memmove(buf->data, buf->data + buf->offset, buf->length);
+    buf->offset = 0;
+  }
+  return sizeof(buf->data) - (buf->offset + buf->length);
+}
+
 static ssize_t read_encrypted(int fd, pair_cipher_bundle *ctx, void *buf, size_t count) {
-  uint8_t in[4096];
-  uint8_t *plain;
-  size_t plain_len;
+  sized_buffer *encrypted = &ctx->encrypted_read_buffer;
+  sized_buffer *plaintext = &ctx->plaintext_read_buffer;
 
   // If there is leftover decoded content from the last pass just return that
-  if (ctx->plaintext_read_buffer.length > 0) {
-    return buf_remove(&ctx->plaintext_read_buffer, buf, count);
+  if (plaintext->length > 0) {
+    return buf_remove(plaintext, buf, count);
   }
 
+  size_t plain_len = 0;
   do {
-    ssize_t got = read(fd, in, sizeof(in));
-    if (got <= 0)
-      return got;
-    buf_add(&ctx->encrypted_read_buffer, in, got);
-
-    ssize_t consumed = pair_decrypt(&plain, &plain_len, ctx->encrypted_read_buffer.data,
-                                    ctx->encrypted_read_buffer.length, ctx->cipher_ctx);
-    if (consumed < 0)
-      return -1;
-    buf_drain(&ctx->encrypted_read_buffer, consumed);
-  } while (plain_len == 0);
-
-  // Fast path, avoids some memcpy + allocs in case of the normal, small message
-  /*  if (ctx->plaintext_read_buffer.len == 0 && plain_len < count) {
-      memcpy(buf, plain, plain_len);
-      free(plain);
-      return plain_len;
+    // decrypt whatever complete blocks are already here before reading more
+    if (encrypted->length >= sizeof(uint16_t)) {
+      ssize_t consumed =
+          pair_decrypt_buf(plaintext->data, sizeof(plaintext->data), &plain_len,
+                           encrypted->data + encrypted->offset, encrypted->length, ctx->cipher_ctx);
+      if (consumed < 0) {
+        debug(1, pair_cipher_errmsg(ctx->cipher_ctx));
+        return -1;
+      }
+      buf_drain(encrypted, consumed);
     }
-  */
-  buf_add(&ctx->plaintext_read_buffer, plain, plain_len);
-  free(plain);
+    if (plain_len == 0) {
+      size_t space = buf_make_room(encrypted);
+      if (space == 0) {
+        debug(1, "an encrypted block is too big for the RTSP input buffer.");
+        errno = EMSGSIZE;
+        return -1;
+      }
+      ssize_t got = read(fd, encrypted->data + encrypted->offset + encrypted->length, space);
+      if (got <= 0)
+        return got;
+      encrypted->length += got;
+    }
+  } while (plain_len == 0);
 
-  return buf_remove(&ctx->plaintext_read_buffer, buf, count);
+  plaintext->offset = 0;
+  plaintext->length = plain_len;
+  return buf_remove(plaintext, buf, count);
 }
 
-static ssize_t write_encrypted(int fd, pair_cipher_bundle *ctx, const void *buf, size_t count) {
-  uint8_t *encrypted;
-  size_t encrypted_len;
-
-  ssize_t ret = pair_encrypt(&encrypted, &encrypted_len, buf, count, ctx->cipher_ctx);
-  if (ret < 0) {
-    debug(1, pair_cipher_errmsg(ctx->cipher_ctx));
-    return -1;
-  }
-
-  size_t remain = encrypted_len;
+static ssize_t write_encrypted_frames(int fd, pair_cipher_bundle *ctx, size_t length) {
+  size_t remain = length;
   while (remain > 0) {
-    ssize_t wrote = write(fd, encrypted + (encrypted_len - remain), remain);
-    if (wrote <= 0) {
-      free(encrypted);
+    ssize_t wrote = write(fd, ctx->encrypted_write_buffer + (length - remain), remain);
+    if (wrote <= 0)
       return wrote;
-    }
     remain -= wrote;
   }
-  free(encrypted);
-  return count;
+  return length;
+}
+
+// Encrypt the pieces straight into the write buffer, one after the other, sending the buffer
+// whenever it fills. Blocks don't have to be full-sized, so a piece can end part way through one.
+static ssize_t writev_encrypted(int fd, pair_cipher_bundle *ctx, const struct iovec *iov,
+                                int iovcnt) {
+  size_t used = 0;
+  ssize_t total = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++) {
+    const uint8_t *plain = iov[i].iov_base;
+    size_t remaining_plain = iov[i].iov_len;
+    while (remaining_plain > 0) {
+      size_t encrypted_len;
+      ssize_t ret = pair_encrypt_buf(ctx->encrypted_write_buffer + used,
+                                     sizeof(ctx->encrypted_write_buffer) - used, &encrypted_len,
+                                     plain, remaining_plain, ctx->cipher_ctx);
+      if ((ret < 0) || ((ret == 0) && (used == 0))) {
+        debug(1, pair_cipher_errmsg(ctx->cipher_ctx));
+        return -1;
+      }
+      used += encrypted_len;
+      plain += ret;
+      remaining_plain -= ret;
+      total += ret;
+      if (remaining_plain > 0) { // the buffer is full
+        ssize_t wrote = write_encrypted_frames(fd, ctx, used);
+        if (wrote <= 0)
+          return wrote;
+        used = 0;
+      }
+    }
+  }
+  if (used > 0) {
+    ssize_t wrote = write_encrypted_frames(fd, ctx, used);
+    if (wrote <= 0)
+      return wrote;
+  }
+  return total;
+}
+
+static ssize_t write_encrypted(int fd, pair_cipher_bundle *ctx, const void *buf, size_t count) {
+  struct iovec iov;
+  iov.iov_base = (void *)buf;
+  iov.iov_len = count;
+  return writev_encrypted(fd, ctx, &iov, 1);
 }
 
 /*
@@ -1270,12 +1424,14 @@ ssize_t read_from_rtsp_connection(rtsp_conn_info *conn, void *buf, size_t count)
       conn->rtsp_link_is_idle = 1;
       conn->udp_clock_sender_is_initialised = 0;
       conn->udp_clock_is_initialised = 0;
+      bump_timing_epoch(conn);
     }
     response = timed_read_from_rtsp_connection(conn, 0, buf, count);
   }
   if (conn->rtsp_link_is_idle == 1) {
     conn->rtsp_link_is_idle = 0;
     debug(1, "Connection %d: RTSP connection traffic has resumed.", conn->connection_number);
+    bump_timing_epoch(conn);
 #ifdef CONFIG_AIRPLAY_2
     if (conn->airplay_stream_type == realtime_stream) {
       conn->last_anchor_info_is_valid = 0;
@@ -1296,28 +1452,91 @@ ssize_t read_from_rtsp_connection(rtsp_conn_info *conn, void *buf, size_t count)
   return response;
 }
 
+// The header of a request is read into a buffer that's kept for the life of the connection and
+// parsed a line at a time, picking up where the previous read left off. The body of a request is
+// read straight into an allocation of its own, which becomes the content of the rtsp_message,
+// so that metadata can be handed on by retaining the message, without copying.
+#define RTSP_INPUT_BUFFER_SIZE 4096
+
+void msg_cleanup_function(void *arg);
+
 enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_message **the_packet) {
 
   *the_packet = NULL; // need this for error handling
 
   enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
-  ssize_t buflen = 4096;
-#ifdef CONFIG_METADATA
-  if ((config.metadata_enabled != 0) && (config.get_coverart != 0))
-    buflen = 1024 * 256; // big enough for typical picture data, which will be base64 encoded
-#endif
-  int release_buffer = 0;         // on exit, don't deallocate the buffer if everything was okay
-  char *buf = malloc(buflen + 1); // add a NUL at the end
-  if (!buf) {
-    warn("Connection %d: rtsp_read_request: can't get a buffer.", conn->connection_number);
-    return (rtsp_read_request_response_error);
+  if (conn->rtsp_input_buffer == NULL) {
+    conn->rtsp_input_buffer = malloc(RTSP_INPUT_BUFFER_SIZE);
+    conn->rtsp_input_buffer_occupancy = 0;
+    conn->rtsp_input_skip_lf = 0;
+    if (conn->rtsp_input_buffer == NULL) {
+      warn("Connection %d: rtsp_read_request: can't get a buffer.", conn->connection_number);
+      return (rtsp_read_request_response_error);
+    }
   }
-  pthread_cleanup_push(malloc_cleanup, buf);
+  char *buf = conn->rtsp_input_buffer;
+  pthread_cleanup_push(msg_cleanup_function, (void *)the_packet);
   ssize_t nread;
-  ssize_t inbuf = 0;
+  size_t line_start = 0; // the start of the line being parsed
+  size_t scanned = 0;    // how far the line has been searched for its end
   int msg_size = -1;
 
-  while (msg_size < 0) {
+  while (1) {
+
+    // parse any complete lines already received
+    while ((msg_size < 0) && (line_start < conn->rtsp_input_buffer_occupancy)) {
+      if (conn->rtsp_input_skip_lf) {
+        conn->rtsp_input_skip_lf = 0;
+        if (buf[line_start] == '\n') {
+          line_start++;
+          scanned = line_start;
+          continue;
+        }
+      }
+      // accept \r, \n, or \r\n as the line ending
+      while ((scanned < conn->rtsp_input_buffer_occupancy) && (buf[scanned] != '\r') &&
+             (buf[scanned] != '\n'))
+        scanned++;
+      if (scanned == conn->rtsp_input_buffer_occupancy)
+        break; // the rest of the line hasn't arrived yet
+      if (buf[scanned] == '\r')
+        conn->rtsp_input_skip_lf = 1;
+      buf[scanned] = '\0';
+      msg_size = msg_handle_line(the_packet, buf + line_start);
+
+      if (!(*the_packet)) {
+        debug(1, "Connection %d: rtsp_read_request can't find an RTSP header.",
+              conn->connection_number);
+        reply = rtsp_read_request_response_bad_packet;
+        goto shutdown;
+      }
+      line_start = scanned + 1;
+      scanned = line_start;
+    }
+
+    if (msg_size >= 0) {
+      // skip the \n of a \r\n at the end of the header -- wait for it if there's a body to come
+      if ((conn->rtsp_input_skip_lf) && (line_start < conn->rtsp_input_buffer_occupancy)) {
+        conn->rtsp_input_skip_lf = 0;
+        if (buf[line_start] == '\n')
+          line_start++;
+      }
+      if ((conn->rtsp_input_skip_lf == 0) || (msg_size == 0))
+        break;
+    }
+
+    // make room for more by dropping the lines already parsed
+    if (conn->rtsp_input_buffer_occupancy == RTSP_INPUT_BUFFER_SIZE) {
+      if (line_start == 0) {
+        warn("Connection %d: an RTSP header line is too long.", conn->connection_number);
+        reply = rtsp_read_request_response_bad_packet;
+        goto shutdown;
+      }
+      conn->rtsp_input_buffer_occupancy -= line_start;
+      memmove(buf, buf + line_start, conn->rtsp_input_buffer_occupancy);
+      scanned -= line_start;
+      line_start = 0;
+    }
 
     /*
       if (conn->stop != 0) {
@@ -1327,7 +1546,8 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
       }
     */
 
-    nread = read_from_rtsp_connection(conn, buf + inbuf, buflen - inbuf);
+    nread = read_from_rtsp_connection(conn, buf + conn->rtsp_input_buffer_occupancy,
+                                      RTSP_INPUT_BUFFER_SIZE - conn->rtsp_input_buffer_occupancy);
 
     if (nread == 0) {
       // a blocking read that returns zero means eof -- implies connection closed by client
@@ -1368,47 +1588,36 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
         {
         void *pt = malloc(nread+1);
         memset(pt, 0, nread+1);
-        memcpy(pt, buf + inbuf, nread);
+        memcpy(pt, buf + conn->rtsp_input_buffer_occupancy, nread);
         debug(1, "Incoming string on port: \"%s\"",pt);
         free(pt);
         }
     */
 
-    inbuf += nread;
-
-    char *next;
-    while (msg_size < 0 && (next = nextline(buf, inbuf))) {
-      msg_size = msg_handle_line(the_packet, buf);
-
-      if (!(*the_packet)) {
-        debug(1, "Connection %d: rtsp_read_request can't find an RTSP header.",
-              conn->connection_number);
-        reply = rtsp_read_request_response_bad_packet;
-        goto shutdown;
-      }
-
-      inbuf -= next - buf;
-      if (inbuf)
-        memmove(buf, next, inbuf);
-    }
+    conn->rtsp_input_buffer_occupancy += nread;
   }
 
-  if (msg_size > buflen) {
-    buf = realloc(buf, msg_size + 1);
-    if (!buf) {
-      warn("Connection %d: too much content.", conn->connection_number);
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
-    }
-    buflen = msg_size;
+  rtsp_message *msg = *the_packet;
+  msg->content = malloc(msg_size + 1); // add a NUL at the end
+  if (msg->content == NULL) {
+    warn("Connection %d: too much content.", conn->connection_number);
+    reply = rtsp_read_request_response_error;
+    goto shutdown;
   }
 
+  // some or all of the body may have come in with the header
+  size_t inbuf = conn->rtsp_input_buffer_occupancy - line_start;
+  if (inbuf > (size_t)msg_size)
+    inbuf = msg_size;
+  memcpy(msg->content, buf + line_start, inbuf);
+  line_start += inbuf;
+
   uint64_t threshold_time =
       get_absolute_time_in_ns() + ((uint64_t)15000000000); // i.e. fifteen seconds from now
   int warning_message_sent = 0;
 
   // const size_t max_read_chunk = 1024 * 1024 / 16;
-  while (inbuf < msg_size) {
+  while (inbuf < (size_t)msg_size) {
 
     // we are going to read the stream in chunks and time how long it takes to
     // do so.
@@ -1440,7 +1649,7 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
     // if (read_chunk > max_read_chunk)
     //  read_chunk = max_read_chunk;
     // usleep(80000); // wait about 80 milliseconds between reads of up to max_read_chunk
-    nread = read_from_rtsp_connection(conn, buf + inbuf, read_chunk);
+    nread = read_from_rtsp_connection(conn, msg->content + inbuf, read_chunk);
     if (!nread) {
       reply = rtsp_read_request_response_error;
       goto shutdown;
@@ -1464,18 +1673,19 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
     inbuf += nread;
   }
 
-  rtsp_message *msg = *the_packet;
   msg->contentlength = inbuf;
-  msg->content = buf;
-  char *jp = inbuf + buf;
-  *jp = '\0';
-  *the_packet = msg;
+  msg->content[inbuf] = '\0';
 shutdown:
-  if (reply != rtsp_read_request_response_ok) {
+  if (reply == rtsp_read_request_response_ok) {
+    // keep anything after the end of this request for the next one
+    conn->rtsp_input_buffer_occupancy -= line_start;
+    if (conn->rtsp_input_buffer_occupancy)
+      memmove(buf, buf + line_start, conn->rtsp_input_buffer_occupancy);
+  } else {
     msg_free(the_packet);
-    release_buffer = 1; // allow the buffer to be released
+    conn->rtsp_input_buffer_occupancy = 0;
   }
-  pthread_cleanup_pop(release_buffer);
+  pthread_cleanup_pop(0);
   return reply;
 }
 
@@ -1546,30 +1756,26 @@ int msg_write_response(rtsp_conn_info *conn, rtsp_message *resp) {
   pktfree -= n;
   p += n;
 
-  if (resp->contentlength) {
-    memcpy(p, resp->content, resp->contentlength);
-    pktfree -= resp->contentlength;
-    p += resp->contentlength;
-  }
+  // the status line and headers are in pkt; the content is sent from where it is
 
-  if (pktfree <= 1024) {
-    debug(1, "Attempted to write overlong RTSP packet 3");
-    return -3;
-  }
+  struct iovec iov[2];
+  iov[0].iov_base = pkt;
+  iov[0].iov_len = p - pkt;
+  iov[1].iov_base = resp->content;
+  iov[1].iov_len = resp->contentlength;
+  int iovcnt = resp->contentlength != 0 ? 2 : 1;
+  ssize_t response_length = (p - pkt) + resp->contentlength;
 
   // here, if the link is encrypted, better do it
 
+  ssize_t reply = 0;
 #ifdef CONFIG_AIRPLAY_2
-  ssize_t reply;
   if (conn->ap2_pairing_context.control_cipher_bundle.is_encrypted) {
-    reply =
-        write_encrypted(conn->fd, &conn->ap2_pairing_context.control_cipher_bundle, pkt, p - pkt);
-  } else {
-    reply = write(conn->fd, pkt, p - pkt);
-  }
-#else
-  ssize_t reply = write(conn->fd, pkt, p - pkt);
+    reply = writev_encrypted(conn->fd, &conn->ap2_pairing_context.control_cipher_bundle, iov,
+                             iovcnt);
+  } else
 #endif
+    reply = writev_fully(conn->fd, iov, iovcnt);
 
   if (reply == -1) {
     char errorstring[1024];
@@ -1577,9 +1783,9 @@ int msg_write_response(rtsp_conn_info *conn, rtsp_message *resp) {
     debug(1, "msg_write_response error %d: \"%s\".", errno, (char *)errorstring);
     return -4;
   }
-  if (reply != p - pkt) {
-    debug(1, "msg_write_response error -- requested bytes: %d not fully written: %d.", p - pkt,
-          reply);
+  if (reply != response_length) {
+    debug(1, "msg_write_response error -- requested bytes: %zd not fully written: %zd.",
+          response_length, reply);
     return -5;
   }
   return 0;
@@ -1672,6 +1878,58 @@ void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp)
 
 #ifdef CONFIG_AIRPLAY_2
 
+// Controllers ask for GET /info often during discovery, but the answers only change when the
+// things they are made from change, so each stage's serialized answer is kept and reused until
+// then.
+typedef struct {
+  char key[1024]; // the inputs the content was made from
+  char *content;
+  uint32_t contentlength;
+} info_response_cache_entry;
+
+static info_response_cache_entry info_response_cache[2]; // one for each stage
+static pthread_mutex_t info_response_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// call with the principal_conn_lock held, as the gidString depends on the principal conn
+static void info_response_key(char *key, size_t key_size) {
+  snprintf(key, key_size, "%" PRIx64 "|%" PRIx32 "|%s|%s|%s|%s|%s|%s|%s", config.airplay_features,
+           config.airplay_statusflags, config.airplay_device_id, config.airplay_pi,
+           config.service_name, deviceIdString, featuresString, piString, gidString);
+}
+
+// returns 1 and gives resp a copy of the cached content if there is some for this key
+static int info_response_from_cache(int stage, const char *key, rtsp_message *resp) {
+  int response = 0;
+  pthread_mutex_lock(&info_response_cache_lock);
+  info_response_cache_entry *entry = &info_response_cache[stage];
+  if ((entry->content != NULL) && (strcmp(entry->key, key) == 0)) {
+    resp->content = malloc(entry->contentlength);
+    if (resp->content != NULL) {
+      memcpy(resp->content, entry->content, entry->contentlength);
+      resp->contentlength = entry->contentlength;
+      response = 1;
+    }
+  }
+  pthread_mutex_unlock(&info_response_cache_lock);
+  return response;
+}
+
+static void info_response_to_cache(int stage, const char *key, rtsp_message *resp) {
+  if ((resp->content == NULL) || (resp->contentlength == 0))
+    return;
+  char *content = malloc(resp->contentlength);
+  if (content == NULL)
+    return;
+  memcpy(content, resp->content, resp->contentlength);
+  pthread_mutex_lock(&info_response_cache_lock);
+  info_response_cache_entry *entry = &info_response_cache[stage];
+  free(entry->content);
+  entry->content = content;
+  entry->contentlength = resp->contentlength;
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+  pthread_mutex_unlock(&info_response_cache_lock);
+}
+
 void handle_get_info(__attribute((unused)) rtsp_conn_info *conn, rtsp_message *req,
                      rtsp_message *resp) {
   debug_log_rtsp_message(2, "GET /info:", req);
@@ -1710,19 +1968,24 @@ void handle_get_info(__attribute((unused)) rtsp_conn_info *conn, rtsp_message *r
     plist_free(info_plist);
     free(qualifier_array_val_cstr);
 
+    pthread_rwlock_rdlock(&principal_conn_lock); // don't let the principal_conn be changed
+    pthread_cleanup_push(rwlock_unlock, (void *)&principal_conn_lock);
+    char cache_key[1024];
+    info_response_key(cache_key, sizeof(cache_key));
+
     // uint8_t bt_addr[6] = {0xB8, 0x27, 0xEB, 0xB7, 0xD4, 0x0E};
     plist_t response_plist = NULL;
-    plist_from_xml((const char *)plists_get_info_response_xml, plists_get_info_response_xml_len,
-                   &response_plist);
-    if (response_plist == NULL) {
+    if (info_response_from_cache(0, cache_key, resp) == 0)
+      plist_from_xml((const char *)plists_get_info_response_xml, plists_get_info_response_xml_len,
+                     &response_plist);
+    if (resp->contentlength != 0) {
+      debug(3, "GET /info Stage 1: cached response used.");
+    } else if (response_plist == NULL) {
       debug(1, "GET /info Stage 1: response plist not created from XML!");
     } else {
       void *qualifier_response_data = NULL;
       size_t qualifier_response_data_length = 0;
 
-      pthread_rwlock_rdlock(&principal_conn_lock); // don't let the principal_conn be changed
-      pthread_cleanup_push(rwlock_unlock, (void *)&principal_conn_lock);
-
       if (add_pstring_to_malloc("acl=0", &qualifier_response_data,
                                 &qualifier_response_data_length) == 0)
         debug(1, "Problem");
@@ -1785,13 +2048,15 @@ void handle_get_info(__attribute((unused)) rtsp_conn_info *conn, rtsp_message *r
       free(vs);
       // pkString_make(pkString, sizeof(pkString), config.airplay_device_id);
       // plist_dict_set_item(response_plist, "pk", plist_new_string(pkString));
-      pthread_cleanup_pop(1); // release the principal_conn lock
       plist_to_bin(response_plist, &resp->content, &resp->contentlength);
       if (resp->contentlength == 0)
         debug(1, "GET /info Stage 1: response bplist not created!");
+      else
+        info_response_to_cache(0, cache_key, resp);
       plist_free(response_plist);
       free(qualifier_response_data);
     }
+    pthread_cleanup_pop(1); // release the principal_conn lock
     msg_add_header(resp, "Content-Type", "application/x-apple-binary-plist");
     debug_log_rtsp_message(2, "GET /info Stage 1 Response:", resp);
     resp->respcode = 200;
@@ -1801,22 +2066,33 @@ void handle_get_info(__attribute((unused)) rtsp_conn_info *conn, rtsp_message *r
     resp->respcode = 400;
     return;
   } else { // stage two
-    plist_t response_plist = NULL;
-    plist_from_xml((const char *)plists_get_info_response_xml, plists_get_info_response_xml_len,
-                   &response_plist);
-    plist_dict_set_item(response_plist, "features", plist_new_uint(config.airplay_features));
-    plist_dict_set_item(response_plist, "statusFlags", plist_new_uint(config.airplay_statusflags));
-    plist_dict_set_item(response_plist, "deviceID", plist_new_string(config.airplay_device_id));
-    plist_dict_set_item(response_plist, "pi", plist_new_string(config.airplay_pi));
-    plist_dict_set_item(response_plist, "name", plist_new_string(config.service_name));
-    char *vs = get_version_string();
-    // plist_dict_set_item(response_plist, "model", plist_new_string(vs));
-    plist_dict_set_item(response_plist, "model", plist_new_string("Shairport Sync"));
-    free(vs);
-    // pkString_make(pkString, sizeof(pkString), config.airplay_device_id);
-    // plist_dict_set_item(response_plist, "pk", plist_new_string(pkString));
-    plist_to_bin(response_plist, &resp->content, &resp->contentlength);
-    plist_free(response_plist);
+    char cache_key[1024];
+    pthread_rwlock_rdlock(&principal_conn_lock); // don't let the principal_conn be changed
+    pthread_cleanup_push(rwlock_unlock, (void *)&principal_conn_lock);
+    info_response_key(cache_key, sizeof(cache_key));
+    pthread_cleanup_pop(1); // release the principal_conn lock
+    if (info_response_from_cache(1, cache_key, resp) == 0) {
+      plist_t response_plist = NULL;
+      plist_from_xml((const char *)plists_get_info_response_xml, plists_get_info_response_xml_len,
+                     &response_plist);
+      plist_dict_set_item(response_plist, "features", plist_new_uint(config.airplay_features));
+      plist_dict_set_item(response_plist, "statusFlags",
+                          plist_new_uint(config.airplay_statusflags));
+      plist_dict_set_item(response_plist, "deviceID", plist_new_string(config.airplay_device_id));
+      plist_dict_set_item(response_plist, "pi", plist_new_string(config.airplay_pi));
+      plist_dict_set_item(response_plist, "name", plist_new_string(config.service_name));
+      char *vs = get_version_string();
+      // plist_dict_set_item(response_plist, "model", plist_new_string(vs));
+      plist_dict_set_item(response_plist, "model", plist_new_string("Shairport Sync"));
+      free(vs);
+      // pkString_make(pkString, sizeof(pkString), config.airplay_device_id);
+      // plist_dict_set_item(response_plist, "pk", plist_new_string(pkString));
+      plist_to_bin(response_plist, &resp->content, &resp->contentlength);
+      plist_free(response_plist);
+      info_response_to_cache(1, cache_key, resp);
+    } else {
+      debug(3, "GET /info Stage 2: cached response used.");
+    }
     msg_add_header(resp, "Content-Type", "application/x-apple-binary-plist");
     debug_log_rtsp_message(2, "GET /info Stage 2 Response", resp);
     resp->respcode = 200;
@@ -2069,15 +2345,33 @@ void handle_post(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
 #endif
 
 #ifdef CONFIG_AIRPLAY_2
+// HomeKit pairings, indexed by device ID. If a general.airplay_pairings_file is given, they are
+// loaded from it the first time they are needed and written back to it whenever they change.
+// The file has one pairing per line -- the public key in hex, a space and the device ID.
+
+#define PAIRINGS_BUCKETS 16
+
 struct pairings {
   char device_id[PAIR_AP_DEVICE_ID_LEN_MAX];
   uint8_t public_key[32];
 
   struct pairings *next;
-} * pairings;
+} * pairings[PAIRINGS_BUCKETS];
+
+static pthread_mutex_t pairings_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pairings_loaded = 0;
+
+static struct pairings **pairings_bucket(const char *device_id) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (; *device_id; device_id++) {
+    h ^= (uint8_t)*device_id;
+    h *= 16777619u;
+  }
+  return &pairings[h % PAIRINGS_BUCKETS];
+}
 
 static struct pairings *pairing_find(const char *device_id) {
-  for (struct pairings *pairing = pairings; pairing; pairing = pairing->next) {
+  for (struct pairings *pairing = *pairings_bucket(device_id); pairing; pairing = pairing->next) {
     if (strcmp(device_id, pairing->device_id) == 0)
       return pairing;
   }
@@ -2086,39 +2380,154 @@ static struct pairings *pairing_find(const char *device_id) {
 
 static void pairing_add(uint8_t public_key[32], const char *device_id) {
   struct pairings *pairing = calloc(1, sizeof(struct pairings));
+  if (pairing == NULL)
+    die("could not allocate memory for a pairing.");
   snprintf(pairing->device_id, sizeof(pairing->device_id), "%s", device_id);
   memcpy(pairing->public_key, public_key, sizeof(pairing->public_key));
 
-  pairing->next = pairings;
-  pairings = pairing;
+  struct pairings **bucket = pairings_bucket(device_id);
+  pairing->next = *bucket;
+  *bucket = pairing;
 }
 
 static void pairing_remove(struct pairings *pairing) {
-  if (pairing == pairings) {
-    pairings = pairing->next;
-  } else {
-    struct pairings *iter;
-    for (iter = pairings; iter && (iter->next != pairing); iter = iter->next)
-      ; /* EMPTY */
+  struct pairings **iter;
+  for (iter = pairings_bucket(pairing->device_id); *iter && (*iter != pairing);
+       iter = &(*iter)->next)
+    ; /* EMPTY */
 
-    if (iter)
-      iter->next = pairing->next;
-  }
+  if (*iter)
+    *iter = pairing->next;
 
   free(pairing);
 }
 
+// call with the pairings_lock held
+static void pairings_load(void) {
+  pairings_loaded = 1;
+  if (config.airplay_pairings_file == NULL)
+    return;
+  FILE *f = fopen(config.airplay_pairings_file, "r");
+  if (f == NULL) {
+    if (errno != ENOENT)
+      warn("Can not open the pairings file \"%s\" -- error %d.", config.airplay_pairings_file,
+           errno);
+    return;
+  }
+  int count = 0;
+  char line[2 * 32 + 1 + PAIR_AP_DEVICE_ID_LEN_MAX + 2];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    uint8_t public_key[32];
+    unsigned int i;
+    int valid =
+        (strlen(line) > 2 * sizeof(public_key) + 1) && (line[2 * sizeof(public_key)] == ' ');
+    for (i = 0; (valid != 0) && (i < sizeof(public_key)); i++) {
+      unsigned int byte;
+      if (sscanf(line + 2 * i, "%2x", &byte) == 1)
+        public_key[i] = byte;
+      else
+        valid = 0;
+    }
+    if (valid) {
+      const char *device_id = line + 2 * sizeof(public_key) + 1;
+      if (pairing_find(device_id) == NULL) {
+        pairing_add(public_key, device_id);
+        count++;
+      }
+    } else if (line[0] != '\0') {
+      debug(1, "Ignoring an invalid line in the pairings file \"%s\".",
+            config.airplay_pairings_file);
+    }
+  }
+  fclose(f);
+  debug(2, "%d pairing%s loaded from \"%s\".", count, count == 1 ? "" : "s",
+        config.airplay_pairings_file);
+}
+
+// call with the pairings_lock held
+// the pairings are written to a temporary file which is synced and then replaces the old one,
+// and the directory is synced after that, so a crash or power cut leaves either the old file or
+// the new one, never a mixture
+static void pairings_save(void) {
+  if (config.airplay_pairings_file == NULL)
+    return;
+  char temporary_path[4096];
+  if (snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", config.airplay_pairings_file) >=
+      (int)sizeof(temporary_path)) {
+    warn("The pairings file path \"%s\" is too long.", config.airplay_pairings_file);
+    return;
+  }
+  int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  FILE *f = NULL;
+  if (fd >= 0)
+    f = fdopen(fd, "w");
+  if (f == NULL) {
+    warn("Can not write the pairings file \"%s\" -- error %d.", temporary_path, errno);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  int ok = 1;
+  int i;
+  for (i = 0; i < PAIRINGS_BUCKETS; i++) {
+    for (struct pairings *pairing = pairings[i]; pairing; pairing = pairing->next) {
+      char line[2 * sizeof(pairing->public_key) + 1 + PAIR_AP_DEVICE_ID_LEN_MAX + 2];
+      unsigned int j;
+      for (j = 0; j < sizeof(pairing->public_key); j++)
+        snprintf(line + 2 * j, 3, "%02x", pairing->public_key[j]);
+      snprintf(line + 2 * j, sizeof(line) - 2 * j, " %s\n", pairing->device_id);
+      if (fputs(line, f) == EOF)
+        ok = 0;
+    }
+  }
+  if ((fflush(f) != 0) || (fsync(fd) != 0))
+    ok = 0;
+  if (fclose(f) != 0)
+    ok = 0;
+  if ((ok == 0) || (rename(temporary_path, config.airplay_pairings_file) != 0)) {
+    warn("Can not update the pairings file \"%s\" -- error %d.", config.airplay_pairings_file,
+         errno);
+    unlink(temporary_path);
+    return;
+  }
+  // the rename itself is only durable once the directory holding the file is synced
+  char directory_path[4096];
+  const char *last_slash = strrchr(config.airplay_pairings_file, '/');
+  if (last_slash == NULL)
+    snprintf(directory_path, sizeof(directory_path), ".");
+  else if (last_slash == config.airplay_pairings_file)
+    snprintf(directory_path, sizeof(directory_path), "/");
+  else
+    snprintf(directory_path, sizeof(directory_path), "%.*s",
+             (int)(last_slash - config.airplay_pairings_file), config.airplay_pairings_file);
+  int directory_fd = open(directory_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if ((directory_fd < 0) || (fsync(directory_fd) != 0))
+    warn("Can not sync the directory of the pairings file \"%s\" -- error %d.",
+         config.airplay_pairings_file, errno);
+  if (directory_fd >= 0)
+    close(directory_fd);
+}
+
 static int pairing_add_cb(uint8_t public_key[32], const char *device_id,
                           void *cb_arg __attribute__((unused))) {
   debug(1, "pair-add cb for %s", device_id);
 
+  pthread_mutex_lock(&pairings_lock);
+  pthread_cleanup_push(mutex_unlock, (void *)&pairings_lock);
+  if (pairings_loaded == 0)
+    pairings_load();
   struct pairings *pairing = pairing_find(device_id);
   if (pairing) {
-    memcpy(pairing->public_key, public_key, sizeof(pairing->public_key));
-    return 0;
+    if (memcmp(pairing->public_key, public_key, sizeof(pairing->public_key)) != 0) {
+      memcpy(pairing->public_key, public_key, sizeof(pairing->public_key));
+      pairings_save();
+    }
+  } else {
+    pairing_add(public_key, device_id);
+    pairings_save();
   }
-
-  pairing_add(public_key, device_id);
+  pthread_cleanup_pop(1); // unlock the pairings_lock
   return 0;
 }
 
@@ -2126,23 +2535,58 @@ static int pairing_remove_cb(uint8_t public_key[32] __attribute__((unused)), con
                              void *cb_arg __attribute__((unused))) {
   debug(1, "pair-remove cb for %s", device_id);
 
+  int response = 0;
+  pthread_mutex_lock(&pairings_lock);
+  pthread_cleanup_push(mutex_unlock, (void *)&pairings_lock);
+  if (pairings_loaded == 0)
+    pairings_load();
   struct pairings *pairing = pairing_find(device_id);
   if (!pairing) {
     debug(1, "pair-remove callback for unknown device");
-    return -1;
+    response = -1;
+  } else {
+    pairing_remove(pairing);
+    pairings_save();
   }
+  pthread_cleanup_pop(1); // unlock the pairings_lock
+  return response;
+}
 
-  pairing_remove(pairing);
-  return 0;
+// Devices that have paired with us are held to their stored public key. Others are let through
+// without being verified -- which is how every device was treated before pairings were kept.
+static int pairing_get_cb(uint8_t public_key[32], const char *device_id,
+                          void *cb_arg __attribute__((unused))) {
+  int response = 1; // unknown, so not verified
+  pthread_mutex_lock(&pairings_lock);
+  pthread_cleanup_push(mutex_unlock, (void *)&pairings_lock);
+  if (pairings_loaded == 0)
+    pairings_load();
+  struct pairings *pairing = pairing_find(device_id);
+  if (pairing) {
+    memcpy(public_key, pairing->public_key, sizeof(pairing->public_key));
+    response = 0;
+  }
+  pthread_cleanup_pop(1); // unlock the pairings_lock
+  debug(2, "pair-verify cb for %s: %s.", device_id,
+        response == 0 ? "verifying against its stored key" : "not paired, so not verified");
+  return response;
 }
 
 static void pairing_list_cb(pair_cb enum_cb, void *enum_cb_arg,
                             void *cb_arg __attribute__((unused))) {
   debug(2, "pair-list cb");
 
-  for (struct pairings *pairing = pairings; pairing; pairing = pairing->next) {
-    enum_cb(pairing->public_key, pairing->device_id, enum_cb_arg);
+  pthread_mutex_lock(&pairings_lock);
+  pthread_cleanup_push(mutex_unlock, (void *)&pairings_lock);
+  if (pairings_loaded == 0)
+    pairings_load();
+  int i;
+  for (i = 0; i < PAIRINGS_BUCKETS; i++) {
+    for (struct pairings *pairing = pairings[i]; pairing; pairing = pairing->next) {
+      enum_cb(pairing->public_key, pairing->device_id, enum_cb_arg);
+    }
   }
+  pthread_cleanup_pop(1); // unlock the pairings_lock
 }
 
 void handle_pair_add(rtsp_conn_info *conn __attribute__((unused)), rtsp_message *req,
@@ -2206,7 +2650,7 @@ void handle_pair_verify(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *r
 
   if (!conn->ap2_pairing_context.verify_ctx) {
     conn->ap2_pairing_context.verify_ctx =
-        pair_verify_new(PAIR_SERVER_HOMEKIT, NULL, NULL, NULL, config.airplay_device_id);
+        pair_verify_new(PAIR_SERVER_HOMEKIT, NULL, pairing_get_cb, NULL, config.airplay_device_id);
     if (!conn->ap2_pairing_context.verify_ctx) {
       debug(1, "Error creating verify context");
       resp->respcode = 500; // Internal Server Error
@@ -2249,8 +2693,10 @@ void handle_pair_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *re
         req->contentlength);
 
   if (!conn->ap2_pairing_context.setup_ctx) {
-    conn->ap2_pairing_context.setup_ctx = pair_setup_new(PAIR_SERVER_HOMEKIT, config.airplay_pin,
-                                                         NULL, NULL, config.airplay_device_id);
+    // a completed (non-transient) pair-setup is recorded like a pair-add
+    conn->ap2_pairing_context.setup_ctx =
+        pair_setup_new(PAIR_SERVER_HOMEKIT, config.airplay_pin, pairing_add_cb, NULL,
+                       config.airplay_device_id);
     if (!conn->ap2_pairing_context.setup_ctx) {
       debug(1, "Error creating setup context");
       resp->respcode = 500; // Internal Server Error
@@ -3369,6 +3815,8 @@ void handle_setup_2(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp)
         conn->input_num_channels = 2;
         conn->input_bit_depth = 16;
         conn->input_bytes_per_frame = conn->input_num_channels * ((conn->input_bit_depth + 7) / 8);
+        conn->resampler_drift_correction = config.buffered_audio_resampler_drift_correction;
+        conn->resampler_frames_to_stuff = 0;
         activity_monitor_signify_activity(1);
         player_prepare_to_play(
             conn); // get capabilities of DAC before creating the buffered audio thread
@@ -3813,21 +4261,24 @@ static int fd = -1;
 // static int dirty = 0;
 
 pc_queue metadata_queue;
-#define metadata_queue_size 500
+#define metadata_queue_size 512
 metadata_package metadata_queue_items[metadata_queue_size];
+uint32_t metadata_queue_sequences[metadata_queue_size];
 pthread_t metadata_thread;
 
 #ifdef CONFIG_METADATA_HUB
 pc_queue metadata_hub_queue;
-#define metadata_hub_queue_size 500
+#define metadata_hub_queue_size 512
 metadata_package metadata_hub_queue_items[metadata_hub_queue_size];
+uint32_t metadata_hub_queue_sequences[metadata_hub_queue_size];
 pthread_t metadata_hub_thread;
 #endif
 
 #ifdef CONFIG_MQTT
 pc_queue metadata_mqtt_queue;
-#define metadata_mqtt_queue_size 500
+#define metadata_mqtt_queue_size 512
 metadata_package metadata_mqtt_queue_items[metadata_mqtt_queue_size];
+uint32_t metadata_mqtt_queue_sequences[metadata_mqtt_queue_size];
 pthread_t metadata_mqtt_thread;
 #endif
 
@@ -3835,8 +4286,9 @@ static int metadata_sock = -1;
 static struct sockaddr_in metadata_sockaddr;
 static char *metadata_sockmsg;
 pc_queue metadata_multicast_queue;
-#define metadata_multicast_queue_size 500
-metadata_package metadata_multicast_queue_items[metadata_queue_size];
+#define metadata_multicast_queue_size 512
+metadata_package metadata_multicast_queue_items[metadata_multicast_queue_size];
+uint32_t metadata_multicast_queue_sequences[metadata_multicast_queue_size];
 pthread_t metadata_multicast_thread;
 
 void metadata_create_multicast_socket(void) {
@@ -3895,6 +4347,8 @@ static void metadata_close(void) {
   fd = -1;
 }
 
+static uint32_t metadata_multicast_message_id = 0; // identifies the items of the compact chunking
+
 void metadata_multicast_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
   // debug(1, "Process multicast metadata with type %x, code %x and length %u.", type, code,
   // length);
@@ -3911,49 +4365,154 @@ void metadata_multicast_process(uint32_t type, uint32_t code, char *data, uint32
     sendto(metadata_sock, metadata_sockmsg, length + 8, 0, (struct sockaddr *)&metadata_sockaddr,
            sizeof(metadata_sockaddr));
   } else if (metadata_sock >= 0) {
-    // send metadata in numbered chunks using the protocol:
+    // send metadata in chunks, using either the original protocol:
     // ("ssnc", "chnk", packet_ix, packet_counts, packet_tag, packet_type, chunked_data)
-
-    uint32_t chunk_ix = 0;
-    if (config.metadata_sockmsglength == 24)
-      die("A divide by zero almost occurred (config.metadata_sockmsglength = 24).");
-    uint32_t chunk_total = length / (config.metadata_sockmsglength - 24);
-    if (chunk_total * (config.metadata_sockmsglength - 24) < length) {
-      chunk_total++;
+    // or the compact one:
+    // ("ssnc", "chk2", message_id, offset, [total_length, packet_tag, packet_type,] chunked_data)
+    // where the bracketed fields are only in the chunk at offset zero.
+    // The chunks are sent in bursts, each with one system call, and if a rate limit is set,
+    // the bursts are spaced out to keep to it.
+
+    if (config.metadata_sockmsglength <= 28)
+      die("A divide by zero almost occurred (config.metadata_sockmsglength = %zu).",
+          config.metadata_sockmsglength);
+    uint32_t chunk_total;
+    if (config.metadata_sock_compact_chunks) {
+      // the first chunk has 28 bytes of header, the rest 16
+      chunk_total = 1;
+      if (length > config.metadata_sockmsglength - 28) {
+        uint32_t rest = length - (config.metadata_sockmsglength - 28);
+        chunk_total += (rest + config.metadata_sockmsglength - 16 - 1) /
+                       (config.metadata_sockmsglength - 16);
+      }
+    } else {
+      chunk_total = (length + config.metadata_sockmsglength - 24 - 1) /
+                    (config.metadata_sockmsglength - 24);
+    }
+    uint8_t *headers = malloc(chunk_total * 28);
+    struct iovec *iovecs = malloc(chunk_total * 2 * sizeof(struct iovec));
+    if ((headers == NULL) || (iovecs == NULL)) {
+      debug(1, "Can not allocate space to send %u bytes of metadata in %u chunks.", length,
+            chunk_total);
+      free(headers);
+      free(iovecs);
+      return;
     }
-    uint32_t remaining = length;
+    uint32_t message_id = metadata_multicast_message_id++;
+    uint32_t chunk_ix;
+    uint32_t offset = 0;
     uint32_t v;
-    char *data_crsr = data;
-    do {
-      char *ptr = metadata_sockmsg;
-      memcpy(ptr, "ssncchnk", 8);
-      ptr += 8;
-      v = htonl(chunk_ix);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      v = htonl(chunk_total);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      v = htonl(type);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      v = htonl(code);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      size_t datalen = remaining;
-      if (datalen > config.metadata_sockmsglength - 24) {
-        datalen = config.metadata_sockmsglength - 24;
+    for (chunk_ix = 0; chunk_ix < chunk_total; chunk_ix++) {
+      uint8_t *ptr = headers + chunk_ix * 28;
+      size_t space;
+      if (config.metadata_sock_compact_chunks) {
+        memcpy(ptr, "ssncchk2", 8);
+        v = htonl(message_id);
+        memcpy(ptr + 8, &v, 4);
+        v = htonl(offset);
+        memcpy(ptr + 12, &v, 4);
+        iovecs[chunk_ix * 2].iov_len = 16;
+        if (chunk_ix == 0) {
+          v = htonl(length);
+          memcpy(ptr + 16, &v, 4);
+          v = htonl(type);
+          memcpy(ptr + 20, &v, 4);
+          v = htonl(code);
+          memcpy(ptr + 24, &v, 4);
+          iovecs[chunk_ix * 2].iov_len = 28;
+        }
+      } else {
+        memcpy(ptr, "ssncchnk", 8);
+        v = htonl(chunk_ix);
+        memcpy(ptr + 8, &v, 4);
+        v = htonl(chunk_total);
+        memcpy(ptr + 12, &v, 4);
+        v = htonl(type);
+        memcpy(ptr + 16, &v, 4);
+        v = htonl(code);
+        memcpy(ptr + 20, &v, 4);
+        iovecs[chunk_ix * 2].iov_len = 24;
+      }
+      iovecs[chunk_ix * 2].iov_base = ptr;
+      space = config.metadata_sockmsglength - iovecs[chunk_ix * 2].iov_len;
+      size_t datalen = length - offset;
+      if (datalen > space)
+        datalen = space;
+      iovecs[chunk_ix * 2 + 1].iov_base = data + offset;
+      iovecs[chunk_ix * 2 + 1].iov_len = datalen;
+      offset += datalen;
+    }
+
+    // when rate limited, a burst is no more than 10 ms worth of data, but at least one chunk
+    size_t burst_byte_limit = (size_t)config.metadata_sock_rate_limit * 1024 / 100;
+    chunk_ix = 0;
+    while (chunk_ix < chunk_total) {
+      int burst = chunk_total - chunk_ix;
+      if (burst > RTP_BATCH_SIZE)
+        burst = RTP_BATCH_SIZE;
+      size_t burst_bytes = 0;
+      if (config.metadata_sock_rate_limit != 0) {
+        int i;
+        for (i = 0; i < burst; i++) {
+          size_t chunk_bytes = iovecs[(chunk_ix + i) * 2].iov_len +
+                               iovecs[(chunk_ix + i) * 2 + 1].iov_len;
+          if ((i != 0) && (burst_bytes + chunk_bytes > burst_byte_limit))
+            break;
+          burst_bytes += chunk_bytes;
+        }
+        burst = i;
       }
-      memcpy(ptr, data_crsr, datalen);
-      data_crsr += datalen;
-      sendto(metadata_sock, metadata_sockmsg, datalen + 24, 0,
-             (struct sockaddr *)&metadata_sockaddr, sizeof(metadata_sockaddr));
-      chunk_ix++;
-      remaining -= datalen;
-      if (remaining == 0)
+      int sent = udp_send_batch(metadata_sock, &metadata_sockaddr, sizeof(metadata_sockaddr),
+                                &iovecs[chunk_ix * 2], 2, burst);
+      if (sent <= 0) {
+        char errorstring[1024];
+        strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+        debug(1, "Error %d (\"%s\") sending metadata chunk %u of %u.", errno, errorstring,
+              chunk_ix, chunk_total);
         break;
-    } while (1);
+      }
+      if ((config.metadata_sock_rate_limit != 0) && (sent == burst)) {
+        uint64_t pause_us =
+            (uint64_t)burst_bytes * 1000000 / ((uint64_t)config.metadata_sock_rate_limit * 1024);
+        usleep(pause_us);
+      }
+      chunk_ix += sent;
+    }
+    free(headers);
+    free(iovecs);
+  }
+}
+
+// In the binary pipe format, each item is a 16-byte header -- the characters "sspm", then the
+// type, code and length of the data as 32-bit big-endian numbers -- followed by the raw data.
+// The marker lets a reader that starts part way through an item find the start of the next one.
+// Items longer than METADATA_BINARY_MAX_LENGTH are not sent, so that a reader can reject a header
+// with a longer length as a false match of the marker inside some data.
+#define METADATA_BINARY_MAX_LENGTH (16 * 1024 * 1024)
+static void metadata_process_binary(uint32_t type, uint32_t code, char *data, uint32_t length) {
+  if ((data != NULL) && (length > METADATA_BINARY_MAX_LENGTH)) {
+    debug(1, "metadata item of type %x, code %x is too long to send: %u bytes.", type, code,
+          length);
+    return;
   }
+  uint8_t header[16];
+  uint32_t v;
+  memcpy(header, "sspm", 4);
+  v = htonl(type);
+  memcpy(header + 4, &v, 4);
+  v = htonl(code);
+  memcpy(header + 8, &v, 4);
+  if (data == NULL)
+    length = 0;
+  v = htonl(length);
+  memcpy(header + 12, &v, 4);
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = data;
+  iov[1].iov_len = length;
+  int iovcnt = length != 0 ? 2 : 1;
+  writev_fully(fd, iov, iovcnt);
 }
 
 void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
@@ -3965,6 +4524,10 @@ void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length)
     metadata_open();
   if (fd < 0)
     return;
+  if (config.metadata_pipe_binary) {
+    metadata_process_binary(type, code, data, length);
+    return;
+  }
   char thestring[1024];
   snprintf(thestring, 1024, "<item><type>%x</type><code>%x</code><length>%u</length>", type, code,
            length);
@@ -4031,8 +4594,8 @@ void metadata_pack_cleanup_function(void *arg) {
   metadata_package *pack = (metadata_package *)arg;
   if (pack->carrier)
     msg_free(&pack->carrier); // release the message
-  else if (pack->data)
-    free(pack->data);
+  else if (pack->payload)
+    metadata_payload_release(pack->payload);
   // debug(1, "metadata_pack_cleanup_function exit");
 }
 
@@ -4043,9 +4606,10 @@ void metadata_thread_cleanup_function(__attribute__((unused)) void *arg) {
 }
 
 void *metadata_thread_function(__attribute__((unused)) void *ignore) {
+  TRACE_THREAD_NAME("metadata pipe");
   // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_queue, (char *)&metadata_queue_items, sizeof(metadata_package),
-                metadata_queue_size, "pipe");
+  pc_queue_init(&metadata_queue, (char *)&metadata_queue_items, metadata_queue_sequences,
+                sizeof(metadata_package), metadata_queue_size, "pipe");
   metadata_create_multicast_socket();
   metadata_package pack;
   pthread_cleanup_push(metadata_thread_cleanup_function, NULL);
@@ -4059,7 +4623,9 @@ void *metadata_thread_function(__attribute__((unused)) void *ignore) {
       } else {
         debug(3, "     pipe: type %x, code %x, length %u.", pack.type, pack.code, pack.length);
       }
+      uint64_t trace_start = TRACE_TIME();
       metadata_process(pack.type, pack.code, pack.data, pack.length);
+      TRACE_COMPLETE("metadata pipe write", trace_start, pack.length);
       debug(3, "     pipe: done.");
     }
     pthread_cleanup_pop(1);
@@ -4075,9 +4641,11 @@ void metadata_multicast_thread_cleanup_function(__attribute__((unused)) void *ar
 }
 
 void *metadata_multicast_thread_function(__attribute__((unused)) void *ignore) {
+  TRACE_THREAD_NAME("metadata multicast");
   // create a pc_queue for passing information to a threaded metadata handler
   pc_queue_init(&metadata_multicast_queue, (char *)&metadata_multicast_queue_items,
-                sizeof(metadata_package), metadata_multicast_queue_size, "multicast");
+                metadata_multicast_queue_sequences, sizeof(metadata_package),
+                metadata_multicast_queue_size, "multicast");
   metadata_create_multicast_socket();
   metadata_package pack;
   pthread_cleanup_push(metadata_multicast_thread_cleanup_function, NULL);
@@ -4116,9 +4684,11 @@ void metadata_hub_thread_cleanup_function(__attribute__((unused)) void *arg) {
 }
 
 void *metadata_hub_thread_function(__attribute__((unused)) void *ignore) {
+  TRACE_THREAD_NAME("metadata hub");
   // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_hub_queue, (char *)&metadata_hub_queue_items, sizeof(metadata_package),
-                metadata_hub_queue_size, "hub");
+  pc_queue_init(&metadata_hub_queue, (char *)&metadata_hub_queue_items,
+                metadata_hub_queue_sequences, sizeof(metadata_package), metadata_hub_queue_size,
+                "hub");
   metadata_package pack;
   pthread_cleanup_push(metadata_hub_thread_cleanup_function, NULL);
   while (1) {
@@ -4151,9 +4721,11 @@ void metadata_mqtt_thread_cleanup_function(__attribute__((unused)) void *arg) {
 }
 
 void *metadata_mqtt_thread_function(__attribute__((unused)) void *ignore) {
+  TRACE_THREAD_NAME("metadata mqtt");
   // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_mqtt_queue, (char *)&metadata_mqtt_queue_items, sizeof(metadata_package),
-                metadata_mqtt_queue_size, "mqtt");
+  pc_queue_init(&metadata_mqtt_queue, (char *)&metadata_mqtt_queue_items,
+                metadata_mqtt_queue_sequences, sizeof(metadata_package), metadata_mqtt_queue_size,
+                "mqtt");
   metadata_package pack;
   pthread_cleanup_push(metadata_mqtt_thread_cleanup_function, NULL);
   while (1) {
@@ -4256,8 +4828,9 @@ void metadata_stop(void) {
   }
 }
 
-int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *data,
-                           uint32_t length, rtsp_message *carrier, int block) {
+static int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *data,
+                                  uint32_t length, rtsp_message *carrier,
+                                  metadata_payload *payload) {
 
   // clang-format off
   // parameters:
@@ -4266,6 +4839,7 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
   //   pointer to data or NULL,
   //   length of data or NULL,
   //   the rtsp_message or NULL,
+  //   the shared copy of the data or NULL
 
   // the rtsp_message is sent for 'core' messages, because it contains the data
   // and must not be freed until the data has been read.
@@ -4281,11 +4855,11 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
   // should be decremented by the metadata handler when finished.
   // If the reference count reduces to zero, the message will be freed.
 
-  // If the rtsp_message is NULL, then if the pointer is non-null then the data it
-  // points to, of the length specified, is memcpy'd and passed to the metadata
-  // handler. The handler should free it when done.
+  // If the rtsp_message is NULL, then if the payload is non-null, it holds a copy
+  // of the data, shared by all the queues. Its reference count is incremented here
+  // and is decremented by the metadata handler when finished.
 
-  // If the rtsp_message is NULL and the pointer is also NULL, nothing further
+  // If the rtsp_message is NULL and the payload is also NULL, nothing further
   // is done.
   // clang-format on
 
@@ -4294,17 +4868,21 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
   pack.code = code;
   pack.length = length;
   pack.carrier = carrier;
+  pack.payload = NULL;
   pack.data = data;
   if (pack.carrier) {
     msg_retain(pack.carrier);
+  } else if (payload) {
+    metadata_payload_retain(payload);
+    pack.payload = payload;
+    pack.data = payload->data;
   } else {
-    if (data)
-      pack.data = memdup(data, length); // only if it's not a null
+    pack.data = NULL;
   }
-  int rc = pc_queue_add_item(queue, &pack, block);
+  int rc = pc_queue_add_item(queue, &pack);
   if (rc != 0) {
     if (pack.carrier) {
-      if (rc == EWOULDBLOCK)
+      if (queue->capacity != 0)
         debug(2,
               "metadata queue \"%s\" full, dropping message item: type %x, code %x, data %x, "
               "length %u, message %d.",
@@ -4312,35 +4890,48 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
               pack.carrier->index_number);
       msg_free(&pack.carrier);
     } else {
-      if (rc == EWOULDBLOCK)
+      if (queue->capacity != 0)
         debug(
             2,
             "metadata queue \"%s\" full, dropping data item: type %x, code %x, data %x, length %u.",
             queue->name, pack.type, pack.code, pack.data, pack.length);
-      if (pack.data)
-        free(pack.data);
+      if (pack.payload)
+        metadata_payload_release(pack.payload);
     }
   }
   return rc;
 }
 
+// Adding to the queues never blocks now, so block is ignored. It's kept so that callers can
+// still say whether they could afford to wait.
 int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
-                  int block) {
+                  __attribute__((unused)) int block) {
   int rc = 0;
+  // unless it's in an rtsp_message, copy the data once, for all the queues to share
+  metadata_payload *payload = NULL;
+  if ((carrier == NULL) && (data != NULL)) {
+    payload = metadata_payload_new(data, length);
+    if (payload == NULL) {
+      debug(1, "Can not allocate %u bytes for metadata type %x, code %x.", length, type, code);
+      return ENOMEM;
+    }
+  }
   if (config.metadata_enabled) {
-    rc = send_metadata_to_queue(&metadata_queue, type, code, data, length, carrier, block);
-    rc =
-        send_metadata_to_queue(&metadata_multicast_queue, type, code, data, length, carrier, block);
+    rc = send_metadata_to_queue(&metadata_queue, type, code, data, length, carrier, payload);
+    rc = send_metadata_to_queue(&metadata_multicast_queue, type, code, data, length, carrier,
+                                payload);
   }
 
 #ifdef CONFIG_METADATA_HUB
-  rc = send_metadata_to_queue(&metadata_hub_queue, type, code, data, length, carrier, block);
+  rc = send_metadata_to_queue(&metadata_hub_queue, type, code, data, length, carrier, payload);
 #endif
 
 #ifdef CONFIG_MQTT
-  rc = send_metadata_to_queue(&metadata_mqtt_queue, type, code, data, length, carrier, block);
+  rc = send_metadata_to_queue(&metadata_mqtt_queue, type, code, data, length, carrier, payload);
 #endif
 
+  if (payload)
+    metadata_payload_release(payload); // the queues have their own references
   return rc;
 }
 
@@ -5110,6 +5701,10 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
       free(conn->auth_nonce);
       conn->auth_nonce = NULL;
     }
+    if (conn->rtsp_input_buffer) {
+      free(conn->rtsp_input_buffer);
+      conn->rtsp_input_buffer = NULL;
+    }
 
 #ifdef CONFIG_AIRPLAY_2
     buf_drain(&conn->ap2_pairing_context.control_cipher_bundle.plaintext_read_buffer, -1);
@@ -5157,15 +5752,18 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
     if (rc)
       debug(1, "Connection %d: error %d destroying flush_mutex.", conn->connection_number, rc);
 
-    debug(3, "Cancel watchdog thread.");
-    pthread_cancel(conn->player_watchdog_thread);
-    debug(3, "Join watchdog thread.");
-    pthread_join(conn->player_watchdog_thread, NULL);
+    debug(3, "Take the connection from the watchdog.");
+    player_watchdog_remove(conn);
     debug(3, "Delete watchdog mutex.");
     pthread_mutex_destroy(&conn->watchdog_mutex);
 
     debug(2, "Connection %d: Closed.", conn->connection_number);
     conn->running = 0; // for the garbage collector
+    // wake up the listener to reap the thread now rather than at its next timeout
+    if (rtsp_listener_wakeup_pipe[1] != -1) {
+      if (write(rtsp_listener_wakeup_pipe[1], "x", 1) != 1)
+        debug(3, "Connection %d: could not wake the RTSP listener.", conn->connection_number);
+    }
     pthread_setcancelstate(oldState, NULL);
   }
 }
@@ -5178,10 +5776,10 @@ void msg_cleanup_function(void *arg) {
 static void *rtsp_conversation_thread_func(void *pconn) {
   rtsp_conn_info *conn = pconn;
 
-  // create the watchdog mutex, initialise the watchdog time and start the watchdog thread;
+  // create the watchdog mutex, initialise the watchdog time and put it under the watchdog
   conn->watchdog_bark_time = get_absolute_time_in_ns();
   pthread_mutex_init(&conn->watchdog_mutex, NULL);
-  pthread_create(&conn->player_watchdog_thread, NULL, &player_watchdog_thread_code, (void *)conn);
+  player_watchdog_add(conn);
 
   int rc = pthread_mutex_init(&conn->flush_mutex, NULL);
   if (rc)
@@ -5214,7 +5812,7 @@ static void *rtsp_conversation_thread_func(void *pconn) {
   rtsp_message *req, *resp;
 
 #ifdef CONFIG_AIRPLAY_2
-  conn->ap2_audio_buffer_size = 1024 * 1024 * 8;
+  conn->ap2_audio_buffer_size = config.ap2_audio_buffer_size;
 #endif
 
   while (conn->stop == 0) {
@@ -5413,7 +6011,18 @@ void rtsp_listen_loop_cleanup_handler(__attribute__((unused)) void *arg) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
   debug(2, "rtsp_listen_loop_cleanup_handler called.");
+  if (player_watchdog_thread_started) {
+    pthread_cancel(player_watchdog_thread);
+    pthread_join(player_watchdog_thread, NULL);
+    player_watchdog_thread_started = 0;
+  }
   cancel_all_RTSP_threads(unspecified_stream_category, 0); // kill all RTSP listeners
+  if (rtsp_listener_wakeup_pipe[0] != -1) {
+    close(rtsp_listener_wakeup_pipe[0]);
+    close(rtsp_listener_wakeup_pipe[1]);
+    rtsp_listener_wakeup_pipe[0] = -1;
+    rtsp_listener_wakeup_pipe[1] = -1;
+  }
   int *sockfd = (int *)arg;
   if (sockfd) {
     int i;
@@ -5532,6 +6141,26 @@ void *rtsp_listen_loop(__attribute((unused)) void *arg) {
         maxfd = sockfd[i];
     }
 
+    // finished conversation threads write to this so that they are reaped promptly
+    if (pipe(rtsp_listener_wakeup_pipe) == 0) {
+      for (i = 0; i < 2; i++) {
+        fcntl(rtsp_listener_wakeup_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(rtsp_listener_wakeup_pipe[i], F_SETFL,
+              fcntl(rtsp_listener_wakeup_pipe[i], F_GETFL) | O_NONBLOCK);
+      }
+      if (rtsp_listener_wakeup_pipe[0] > maxfd)
+        maxfd = rtsp_listener_wakeup_pipe[0];
+    } else {
+      debug(1, "Can not create the RTSP listener wakeup pipe -- error %d.", errno);
+      rtsp_listener_wakeup_pipe[0] = -1;
+      rtsp_listener_wakeup_pipe[1] = -1;
+    }
+
+    ret = pthread_create(&player_watchdog_thread, NULL, &player_watchdog_thread_code, NULL);
+    if (ret)
+      die("Can not create the player watchdog thread -- error %d.", ret);
+    player_watchdog_thread_started = 1;
+
     char **t1 = txt_records; // ap1 text records
     char **t2 = NULL;        // possibly two text records
 #ifdef CONFIG_AIRPLAY_2
@@ -5555,6 +6184,8 @@ void *rtsp_listen_loop(__attribute((unused)) void *arg) {
       // skip the first element in sockfd -- it's the count
       for (i = 1; i <= nsock; i++)
         FD_SET(sockfd[i], &fds);
+      if (rtsp_listener_wakeup_pipe[0] != -1)
+        FD_SET(rtsp_listener_wakeup_pipe[0], &fds);
 
       ret = select(maxfd + 1, &fds, 0, 0, &tv);
 
@@ -5564,6 +6195,12 @@ void *rtsp_listen_loop(__attribute((unused)) void *arg) {
         break;
       }
 
+      if ((rtsp_listener_wakeup_pipe[0] != -1) && (FD_ISSET(rtsp_listener_wakeup_pipe[0], &fds))) {
+        char drain[64];
+        while (read(rtsp_listener_wakeup_pipe[0], drain, sizeof(drain)) > 0)
+          ;
+      }
+
       cleanup_threads();
 
       acceptfd = -1;
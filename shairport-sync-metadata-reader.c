@@ -0,0 +1,173 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A reference reader for the binary metadata pipe format, selected with
+// metadata.pipe_format = "binary".
+// Each item is a 16-byte header -- the characters "sspm", then the type, code and length of the
+// data as 32-bit big-endian numbers -- followed by that many bytes of data.
+// No item is longer than MAX_LENGTH, which must match METADATA_BINARY_MAX_LENGTH in rtsp.c.
+// Usage: shairport-sync-metadata-reader [pipe path] [directory for pictures]
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LENGTH (16 * 1024 * 1024)
+
+// read exactly len bytes, returning 0 on success or -1 at the end of the stream or on error
+static int read_fully(int fd, void *buf, size_t len) {
+  uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t r = read(fd, p, len);
+    if (r == 0)
+      return -1;
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int is_fourcc(const uint8_t *p) {
+  int i;
+  for (i = 0; i < 4; i++)
+    if ((p[i] < 0x20) || (p[i] > 0x7e))
+      return 0;
+  return 1;
+}
+
+// a header must have the "sspm" marker, a type and code made of printable characters and a
+// length no longer than any item that is sent -- the marker alone could turn up in a picture
+static int is_header(const uint8_t *header) {
+  uint32_t v;
+  memcpy(&v, header + 12, 4);
+  return (memcmp(header, "sspm", 4) == 0) && (is_fourcc(header + 4)) && (is_fourcc(header + 8)) &&
+         (ntohl(v) <= MAX_LENGTH);
+}
+
+// read the next header, skipping anything before it -- that only happens if the reader started
+// part way through an item. If what looks like a header is rejected, the search carries on from
+// the next byte.
+static int read_header(int fd, uint32_t *type, uint32_t *code, uint32_t *length) {
+  uint8_t header[16];
+  if (read_fully(fd, header, sizeof(header)) != 0)
+    return -1;
+  while (is_header(header) == 0) {
+    memmove(header, header + 1, sizeof(header) - 1);
+    if (read_fully(fd, header + sizeof(header) - 1, 1) != 0)
+      return -1;
+  }
+  uint32_t v;
+  memcpy(&v, header + 4, 4);
+  *type = ntohl(v);
+  memcpy(&v, header + 8, 4);
+  *code = ntohl(v);
+  memcpy(&v, header + 12, 4);
+  *length = ntohl(v);
+  return 0;
+}
+
+static void fourcc(uint32_t v, char *s) {
+  s[0] = (v >> 24) & 0xff;
+  s[1] = (v >> 16) & 0xff;
+  s[2] = (v >> 8) & 0xff;
+  s[3] = v & 0xff;
+  s[4] = '\0';
+}
+
+static int is_printable(const uint8_t *data, uint32_t length) {
+  uint32_t i;
+  for (i = 0; i < length; i++)
+    if ((data[i] < 0x20) && (data[i] != '\n') && (data[i] != '\r') && (data[i] != '\t'))
+      return 0;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  const char *pipe_path = "/tmp/shairport-sync-metadata";
+  const char *picture_directory = NULL;
+  if (argc > 1)
+    pipe_path = argv[1];
+  if (argc > 2)
+    picture_directory = argv[2];
+
+  int fd = open(pipe_path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can not open \"%s\": %s.\n", pipe_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  int picture_number = 0;
+  uint32_t type, code, length;
+  while (read_header(fd, &type, &code, &length) == 0) {
+    uint8_t *data = NULL;
+    if (length != 0) {
+      data = malloc(length);
+      if (data == NULL) {
+        fprintf(stderr, "Can not allocate %" PRIu32 " bytes.\n", length);
+        exit(EXIT_FAILURE);
+      }
+      if (read_fully(fd, data, length) != 0) {
+        free(data);
+        break;
+      }
+    }
+    char type_string[5], code_string[5];
+    fourcc(type, type_string);
+    fourcc(code, code_string);
+    if ((type == 0x73736e63) && (code == 0x50494354)) { // 'ssnc' 'PICT'
+      printf("%s %s: picture, %" PRIu32 " bytes", type_string, code_string, length);
+      if ((picture_directory != NULL) && (length != 0)) {
+        char path[4096];
+        const char *ext = ((length > 3) && (data[0] == 0xFF) && (data[1] == 0xD8)) ? "jpg" : "png";
+        snprintf(path, sizeof(path), "%s/picture-%d.%s", picture_directory, picture_number++, ext);
+        FILE *f = fopen(path, "wb");
+        if (f) {
+          fwrite(data, 1, length, f);
+          fclose(f);
+          printf(", saved as \"%s\"", path);
+        }
+      }
+      printf(".\n");
+    } else if ((length != 0) && (is_printable(data, length))) {
+      printf("%s %s: \"%.*s\".\n", type_string, code_string, (int)length, (char *)data);
+    } else {
+      printf("%s %s: %" PRIu32 " bytes.\n", type_string, code_string, length);
+    }
+    fflush(stdout);
+    free(data);
+  }
+  close(fd);
+  return 0;
+}
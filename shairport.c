@@ -74,6 +74,7 @@
 #include "common.h"
 #include "rtp.h"
 #include "rtsp.h"
+#include "trace.h"
 
 #if defined(CONFIG_DACP_CLIENT)
 #include "dacp.h"
@@ -545,6 +546,10 @@ int parse_options(int argc, char **argv) {
   // Set to NULL to work with transient pairing
   config.airplay_pin = NULL;
 
+  config.ap2_audio_buffer_size = 1024 * 1024 * 8;
+  config.ap2_decoding_lookahead = 0.4;
+  config.buffered_audio_resampler_drift_correction = 0;
+
   // use the MAC address placed in config.hw_addr to generate the default airplay_device_id
   uint64_t temporary_airplay_id = nctoh64(config.hw_addr);
   temporary_airplay_id =
@@ -665,6 +670,17 @@ int parse_options(int argc, char **argv) {
               str);
       }
 
+      if (config_lookup_string(config.cfg, "general.clock_estimator", &str)) {
+        if (strcasecmp(str, "regression") == 0)
+          config.clock_estimator = CE_regression;
+        else if (strcasecmp(str, "kalman") == 0)
+          config.clock_estimator = CE_kalman;
+        else
+          die("Invalid clock_estimator option choice \"%s\". It should be \"regression\" or "
+              "\"kalman\"",
+              str);
+      }
+
 #ifdef CONFIG_SOXR
 
       /* Get the soxr_delay_threshold setting. */
@@ -772,6 +788,49 @@ int parse_options(int argc, char **argv) {
               str);
       }
 
+      /* Get the asynchronous logging setting. */
+      if (config_lookup_string(config.cfg, "diagnostics.log_asynchronously", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.log_asynchronously = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.log_asynchronously = 1;
+        else
+          die("Invalid diagnostics log_asynchronously option choice \"%s\". It should be "
+              "\"yes\" or \"no\"",
+              str);
+      }
+
+      /* Get the mutex profiling setting. */
+      if (config_lookup_string(config.cfg, "diagnostics.mutex_profiling", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.mutex_profiling = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.mutex_profiling = 1;
+        else
+          die("Invalid diagnostics mutex_profiling option choice \"%s\". It should be \"yes\" or "
+              "\"no\"",
+              str);
+      }
+
+#ifdef CONFIG_TRACING
+      /* Get the tracing settings. */
+      if (config_lookup_string(config.cfg, "diagnostics.trace", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.trace_requested = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.trace_requested = 1;
+        else
+          die("Invalid diagnostics trace option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "diagnostics.trace_file", &str)) {
+        if (config.trace_file_path)
+          free(config.trace_file_path);
+        config.trace_file_path = strdup(str);
+      }
+#endif
+
       /* Get the statistics setting. */
       if (config_lookup_string(config.cfg, "diagnostics.statistics", &str)) {
         if (strcasecmp(str, "no") == 0)
@@ -1012,6 +1071,17 @@ int parse_options(int argc, char **argv) {
                dvalue, config.missing_port_dacp_scan_interval_seconds);
       }
 
+      /* Get the dacp_long_polling setting. */
+      if (config_lookup_string(config.cfg, "general.dacp_long_polling", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.dacp_long_polling = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.dacp_long_polling = 1;
+        else
+          die("Invalid dacp_long_polling option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
       /* Get the default latency. Deprecated! */
       if (config_lookup_int(config.cfg, "latencies.default", &value))
         config.userSuppliedLatency = value;
@@ -1042,6 +1112,17 @@ int parse_options(int argc, char **argv) {
         config.metadata_pipename = (char *)str;
       }
 
+      if (config_lookup_string(config.cfg, "metadata.pipe_format", &str)) {
+        if (strcasecmp(str, "xml") == 0)
+          config.metadata_pipe_binary = 0;
+        else if (strcasecmp(str, "binary") == 0)
+          config.metadata_pipe_binary = 1;
+        else
+          die("Invalid metadata pipe_format option choice \"%s\". It should be \"xml\" or "
+              "\"binary\"",
+              str);
+      }
+
       if (config_lookup_float(config.cfg, "metadata.progress_interval", &dvalue)) {
         config.metadata_progress_interval = dvalue;
       }
@@ -1056,6 +1137,21 @@ int parse_options(int argc, char **argv) {
       if (config_lookup_int(config.cfg, "metadata.socket_msglength", &value)) {
         config.metadata_sockmsglength = value < 500 ? 500 : value > 65000 ? 65000 : value;
       }
+      if (config_lookup_string(config.cfg, "metadata.socket_chunk_format", &str)) {
+        if (strcasecmp(str, "original") == 0)
+          config.metadata_sock_compact_chunks = 0;
+        else if (strcasecmp(str, "compact") == 0)
+          config.metadata_sock_compact_chunks = 1;
+        else
+          die("Invalid metadata socket_chunk_format option choice \"%s\". It should be "
+              "\"original\" or \"compact\"",
+              str);
+      }
+      if (config_lookup_int(config.cfg, "metadata.socket_rate_limit", &value)) {
+        if (value < 0)
+          die("Invalid metadata socket_rate_limit \"%d\". It should be zero or more.", value);
+        config.metadata_sock_rate_limit = value;
+      }
 
 #endif
 
@@ -1064,6 +1160,13 @@ int parse_options(int argc, char **argv) {
         config.cover_art_cache_dir = (char *)str;
       }
 
+      if (config_lookup_int(config.cfg, "metadata.cover_art_cache_size_limit", &value)) {
+        if (value < 0)
+          die("Invalid metadata cover_art_cache_size_limit \"%d\". It should be zero or more.",
+              value);
+        config.cover_art_cache_size_limit = value;
+      }
+
       if (config_lookup_string(config.cfg, "diagnostics.retain_cover_art", &str)) {
         if (strcasecmp(str, "no") == 0)
           config.retain_coverart = 0;
@@ -1331,6 +1434,41 @@ int parse_options(int argc, char **argv) {
       temporary_airplay_id += aid;
     }
 
+    if (config_lookup_int(config.cfg, "general.buffered_audio_buffer_size_in_kilobytes",
+                          &value)) {
+      if ((value >= 512) && (value <= 65536))
+        config.ap2_audio_buffer_size = value * 1024;
+      else
+        warn("Invalid general buffered_audio_buffer_size_in_kilobytes setting \"%d\". It should "
+             "be between 512 and 65536, inclusive. The setting remains at %zu kilobytes.",
+             value, config.ap2_audio_buffer_size / 1024);
+    }
+
+    if (config_lookup_float(config.cfg, "general.buffered_audio_decode_ahead_in_seconds",
+                            &dvalue)) {
+      if ((dvalue >= 0.1) && (dvalue <= 5.0))
+        config.ap2_decoding_lookahead = dvalue;
+      else
+        warn("Invalid general buffered_audio_decode_ahead_in_seconds setting \"%f\". It should "
+             "be between 0.1 and 5.0, inclusive. The setting remains at %f seconds.",
+             dvalue, config.ap2_decoding_lookahead);
+    }
+
+    if (config_lookup_string(config.cfg, "general.buffered_audio_drift_correction", &str)) {
+      if (strcasecmp(str, "player") == 0)
+        config.buffered_audio_resampler_drift_correction = 0;
+      else if (strcasecmp(str, "resampler") == 0)
+        config.buffered_audio_resampler_drift_correction = 1;
+      else
+        warn("Invalid general buffered_audio_drift_correction option choice \"%s\". It should be "
+             "\"player\" or \"resampler\". It remains set to \"%s\".",
+             str, config.buffered_audio_resampler_drift_correction ? "resampler" : "player");
+    }
+
+    if (config_lookup_string(config.cfg, "general.airplay_pairings_file", &str)) {
+      config.airplay_pairings_file = (char *)str;
+    }
+
 #endif
   }
 
@@ -1727,6 +1865,10 @@ void exit_function() {
   } else {
     debug(1, "emergency exit");
   }
+#ifdef CONFIG_TRACING
+  trace_stop();
+#endif
+  log_writer_stop();
 }
 
 // for removing zombie script processes
@@ -2034,6 +2176,9 @@ int main(int argc, char **argv) {
       1; // by default, log the file and line of the originating message
   config.debugger_show_relative_time =
       1;                // by default, log the  time back to the previous debug message
+#ifdef CONFIG_TRACING
+  config.trace_file_path = strdup("/var/lib/shairport-sync/trace.json");
+#endif
   config.timeout = 120; // this number of seconds to wait for [more] audio before switching to idle.
   config.buffer_start_fill = 220;
 
@@ -2237,6 +2382,14 @@ int main(int argc, char **argv) {
 
 #endif
 
+  // start this after daemonising, as threads don't survive the fork
+  if (config.log_asynchronously)
+    log_writer_start();
+#ifdef CONFIG_TRACING
+  if (config.trace_requested)
+    trace_start(config.trace_file_path);
+#endif
+
 #ifdef CONFIG_AIRPLAY_2
 
   if (has_fltp_capable_aac_decoder() == 0) {
@@ -2424,6 +2577,12 @@ int main(int argc, char **argv) {
         : config.packet_stuffing == ST_soxr ? "soxr"
                                             : "auto");
   debug(1, "interpolation soxr_delay_threshold is %d.", config.soxr_delay_threshold);
+  debug(1, "clock estimator is \"%s\".",
+        config.clock_estimator == CE_kalman ? "kalman" : "regression");
+#ifdef CONFIG_AIRPLAY_2
+  debug(1, "buffered audio drift correction is done by the %s.",
+        config.buffered_audio_resampler_drift_correction ? "resampler" : "player");
+#endif
   debug(1, "resync time is %f seconds.", config.resync_threshold);
   debug(1, "resync recovery time is %f seconds.", config.resync_recovery_time);
   debug(1, "allow a session to be interrupted: %d.", config.allow_session_interruption);
@@ -2629,10 +2788,10 @@ int main(int argc, char **argv) {
   if (ptp_clock_version == 0) {
     die("The nqptp service on this system, which is required for Shairport Sync to operate, does "
         "not seem to be initialised.");
-  } else if (ptp_clock_version < NQPTP_SHM_STRUCTURES_VERSION) {
+  } else if (ptp_clock_version < NQPTP_SHM_STRUCTURES_VERSION_DUAL_RECORD) {
     die("The nqptp service (SMI Version %d) on this system is too old for this version of "
-        "Shairport Sync, which requires SMI Version %d. Please update.",
-        ptp_clock_version, NQPTP_SHM_STRUCTURES_VERSION);
+        "Shairport Sync, which requires SMI Version %d or later. Please update.",
+        ptp_clock_version, NQPTP_SHM_STRUCTURES_VERSION_DUAL_RECORD);
   } else if (ptp_clock_version > NQPTP_SHM_STRUCTURES_VERSION) {
     die("This version of Shairport Sync (SMI Version %d) is too old for the version of nqptp (SMI "
         "Version %d) on this system. Please update.",
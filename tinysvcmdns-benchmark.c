@@ -0,0 +1,251 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A benchmark for the tinysvcmdns responder.
+// It sets up a responder with the records Shairport Sync publishes, but not on the network, and
+// replays a burst of mDNS packets to it over and over, timing how long it takes to answer them.
+// The burst is either a built-in mix of the queries seen on a busy network -- for our services,
+// for other devices' services with known answers, for other hosts, and other devices' responses
+// -- or is read from a file of captured packets, each preceded by its length as a 16-bit
+// big-endian number.
+// Usage: tinysvcmdns-benchmark [iterations] [capture file]
+
+#include "tinysvcmdns.h"
+#include "common.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// tinysvcmdns logs through common.c, which isn't linked in here
+
+volatile int debuglev = 0;
+
+void _die(const char *filename, const int linenumber, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "fatal error: \"%s:%d\": ", filename, linenumber);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  exit(EXIT_FAILURE);
+}
+
+void _warn(const char *filename, const int linenumber, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "warning: \"%s:%d\": ", filename, linenumber);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+void _debug(__attribute__((unused)) const char *filename,
+            __attribute__((unused)) const int linenumber, __attribute__((unused)) int level,
+            __attribute__((unused)) const char *format, ...) {}
+
+#define MAX_PACKETS 1024
+#define MAX_PACKET_SIZE 9000
+
+typedef struct {
+  size_t length;
+  uint8_t data[MAX_PACKET_SIZE];
+} packet;
+
+static packet packets[MAX_PACKETS];
+static int packet_count = 0;
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+  return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+  p = put_u16(p, v >> 16);
+  return put_u16(p, v & 0xffff);
+}
+
+// a name in wire format, uncompressed
+static uint8_t *put_name(uint8_t *p, const char *name) {
+  while (*name) {
+    const char *dot = strchr(name, '.');
+    size_t length = dot ? (size_t)(dot - name) : strlen(name);
+    *p++ = length;
+    memcpy(p, name, length);
+    p += length;
+    name += length;
+    if (*name == '.')
+      name++;
+  }
+  *p++ = 0;
+  return p;
+}
+
+// a packet with one question and, optionally, one PTR record as a known answer or, if the
+// response flag is set, as an answer
+static void add_packet(uint16_t flags, const char *name, uint16_t type, const char *ptr_target) {
+  if (packet_count == MAX_PACKETS)
+    return;
+  int is_response = (flags & MDNS_FLAG_RESP) != 0;
+  uint8_t *p = packets[packet_count].data;
+  p = put_u16(p, 0);                                       // id
+  p = put_u16(p, flags);                                   // flags
+  p = put_u16(p, is_response ? 0 : 1);                     // questions
+  p = put_u16(p, ptr_target ? 1 : 0);                      // answers
+  p = put_u16(p, 0);                                       // authority records
+  p = put_u16(p, 0);                                       // additional records
+  if (is_response == 0) {
+    p = put_name(p, name);
+    p = put_u16(p, type);
+    p = put_u16(p, 1); // class IN
+  }
+  if (ptr_target) {
+    p = put_name(p, name);
+    p = put_u16(p, RR_PTR);
+    p = put_u16(p, 1);
+    p = put_u32(p, 4500);
+    uint8_t *rdlength = p;
+    p = put_name(p + 2, ptr_target);
+    put_u16(rdlength, p - rdlength - 2);
+  }
+  packets[packet_count].length = p - packets[packet_count].data;
+  packet_count++;
+}
+
+static void make_burst() {
+  char name[256];
+  int i;
+  for (i = 0; i < 8; i++) {
+    // other controllers browsing, already knowing about some other speakers
+    snprintf(name, sizeof(name), "Speaker %d._airplay._tcp.local", i);
+    add_packet(0, "_airplay._tcp.local", RR_PTR, name);
+    snprintf(name, sizeof(name), "0123456789A%d@Speaker %d._raop._tcp.local", i, i);
+    add_packet(0, "_raop._tcp.local", RR_PTR, name);
+    // other speakers answering them
+    snprintf(name, sizeof(name), "Speaker %d._airplay._tcp.local", i);
+    add_packet(MDNS_FLAG_RESP | MDNS_FLAG_AA, "_airplay._tcp.local", RR_PTR, name);
+    // questions for other hosts and services
+    snprintf(name, sizeof(name), "speaker-%d.local", i);
+    add_packet(0, name, RR_A, NULL);
+    add_packet(0, name, RR_AAAA, NULL);
+    add_packet(0, "_companion-link._tcp.local", RR_PTR, NULL);
+    add_packet(0, "_googlecast._tcp.local", RR_PTR, NULL);
+  }
+  // questions for us
+  add_packet(0, "_airplay._tcp.local", RR_PTR, NULL);
+  add_packet(0, "_raop._tcp.local", RR_PTR, NULL);
+  add_packet(0, "_services._dns-sd._udp.local", RR_PTR, NULL);
+  add_packet(0, "Benchmark._airplay._tcp.local", RR_ANY, NULL);
+  add_packet(0, "benchmark.local", RR_A, NULL);
+}
+
+static int read_capture(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Can not open \"%s\": %s.\n", path, strerror(errno));
+    return -1;
+  }
+  uint8_t length_bytes[2];
+  while ((packet_count < MAX_PACKETS) && (fread(length_bytes, 1, 2, f) == 2)) {
+    size_t length = (length_bytes[0] << 8) | length_bytes[1];
+    if ((length > MAX_PACKET_SIZE) ||
+        (fread(packets[packet_count].data, 1, length, f) != length)) {
+      fprintf(stderr, "\"%s\" is not a capture file, or is truncated.\n", path);
+      fclose(f);
+      return -1;
+    }
+    packets[packet_count].length = length;
+    packet_count++;
+  }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  long iterations = 20000;
+  if (argc > 1)
+    iterations = strtol(argv[1], NULL, 10);
+  if (iterations <= 0)
+    iterations = 1;
+  if (argc > 2) {
+    if (read_capture(argv[2]) != 0)
+      exit(EXIT_FAILURE);
+  } else {
+    make_burst();
+  }
+  if (packet_count == 0) {
+    fprintf(stderr, "No packets to replay.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct mdnsd *svr = mdnsd_new();
+  if (svr == NULL) {
+    fprintf(stderr, "Can not create the responder.\n");
+    exit(EXIT_FAILURE);
+  }
+  mdnsd_set_hostname(svr, "benchmark.local", inet_addr("192.168.1.2"));
+  const char *txt[] = {"cn=0,1", "da=true", "et=0,4", "ft=0x5A7FFEE6", "md=0,1,2",
+                       "am=Shairport Sync", "sf=0x4", "tp=UDP", "vn=65537", "vs=366.0", NULL};
+  mdnsd_register_svc(svr, "0123456789AB@Benchmark", "_raop._tcp.local", 7000, NULL, txt);
+  mdnsd_register_svc(svr, "Benchmark", "_airplay._tcp.local", 7000, NULL, txt);
+
+  struct mdns_pkt *reply = calloc(1, sizeof(struct mdns_pkt));
+  uint8_t *pkt_buf = malloc(MAX_PACKET_SIZE);
+  uint8_t *reply_buf = malloc(65536);
+  if ((reply == NULL) || (pkt_buf == NULL) || (reply_buf == NULL)) {
+    fprintf(stderr, "Can not allocate memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t answered = 0;
+  uint64_t reply_bytes = 0;
+  struct timespec start, finish;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long i;
+  for (i = 0; i < iterations; i++) {
+    int j;
+    for (j = 0; j < packet_count; j++) {
+      // the responder receives into the buffer it may also reply into
+      memcpy(pkt_buf, packets[j].data, packets[j].length);
+      size_t replylen =
+          mdnsd_answer_query(svr, pkt_buf, packets[j].length, reply, reply_buf, 65536);
+      if (replylen != 0) {
+        answered++;
+        reply_bytes += replylen;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &finish);
+  double seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) * 1E-9;
+  uint64_t total = (uint64_t)iterations * packet_count;
+  printf("%" PRIu64 " packets (%d per burst) in %.3f seconds: %.0f packets per second, "
+         "%.3f microseconds per packet.\n",
+         total, packet_count, seconds, total / seconds, seconds * 1E6 / total);
+  printf("%" PRIu64 " answered, %" PRIu64 " bytes of replies.\n", answered, reply_bytes);
+  return 0;
+}
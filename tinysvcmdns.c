@@ -73,10 +73,16 @@
 #define DEFAULT_TTL 4500
 
 struct name_comp {
-  uint8_t *label; // label
-  size_t pos;     // position in msg
+  const uint8_t *label; // label
+  size_t pos;           // position in msg
+};
 
-  struct name_comp *next;
+// names already written to a packet, for compression
+// kept on the stack while a packet is encoded; if it fills up, later names just aren't compressed
+#define NAME_COMP_MAX 128
+struct name_comp_table {
+  struct name_comp entry[NAME_COMP_MAX];
+  int count;
 };
 
 // ----- label functions -----
@@ -845,8 +851,9 @@ err:
   return 0;
 }
 
-// parse a MDNS packet into an mdns_pkt struct
-struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
+// parse the header and questions of a MDNS packet into an mdns_pkt struct
+// the offset of the answers is returned in ans_off, for mdns_parse_pkt_ans
+struct mdns_pkt *mdns_parse_pkt_qn(uint8_t *pkt_buf, size_t pkt_len, size_t *ans_off) {
   uint8_t *p = pkt_buf;
   size_t off;
   struct mdns_pkt *pkt;
@@ -888,13 +895,19 @@ struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
     off += l;
   }
 
-  // parse answer RRs
+  *ans_off = off;
+  return pkt;
+}
+
+// parse the answer RRs of a MDNS packet whose questions have been parsed
+// returns 0 if successful
+int mdns_parse_pkt_ans(struct mdns_pkt *pkt, uint8_t *pkt_buf, size_t pkt_len, size_t off) {
+  int i;
   for (i = 0; i < pkt->num_ans_rr; i++) {
     size_t l = mdns_parse_rr(pkt_buf, pkt_len, off, pkt);
     if (!l) {
       DEBUG_PRINTF("error parsing answer #%d\n", i);
-      mdns_pkt_destroy(pkt);
-      return NULL;
+      return -1;
     }
 
     off += l;
@@ -902,28 +915,36 @@ struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
 
   // TODO: parse the authority and additional RR sections
 
+  return 0;
+}
+
+// parse a MDNS packet into an mdns_pkt struct
+struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
+  size_t off;
+  struct mdns_pkt *pkt = mdns_parse_pkt_qn(pkt_buf, pkt_len, &off);
+  if ((pkt != NULL) && (mdns_parse_pkt_ans(pkt, pkt_buf, pkt_len, off) != 0)) {
+    mdns_pkt_destroy(pkt);
+    pkt = NULL;
+  }
   return pkt;
 }
 
 // encodes a name (label) into a packet using the name compression scheme
 // encoded names will be added to the compression list for subsequent use
 static size_t mdns_encode_name(uint8_t *pkt_buf, __attribute__((unused)) size_t pkt_len, size_t off,
-                               const uint8_t *name, struct name_comp *comp) {
-  struct name_comp *c, *c_tail = NULL;
+                               const uint8_t *name, struct name_comp_table *comp) {
   uint8_t *p = pkt_buf + off;
   size_t len = 0;
+  int i;
 
   if (name) {
     while (*name) {
       // find match for compression
-      for (c = comp; c; c = c->next) {
-        if (cmp_nlabel(name, c->label) == 0) {
-          mdns_write_u16(p, 0xC000 | (c->pos & ~0xC000));
+      for (i = 0; i < comp->count; i++) {
+        if (cmp_nlabel(name, comp->entry[i].label) == 0) {
+          mdns_write_u16(p, 0xC000 | (comp->entry[i].pos & ~0xC000));
           return len + sizeof(uint16_t);
         }
-
-        if (c->next == NULL)
-          c_tail = c;
       }
 
       // copy this segment
@@ -931,11 +952,11 @@ static size_t mdns_encode_name(uint8_t *pkt_buf, __attribute__((unused)) size_t
       strncpy((char *)p, (char *)name, segment_len);
 
       // cache the name for subsequent compression
-      DECL_MALLOC_ZERO_STRUCT(new_c, name_comp);
-
-      new_c->label = (uint8_t *)name;
-      new_c->pos = p - pkt_buf;
-      c_tail->next = new_c;
+      if (comp->count < NAME_COMP_MAX) {
+        comp->entry[comp->count].label = name;
+        comp->entry[comp->count].pos = p - pkt_buf;
+        comp->count++;
+      }
 
       // advance to next name segment
       p += segment_len;
@@ -953,7 +974,7 @@ static size_t mdns_encode_name(uint8_t *pkt_buf, __attribute__((unused)) size_t
 // encodes an RR entry at the given offset
 // returns the size of the entire RR entry
 static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off, struct rr_entry *rr,
-                             struct name_comp *comp) {
+                             struct name_comp_table *comp) {
   uint8_t *p = pkt_buf + off, *p_data;
   size_t l;
   struct rr_data_txt *txt_rec;
@@ -1045,7 +1066,7 @@ static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off, struc
 // encodes a MDNS packet from the given mdns_pkt struct into a buffer
 // returns the size of the entire MDNS packet
 size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len) {
-  struct name_comp *comp;
+  struct name_comp_table comp;
   uint8_t *p = pkt_buf;
   // uint8_t *e = pkt_buf + pkt_len;
   size_t off;
@@ -1069,15 +1090,8 @@ size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len
 
   off = p - pkt_buf;
 
-  // allocate list for name compression
-  comp = malloc(sizeof(struct name_comp));
-  if (comp == NULL)
-    return -1;
-  memset(comp, 0, sizeof(struct name_comp));
-
-  // dummy entry
-  comp->label = (uint8_t *)"";
-  comp->pos = 0;
+  // no names for compression yet
+  comp.count = 0;
 
   // skip encoding of qn
 
@@ -1087,7 +1101,7 @@ size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len
   for (i = 0; i < sizeof(rr_set) / sizeof(rr_set[0]); i++) {
     struct rr_list *rr = rr_set[i];
     for (; rr; rr = rr->next) {
-      size_t l = mdns_encode_rr(pkt_buf, pkt_len, off, rr->e, comp);
+      size_t l = mdns_encode_rr(pkt_buf, pkt_len, off, rr->e, &comp);
       off += l;
 
       if (off >= pkt_len) {
@@ -1097,13 +1111,6 @@ size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len
     }
   }
 
-  // free name compression list
-  while (comp) {
-    struct name_comp *c = comp->next;
-    free(comp);
-    comp = c;
-  }
-
   return off;
 }
 
@@ -1152,13 +1159,16 @@ size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len
 
 #define SERVICES_DNS_SD_NLABEL ((uint8_t *)"\x09_services\x07_dns-sd\x04_udp\x05local")
 
+// the record groups are kept in a small hash table indexed by name
+#define GROUP_BUCKETS 32
+
 struct mdnsd {
   pthread_mutex_t data_lock;
   int sockfd;
   int notify_pipe[2];
   int stop_flag;
 
-  struct rr_group *group;
+  struct rr_group *group[GROUP_BUCKETS];
   struct rr_list *announce;
   struct rr_list *services;
   uint8_t *hostname;
@@ -1170,6 +1180,16 @@ struct mdns_service {
 
 /////////////////////////////////
 
+// returns the hash bucket for records with this name (FNV-1a)
+static struct rr_group **group_bucket(struct mdnsd *svr, const uint8_t *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h ^= *name;
+    h *= 16777619u;
+  }
+  return &svr->group[h % GROUP_BUCKETS];
+}
+
 static int create_recv_sock() {
   int sd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sd < 0) {
@@ -1241,7 +1261,7 @@ static int populate_answers(struct mdnsd *svr, struct rr_list **rr_head, uint8_t
 
   // check if we have the records
   pthread_mutex_lock(&svr->data_lock);
-  struct rr_group *ans_grp = rr_group_find(svr->group, name);
+  struct rr_group *ans_grp = rr_group_find(*group_bucket(svr, name), name);
   if (ans_grp == NULL) {
     pthread_mutex_unlock(&svr->data_lock);
     return num_ans;
@@ -1332,10 +1352,12 @@ static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns
       struct rr_entry *qn = qnl->e;
       int num_ans_added = 0;
 
-      char *namestr = nlabel_to_str(qn->name);
-      DEBUG_PRINTF("qn #%d: type %s (%02x) %s - ", i, rr_get_type_name(qn->type), qn->type,
-                   namestr);
-      free(namestr);
+      if (debuglev >= 3) {
+        char *namestr = nlabel_to_str(qn->name);
+        DEBUG_PRINTF("qn #%d: type %s (%02x) %s - ", i, rr_get_type_name(qn->type), qn->type,
+                     namestr);
+        free(namestr);
+      }
 
       // check if it's a unicast query - we ignore those
       if (qn->unicast_query) {
@@ -1357,9 +1379,11 @@ static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns
 
       // discard answers that have at least half of the actual TTL
       if (known_ans != NULL && known_ans->ttl >= ans->e->ttl / 2) {
-        char *namestr = nlabel_to_str(ans->e->name);
-        DEBUG_PRINTF("removing answer for %s\n", namestr);
-        free(namestr);
+        if (debuglev >= 3) {
+          char *namestr = nlabel_to_str(ans->e->name);
+          DEBUG_PRINTF("removing answer for %s\n", namestr);
+          free(namestr);
+        }
 
         // check if list item is head
         if (prev_ans == NULL)
@@ -1392,6 +1416,48 @@ static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns
   return 0;
 }
 
+// checks the header of a received packet to see if it's a standard query with questions
+// -- responses and anything else are ignored, so there's no need to parse them
+static int is_standard_query(const uint8_t *pkt_buf, ssize_t pkt_len) {
+  if (pkt_len < 12)
+    return 0;
+  uint16_t flags = mdns_read_u16(pkt_buf + 2);
+  uint16_t num_qn = mdns_read_u16(pkt_buf + 4);
+  return ((flags & MDNS_FLAG_RESP) == 0) && (MDNS_FLAG_GET_OPCODE(flags) == 0) && (num_qn != 0);
+}
+
+// returns 1 if we have records for any of the questions that want a multicast answer
+static int has_records_for_questions(struct mdnsd *svr, struct mdns_pkt *pkt) {
+  int response = 0;
+  struct rr_list *qnl;
+  pthread_mutex_lock(&svr->data_lock);
+  for (qnl = pkt->rr_qn; (qnl != NULL) && (response == 0); qnl = qnl->next) {
+    if ((qnl->e->unicast_query == 0) &&
+        (rr_group_find(*group_bucket(svr, qnl->e->name), qnl->e->name) != NULL))
+      response = 1;
+  }
+  pthread_mutex_unlock(&svr->data_lock);
+  return response;
+}
+
+size_t mdnsd_answer_query(struct mdnsd *svr, uint8_t *pkt_buf, ssize_t pkt_len,
+                          struct mdns_pkt *reply, uint8_t *reply_buf, size_t reply_size) {
+  size_t replylen = 0;
+  if (is_standard_query(pkt_buf, pkt_len)) {
+    size_t ans_off;
+    struct mdns_pkt *mdns = mdns_parse_pkt_qn(pkt_buf, pkt_len, &ans_off);
+    if (mdns != NULL) {
+      // the known answers are only needed if there's something of ours to answer with
+      if ((has_records_for_questions(svr, mdns)) &&
+          (mdns_parse_pkt_ans(mdns, pkt_buf, pkt_len, ans_off) == 0) &&
+          (process_mdns_pkt(svr, mdns, reply)))
+        replylen = mdns_encode_pkt(reply, reply_buf, reply_size);
+      mdns_pkt_destroy(mdns);
+    }
+  }
+  return replylen;
+}
+
 int create_pipe(int handles[2]) {
 #ifdef _WIN32
   SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -1500,19 +1566,12 @@ void *main_loop(struct mdnsd *svr) {
                                   (struct sockaddr *)&fromaddr, &sockaddr_size);
       if (recvsize < 0) {
         log_message(LOG_ERR, "recv(): %m");
-      }
-
-      DEBUG_PRINTF("data from=%s size=%ld\n", inet_ntoa(fromaddr.sin_addr), (long)recvsize);
-      struct mdns_pkt *mdns = mdns_parse_pkt(pkt_buffer, recvsize);
-      if (mdns != NULL) {
-        if (process_mdns_pkt(svr, mdns, mdns_reply)) {
-          size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
+      } else {
+        DEBUG_PRINTF("data from=%s size=%ld\n", inet_ntoa(fromaddr.sin_addr), (long)recvsize);
+        size_t replylen =
+            mdnsd_answer_query(svr, pkt_buffer, recvsize, mdns_reply, pkt_buffer, PACKET_SIZE);
+        if (replylen > 0)
           send_packet(svr->sockfd, pkt_buffer, replylen);
-        } else if (mdns->num_qn == 0) {
-          DEBUG_PRINTF("(no questions in packet)\n\n");
-        }
-
-        mdns_pkt_destroy(mdns);
       }
     }
 
@@ -1589,8 +1648,8 @@ void mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, uint32_t ip) {
 
   pthread_mutex_lock(&svr->data_lock);
   svr->hostname = create_nlabel(hostname);
-  rr_group_add(&svr->group, a_e);
-  rr_group_add(&svr->group, nsec_e);
+  rr_group_add(group_bucket(svr, a_e->name), a_e);
+  rr_group_add(group_bucket(svr, nsec_e->name), nsec_e);
   pthread_mutex_unlock(&svr->data_lock);
 }
 
@@ -1609,14 +1668,14 @@ void mdnsd_set_hostname_v6(struct mdnsd *svr, const char *hostname, struct in6_a
 
   pthread_mutex_lock(&svr->data_lock);
   svr->hostname = create_nlabel(hostname);
-  rr_group_add(&svr->group, aaaa_e);
-  rr_group_add(&svr->group, nsec_e);
+  rr_group_add(group_bucket(svr, aaaa_e->name), aaaa_e);
+  rr_group_add(group_bucket(svr, nsec_e->name), nsec_e);
   pthread_mutex_unlock(&svr->data_lock);
 }
 
 void mdnsd_add_rr(struct mdnsd *svr, struct rr_entry *rr) {
   pthread_mutex_lock(&svr->data_lock);
-  rr_group_add(&svr->group, rr);
+  rr_group_add(group_bucket(svr, rr->name), rr);
   pthread_mutex_unlock(&svr->data_lock);
 }
 
@@ -1668,10 +1727,10 @@ struct mdns_service *mdnsd_register_svc(struct mdnsd *svr, const char *instance_
   pthread_mutex_lock(&svr->data_lock);
 
   if (txt_e)
-    rr_group_add(&svr->group, txt_e);
-  rr_group_add(&svr->group, srv_e);
-  rr_group_add(&svr->group, ptr_e);
-  rr_group_add(&svr->group, bptr_e);
+    rr_group_add(group_bucket(svr, txt_e->name), txt_e);
+  rr_group_add(group_bucket(svr, srv_e->name), srv_e);
+  rr_group_add(group_bucket(svr, ptr_e->name), ptr_e);
+  rr_group_add(group_bucket(svr, bptr_e->name), bptr_e);
 
   // append PTR entry to announce list
   rr_list_append(&svr->announce, ptr_e);
@@ -1696,10 +1755,7 @@ void mdns_service_destroy(struct mdns_service *srv) {
   free(srv);
 }
 
-struct mdnsd *mdnsd_start() {
-  pthread_t tid;
-  pthread_attr_t attr;
-
+struct mdnsd *mdnsd_new() {
   struct mdnsd *server = malloc(sizeof(struct mdnsd));
   if (server)
     memset(server, 0, sizeof(struct mdnsd));
@@ -1711,16 +1767,28 @@ struct mdnsd *mdnsd_start() {
     free(server);
     return NULL;
   }
+  server->sockfd = -1;
+
+  pthread_mutex_init(&server->data_lock, NULL);
+  return server;
+}
+
+struct mdnsd *mdnsd_start() {
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  struct mdnsd *server = mdnsd_new();
+  if (server == NULL)
+    return NULL;
 
   server->sockfd = create_recv_sock();
   if (server->sockfd < 0) {
     log_message(LOG_ERR, "unable to create recv socket");
+    pthread_mutex_destroy(&server->data_lock);
     free(server);
     return NULL;
   }
 
-  pthread_mutex_init(&server->data_lock, NULL);
-
   // init thread
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -1752,7 +1820,9 @@ void mdnsd_stop(struct mdnsd *s) {
   close_pipe(s->notify_pipe[1]);
 
   pthread_mutex_destroy(&s->data_lock);
-  rr_group_destroy(s->group);
+  int i;
+  for (i = 0; i < GROUP_BUCKETS; i++)
+    rr_group_destroy(s->group[i]);
   rr_list_destroy(s->announce, 0);
   rr_list_destroy(s->services, 0);
 
@@ -38,6 +38,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 #ifdef _WIN32
 #include <winsock.h>
@@ -161,6 +162,8 @@ struct mdns_pkt {
 };
 
 struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len);
+struct mdns_pkt *mdns_parse_pkt_qn(uint8_t *pkt_buf, size_t pkt_len, size_t *ans_off);
+int mdns_parse_pkt_ans(struct mdns_pkt *pkt, uint8_t *pkt_buf, size_t pkt_len, size_t off);
 
 void mdns_init_reply(struct mdns_pkt *pkt, uint16_t id);
 size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len);
@@ -210,6 +213,15 @@ struct mdns_service;
 // returns NULL if unsuccessful
 struct mdnsd *mdnsd_start();
 
+// create a server that isn't on the network and doesn't run a thread of its own
+// -- queries can be put to it with mdnsd_answer_query()
+struct mdnsd *mdnsd_new();
+
+// answer a received packet from the records the server holds, using reply as working space
+// returns the length of the encoded reply in reply_buf, or 0 if there's nothing to send
+size_t mdnsd_answer_query(struct mdnsd *svr, uint8_t *pkt_buf, ssize_t pkt_len,
+                          struct mdns_pkt *reply, uint8_t *reply_buf, size_t reply_size);
+
 // stops the given MDNS responder instance
 void mdnsd_stop(struct mdnsd *s);
 
@@ -0,0 +1,267 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "trace.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Each thread that records an event gets a buffer of its own, so recording needs no locks.
+// The buffer is a ring: when it's full, the oldest events are overwritten.
+// When a thread exits, its buffer is kept -- so its events can still be dumped -- until it's
+// needed by a new thread.
+
+#define TRACE_BUFFER_SIZE 4096 // events per thread, must be a power of two
+
+typedef struct {
+  uint64_t time;     // of the event, or of the start of a complete event
+  uint64_t duration; // complete events only
+  uint64_t arg;
+  const char *name;
+  char phase; // as in the Chrome trace event format: 'i' for instant, 'X' for complete
+} trace_event_t;
+
+typedef struct trace_buffer {
+  struct trace_buffer *next;
+  int thread_number;
+  char thread_name[32];
+  volatile int thread_has_exited;
+  volatile uint32_t count; // the number of events ever recorded in the buffer
+  trace_event_t events[TRACE_BUFFER_SIZE];
+} trace_buffer;
+
+volatile int trace_enabled = 0;
+
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer *trace_buffers = NULL;
+static int trace_thread_count = 0;
+
+static char *trace_dump_path = NULL;
+static volatile sig_atomic_t trace_dump_requested = 0;
+static volatile int trace_dump_thread_stop_requested;
+static pthread_t trace_dump_thread;
+static int trace_dump_thread_running = 0;
+
+static void trace_thread_exit(void *arg) {
+  trace_buffer *buffer = (trace_buffer *)arg;
+  buffer->thread_has_exited = 1;
+}
+
+static void trace_key_create() { pthread_key_create(&trace_key, trace_thread_exit); }
+
+static trace_buffer *trace_buffer_for_this_thread() {
+  pthread_once(&trace_key_once, trace_key_create);
+  trace_buffer *buffer = pthread_getspecific(trace_key);
+  if (buffer == NULL) {
+    pthread_mutex_lock(&trace_buffers_lock);
+    // reuse the buffer of a thread that has exited, if there is one
+    buffer = trace_buffers;
+    while ((buffer != NULL) && (buffer->thread_has_exited == 0))
+      buffer = buffer->next;
+    if (buffer == NULL) {
+      buffer = malloc(sizeof(trace_buffer));
+      if (buffer != NULL) {
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+      }
+    }
+    if (buffer != NULL) {
+      buffer->thread_number = ++trace_thread_count;
+      snprintf(buffer->thread_name, sizeof(buffer->thread_name), "thread %d",
+               buffer->thread_number);
+      buffer->count = 0;
+      buffer->thread_has_exited = 0;
+      pthread_setspecific(trace_key, buffer);
+    }
+    pthread_mutex_unlock(&trace_buffers_lock);
+  }
+  return buffer;
+}
+
+void trace_event(char phase, const char *name, uint64_t start_time, uint64_t arg) {
+  trace_buffer *buffer = trace_buffer_for_this_thread();
+  if (buffer != NULL) {
+    uint64_t time_now = get_absolute_time_in_ns();
+    uint32_t count = buffer->count;
+    trace_event_t *event = &buffer->events[count & (TRACE_BUFFER_SIZE - 1)];
+    if (phase == 'X') {
+      event->time = start_time;
+      event->duration = time_now - start_time;
+    } else {
+      event->time = time_now;
+      event->duration = 0;
+    }
+    event->name = name;
+    event->arg = arg;
+    event->phase = phase;
+    __sync_synchronize(); // the event must be complete before it's counted
+    buffer->count = count + 1;
+  }
+}
+
+void trace_thread_name(const char *name) {
+  trace_buffer *buffer = trace_buffer_for_this_thread();
+  if (buffer != NULL) {
+    pthread_mutex_lock(&trace_buffers_lock); // the name might be being dumped
+    snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
+    pthread_mutex_unlock(&trace_buffers_lock);
+  }
+}
+
+// the previous dump is removed and a new file created, never followed if it's a symbolic link and
+// never opened if someone else has put a file there in the meantime
+static FILE *trace_dump_open(const char *path) {
+  FILE *f = NULL;
+  if ((unlink(path) == 0) || (errno == ENOENT)) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+      f = fdopen(fd, "w");
+      if (f == NULL)
+        close(fd);
+    }
+  }
+  if (f == NULL) {
+    char errorstring[1024];
+    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+    warn("Could not open \"%s\" to dump the trace to: \"%s\".", path, errorstring);
+  }
+  return f;
+}
+
+int trace_dump() {
+  int response = -1;
+  const char *path = trace_dump_path;
+  if (path == NULL) {
+    debug(1, "trace_dump: no file to dump the trace to.");
+    return response;
+  }
+  FILE *f = trace_dump_open(path);
+  if (f == NULL)
+    return response;
+  trace_event_t *events = malloc(sizeof(trace_event_t) * TRACE_BUFFER_SIZE);
+  if (events != NULL) {
+    int pid = getpid();
+    int event_count = 0;
+    int separator = ' ';
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    pthread_mutex_lock(&trace_buffers_lock);
+    trace_buffer *buffer;
+    for (buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+      fprintf(f,
+              "%c\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+              "\"args\":{\"name\":\"%s\"}}",
+              separator, pid, buffer->thread_number, buffer->thread_name);
+      separator = ',';
+      // copy the events out, then discard any that were overwritten while copying
+      uint32_t last = buffer->count;
+      __sync_synchronize();
+      uint32_t oldest = last > TRACE_BUFFER_SIZE ? last - TRACE_BUFFER_SIZE : 0;
+      uint32_t i;
+      for (i = oldest; i != last; i++)
+        events[i - oldest] = buffer->events[i & (TRACE_BUFFER_SIZE - 1)];
+      __sync_synchronize();
+      uint32_t first = oldest;
+      uint32_t count_after_copying = buffer->count;
+      if (count_after_copying - first > TRACE_BUFFER_SIZE)
+        first = count_after_copying - TRACE_BUFFER_SIZE;
+      for (i = first; (int32_t)(last - i) > 0; i++) {
+        trace_event_t *event = &events[i - oldest];
+        // times are in microseconds since startup
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", event->name, event->phase,
+                0.001 * (int64_t)(event->time - ns_time_at_startup));
+        if (event->phase == 'X')
+          fprintf(f, "\"dur\":%.3f,", 0.001 * event->duration);
+        else
+          fprintf(f, "\"s\":\"t\",");
+        fprintf(f, "\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%" PRIu64 "}}", pid,
+                buffer->thread_number, event->arg);
+        event_count++;
+      }
+    }
+    pthread_mutex_unlock(&trace_buffers_lock);
+    fprintf(f, "\n]}\n");
+    free(events);
+    debug(1, "Dumped %d trace events to \"%s\".", event_count, path);
+    response = 0;
+  }
+  if (fclose(f) != 0)
+    response = -1;
+  return response;
+}
+
+static void trace_dump_signal_handler(__attribute__((unused)) int sig) {
+  trace_dump_requested = 1;
+}
+
+// the dump is done here rather than in the signal handler, which mustn't do any I/O
+static void *trace_dump_thread_func(__attribute__((unused)) void *arg) {
+  while (trace_dump_thread_stop_requested == 0) {
+    if (trace_dump_requested) {
+      trace_dump_requested = 0;
+      trace_dump();
+    }
+    usleep(100000);
+  }
+  pthread_exit(NULL);
+}
+
+void trace_start(const char *path) {
+  if (trace_dump_path)
+    free(trace_dump_path);
+  trace_dump_path = path ? strdup(path) : NULL;
+  struct sigaction act;
+  memset(&act, 0, sizeof(struct sigaction));
+  act.sa_handler = trace_dump_signal_handler;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &act, NULL);
+  trace_dump_thread_stop_requested = 0;
+  if (pthread_create(&trace_dump_thread, NULL, trace_dump_thread_func, NULL) == 0)
+    trace_dump_thread_running = 1;
+  else
+    warn("Could not start the trace dump thread -- SIGUSR2 will not dump the trace.");
+  trace_enabled = 1;
+  debug(1, "Tracing is on. Send SIGUSR2 to dump the trace to \"%s\".",
+        trace_dump_path ? trace_dump_path : "");
+}
+
+void trace_stop() {
+  trace_enabled = 0;
+  if (trace_dump_thread_running) {
+    trace_dump_thread_stop_requested = 1;
+    pthread_join(trace_dump_thread, NULL);
+    trace_dump_thread_running = 0;
+  }
+  signal(SIGUSR2, SIG_DFL);
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "config.h"
+#include <stdint.h>
+
+// Tracepoints record what each thread is doing into a ring of events belonging to that thread.
+// The rings can be written out as Chrome trace JSON, which Perfetto (https://ui.perfetto.dev)
+// and chrome://tracing can display, on a SIGUSR2 signal or a D-Bus DumpTrace call.
+// When built without tracing, the tracepoints compile to nothing; when built with tracing but
+// tracing isn't turned on, each costs one test of trace_enabled.
+
+#ifdef CONFIG_TRACING
+
+extern volatile int trace_enabled;
+
+void trace_event(char phase, const char *name, uint64_t start_time, uint64_t arg);
+void trace_thread_name(const char *name); // name the calling thread in the trace
+int trace_dump();                         // to the trace file, returns 0 on success
+void trace_start(const char *path);       // start tracing and arrange for SIGUSR2 to dump to path
+void trace_stop();
+
+// the name must be a string constant -- only the pointer is recorded
+#define TRACE_TIME() (__builtin_expect(trace_enabled, 0) ? get_absolute_time_in_ns() : 0)
+#define TRACE_INSTANT(name, arg)                                                                   \
+  do {                                                                                             \
+    if (__builtin_expect(trace_enabled, 0))                                                        \
+      trace_event('i', name, 0, arg);                                                              \
+  } while (0)
+#define TRACE_COMPLETE(name, start_time, arg)                                                      \
+  do {                                                                                             \
+    if (__builtin_expect(trace_enabled, 0) && ((start_time) != 0))                                 \
+      trace_event('X', name, start_time, arg);                                                     \
+  } while (0)
+#define TRACE_THREAD_NAME(name)                                                                    \
+  do {                                                                                             \
+    if (__builtin_expect(trace_enabled, 0))                                                        \
+      trace_thread_name(name);                                                                     \
+  } while (0)
+
+#else
+
+#define TRACE_TIME() 0
+#define TRACE_INSTANT(name, arg)                                                                   \
+  do {                                                                                             \
+  } while (0)
+#define TRACE_COMPLETE(name, start_time, arg)                                                      \
+  do {                                                                                             \
+    (void)(start_time);                                                                            \
+  } while (0)
+#define TRACE_THREAD_NAME(name)                                                                    \
+  do {                                                                                             \
+  } while (0)
+
+#endif
+
+#endif /* __TRACE_H */